@@ -21,6 +21,7 @@ namespace KarrotSoundProduction
         [UI] private Entry fadeInTimeEntry = null;
         [UI] private Entry fadeOutTimeEntry = null;
         [UI] private Entry speedEntry = null;
+        [UI] private CheckButton preservePitchCheck = null;
         [UI] private FileChooserButton soundFileChooser = null;
         [UI] private Label hotkeyLabel = null;
         [UI] private Button hotkeyRecordButton = null;
@@ -100,12 +101,13 @@ namespace KarrotSoundProduction
                 return;
             }
             string originalFileName = System.IO.Path.GetFullPath(soundFileChooser.File.Path);
-            string fileName = Utils.GetWavePath(originalFileName);
-            Console.WriteLine(Utils.GetFileFormat(fileName));
+            Console.WriteLine(Utils.GetFileFormat(originalFileName));
 
-            Console.WriteLine(fileName);
-            SoundConfiguration sound = new(fileName, key.Value, null, originalFileName, (int)(fadeInTime * 1000), (int)(fadeOutTime * 1000), 100, 0, speed);
-            SoundboardConfiguration.CurrentConfig.AddSound(sound);
+            Console.WriteLine(originalFileName);
+            //The file is decoded, if it needs to be, when the sound is preloaded
+            SoundConfiguration sound = new(originalFileName, key.Value, null, originalFileName, (int)(fadeInTime * 1000), (int)(fadeOutTime * 1000), 100, 0, speed,
+                                           preservePitch: preservePitchCheck.Active);
+            SoundboardConfiguration.CurrentConfig.AddSound(sound, Program.MainWindow.CreateLoadProgress());
             Console.WriteLine(SoundboardConfiguration.CurrentConfig);
             Close();
             Program.MainWindow.UpdateMainText();
@@ -0,0 +1,159 @@
+/*
+*  This Source Code Form is subject to the terms of the Mozilla Public
+*  License, v. 2.0. If a copy of the MPL was not distributed with this
+*  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+using System;
+using KarrotObjectNotation;
+using NetCoreAudio.Players;
+
+namespace KarrotSoundProduction
+{
+    /// <summary>
+    /// Represents the configuration of one of the native engine's submix buses, which sounds are mixed into before they
+    /// are played. Every bus is mixed in the same pass; each can have its own volume, be muted, and be played through a
+    /// PipeWire node of its own, such as a monitor bus on a pair of headphones. Changes take effect straight away,
+    /// without restarting the sounds on the bus.
+    /// </summary>
+    public class BusConfiguration
+    {
+        /// <summary>
+        /// The number of the bus in the engine, from 0 to <see cref="NativeEngine.MaxBuses"/> - 1. Sounds play on bus 0
+        /// unless they are put on another.
+        /// </summary>
+        /// <value></value>
+        public int Index { get; private set; }
+
+        /// <summary>
+        /// The name shown for the bus, such as FX, Music or Monitor.
+        /// </summary>
+        /// <value></value>
+        public string Name { get; private set; }
+
+        /// <summary>
+        /// The volume, in percent, every sound on the bus is played at. (Default: 100)
+        /// </summary>
+        /// <value></value>
+        public float Volume { get; private set; }
+
+        /// <summary>
+        /// Whether the bus is silenced. The sounds on it carry on playing.
+        /// </summary>
+        /// <value></value>
+        public bool Muted { get; private set; }
+
+        /// <summary>
+        /// The name or serial of the PipeWire node the bus plays through, or null to play through the engine's main
+        /// output. Bus 0 always plays through the main output.
+        /// </summary>
+        /// <value></value>
+        public string Target { get; private set; }
+
+        /// <summary>
+        /// The filters and limiter the bus's sounds are run through, before its volume.
+        /// </summary>
+        /// <value></value>
+        public DspConfiguration Dsp { get; private set; }
+
+        public BusConfiguration(int index, string name = null, float volume = 100, bool muted = false, string target = null,
+                                DspConfiguration dsp = null)
+        {
+            Index = index;
+            Name = name ?? (index == 0 ? "Main" : $"Bus {index}");
+            Volume = volume;
+            Muted = muted;
+            Target = string.IsNullOrEmpty(target) ? null : target;
+            Dsp = dsp ?? new();
+        }
+
+        public void SetVolume(float volume)
+        {
+            Volume = volume;
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_bus_set_gain(NativeEngine.Handle, Index, LinuxPlayerNative.PercentToGain(volume));
+        }
+
+        public void SetMuted(bool muted)
+        {
+            Muted = muted;
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_bus_set_muted(NativeEngine.Handle, Index, muted);
+        }
+
+        /// <summary>
+        /// Moves the bus to another output. The sounds on it keep playing while the new output is connected.
+        /// </summary>
+        /// <param name="target">The name or serial of a PipeWire node, or null for the engine's main output</param>
+        /// <returns>Whether the bus could be given the output, which only the PipeWire backend can do</returns>
+        public bool SetTarget(string target)
+        {
+            Target = string.IsNullOrEmpty(target) ? null : target;
+            if (!NativeEngine.Available)
+                return Target == null;
+            bool routed = NativeEngine.Interop.ksp_bus_set_target(NativeEngine.Handle, Index, Target);
+            if (!routed)
+                Console.Error.WriteLine($"Could not play bus {Name} through {Target ?? "the main output"}");
+            return routed;
+        }
+
+        /// <summary>
+        /// Sends the whole configuration to the native engine.
+        /// </summary>
+        public void Apply()
+        {
+            SetVolume(Volume);
+            SetMuted(Muted);
+            SetTarget(Target);
+            Dsp.Apply(Index);
+        }
+
+        /// <summary>
+        /// Gets the KONNode object that represents this bus configuration.
+        /// </summary>
+        /// <returns></returns>
+        public KONNode GetNode()
+        {
+            KONNode output = new("BUS");
+            output.AddValue("index", Index);
+            output.AddValue("name", Name);
+            output.AddValue("volume", Volume);
+            if (Muted)
+                output.AddValue("muted", 1);
+            if (Target != null)
+                output.AddValue("target", Target);
+            if (!Dsp.IsEmpty)
+                Dsp.AddToNode(output);
+            return output;
+        }
+
+        /// <summary>
+        /// Reads a bus configuration from a soundboard file, or returns null if it names no bus the engine has.
+        /// </summary>
+        /// <param name="node"></param>
+        /// <returns></returns>
+        public static BusConfiguration FromNode(KONNode node)
+        {
+            if (!node.Values.ContainsKey("index"))
+                return null;
+            int index = (int)node.Values["index"];
+            if (index < 0 || index >= NativeEngine.MaxBuses)
+                return null;
+
+            string name = null;
+            if (node.Values.ContainsKey("name"))
+                name = (string)node.Values["name"];
+            float volume = 100;
+            if (node.Values.ContainsKey("volume"))
+                volume = Math.Max(0, Convert.ToSingle(node.Values["volume"]));
+            bool muted = node.Values.ContainsKey("muted") && (int)node.Values["muted"] != 0;
+            string target = null;
+            if (node.Values.ContainsKey("target"))
+                target = (string)node.Values["target"];
+            DspConfiguration dsp = new();
+            dsp.ReadNode(node);
+            return new(index, name, volume, muted, target, dsp);
+        }
+
+        public override string ToString() => Target == null ? Name : $"{Name} ({Target})";
+    }
+}
@@ -0,0 +1,185 @@
+/*
+*  This Source Code Form is subject to the terms of the Mozilla Public
+*  License, v. 2.0. If a copy of the MPL was not distributed with this
+*  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+using System;
+using KarrotObjectNotation;
+using NetCoreAudio.Players;
+
+namespace KarrotSoundProduction
+{
+    /// <summary>
+    /// One of the filters a bus or the master runs its audio through.
+    /// </summary>
+    public class FilterConfiguration
+    {
+        public static readonly FilterConfiguration Off = new(DspConfiguration.FilterType.Off, 1000);
+
+        public DspConfiguration.FilterType Type { get; private set; }
+
+        /// <summary>
+        /// The cutoff, or the centre of a peak filter, in Hz.
+        /// </summary>
+        /// <value></value>
+        public float Frequency { get; private set; }
+
+        /// <summary>
+        /// How much a peak or shelf filter boosts or cuts by, in dB.
+        /// </summary>
+        /// <value></value>
+        public float Gain { get; private set; }
+
+        public float Q { get; private set; }
+
+        public FilterConfiguration(DspConfiguration.FilterType type, float frequency, float gain = 0, float q = 0.707f)
+        {
+            Type = type;
+            Frequency = frequency;
+            Gain = gain;
+            Q = q;
+        }
+    }
+
+    /// <summary>
+    /// The filters and look-ahead limiter the native engine runs a bus, or the master, through. The filters run one
+    /// after another, before the bus's volume, and the limiter after them; nothing gets past its ceiling.
+    /// </summary>
+    public class DspConfiguration
+    {
+        /// <summary>
+        /// Kinds of filter a bus or the master can run. Matches ksp_filter_type in the native library.
+        /// </summary>
+        public enum FilterType
+        {
+            Off,
+            HighPass,
+            LowPass,
+            Peak,
+            LowShelf,
+            HighShelf
+        }
+
+        public const float DefaultCeiling = -1;
+        public const float DefaultRelease = 100;
+
+        public FilterConfiguration[] Filters { get; } = new FilterConfiguration[NativeEngine.MaxFilters];
+
+        public bool LimiterEnabled { get; private set; }
+
+        /// <summary>
+        /// The level, in dBFS, the limiter keeps the audio under. (Default: -1)
+        /// </summary>
+        /// <value></value>
+        public float LimiterCeiling { get; private set; } = DefaultCeiling;
+
+        /// <summary>
+        /// How long, in milliseconds, the limiter takes to bring the volume back up after a peak. (Default: 100)
+        /// </summary>
+        /// <value></value>
+        public float LimiterRelease { get; private set; } = DefaultRelease;
+
+        public DspConfiguration(bool limiterEnabled = false)
+        {
+            for (int i = 0; i < Filters.Length; i++)
+                Filters[i] = FilterConfiguration.Off;
+            LimiterEnabled = limiterEnabled;
+        }
+
+        /// <summary>
+        /// Whether this leaves the audio as it is.
+        /// </summary>
+        public bool IsEmpty => !LimiterEnabled && Array.TrueForAll(Filters, x => x.Type == FilterType.Off);
+
+        public void SetFilter(int bus, int index, FilterConfiguration filter)
+        {
+            Filters[index] = filter ?? FilterConfiguration.Off;
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_bus_set_filter(NativeEngine.Handle, bus, index, Filters[index].Type,
+                                                        Filters[index].Frequency, Filters[index].Gain, Filters[index].Q);
+        }
+
+        public void SetLimiter(int bus, bool enabled, float ceiling = DefaultCeiling, float release = DefaultRelease)
+        {
+            LimiterEnabled = enabled;
+            LimiterCeiling = Math.Min(0, ceiling);
+            LimiterRelease = Math.Max(1, release);
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_bus_set_limiter(NativeEngine.Handle, bus, enabled, LimiterCeiling, LimiterRelease);
+        }
+
+        /// <summary>
+        /// Sends the whole configuration to the native engine, for the given bus or <see cref="NativeEngine.MasterBus"/>.
+        /// </summary>
+        public void Apply(int bus)
+        {
+            for (int i = 0; i < Filters.Length; i++)
+                SetFilter(bus, i, Filters[i]);
+            SetLimiter(bus, LimiterEnabled, LimiterCeiling, LimiterRelease);
+        }
+
+        /// <summary>
+        /// How far the limiter turned the audio down in the engine's last cycle, in dB.
+        /// </summary>
+        public static float GetGainReduction(int bus) =>
+            NativeEngine.Available ? NativeEngine.Interop.ksp_bus_get_gain_reduction(NativeEngine.Handle, bus) : 0;
+
+        /// <summary>
+        /// Adds a FILTER node for each filter that is on, and a LIMITER node, to the node of the bus or board.
+        /// </summary>
+        /// <param name="node"></param>
+        public void AddToNode(KONNode node)
+        {
+            for (int i = 0; i < Filters.Length; i++)
+            {
+                if (Filters[i].Type == FilterType.Off)
+                    continue;
+                KONNode filterNode = new("FILTER");
+                filterNode.AddValue("index", i);
+                filterNode.AddValue("type", Filters[i].Type.ToString());
+                filterNode.AddValue("frequency", Filters[i].Frequency);
+                filterNode.AddValue("gain", Filters[i].Gain);
+                filterNode.AddValue("q", Filters[i].Q);
+                node.AddChild(filterNode);
+            }
+            KONNode limiterNode = new("LIMITER");
+            limiterNode.AddValue("enabled", LimiterEnabled ? 1 : 0);
+            limiterNode.AddValue("ceiling", LimiterCeiling);
+            limiterNode.AddValue("release", LimiterRelease);
+            node.AddChild(limiterNode);
+        }
+
+        /// <summary>
+        /// Reads the FILTER and LIMITER nodes under a bus or board node. Whatever isn't there is left as it is.
+        /// </summary>
+        /// <param name="node"></param>
+        public void ReadNode(KONNode node)
+        {
+            foreach (KONNode childNode in node.Children)
+            {
+                if (childNode.Name == "FILTER")
+                {
+                    if (!childNode.Values.ContainsKey("index") || !childNode.Values.ContainsKey("type") ||
+                        !Enum.TryParse((string)childNode.Values["type"], true, out FilterType type))
+                        continue;
+                    int index = (int)childNode.Values["index"];
+                    if (index < 0 || index >= Filters.Length)
+                        continue;
+                    float frequency = childNode.Values.ContainsKey("frequency") ? Convert.ToSingle(childNode.Values["frequency"]) : 1000;
+                    float gain = childNode.Values.ContainsKey("gain") ? Convert.ToSingle(childNode.Values["gain"]) : 0;
+                    float q = childNode.Values.ContainsKey("q") ? Convert.ToSingle(childNode.Values["q"]) : 0.707f;
+                    Filters[index] = new(type, frequency, gain, q);
+                }
+                else if (childNode.Name == "LIMITER")
+                {
+                    if (childNode.Values.ContainsKey("enabled"))
+                        LimiterEnabled = (int)childNode.Values["enabled"] != 0;
+                    if (childNode.Values.ContainsKey("ceiling"))
+                        LimiterCeiling = Math.Min(0, Convert.ToSingle(childNode.Values["ceiling"]));
+                    if (childNode.Values.ContainsKey("release"))
+                        LimiterRelease = Math.Max(1, Convert.ToSingle(childNode.Values["release"]));
+                }
+            }
+        }
+    }
+}
@@ -21,6 +21,7 @@ namespace KarrotSoundProduction
         [UI] private Entry editFadeInTimeEntry = null;
         [UI] private Entry editFadeOutTimeEntry = null;
         [UI] private Entry editSpeedEntry = null;
+        [UI] private CheckButton editPreservePitchCheck = null;
         [UI] private ComboBoxText editSoundSelector = null;
         [UI] private Label editHotkeyLabel = null;
         [UI] private Button editHotkeyRecordButton = null;
@@ -68,6 +69,7 @@ namespace KarrotSoundProduction
             editFadeInTimeEntry.Text = ((float)currentSound.FadeInTime / 1000).ToString();
             editFadeOutTimeEntry.Text = ((float)currentSound.FadeOutTime / 1000).ToString();
             editSpeedEntry.Text = currentSound.PlaybackSpeed.ToString();
+            editPreservePitchCheck.Active = currentSound.PreservePitch;
         }
 
         private void KeyReleased(object sender, KeyReleaseEventArgs e)
@@ -104,8 +106,13 @@ namespace KarrotSoundProduction
                 return;
             }
 
-            SoundConfiguration sound = new(currentSound.FilePath, key.Value, null, currentSound.OriginalFilePath, (int)(fadeInTime * 1000), (int)(fadeOutTime * 1000), 100, 0, speed);
-            SoundboardConfiguration.CurrentConfig.EditSound(editSoundSelector.Active, sound);
+            //Polyphony and cue settings aren't in the dialog yet, so they carry over from the board file
+            SoundConfiguration sound = new(currentSound.FilePath, key.Value, null, currentSound.OriginalFilePath, (int)(fadeInTime * 1000), (int)(fadeOutTime * 1000), 100, 0, speed,
+                                           currentSound.MaxPolyphony, currentSound.Retrigger, currentSound.ChokeGroup, currentSound.PreWait, currentSound.AutoFollow,
+                                           currentSound.Loop, currentSound.LoopStart, currentSound.LoopEnd, currentSound.LoopCrossfade,
+                                           currentSound.FadeShape, currentSound.CrossfadeInto, currentSound.CrossfadeTime, currentSound.CrossfadeCurve,
+                                           currentSound.Bus, editPreservePitchCheck.Active);
+            SoundboardConfiguration.CurrentConfig.EditSound(editSoundSelector.Active, sound, Program.MainWindow.CreateLoadProgress());
             Console.WriteLine(SoundboardConfiguration.CurrentConfig);
             this.Close();
             Program.MainWindow.UpdateMainText();
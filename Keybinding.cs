@@ -6,6 +6,7 @@
 using System;
 using System.Threading.Tasks;
 using Gtk;
+using NetCoreAudio.Players;
 
 namespace KarrotSoundProduction
 {
@@ -15,21 +16,58 @@ namespace KarrotSoundProduction
 
         public event EventHandler<KeyTriggerEventArgs> KeyTriggered;
 
-        private protected virtual async Task OnKeyTrigger(KeyTriggerEventArgs e)
+        /// <summary>
+        /// Runs the handlers on the calling thread. They must not block: anything slow should be awaited, as
+        /// <see cref="SoundConfiguration.PlaySound"/> does, so that a sound starts as soon as its key is pressed.
+        /// </summary>
+        /// <param name="e"></param>
+        /// <returns></returns>
+        private protected virtual Task OnKeyTrigger(KeyTriggerEventArgs e)
         {
-            EventHandler<KeyTriggerEventArgs> raiseEvent = KeyTriggered;
+            KeyTriggered?.Invoke(this, e);
+            return Task.CompletedTask;
+        }
 
-            if (raiseEvent != null)
+        /// <summary>
+        /// Fires the binding's handlers.
+        /// </summary>
+        /// <param name="keyEventTimestamp">When the key event was received, from <see cref="Utils.MonotonicNanoseconds"/>; 0 if unknown.</param>
+        /// <returns></returns>
+        public async Task TriggerKey(long keyEventTimestamp = 0)
+        {
+            KeyTriggerEventArgs e = new(Key)
             {
-                await Task.Run(() => { raiseEvent(this, e); });
-            }
+                KeyEventTimestamp = keyEventTimestamp,
+                TriggerTimestamp = Utils.MonotonicNanoseconds()
+            };
+            //Sounds sharing a key are started separately, so they are all stamped with the same frame to line them up
+            if (SoundsStarted() > 1 && NativeEngine.Available)
+                e.StartFrame = NativeEngine.Interop.ksp_engine_get_time(NativeEngine.Handle) + StartDelayFrames;
+            await OnKeyTrigger(e);
         }
 
-        public async Task TriggerKey()
+        /// <summary>
+        /// The number of sounds a press of this key starts. Handlers that stop sounds or do anything else don't count, as
+        /// there is nothing to line up with them.
+        /// </summary>
+        /// <returns></returns>
+        private int SoundsStarted()
         {
-            await OnKeyTrigger(new KeyTriggerEventArgs(Key));
+            int output = 0;
+            foreach (Delegate handler in KeyTriggered?.GetInvocationList() ?? Array.Empty<Delegate>())
+            {
+                if (handler.Target is SoundConfiguration sound && handler.Method.Name == nameof(SoundConfiguration.PlaySound) && sound.Ready)
+                    output++;
+            }
+            return output;
         }
 
+        /// <summary>
+        /// How far ahead of the engine's clock sounds sharing a key are scheduled: long enough for every handler to
+        /// have queued its sound before the engine mixes that frame.
+        /// </summary>
+        private const ulong StartDelayFrames = 1024;
+
         public Keybinding(Gdk.Key key)
         {
             Key = key;
@@ -42,6 +80,19 @@ namespace KarrotSoundProduction
     public class KeyTriggerEventArgs : EventArgs
     {
         public Gdk.Key Key;
+        /// <summary>
+        /// When the key event was received, from <see cref="Utils.MonotonicNanoseconds"/>; 0 if unknown.
+        /// </summary>
+        public long KeyEventTimestamp;
+        /// <summary>
+        /// When the keybinding fired, from <see cref="Utils.MonotonicNanoseconds"/>; 0 if unknown.
+        /// </summary>
+        public long TriggerTimestamp;
+        /// <summary>
+        /// The frame of the native engine's clock to start sounds on, so every sound started by the same key press
+        /// starts together; 0 to start them in the engine's next cycle.
+        /// </summary>
+        public ulong StartFrame;
         public KeyTriggerEventArgs(Gdk.Key key)
         {
             Key = key;
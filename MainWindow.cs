@@ -13,6 +13,7 @@ using GLib;
 using UI = Gtk.Builder.ObjectAttribute;
 using Task = System.Threading.Tasks.Task;
 using NetCoreAudio;
+using NetCoreAudio.Players;
 
 namespace KarrotSoundProduction
 {
@@ -30,9 +31,36 @@ namespace KarrotSoundProduction
         [UI] private ImageMenuItem newFileButton = null;
         [UI] private ImageMenuItem saveFileButton = null;
         [UI] private ImageMenuItem saveFileAsButton = null;
+        [UI] private MenuItem exportBundleButton = null;
         [UI] private ImageMenuItem quitButton = null;
         [UI] private Label mainViewLabel = null;
         [UI] private CheckButton playbackEnabledCheck = null;
+        [UI] private DrawingArea playbackArea = null;
+
+        //How often the playback view reads the engine's voices, about 30 times a second
+        private const uint PlaybackRefreshMilliseconds = 33;
+        //How often the main view is refreshed while a board loads, however quickly its sounds become ready
+        private const uint LoadRefreshMilliseconds = 250;
+        private const int PlaybackRowHeight = 40;
+        //Room each voice's meters take up at the right of its row, with a bar for each channel
+        private const int MeterBarWidth = 6;
+        private const int MeterAreaWidth = NativeEngine.MeterChannels * (MeterBarWidth + 2) + 8;
+        //Quietest level the meters show, in dBFS
+        private const double MeterFloor = -60;
+
+        private readonly NativeEngine.VoiceSnapshot[] voices = new NativeEngine.VoiceSnapshot[NativeEngine.MaxVoices];
+        private int voiceCount;
+
+        //The name and waveform of each sound being played, by sample ID, looked up the first time it is drawn
+        private readonly Dictionary<int, PlaybackSound> playbackSounds = new();
+        private bool loadRefreshQueued;
+
+        private class PlaybackSound
+        {
+            public string Name = "";
+            public int Width;
+            public NativeEngine.PeakColumn[] Waveform = Array.Empty<NativeEngine.PeakColumn>();
+        }
 
         public MainWindow() : this(new Builder("MainWindow.glade"))
         {
@@ -64,8 +92,11 @@ namespace KarrotSoundProduction
             removeSoundButton.Clicked += RemoveSoundClicked;
             saveFileAsButton.Activated += ShowSaveFileAs;
             saveFileButton.Activated += SaveFileClicked;
+            exportBundleButton.Activated += ShowExportBundle;
             quitButton.Activated += QuitButtonClicked;
             newFileButton.Activated += NewButtonClicked;
+            playbackArea.Drawn += DrawPlayback;
+            GLib.Timeout.Add(PlaybackRefreshMilliseconds, RefreshPlayback);
         }
 
         private async void Window_DeleteEvent(object sender, DeleteEventArgs e)
@@ -91,6 +122,7 @@ namespace KarrotSoundProduction
             if (ok)
             {
                 using var l = await SoundboardConfiguration.CurrentConfigLockProvider.GetLock();
+                SoundboardConfiguration.CurrentConfig.Unload();
                 SoundboardConfiguration.CurrentConfig = new();
                 UpdateMainText();
             }
@@ -155,14 +187,184 @@ namespace KarrotSoundProduction
             dialog.Show();
         }
 
-        public async void UpdateMainText()
+        public void UpdateMainText()
+        {
+            //Sample IDs are handed out again once a sound or board is unloaded
+            playbackSounds.Clear();
+            RefreshMainText();
+        }
+
+        /// <summary>
+        /// Rebuilds the main view's text without forgetting the sounds the playback view has looked up, which are still
+        /// the same while a board loads.
+        /// </summary>
+        private async void RefreshMainText()
+        {
+            using var l = await SoundboardConfiguration.CurrentConfigLockProvider.GetLock();
+            SoundboardConfiguration config = SoundboardConfiguration.CurrentConfig;
+            mainViewLabel.Text = config.ToString();
+            int loading = config.SoundsLoading;
+            if (loading > 0)
+                mainViewLabel.Text += $"\nLoading sounds: {config.Sounds.Count - loading} of {config.Sounds.Count} ready";
+            if (config.Sounds.Count > 0)
+                mainViewLabel.Text += $"\n{Utils.FormatBytes(config.ResidentBytes)} of audio resident in memory";
+            ulong underruns = NetCoreAudio.Players.NativeEngine.Underruns;
+            if (underruns > 0)
+                mainViewLabel.Text += $"\nStreamed sounds have run out of audio {underruns} times";
+            NetCoreAudio.Players.NativeEngine.Stats stats = NetCoreAudio.Players.NativeEngine.GetStats();
+            if (stats.xruns > 0)
+                mainViewLabel.Text += $"\nThe audio device has missed {stats.xruns} cycles";
+            if (stats.voicesPeak > 0)
+                mainViewLabel.Text += $"\nVoices: {stats.voices} of {NetCoreAudio.Players.NativeEngine.MaxVoices} in use, {stats.voicesPeak} at most, {stats.voicesStolen} cut off to make room";
+            if (stats.triggerMax > 0)
+                mainViewLabel.Text += $"\nKey to sound latency: {stats.triggerP50 / 1e6:0.0} ms typical, {stats.triggerP99 / 1e6:0.0} ms worst 1%";
+            if (stats.gainReductionPeak > 0)
+                mainViewLabel.Text += $"\nLimiting: {stats.gainReduction:0.0} dB now, {stats.gainReductionPeak:0.0} dB at most";
+            if (stats.dspMax > 0)
+                mainViewLabel.Text += $"\nFilters and limiters: {stats.dspP50 / 1e3:0} µs a block typical, {stats.dspP99 / 1e3:0} µs worst 1%";
+        }
+
+        /// <summary>
+        /// Reads where every voice has got to from the engine, in one call, and redraws the playback view while anything
+        /// is playing. Keeps the timer going.
+        /// </summary>
+        /// <returns></returns>
+        private bool RefreshPlayback()
+        {
+            int previous = voiceCount;
+            voiceCount = NativeEngine.GetVoices(voices);
+            if (voiceCount != previous)
+                playbackArea.SetSizeRequest(-1, voiceCount * PlaybackRowHeight);
+            if (voiceCount > 0 || previous > 0)
+                playbackArea.QueueDraw();
+            return true;
+        }
+
+        /// <summary>
+        /// Draws a row for each voice: the waveform of its sound with the playhead across it, its name and times, and a
+        /// meter for each channel.
+        /// </summary>
+        private void DrawPlayback(object sender, DrawnArgs e)
+        {
+            Cairo.Context cr = e.Cr;
+            int waveformWidth = Math.Max(1, playbackArea.AllocatedWidth - MeterAreaWidth);
+            for (int i = 0; i < voiceCount; i++)
+            {
+                double top = i * PlaybackRowHeight;
+                PlaybackSound sound = GetPlaybackSound(voices[i].sampleId, waveformWidth);
+                DrawWaveform(cr, sound.Waveform, top);
+
+                if (voices[i].frameCount > 0)
+                {
+                    double x = Math.Floor(waveformWidth * Math.Min(1, (double)voices[i].position / voices[i].frameCount)) + 0.5;
+                    cr.SetSourceRGB(0.85, 0.15, 0.1);
+                    cr.LineWidth = 1;
+                    cr.MoveTo(x, top);
+                    cr.LineTo(x, top + PlaybackRowHeight - 2);
+                    cr.Stroke();
+                }
+
+                string text = $"{sound.Name}  {FormatPlaybackTime(voices[i].seconds)}";
+                if (voices[i].remaining >= 0)
+                    text += $"  -{FormatPlaybackTime(voices[i].remaining)}";
+                if (voices[i].state == NativeEngine.VoiceState.Paused)
+                    text += "  (paused)";
+                cr.SetSourceRGB(0.1, 0.1, 0.1);
+                cr.SetFontSize(11);
+                cr.MoveTo(4, top + 13);
+                cr.ShowText(text);
+
+                DrawMeters(cr, voices[i], waveformWidth + 8, top);
+            }
+        }
+
+        private static void DrawWaveform(Cairo.Context cr, NativeEngine.PeakColumn[] waveform, double top)
+        {
+            double middle = top + PlaybackRowHeight / 2.0;
+            double scale = (PlaybackRowHeight - 4) / 2.0;
+            cr.SetSourceRGB(0.6, 0.68, 0.8);
+            for (int x = 0; x < waveform.Length; x++)
+                cr.Rectangle(x, middle - waveform[x].max * scale, 1, Math.Max(1, (waveform[x].max - waveform[x].min) * scale));
+            cr.Fill();
+        }
+
+        //Each channel's RMS as a bar, with its peak as a line above it, from MeterFloor to full scale
+        private static unsafe void DrawMeters(Cairo.Context cr, NativeEngine.VoiceSnapshot voice, double left, double top)
+        {
+            double height = PlaybackRowHeight - 4;
+            for (int c = 0; c < voice.channels; c++)
+            {
+                double x = left + c * (MeterBarWidth + 2);
+                double rms = MeterFraction(voice.rms[c]) * height;
+                double peak = MeterFraction(voice.peaks[c]) * height;
+                cr.SetSourceRGB(0.85, 0.85, 0.85);
+                cr.Rectangle(x, top + 2, MeterBarWidth, height);
+                cr.Fill();
+                cr.SetSourceRGB(0.2, 0.65, 0.25);
+                cr.Rectangle(x, top + 2 + height - rms, MeterBarWidth, rms);
+                cr.Fill();
+                if (voice.peaks[c] >= 1)
+                    cr.SetSourceRGB(0.85, 0.15, 0.1);
+                cr.Rectangle(x, top + 2 + height - peak, MeterBarWidth, 1);
+                cr.Fill();
+            }
+        }
+
+        private static double MeterFraction(float level) =>
+            level > 0 ? Math.Clamp((20 * Math.Log10(level) - MeterFloor) / -MeterFloor, 0, 1) : 0;
+
+        private static string FormatPlaybackTime(double seconds) =>
+            TimeSpan.FromSeconds(seconds).ToString(seconds >= 3600 ? @"h\:mm\:ss" : @"m\:ss\.f");
+
+        /// <summary>
+        /// Gets the name and waveform of the sound with the given sample ID, drawn width pixels wide. Sounds that haven't
+        /// been looked up at that width yet are looked up once the board is free, and drawn without a waveform until then.
+        /// </summary>
+        private PlaybackSound GetPlaybackSound(int sampleId, int width)
+        {
+            if (playbackSounds.TryGetValue(sampleId, out PlaybackSound sound) && (sound.Width == width || sound.Width < 0))
+                return sound;
+            sound ??= new();
+            sound.Width = -1;
+            playbackSounds[sampleId] = sound;
+            LoadPlaybackSound(sampleId, width, sound);
+            return sound;
+        }
+
+        private async void LoadPlaybackSound(int sampleId, int width, PlaybackSound sound)
         {
             using var l = await SoundboardConfiguration.CurrentConfigLockProvider.GetLock();
-            mainViewLabel.Text = SoundboardConfiguration.CurrentConfig.ToString();
+            SoundConfiguration config = SoundboardConfiguration.CurrentConfig.Sounds.Find(x => x.SampleId == sampleId);
+            sound.Name = config?.ToString(false) ?? "";
+            sound.Waveform = config?.GetWaveform(width) ?? Array.Empty<NativeEngine.PeakColumn>();
+            sound.Width = width;
+        }
+
+        /// <summary>
+        /// Refreshes the main view as sounds on a loading board become ready, at most every
+        /// <see cref="LoadRefreshMilliseconds"/>, so a large board isn't measured again for every sound.
+        /// </summary>
+        /// <returns></returns>
+        public IProgress<int> CreateLoadProgress() =>
+            new Progress<int>(loaded => Gtk.Application.Invoke((sender, e) => QueueLoadRefresh()));
+
+        private void QueueLoadRefresh()
+        {
+            if (loadRefreshQueued)
+                return;
+            loadRefreshQueued = true;
+            //The refresh comes after the report that queued it, so the last sound to load is always shown
+            GLib.Timeout.Add(LoadRefreshMilliseconds, () =>
+            {
+                loadRefreshQueued = false;
+                RefreshMainText();
+                return false;
+            });
         }
 
         private async void Key_Released(object sender, KeyReleaseEventArgs e)
         {
+            long keyEventTimestamp = Utils.MonotonicNanoseconds();
             if (!playbackEnabledCheck.Active) return;
             Console.WriteLine($"Received {e.Event.Key} ({e.Event.HardwareKeycode})");
 
@@ -172,7 +374,7 @@ namespace KarrotSoundProduction
 
             if (ok)
             {
-                await value.TriggerKey();
+                await value.TriggerKey(keyEventTimestamp);
             }
         }
 
@@ -205,6 +407,7 @@ namespace KarrotSoundProduction
                 Name = "KON Soundboard Files"
             };
             filter.AddPattern("*.ksp");
+            filter.AddPattern("*.kspb");
             fileChooser.Filter = filter;
             int response = 32768;
             string path = "";
@@ -222,9 +425,10 @@ namespace KarrotSoundProduction
                     fileChooser.Destroy();
                 }
             } while (response != 0 && response != -3);
-            var loadedConfig = await SoundboardConfiguration.Load(path);
+            var loadedConfig = await SoundboardConfiguration.Load(path, CreateLoadProgress());
             if (loadedConfig != null)
             {
+                SoundboardConfiguration.CurrentConfig.Unload();
                 SoundboardConfiguration.CurrentConfig = loadedConfig;
                 UpdateMainText();
             }
@@ -289,6 +493,51 @@ namespace KarrotSoundProduction
             return true;
         }
 
+        private async void ShowExportBundle(object sender, EventArgs e)
+        {
+            using var l = await SoundboardConfiguration.CurrentConfigLockProvider.GetLock();
+            FileChooserDialog fileChooser = new("Select Bundle Location", this, FileChooserAction.Save, "_Cancel", ResponseType.Cancel, "_Export", ResponseType.Accept);
+            FileFilter filter = new()
+            {
+                Name = "KSP Soundboard Bundles"
+            };
+            filter.AddPattern("*.kspb");
+            fileChooser.Filter = filter;
+            fileChooser.SetFilename("soundboard.kspb");
+            fileChooser.SelectFilename("soundboard.kspb");
+            int response = 32768;
+            string path = "";
+            do
+            {
+                response = fileChooser.Run();
+                if (response == -6 || response == -4) //Cancel or close
+                {
+                    fileChooser.Destroy();
+                    return;
+                }
+                if (fileChooser.File != null && (response == -3 || response == -1)) //Open or Accept
+                {
+                    path = fileChooser.File.Path;
+                    fileChooser.Destroy();
+                }
+            } while (response != -1 && response != -3);
+            if (!path.EndsWith(".kspb"))
+            {
+                path += ".kspb";
+            }
+            if (File.Exists(path))
+            {
+                WarningDialog dialog = new("This file already exists. Would you like to continue?", "Overwrite");
+                var wResponse = await dialog.GetResponse();
+                if (wResponse == DialogResponse.Cancel) return;
+            }
+            if (!await SoundboardConfiguration.CurrentConfig.ExportBundle(path))
+            {
+                ErrorDialog error = new("The bundle could not be written.");
+                error.Show();
+            }
+        }
+
         private async void SaveFileClicked(object sender, EventArgs e)
         {
             await SaveFile();
@@ -48,7 +48,7 @@ namespace NetCoreAudio
             }
             else if (RuntimeInformation.IsOSPlatform(OSPlatform.Linux))
             {
-                if (KarrotSoundProduction.Utils.CheckForCommand("pw-play"))
+                if (NativeEngine.Available)
                 {
                     _internalPlayer = new LinuxPlayerNative();
                 }
@@ -92,11 +92,40 @@ namespace NetCoreAudio
             await _internalPlayer.Play(fileName);
         }
 
-        public async Task Play(string fileName, KarrotSoundProduction.SoundConfiguration config)
+        /// <summary>
+        /// Plays the sound with the given configuration, completing once it has finished. The sound is started before
+        /// this first yields; only the wait for it to end happens on another thread.
+        /// </summary>
+        /// <param name="fileName"></param>
+        /// <param name="config"></param>
+        /// <param name="trigger">The key trigger that started the sound, if any</param>
+        /// <returns></returns>
+        public async Task Play(string fileName, KarrotSoundProduction.SoundConfiguration config, KarrotSoundProduction.KeyTriggerEventArgs trigger = null)
         {
             if (_internalPlayer is LinuxPlayerNative lpn)
             {
-                lpn.Play(fileName, config);
+                lpn.Start(fileName, config, trigger);
+                await lpn.WaitUntilFinished();
+            }
+            else throw new NotImplementedException();
+        }
+
+        /// <summary>
+        /// Plays the sound with the given configuration, fading it in while another playback fades out, and completes
+        /// once it has finished. Only the native backend can crossfade.
+        /// </summary>
+        /// <param name="fileName"></param>
+        /// <param name="config"></param>
+        /// <param name="from">The playback to fade out</param>
+        /// <param name="milliseconds">The length of both fades</param>
+        /// <param name="curve">The shape of both fades</param>
+        /// <returns></returns>
+        public async Task Crossfade(string fileName, KarrotSoundProduction.SoundConfiguration config, Player from, int milliseconds, KarrotSoundProduction.SoundConfiguration.FadeCurve curve)
+        {
+            if (_internalPlayer is LinuxPlayerNative lpn && from._internalPlayer is LinuxPlayerNative fromLpn)
+            {
+                lpn.StartCrossfade(fileName, config, fromLpn, milliseconds, curve);
+                await lpn.WaitUntilFinished();
             }
             else throw new NotImplementedException();
         }
@@ -141,6 +170,57 @@ namespace NetCoreAudio
             await _internalPlayer.Stop();
         }
 
+        /// <summary>
+        /// Fades any current playback out over the given time, then stops it. Backends without native fades stop immediately.
+        /// </summary>
+        /// <param name="fadeOutMilliseconds"></param>
+        /// <returns></returns>
+        public async Task Stop(int fadeOutMilliseconds)
+        {
+            if (_internalPlayer is LinuxPlayerNative lpn)
+                await lpn.Stop(fadeOutMilliseconds);
+            else
+                await _internalPlayer.Stop();
+        }
+
+        /// <summary>
+        /// Changes the speed of the current playback without restarting it. Only the native backend supports this; others ignore it.
+        /// </summary>
+        /// <param name="speedFactor"></param>
+        /// <returns></returns>
+        public async Task SetSpeed(float speedFactor)
+        {
+            if (_internalPlayer is LinuxPlayerNative lpn)
+                await lpn.SetSpeed(speedFactor);
+        }
+
+        /// <summary>
+        /// Moves the current playback to another of the engine's buses without restarting it. Only the native backend
+        /// has buses; others ignore it.
+        /// </summary>
+        /// <param name="bus"></param>
+        /// <returns></returns>
+        public async Task SetBus(int bus)
+        {
+            if (_internalPlayer is LinuxPlayerNative lpn)
+                await lpn.SetBus(bus);
+        }
+
+        /// <summary>
+        /// Whether the current playback is going round its loop. Only the native backend can loop sounds.
+        /// </summary>
+        public bool Looping => _internalPlayer is LinuxPlayerNative lpn && lpn.Looping;
+
+        /// <summary>
+        /// Lets the current playback finish its pass through its loop and play on to its end.
+        /// </summary>
+        /// <returns></returns>
+        public async Task ExitLoop()
+        {
+            if (_internalPlayer is LinuxPlayerNative lpn)
+                await lpn.ExitLoop();
+        }
+
         private void OnPlaybackFinished(object sender, EventArgs e)
         {
             PlaybackFinished?.Invoke(this, e);
@@ -4,6 +4,7 @@
 *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 using System;
+using System.Collections.Generic;
 using System.Runtime.InteropServices;
 using System.IO;
 using System.Diagnostics;
@@ -23,197 +24,211 @@ internal partial class LinuxPlayerNative : IPlayer
     public int CurrentVolume { get; set; }
 
     public bool Playing { get; private set; }
-    public bool Paused { get; }
+    public bool Paused { get; private set; }
+    /// <summary>
+    /// Whether the sound is going round its loop, and hasn't been told to carry on past it.
+    /// </summary>
+    public bool Looping { get; private set; }
 
     public LinuxPlayer.PlayerBackend Backend { get { return LinuxPlayer.PlayerBackend.NativePipewire; } }
 
-    private static partial class Interop
-    {
-        [LibraryImport("pw_interface.so")]
-        public static unsafe partial void startPlayer(pw_player_info* info, int argc, byte** argv);
-
-        [LibraryImport("pw_interface.so")]
-        public static unsafe partial void stopPlayer(void* userdata, int signal);
-
-        [LibraryImport("pw_interface.so")]
-        public static unsafe partial void setVolume(pw_player_info* info, float volume);
-
-        [LibraryImport("pw_interface.so")]
-        public static unsafe partial float getVolume(pw_player_info* info);
+    //The sound's voice, followed by the voices of any sounds that follow on from it automatically
+    private int[] voices = { -1 };
 
-        [LibraryImport("pw_interface.so")]
-        public static unsafe partial void setPaused(pw_player_info* info, [MarshalAs(UnmanagedType.Bool)] bool paused);
-
-        //Import C strlen for string operations
-        [LibraryImport("libc")]
-        public static unsafe partial IntPtr strlen(byte* contents);
+    public Task Play(string fileName)
+    {
+        return Play(fileName, new KarrotSoundProduction.SoundConfiguration(fileName, Gdk.Key.A));
+    }
 
-        public static unsafe string ConvertFromCStr(byte* cstr)
-        {
-            if (cstr == null) throw new NullReferenceException("Received null pointer as input.");
-            byte[] bytes = CreateArray<byte>(cstr, (int)strlen(cstr));
-            string output = Encoding.ASCII.GetString(bytes);
-            return output;
-        }
+    /// <summary>
+    /// Plays the sound with the given configuration and blocks until it has finished.
+    /// </summary>
+    /// <param name="trigger">The key trigger that started the sound, whose timestamps feed the engine's latency statistics.</param>
+    public Task Play(string fileName, KarrotSoundProduction.SoundConfiguration config, KarrotSoundProduction.KeyTriggerEventArgs trigger = null)
+    {
+        if (Start(fileName, config, trigger))
+            WaitForVoices(voices);
+        Finish();
+        return Task.CompletedTask;
+    }
 
-        public static unsafe byte* ConvertToCStr(string str)
-        {
-            byte[] bytes = Encoding.UTF8.GetBytes(str);
-            fixed (byte* ptr = bytes)
-            {
-                return ptr;
-            }
-        }
+    /// <summary>
+    /// Starts the sound with the given configuration and returns straight away. A preloaded sound is only queued for
+    /// the engine's next cycle, so nothing here waits on the disk or on another thread.
+    /// </summary>
+    /// <param name="trigger">The key trigger that started the sound, whose timestamps feed the engine's latency statistics.</param>
+    /// <returns>Whether the sound was started, which it isn't if it is already playing and set to ignore retriggers</returns>
+    public bool Start(string fileName, KarrotSoundProduction.SoundConfiguration config, KarrotSoundProduction.KeyTriggerEventArgs trigger = null)
+    {
+        IntPtr engine = NativeEngine.Handle;
+        NativeEngine.VoiceParams voiceParams = GetVoiceParams(config, trigger);
+        //Scheduled to the frame when the key also started other sounds, so they all start together
+        ulong at = trigger != null && trigger.StartFrame != 0 ? trigger.StartFrame : NativeEngine.NextCycle;
+        List<KarrotSoundProduction.SoundConfiguration> chain = config.SampleId >= 0 ? config.FollowChain() : null;
 
-        public unsafe static T[] CreateArray<T>(void* source, int length) where T : struct
+        unsafe
         {
-            var type = typeof(T);
-            var sizeInBytes = Marshal.SizeOf(typeof(T));
-
-            T[] output = new T[length];
-
-            if (type.IsPrimitive)
+            //Preloaded sounds start straight from the sample bank without touching the file
+            if (chain?.Count > 1)
             {
-                // Make sure the array won't be moved around by the GC 
-                var handle = GCHandle.Alloc(output, GCHandleType.Pinned);
-
-                var destination = (byte*)handle.AddrOfPinnedObject().ToPointer();
-                var byteLength = length * sizeInBytes;
-
-                // There are faster ways to do this, particularly by using wider types or by 
-                // handling special lengths.
-                for (int i = 0; i < byteLength; i++)
-                    destination[i] = ((byte*)source)[i];
-
-                handle.Free();
-            }
-            else if (type.IsValueType)
-            {
-                if (!type.IsLayoutSequential && !type.IsExplicitLayout)
-                {
-                    throw new InvalidOperationException(string.Format("{0} does not define a StructLayout attribute", type));
-                }
-
-                IntPtr sourcePtr = new(source);
-
-                for (int i = 0; i < length; i++)
+                //Each sound in the chain is started by the engine on the frame after the one before it ends
+                int[] sampleIds = new int[chain.Count];
+                NativeEngine.VoiceParams[] chainParams = new NativeEngine.VoiceParams[chain.Count];
+                int[] handles = new int[chain.Count];
+                for (int i = 0; i < chain.Count; i++)
                 {
-                    IntPtr p = new((byte*)source + i * sizeInBytes);
-
-                    output[i] = (T)Marshal.PtrToStructure(p, typeof(T))!;
+                    sampleIds[i] = chain[i].SampleId;
+                    chainParams[i] = i == 0 ? voiceParams : GetVoiceParams(chain[i], trigger);
                 }
+                fixed (int* sampleIdsPtr = sampleIds, handlesPtr = handles)
+                fixed (NativeEngine.VoiceParams* paramsPtr = chainParams)
+                    NativeEngine.Interop.ksp_trigger_chain(engine, sampleIdsPtr, paramsPtr, chain.Count, at, handlesPtr);
+                voices = handles;
             }
+            else if (config.SampleId >= 0)
+                voices = new[] { NativeEngine.Interop.ksp_trigger_at(engine, config.SampleId, &voiceParams, at) };
             else
-            {
-                throw new InvalidOperationException(string.Format("{0} is not supported", type));
-            }
-
-            return output;
+                voices = new[] { NativeEngine.Interop.ksp_voice_start(engine, fileName, &voiceParams) };
         }
+
+        Console.WriteLine($"Playing {fileName} with Native Pipewire backend");
+        Playing = voices[0] >= 0;
+        //The engine plays a sound once if it can't loop it, so the stop key mustn't wait for it to leave the loop
+        Looping = Playing && NativeEngine.Interop.ksp_voice_is_looping(engine, voices[0]);
+        return Playing;
     }
 
-    private unsafe pw_player_info playerInfo;
+    /// <summary>
+    /// Starts the sound fading in while whichever voice of another player is still playing fades out over the same
+    /// frames. A sound that isn't preloaded can't be lined up with the fade out, so it is just started after it.
+    /// </summary>
+    /// <returns>Whether the sound was started</returns>
+    public bool StartCrossfade(string fileName, KarrotSoundProduction.SoundConfiguration config, LinuxPlayerNative from, int milliseconds, KarrotSoundProduction.SoundConfiguration.FadeCurve curve)
+    {
+        if (config.SampleId < 0)
+        {
+            from.Stop(milliseconds);
+            return Start(fileName, config);
+        }
 
-    public Task Play(string fileName)
+        IntPtr engine = NativeEngine.Handle;
+        int playing = Array.FindIndex(from.voices, x => NativeEngine.Interop.ksp_voice_is_playing(engine, x));
+        int fromVoice = playing >= 0 ? from.voices[playing] : -1;
+        NativeEngine.VoiceParams voiceParams = GetVoiceParams(config, null);
+        unsafe
+        {
+            voices = new[] { NativeEngine.Interop.ksp_crossfade(engine, fromVoice, config.SampleId, &voiceParams, milliseconds, curve) };
+        }
+
+        Playing = voices[0] >= 0;
+        Looping = Playing && NativeEngine.Interop.ksp_voice_is_looping(engine, voices[0]);
+        return Playing;
+    }
+
+    private NativeEngine.VoiceParams GetVoiceParams(KarrotSoundProduction.SoundConfiguration config, KarrotSoundProduction.KeyTriggerEventArgs trigger)
     {
-        return Play(fileName, new KarrotSoundProduction.SoundConfiguration(fileName, Gdk.Key.A));
+        return new()
+        {
+            volume = PercentToGain(CurrentVolume),
+            fadeInMilliseconds = config.FadeInTime,
+            fadeOutMilliseconds = config.FadeOutTime,
+            speedFactor = config.PlaybackSpeed,
+            minVolume = PercentToGain(config.MinVolume),
+            maxVolume = PercentToGain(config.MaxVolume),
+            keyEventNs = trigger?.KeyEventTimestamp ?? 0,
+            triggerNs = trigger?.TriggerTimestamp ?? 0,
+            maxPolyphony = config.MaxPolyphony,
+            retrigger = config.Retrigger,
+            chokeGroup = config.ChokeGroup,
+            preWaitMilliseconds = config.PreWait,
+            loop = config.Loop ? 1 : 0,
+            loopStart = config.LoopStart,
+            loopEnd = config.LoopEnd,
+            loopCrossfadeMilliseconds = config.LoopCrossfade,
+            fadeCurve = config.FadeShape,
+            bus = config.Bus,
+            timeStretch = config.PreservePitch ? 1 : 0
+        };
     }
 
-    public Task Play(string fileName, KarrotSoundProduction.SoundConfiguration config)
+    //Waits for each voice in turn. Those that were cancelled or never started are finished already.
+    private static void WaitForVoices(int[] playing)
     {
-        Console.WriteLine($"Playing {fileName} with Native Pipewire backend");
-        string[] args = Environment.GetCommandLineArgs();
-        int argc = args.Length;
-        playerInfo.firstRun = true;
-        unsafe
+        foreach (int voice in playing)
         {
-            playerInfo.volume = (float)Math.Pow(10, Math.Log2((double)CurrentVolume / 100));
-            playerInfo.fileName = Interop.ConvertToCStr(fileName);
-            playerInfo.playing = true;
-            playerInfo.speedFactor = config.PlaybackSpeed;
-            playerInfo.fadeInMilliseconds = config.FadeInTime;
-            playerInfo.fadeOutMilliseconds = config.FadeOutTime;
-
-            byte*[] charPtrs = new byte*[argc];
-            for (int i = 0; i < argc; i++)
-            {
-                charPtrs[i] = Interop.ConvertToCStr(args[i]);
-            }
-            fixed (byte** argv = charPtrs)
-            fixed (pw_player_info* player_info = &playerInfo)
-            {
-                Console.WriteLine("Starting native player");
-                try
-                {
-                    Playing = true;
-                    Interop.startPlayer(player_info, argc, argv);
-                }
-                catch (Exception e) { Console.WriteLine(e.ToString()); }
-            }
+            if (voice >= 0)
+                NativeEngine.Interop.ksp_voice_wait(NativeEngine.Handle, voice);
         }
+    }
 
-        PlaybackFinished.Invoke(this, new EventArgs());
-        Playing = false;
+    /// <summary>
+    /// Waits on the thread pool for the sound started by <see cref="Start"/> to finish.
+    /// </summary>
+    public async Task WaitUntilFinished()
+    {
+        int[] playing = voices;
+        if (playing[0] >= 0)
+            await Task.Run(() => WaitForVoices(playing));
+        Finish();
+    }
 
-        return Task.CompletedTask;
+    private void Finish()
+    {
+        Playing = false;
+        Looping = false;
+        PlaybackFinished?.Invoke(this, new EventArgs());
     }
 
     public Task Pause()
     {
-        unsafe
-        {
-            playerInfo.playing = false;
-            fixed (pw_player_info* player_info = &playerInfo)
-            Interop.setPaused(player_info, true);
-        }
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_paused(NativeEngine.Handle, voice, true);
+        Paused = true;
 
         return Task.CompletedTask;
     }
 
     public Task Resume()
     {
-        unsafe
-        {
-            playerInfo.playing = true;
-            fixed (pw_player_info* player_info = &playerInfo)
-            Interop.setPaused(player_info, false);
-        }
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_paused(NativeEngine.Handle, voice, false);
+        Paused = false;
 
         return Task.CompletedTask;
     }
 
-    public Task Stop()
+    public Task Stop() => Stop(0);
+
+    /// <summary>
+    /// Fades the voice out over the given time and then stops it. The fade runs on the engine's realtime thread,
+    /// so this returns immediately.
+    /// </summary>
+    public Task Stop(int fadeOutMilliseconds)
     {
         if (!Playing) return Task.CompletedTask;
-        unsafe
-        {
-            fixed (pw_player_info* player_info = &playerInfo)
-            {
-                Interop.stopPlayer(player_info, 0);
-            }
-        }
-        Playing = false;
-        PlaybackFinished.Invoke(this, new());
+        //Play() raises PlaybackFinished once the engine has actually released the voice. Stopping whichever voice of
+        //the chain is playing cancels the ones after it; those that have finished already ignore the stop.
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_fade_out(NativeEngine.Handle, voice, fadeOutMilliseconds);
+        return Task.CompletedTask;
+    }
+
+    /// <summary>
+    /// Lets the sound finish the pass through its loop it is on, then play on to its end.
+    /// </summary>
+    public Task ExitLoop()
+    {
+        if (!Looping) return Task.CompletedTask;
+        NativeEngine.Interop.ksp_voice_exit_loop(NativeEngine.Handle, voices[0]);
+        Looping = false;
         return Task.CompletedTask;
     }
 
     public Task SetVolume(int percent)
     {
         CurrentVolume = percent;
-        unsafe
-        {
-            fixed (pw_player_info* player_info = &playerInfo)
-            {
-                //Console.WriteLine($"Current volume: {Interop.getVolume(player_info)}");
-                //Convert the percent into 0-1 log scale by doing the following:
-                //1) Cast to double and divide by 100
-                //2) Take the log base 2 of that value
-                //3) Take 10 to that power
-                double value = Math.Pow(10, Math.Log2((double)percent / 100));
-                playerInfo.volume = (float)value;
-                Interop.setVolume(player_info, (float)value);
-            }
-        }
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_volume(NativeEngine.Handle, voice, PercentToGain(percent));
 
         return Task.CompletedTask;
     }
@@ -221,73 +236,46 @@ internal partial class LinuxPlayerNative : IPlayer
     public Task SetVolume(double log2Scale)
     {
         CurrentVolume = (int)Math.Pow(2, Math.Log10(log2Scale));
-        unsafe
-        {
-            fixed (pw_player_info* player_info = &playerInfo)
-            {
-                playerInfo.volume = (float)log2Scale;
-                Interop.setVolume(player_info, (float)log2Scale);
-            }
-        }
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_volume(NativeEngine.Handle, voice, (float)log2Scale);
         return Task.CompletedTask;
     }
 
-    public Task SetFadeInTime(float seconds)
+    /// <summary>
+    /// Changes the speed of the voice while it plays. A voice started with
+    /// <see cref="KarrotSoundProduction.SoundConfiguration.PreservePitch"/> is time stretched and keeps its pitch;
+    /// any other changes pitch along with speed.
+    /// </summary>
+    public Task SetSpeed(float speedFactor)
     {
-        playerInfo.fadeInMilliseconds = (int)(seconds / 1000);
+        if (!Playing) return Task.CompletedTask;
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_speed(NativeEngine.Handle, voice, speedFactor);
         return Task.CompletedTask;
     }
 
-    public Task SetFadeOutTime(float seconds)
+    /// <summary>
+    /// Moves every voice of the sound to another bus while it plays.
+    /// </summary>
+    public Task SetBus(int bus)
     {
-        playerInfo.fadeOutMilliseconds = (int)(seconds / 1000);
+        if (!Playing) return Task.CompletedTask;
+        foreach (int voice in voices)
+            NativeEngine.Interop.ksp_voice_set_bus(NativeEngine.Handle, voice, bus);
         return Task.CompletedTask;
     }
 
+    internal static float PercentToGain(double percent)
+    {
+        //Convert the percent into 0-1 log scale by doing the following:
+        //1) Divide by 100
+        //2) Take the log base 2 of that value
+        //3) Take 10 to that power
+        return (float)Math.Pow(10, Math.Log2(percent / 100));
+    }
+
     public LinuxPlayerNative()
     {
-        unsafe
-        {
-            playerInfo = new pw_player_info();
-        }
         CurrentVolume = 100;
     }
 }
-
-unsafe struct pw_player_info
-{
-    public float volume;
-    public byte* fileName;
-    public bool playing;
-    public bool firstRun;
-    KarrotSoundProduction.Utils.AudioFormat format;
-    public int fadeInMilliseconds;
-    public int fadeOutMilliseconds;
-    public float speedFactor;
-    public void* data;
-}
-
-unsafe struct waveFile
-{
-    fixed byte chunkId[5]; //Should always be RIFF
-    uint chunkSize;
-    fixed byte format[5]; //Should always be WAVE
-    waveFormatSubChunk formatChunk;
-    waveDataSubChunk dataChunk;
-}
-
-struct waveFormatSubChunk
-{
-    ushort audioFormat;
-    ushort channels;
-    uint sampleRate;
-    uint avgBytesPerSec;
-    ushort blockAlign; //(Bits per sample * channels) / 8
-    ushort bitsPerSample;
-}
-
-unsafe struct waveDataSubChunk
-{
-    uint dataSize;
-    byte* data;
-}
@@ -0,0 +1,516 @@
+/*
+*  This Source Code Form is subject to the terms of the Mozilla Public
+*  License, v. 2.0. If a copy of the MPL was not distributed with this
+*  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+using System;
+using System.Runtime.InteropServices;
+
+namespace NetCoreAudio.Players;
+
+/// <summary>
+/// Owns the single native mixing engine in pw_interface.so. Every voice started by
+/// <see cref="LinuxPlayerNative"/> is mixed into one of the engine's buses, which play through its main output,
+/// normally a PipeWire stream, or through PipeWire streams of their own.
+/// </summary>
+internal static partial class NativeEngine
+{
+    public const uint SampleRate = 48000;
+    public const uint Channels = 2;
+
+    /// <summary>
+    /// Number of voices the engine's pool holds. A few are kept back for voices fading out after being stolen.
+    /// </summary>
+    public const int MaxVoices = 64;
+
+    /// <summary>
+    /// Number of submix buses the engine mixes. Sounds play on bus 0, which always goes to the main output, unless they
+    /// are put on another.
+    /// </summary>
+    public const int MaxBuses = 8;
+
+    /// <summary>
+    /// Stands for the master, which every bus playing through the main output is added to, when setting up filters
+    /// and limiters.
+    /// </summary>
+    public const int MasterBus = -1;
+
+    /// <summary>
+    /// Number of filters each bus and the master can run one after another.
+    /// </summary>
+    public const int MaxFilters = 4;
+
+    /// <summary>
+    /// Number of channels of each voice the engine meters. Any after these aren't metered.
+    /// </summary>
+    public const int MeterChannels = 8;
+
+    /// <summary>
+    /// Flag for <see cref="Interop.ksp_bank_load"/>: mlock() the sample so it can never be paged out.
+    /// </summary>
+    public const uint BankLock = 0x1;
+
+    /// <summary>
+    /// Flag for <see cref="Interop.ksp_bank_load"/>: map the sample's peak index from the cache, or work it out and
+    /// cache it, so its waveform can be drawn with <see cref="Interop.ksp_bank_peaks"/>.
+    /// </summary>
+    public const uint BankPeaks = 0x2;
+
+    /// <summary>
+    /// Flag for <see cref="Interop.ksp_bank_load"/>: decode or map the whole sample however long it is. Streamed
+    /// samples can't loop, so looping sounds are loaded with this.
+    /// </summary>
+    public const uint BankResident = 0x4;
+
+    /// <summary>
+    /// Flag for the times commands are stamped with: the rest of the time is a number of frames from the start of the
+    /// engine's next cycle, rather than a frame of its clock.
+    /// </summary>
+    public const ulong NextCycle = 1UL << 63;
+
+    /// <summary>
+    /// How cleanly the engine converts sounds to its own rate and applies their playback speed, at the cost of CPU time.
+    /// </summary>
+    public enum ResampleQuality
+    {
+        Linear,
+        Low,
+        Medium,
+        High
+    }
+
+    /// <summary>
+    /// Which voice the engine cuts off to make room for a new one when every voice is in use.
+    /// </summary>
+    public enum StealPolicy
+    {
+        Oldest,
+        Quietest
+    }
+
+    /// <summary>
+    /// Where a voice is in its life. Matches ksp_voice_state in the native library.
+    /// </summary>
+    public enum VoiceState
+    {
+        Free,
+        Loading,
+        Playing,
+        Paused,
+        /// <summary>
+        /// Fading out after being stopped.
+        /// </summary>
+        Stopping,
+        Finished
+    }
+
+    /// <summary>
+    /// What the engine plays through. Matches ksp_backend_type in the native library.
+    /// </summary>
+    public enum Backend
+    {
+        PipeWire,
+        /// <summary>
+        /// Mixes in real time and throws the audio away, for running without an audio device.
+        /// </summary>
+        Null,
+        Offline
+    }
+
+    /// <summary>
+    /// The backend named by the KSP_AUDIO_BACKEND environment variable, or PipeWire if it isn't set. Offline
+    /// rendering needs something to drive it, so only the live backends can be picked this way.
+    /// </summary>
+    public static Backend SelectedBackend { get; } =
+        string.Equals(Environment.GetEnvironmentVariable("KSP_AUDIO_BACKEND"), "null", StringComparison.OrdinalIgnoreCase)
+            ? Backend.Null
+            : Backend.PipeWire;
+
+    private static readonly Lazy<bool> available = new(() =>
+        RuntimeInformation.IsOSPlatform(OSPlatform.Linux) &&
+        (SelectedBackend == Backend.Null || KarrotSoundProduction.Utils.CheckForCommand("pw-play")));
+
+    /// <summary>
+    /// Whether the native PipeWire engine can be used on this system.
+    /// </summary>
+    public static bool Available => available.Value;
+
+    private static readonly Lazy<IntPtr> engine = new(() =>
+    {
+        IntPtr output = Interop.ksp_engine_create_backend(SampleRate, Channels, SelectedBackend, null);
+        if (output == IntPtr.Zero)
+            throw new Exception("Could not start the native audio engine.");
+        //Without the cache compressed sounds are simply decoded afresh every time they are loaded
+        Interop.ksp_bank_open_cache(output, KarrotSoundProduction.Utils.cacheDir);
+        return output;
+    });
+
+    /// <summary>
+    /// The native engine pointer. The engine is created the first time this is accessed and lives for the rest of the process.
+    /// </summary>
+    public static IntPtr Handle => engine.Value;
+
+    /// <summary>
+    /// Number of audio cycles in which a sound streamed from the disk ran out of audio, over every sound played so far.
+    /// Zero if the engine hasn't been started.
+    /// </summary>
+    public static ulong Underruns => engine.IsValueCreated ? Interop.ksp_engine_get_underruns(engine.Value) : 0;
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct VoiceParams
+    {
+        public float volume;
+        public int fadeInMilliseconds;
+        public int fadeOutMilliseconds;
+        public float speedFactor;
+        public float minVolume;
+        public float maxVolume;
+        public long keyEventNs;
+        public long triggerNs;
+        public int maxPolyphony;
+        public KarrotSoundProduction.SoundConfiguration.RetriggerPolicy retrigger;
+        public int chokeGroup;
+        public int preWaitMilliseconds;
+        public int loop;
+        public int loopStart;
+        public int loopEnd;
+        public int loopCrossfadeMilliseconds;
+        public KarrotSoundProduction.SoundConfiguration.FadeCurve fadeCurve;
+        public int bus;
+        public int timeStretch;
+    }
+
+    /// <summary>
+    /// One column of a waveform, in the same scale as the audio.
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PeakColumn
+    {
+        public float min;
+        public float max;
+        public float rms;
+    }
+
+    /// <summary>
+    /// Where a voice had got to at the end of the engine's last cycle, and how loud it was. Matches ksp_voice_snapshot.
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential)]
+    public unsafe struct VoiceSnapshot
+    {
+        public int handle;
+        public int sampleId;
+        public VoiceState state;
+        public int bus;
+        /// <summary>
+        /// Frame of the sample the voice has got to.
+        /// </summary>
+        public ulong position;
+        /// <summary>
+        /// Length of the sample in frames, or 0 if a streamed sample's length isn't known.
+        /// </summary>
+        public ulong frameCount;
+        public double seconds;
+        /// <summary>
+        /// Seconds until the voice ends at its current speed, or -1 if it is looping or its length isn't known.
+        /// </summary>
+        public double remaining;
+        /// <summary>
+        /// Of the voice's volume, fades and envelope together.
+        /// </summary>
+        public float gain;
+        public uint channels;
+        /// <summary>
+        /// Largest magnitude of each channel lately, which falls back once the peak has passed.
+        /// </summary>
+        public fixed float peaks[MeterChannels];
+        /// <summary>
+        /// Of each channel over the last 300 ms or so.
+        /// </summary>
+        public fixed float rms[MeterChannels];
+    }
+
+    /// <summary>
+    /// When each step between a key being pressed and its sound being heard happened, in nanoseconds on the same
+    /// monotonic clock as <see cref="KarrotSoundProduction.Utils.MonotonicNanoseconds"/>.
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential)]
+    public struct LatencyTrace
+    {
+        public long keyEvent;
+        public long trigger;
+        public long voiceStart;
+        public long firstQueued;
+        public long deviceDelay;
+    }
+
+    /// <summary>
+    /// Counters and latency percentiles kept by the engine, with every duration in nanoseconds.
+    /// </summary>
+    [StructLayout(LayoutKind.Sequential)]
+    public struct Stats
+    {
+        public ulong callbacks;
+        public ulong overruns;
+        public ulong xruns;
+        public ulong outOfBuffers;
+        public ulong underruns;
+        public ulong callbackP50;
+        public ulong callbackP99;
+        public ulong callbackMax;
+        public ulong triggerP50;
+        public ulong triggerP99;
+        public ulong triggerMax;
+        public LatencyTrace lastTrace;
+        public ulong voices;
+        public ulong voicesPeak;
+        public ulong voicesStolen;
+        public ulong dspP50;
+        public ulong dspP99;
+        public ulong dspMax;
+        /// <summary>
+        /// Most any limiter turned its audio down by in the last cycle, in dB.
+        /// </summary>
+        public float gainReduction;
+        public float gainReductionPeak;
+    }
+
+    /// <summary>
+    /// Reads the engine's counters and latency percentiles. All zero if the engine hasn't been started.
+    /// </summary>
+    public static Stats GetStats()
+    {
+        Stats output = default;
+        if (engine.IsValueCreated)
+        {
+            unsafe
+            {
+                Interop.ksp_engine_get_stats(engine.Value, &output);
+            }
+        }
+        return output;
+    }
+
+    /// <summary>
+    /// Fills voices with every voice that is playing, paused or stopping, as of the engine's last cycle, and returns how
+    /// many there are. Takes one call for all of them, and never waits for the audio thread, so it can be called every
+    /// time the display is redrawn. 0 if the engine hasn't been started.
+    /// </summary>
+    public static int GetVoices(VoiceSnapshot[] voices)
+    {
+        if (!engine.IsValueCreated)
+            return 0;
+        unsafe
+        {
+            fixed (VoiceSnapshot* voicesPtr = voices)
+                return Interop.ksp_engine_get_voices(engine.Value, voicesPtr, voices.Length);
+        }
+    }
+
+    /// <summary>
+    /// Every counter and histogram the engine keeps, as a JSON object. Null if the engine hasn't been started.
+    /// </summary>
+    public static string GetStatsJson()
+    {
+        if (!engine.IsValueCreated)
+            return null;
+        //The histograms can grow between the two calls, so the buffer gets some room to spare
+        int length = Interop.ksp_engine_stats_json(engine.Value, null, 0);
+        if (length < 0)
+            return null;
+        byte[] buffer = new byte[length + 1024];
+        length = Interop.ksp_engine_stats_json(engine.Value, buffer, buffer.Length);
+        return System.Text.Encoding.UTF8.GetString(buffer, 0, Math.Min(length, buffer.Length - 1));
+    }
+
+    /// <summary>
+    /// The board file kept in a bundle opened with <see cref="Interop.ksp_bundle_open"/>.
+    /// </summary>
+    public static string GetBundleMetadata(IntPtr bundle)
+    {
+        int length = Interop.ksp_bundle_metadata(bundle, null, 0);
+        byte[] buffer = new byte[length + 1];
+        Interop.ksp_bundle_metadata(bundle, buffer, buffer.Length);
+        return System.Text.Encoding.UTF8.GetString(buffer, 0, length);
+    }
+
+    public static partial class Interop
+    {
+        [LibraryImport("pw_interface.so")]
+        public static partial IntPtr ksp_engine_create(uint sampleRate, uint channels);
+
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        public static partial IntPtr ksp_engine_create_backend(uint sampleRate, uint channels, Backend backend, string output);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_engine_destroy(IntPtr engine);
+
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        public static unsafe partial int ksp_voice_start(IntPtr engine, string filePath, VoiceParams* voiceParams);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_voice_start_bank(IntPtr engine, int sampleId, VoiceParams* voiceParams);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_trigger(IntPtr engine, int sampleId, VoiceParams* voiceParams);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_trigger_at(IntPtr engine, int sampleId, VoiceParams* voiceParams, ulong at);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_trigger_group(IntPtr engine, int* sampleIds, VoiceParams* voiceParams, int count, ulong at, int* handles);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_trigger_chain(IntPtr engine, int* sampleIds, VoiceParams* voiceParams, int count, ulong at, int* handles);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_crossfade(IntPtr engine, int from, int sampleId, VoiceParams* voiceParams, int milliseconds, KarrotSoundProduction.SoundConfiguration.FadeCurve curve);
+
+        /// <summary>
+        /// Returns the file's format as a <see cref="KarrotSoundProduction.Utils.AudioFormat"/>, judged from its first bytes.
+        /// </summary>
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        public static partial int ksp_bank_probe(string filePath);
+
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static partial bool ksp_bank_open_cache(IntPtr engine, string directory);
+
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        public static partial int ksp_bank_load(IntPtr engine, string filePath, uint flags);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bank_release(IntPtr engine, int sampleId);
+
+        /// <summary>
+        /// Whether the file starts like a bundle rather than a board file.
+        /// </summary>
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static partial bool ksp_bundle_probe(string path);
+
+        /// <summary>
+        /// Maps a bundle, or returns IntPtr.Zero if it can't be read. Release it with <see cref="ksp_bundle_release"/>
+        /// once its cues have been loaded; the samples loaded from it keep it mapped.
+        /// </summary>
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        public static partial IntPtr ksp_bundle_open(string path);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bundle_release(IntPtr bundle);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial int ksp_bundle_metadata(IntPtr bundle, [Out] byte[] buffer, int size);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial int ksp_bank_load_bundled(IntPtr engine, IntPtr bundle, uint cue, uint flags);
+
+        /// <summary>
+        /// Writes the samples, in cue order, and the board file into a bundle. An ID of -1 leaves its cue empty.
+        /// </summary>
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static unsafe partial bool ksp_bank_export(IntPtr engine, string path, int* sampleIds, int count, [In] byte[] metadata, nuint metadataBytes);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial nuint ksp_bank_resident_bytes(IntPtr engine, int sampleId);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial nuint ksp_bank_resident_bytes_total(IntPtr engine, int* sampleIds, int count);
+
+        /// <summary>
+        /// Fills up to pixels columns spread over frames start to end of a sample, from its peak index. end is 0 for
+        /// the whole sample, and channel is -1 for every channel together. Returns the number of columns filled.
+        /// </summary>
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_bank_peaks(IntPtr engine, int sampleId, ulong start, ulong end, int channel, PeakColumn* columns, int pixels);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_stop(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_fade_out(IntPtr engine, int voice, int fadeMilliseconds);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_stop_at(IntPtr engine, int voice, int fadeMilliseconds, ulong at);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_exit_loop(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial ulong ksp_engine_get_time(IntPtr engine);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_set_paused(IntPtr engine, int voice, [MarshalAs(UnmanagedType.U1)] bool paused);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_set_volume(IntPtr engine, int voice, float volume);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_set_speed(IntPtr engine, int voice, float speedFactor);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_set_bus(IntPtr engine, int voice, int bus);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bus_set_gain(IntPtr engine, int bus, float gain);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bus_set_muted(IntPtr engine, int bus, [MarshalAs(UnmanagedType.U1)] bool muted);
+
+        /// <summary>
+        /// Plays a bus through the PipeWire node named by target, or through the main output if target is null.
+        /// Returns false if the bus couldn't be given its own output.
+        /// </summary>
+        [LibraryImport("pw_interface.so", StringMarshalling = StringMarshalling.Utf8)]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static partial bool ksp_bus_set_target(IntPtr engine, int bus, string target);
+
+        /// <summary>
+        /// Sets up one of a bus's filters, or the master's for <see cref="MasterBus"/>. gain is in dB, and only
+        /// matters to peak and shelf filters.
+        /// </summary>
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bus_set_filter(IntPtr engine, int bus, int filter, KarrotSoundProduction.DspConfiguration.FilterType type, float frequency, float gain, float q);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_bus_set_limiter(IntPtr engine, int bus, [MarshalAs(UnmanagedType.U1)] bool enabled, float ceiling, float releaseMilliseconds);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial float ksp_bus_get_gain_reduction(IntPtr engine, int bus);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_engine_set_resample_quality(IntPtr engine, int quality);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_engine_set_steal_policy(IntPtr engine, int policy);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial float ksp_voice_get_volume(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial uint ksp_voice_get_underruns(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial ulong ksp_engine_get_underruns(IntPtr engine);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial void ksp_engine_get_stats(IntPtr engine, Stats* output);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial int ksp_engine_stats_json(IntPtr engine, [Out] byte[] buffer, int size);
+
+        [LibraryImport("pw_interface.so")]
+        public static unsafe partial int ksp_engine_get_voices(IntPtr engine, VoiceSnapshot* voices, int max);
+
+        [LibraryImport("pw_interface.so")]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static partial bool ksp_voice_is_playing(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        [return: MarshalAs(UnmanagedType.U1)]
+        public static partial bool ksp_voice_is_looping(IntPtr engine, int voice);
+
+        [LibraryImport("pw_interface.so")]
+        public static partial void ksp_voice_wait(IntPtr engine, int voice);
+    }
+}
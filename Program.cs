@@ -34,7 +34,7 @@ namespace KarrotSoundProduction
             MainWindow.Show();
             if (args.Length >= 1 && File.Exists(args[0]))
             {
-                var config = await SoundboardConfiguration.Load(args[0]);
+                var config = await SoundboardConfiguration.Load(args[0], MainWindow.CreateLoadProgress());
                 if (config != null)
                 {
                     SoundboardConfiguration.CurrentConfig = config;
@@ -43,18 +43,23 @@ namespace KarrotSoundProduction
             }
             if (RuntimeInformation.IsOSPlatform(OSPlatform.Linux) || RuntimeInformation.IsOSPlatform(OSPlatform.OSX))
             {
-                if (!Utils.CheckForCommand("ffmpeg"))
+                if (!NetCoreAudio.Players.NativeEngine.Available && !Utils.CheckForCommand("ffmpeg"))
                 {
                     ErrorDialog dialog = new("FFMPEG not found. KSP requires FFMPEG to play MP3 audio. Please ensure FFMPEG is installed.");
                     dialog.Show();
                 }
-                if (!Utils.CheckForCommand("flac"))
+                if (!NetCoreAudio.Players.NativeEngine.Available && !Utils.CheckForCommand("flac"))
                 {
                     ErrorDialog dialog = new("FLAC decoder not found. KSP will not be able to play FLAC audio.");
                     dialog.Show();
                 }
             }
             Application.Run();
+            //Lets a run be profiled without adding anything to the UI
+            string statsFile = Environment.GetEnvironmentVariable("KSP_STATS_FILE");
+            string stats = NetCoreAudio.Players.NativeEngine.GetStatsJson();
+            if (!string.IsNullOrEmpty(statsFile) && stats != null)
+                File.WriteAllText(statsFile, stats);
             NetCoreAudio.Utils.FileUtil.ClearTempFiles();
             SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.ForEach(async x => await x.Stop());
         }
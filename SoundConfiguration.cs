@@ -12,6 +12,7 @@ using KarrotObjectNotation;
 using System.Threading.Tasks;
 using System.Threading;
 using NetCoreAudio;
+using NetCoreAudio.Players;
 
 namespace KarrotSoundProduction
 {
@@ -20,6 +21,49 @@ namespace KarrotSoundProduction
     /// </summary>
     public class SoundConfiguration
     {
+        /// <summary>
+        /// What happens when a sound's key is pressed while the sound is still playing. Matches ksp_retrigger in the
+        /// native library.
+        /// </summary>
+        public enum RetriggerPolicy
+        {
+            /// <summary>
+            /// Plays another copy on top, cutting off the oldest once <see cref="MaxPolyphony"/> are playing.
+            /// </summary>
+            Stack,
+            /// <summary>
+            /// Cuts off the copies already playing and starts again from the beginning.
+            /// </summary>
+            Restart,
+            /// <summary>
+            /// Does nothing until the sound has finished.
+            /// </summary>
+            Ignore,
+            /// <summary>
+            /// Cuts off every sound in the same <see cref="ChokeGroup"/>, this one included.
+            /// </summary>
+            Choke
+        }
+
+        /// <summary>
+        /// The shape of a fade. Matches ksp_fade_curve in the native library.
+        /// </summary>
+        public enum FadeCurve
+        {
+            /// <summary>
+            /// The gain changes at a constant rate.
+            /// </summary>
+            Linear,
+            /// <summary>
+            /// A quarter sine. Two sounds crossfaded along it keep the same loudness throughout.
+            /// </summary>
+            EqualPower,
+            /// <summary>
+            /// A half cosine, which leaves and arrives gently.
+            /// </summary>
+            SCurve
+        }
+
         private Player player;
 
         /// <summary>
@@ -78,6 +122,219 @@ namespace KarrotSoundProduction
         /// <value></value>
         public float PlaybackSpeed { get; private set; }
 
+        /// <summary>
+        /// Whether the sound keeps its pitch when <see cref="PlaybackSpeed"/> isn't 1, by being time stretched in the
+        /// native engine rather than played at a different rate.
+        /// </summary>
+        /// <value></value>
+        public bool PreservePitch { get; private set; }
+
+        /// <summary>
+        /// The most copies of the sound that can play at once, or 0 for no limit other than the engine's voice pool.
+        /// </summary>
+        /// <value></value>
+        public int MaxPolyphony { get; private set; }
+
+        /// <summary>
+        /// What happens when the sound is started again while it is still playing. (Default: Stack)
+        /// </summary>
+        /// <value></value>
+        public RetriggerPolicy Retrigger { get; private set; }
+
+        /// <summary>
+        /// Sounds with the <see cref="RetriggerPolicy.Choke"/> policy cut off the others in the same group when they
+        /// start. 0 for none.
+        /// </summary>
+        /// <value></value>
+        public int ChokeGroup { get; private set; }
+
+        /// <summary>
+        /// The time, in milliseconds, between the sound being started and it being heard. The wait is counted by the
+        /// native engine, to the frame.
+        /// </summary>
+        /// <value></value>
+        public int PreWait { get; private set; }
+
+        /// <summary>
+        /// The key of the sound that starts, after its own pre-wait, as soon as this one reaches its end. Stopping this
+        /// sound before then cancels it. Null for none.
+        /// </summary>
+        /// <value></value>
+        public Gdk.Key? AutoFollow { get; private set; }
+
+        /// <summary>
+        /// Whether the sound loops until its stop key is pressed, after which it plays on to its end. Needs the native
+        /// engine.
+        /// </summary>
+        /// <value></value>
+        public bool Loop { get; private set; }
+
+        /// <summary>
+        /// The first frame of the loop. Only used if <see cref="LoopEnd"/> is set.
+        /// </summary>
+        /// <value></value>
+        public int LoopStart { get; private set; }
+
+        /// <summary>
+        /// One past the last frame of the loop, or 0 to use the loop stored in the file's smpl or cue chunk, or failing
+        /// that the whole sound.
+        /// </summary>
+        /// <value></value>
+        public int LoopEnd { get; private set; }
+
+        /// <summary>
+        /// The time, in milliseconds, over which the end of the loop is crossfaded into its start.
+        /// </summary>
+        /// <value></value>
+        public int LoopCrossfade { get; private set; }
+
+        /// <summary>
+        /// The shape of the sound's fade in and fade outs. (Default: Linear)
+        /// </summary>
+        /// <value></value>
+        public FadeCurve FadeShape { get; private set; }
+
+        /// <summary>
+        /// The key of the sound that the stop key crossfades into, instead of just fading this one out. Null for none.
+        /// </summary>
+        /// <value></value>
+        public Gdk.Key? CrossfadeInto { get; private set; }
+
+        /// <summary>
+        /// The time, in milliseconds, over which this sound crossfades into <see cref="CrossfadeInto"/>.
+        /// </summary>
+        /// <value></value>
+        public int CrossfadeTime { get; private set; }
+
+        /// <summary>
+        /// The shape of both fades of the crossfade into <see cref="CrossfadeInto"/>. (Default: EqualPower)
+        /// </summary>
+        /// <value></value>
+        public FadeCurve CrossfadeCurve { get; private set; }
+
+        /// <summary>
+        /// The native engine's bus the sound is mixed into. (Default: 0, the main bus)
+        /// </summary>
+        /// <value></value>
+        public int Bus { get; private set; }
+
+        /// <summary>
+        /// The ID of this sound in the native engine's sample bank, or -1 if it has not been preloaded.
+        /// </summary>
+        /// <value></value>
+        public int SampleId { get; private set; } = -1;
+
+        /// <summary>
+        /// The number of bytes of this sound's audio currently resident in memory.
+        /// </summary>
+        /// <value></value>
+        public long ResidentBytes => SampleId >= 0 ? (long)NativeEngine.Interop.ksp_bank_resident_bytes(NativeEngine.Handle, SampleId) : 0;
+
+        /// <summary>
+        /// Whether the sound has finished loading and can be played. Sounds on a board that is still loading become
+        /// ready one at a time, as soon as each has been decoded and preloaded.
+        /// </summary>
+        /// <value></value>
+        public bool Ready => ready;
+        private volatile bool ready;
+
+        //Preload can run on a loader thread while the control thread unloads the sound
+        private readonly object loadLock = new();
+        private bool released;
+
+        /// <summary>
+        /// Parses and maps the sound into the native sample bank so that triggering it never touches the disk.
+        /// Does nothing if the native engine is unavailable or the sound is already loaded.
+        /// </summary>
+        /// <param name="lockInMemory">Whether to mlock() the sound's audio so it can never be paged out.</param>
+        public void Preload(bool lockInMemory = false)
+        {
+            lock (loadLock)
+            {
+                if (SampleId < 0 && !released && NativeEngine.Available)
+                {
+                    uint flags = NativeEngine.BankPeaks | (lockInMemory ? NativeEngine.BankLock : 0) | (Loop ? NativeEngine.BankResident : 0);
+                    SampleId = NativeEngine.Interop.ksp_bank_load(NativeEngine.Handle, FilePath, flags);
+                    if (SampleId < 0)
+                        Console.Error.WriteLine($"Could not preload {FilePath}");
+                }
+                ready = !released;
+            }
+        }
+
+        /// <summary>
+        /// Loads the sound from its cue of a bundle instead of from its own file, which may not be on this machine.
+        /// Does nothing if the sound is already loaded.
+        /// </summary>
+        /// <param name="bundle">A bundle opened with <see cref="NativeEngine.Interop.ksp_bundle_open"/></param>
+        /// <param name="cue">The sound's index among the bundled board's sounds</param>
+        /// <param name="lockInMemory">Whether to mlock() the sound's audio so it can never be paged out.</param>
+        internal void PreloadBundled(IntPtr bundle, uint cue, bool lockInMemory = false)
+        {
+            lock (loadLock)
+            {
+                if (SampleId < 0 && !released)
+                {
+                    uint flags = NativeEngine.BankPeaks | (lockInMemory ? NativeEngine.BankLock : 0);
+                    SampleId = NativeEngine.Interop.ksp_bank_load_bundled(NativeEngine.Handle, bundle, cue, flags);
+                    if (SampleId < 0)
+                        Console.Error.WriteLine($"Could not load {FilePath} from the bundle");
+                }
+                ready = !released;
+            }
+        }
+
+        /// <summary>
+        /// Decodes the original file into something the current backend can play if it needs to be, then preloads it.
+        /// Blocks for as long as decoding takes, so boards run this on their loader threads.
+        /// </summary>
+        /// <param name="lockInMemory">Whether to mlock() the sound's audio so it can never be paged out.</param>
+        public void Prepare(bool lockInMemory = false)
+        {
+            FilePath = Utils.GetWavePath(OriginalFilePath);
+            Preload(lockInMemory);
+        }
+
+        /// <summary>
+        /// Releases this sound from the native sample bank. Voices that are still playing it keep it alive until they finish.
+        /// A sound that has been unloaded is never loaded again, even if its board was still loading it.
+        /// </summary>
+        public void Unload()
+        {
+            lock (loadLock)
+            {
+                released = true;
+                ready = false;
+                if (SampleId < 0) return;
+                NativeEngine.Interop.ksp_bank_release(NativeEngine.Handle, SampleId);
+                SampleId = -1;
+            }
+        }
+
+        /// <summary>
+        /// The waveform of the sound, or of part of it, as one column per pixel. It is drawn from the peak index worked
+        /// out when the sound was preloaded, so it costs the same however long the sound is. Empty if the sound hasn't
+        /// been preloaded.
+        /// </summary>
+        /// <param name="pixels">The number of columns</param>
+        /// <param name="start">The first frame shown</param>
+        /// <param name="end">One past the last frame shown, or 0 for the end of the sound</param>
+        /// <param name="channel">The channel to show, or -1 for all of them together</param>
+        /// <returns></returns>
+        internal NativeEngine.PeakColumn[] GetWaveform(int pixels, ulong start = 0, ulong end = 0, int channel = -1)
+        {
+            if (SampleId < 0 || pixels <= 0)
+                return Array.Empty<NativeEngine.PeakColumn>();
+            NativeEngine.PeakColumn[] columns = new NativeEngine.PeakColumn[pixels];
+            int filled;
+            unsafe
+            {
+                fixed (NativeEngine.PeakColumn* columnsPtr = columns)
+                    filled = NativeEngine.Interop.ksp_bank_peaks(NativeEngine.Handle, SampleId, start, end, channel, columnsPtr, pixels);
+            }
+            return filled == pixels ? columns : Array.Empty<NativeEngine.PeakColumn>();
+        }
+
         /// <summary>
         /// Gets the KONNode object that represents this sound configuration.
         /// </summary>
@@ -94,10 +351,60 @@ namespace KarrotSoundProduction
             output.AddValue("maxVolume", MaxVolume);
             output.AddValue("minVolume", MinVolume);
             output.AddValue("PlaybackSpeed", PlaybackSpeed);
+            if (PreservePitch)
+                output.AddValue("preservePitch", 1);
+            output.AddValue("maxPolyphony", MaxPolyphony);
+            output.AddValue("retrigger", Retrigger.ToString());
+            output.AddValue("chokeGroup", ChokeGroup);
+            if (PreWait > 0)
+                output.AddValue("preWait", PreWait);
+            if (AutoFollow != null)
+                output.AddValue("autoFollowKeyCode", (int)AutoFollow);
+            if (Loop)
+            {
+                output.AddValue("loop", 1);
+                if (LoopEnd > 0)
+                {
+                    output.AddValue("loopStart", LoopStart);
+                    output.AddValue("loopEnd", LoopEnd);
+                }
+                if (LoopCrossfade > 0)
+                    output.AddValue("loopCrossfade", LoopCrossfade);
+            }
+            if (FadeShape != FadeCurve.Linear)
+                output.AddValue("fadeCurve", FadeShape.ToString());
+            if (CrossfadeInto != null)
+            {
+                output.AddValue("crossfadeIntoKeyCode", (int)CrossfadeInto);
+                output.AddValue("crossfadeTime", CrossfadeTime);
+                output.AddValue("crossfadeCurve", CrossfadeCurve.ToString());
+            }
+            if (Bus != 0)
+                output.AddValue("bus", Bus);
 
             return output;
         }
 
+        /// <summary>
+        /// This sound followed by each sound its <see cref="AutoFollow"/> leads on to, as far as the first that isn't
+        /// on the current board, isn't preloaded, or is already in the chain.
+        /// </summary>
+        /// <returns></returns>
+        public List<SoundConfiguration> FollowChain()
+        {
+            List<SoundConfiguration> output = new() { this };
+            SoundConfiguration current = this;
+            while (current.AutoFollow != null)
+            {
+                SoundConfiguration next = SoundboardConfiguration.CurrentConfig?.Sounds.Find(x => x.Key == current.AutoFollow);
+                if (next == null || next.SampleId < 0 || output.Contains(next))
+                    break;
+                output.Add(next);
+                current = next;
+            }
+            return output;
+        }
+
         /// <summary>
         /// When attached to a key trigger event, starts the sound when the key is pressed.
         /// </summary>
@@ -106,11 +413,21 @@ namespace KarrotSoundProduction
         /// <returns></returns>
         public async void PlaySound(object sender, KeyTriggerEventArgs e)
         {
+            if (!Ready)
+            {
+                Console.WriteLine($"{ToString(false)} is still loading");
+                return;
+            }
+            //The engine would refuse it anyway, and the stop key keeps working on the copy that is playing
+            if (Retrigger == RetriggerPolicy.Ignore && this.player.Playing)
+                return;
+            //Stop and kill act on the most recently started playback
             Player player = new();
+            this.player = player;
             int initialVolume = FadeInTime >= 100 ? 0 : 100;
             //await player.SetVolume(initialVolume);
             SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Add(player);
-            await player.Play(FilePath, this);
+            await player.Play(FilePath, this, e);
             //await Task.Delay(1000);
             //await player.SetVolume(20);
             //await playerTask;
@@ -125,6 +442,21 @@ namespace KarrotSoundProduction
             SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Remove(player);
         }
 
+        /// <summary>
+        /// Starts the sound fading in while another playback fades out over the same time.
+        /// </summary>
+        /// <param name="from">The playback to fade out</param>
+        /// <param name="milliseconds">The length of both fades</param>
+        /// <param name="curve">The shape of both fades</param>
+        public async void CrossfadeFrom(Player from, int milliseconds, FadeCurve curve)
+        {
+            Player player = new();
+            this.player = player;
+            SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Add(player);
+            await player.Crossfade(FilePath, this, from, milliseconds, curve);
+            SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Remove(player);
+        }
+
         /// <summary>
         /// When attached to a key trigger event, stops or fades out the sound when the key is pressed.
         /// </summary>
@@ -133,16 +465,45 @@ namespace KarrotSoundProduction
         /// <returns></returns>
         public async void StopSound(object sender, KeyTriggerEventArgs e)
         {
-            if (FadeOutTime >= 100)
+            //Both fades are started by the engine on the same frame, so the handover has no gap or bump
+            if (CrossfadeInto != null && player.Playing)
             {
-                while (player.CurrentVolume > 0)
+                SoundConfiguration next = SoundboardConfiguration.CurrentConfig?.Sounds.Find(x => x.Key == CrossfadeInto);
+                if (next != null && next.Ready && next.SampleId >= 0)
                 {
-                    await player.SetVolume(player.CurrentVolume - 1);
-                    Thread.Sleep(FadeOutTime / 100);
+                    next.CrossfadeFrom(player, CrossfadeTime, CrossfadeCurve);
+                    return;
                 }
             }
-            await player.Stop();
-            SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Remove(player);
+            //A looping sound is first let out of its loop to play its tail, and only faded out if stopped again
+            if (player.Looping)
+            {
+                await player.ExitLoop();
+                return;
+            }
+            //The fade runs in the native engine. PlaySound removes the player from CurrentlyPlaying once the
+            //voice has finished, so killing all sounds can still cut the fade short.
+            await player.Stop(FadeOutTime);
+        }
+
+        /// <summary>
+        /// Changes the speed of the most recently started playback of this sound, if it is still playing.
+        /// </summary>
+        /// <param name="speed"></param>
+        /// <returns></returns>
+        public async Task SetPlayingSpeed(float speed)
+        {
+            await player.SetSpeed(speed);
+        }
+
+        /// <summary>
+        /// Moves the most recently started playback of this sound to another bus, if it is still playing.
+        /// </summary>
+        /// <param name="bus"></param>
+        /// <returns></returns>
+        public async Task SetPlayingBus(int bus)
+        {
+            await player.SetBus(bus);
         }
 
         /// <summary>
@@ -157,7 +518,7 @@ namespace KarrotSoundProduction
             SoundboardConfiguration.CurrentConfig.CurrentlyPlaying.Remove(player);
         }
 
-        public SoundConfiguration(string filePath, Gdk.Key key, Gdk.Key? stopKey = null, string originalFilePath = null, int fadeInTime = 0, int fadeOutTime = 0, float maxVolume = 100, float minVolume = 0, float speed = 1)
+        public SoundConfiguration(string filePath, Gdk.Key key, Gdk.Key? stopKey = null, string originalFilePath = null, int fadeInTime = 0, int fadeOutTime = 0, float maxVolume = 100, float minVolume = 0, float speed = 1, int maxPolyphony = 0, RetriggerPolicy retrigger = RetriggerPolicy.Stack, int chokeGroup = 0, int preWait = 0, Gdk.Key? autoFollow = null, bool loop = false, int loopStart = 0, int loopEnd = 0, int loopCrossfade = 0, FadeCurve fadeShape = FadeCurve.Linear, Gdk.Key? crossfadeInto = null, int crossfadeTime = 0, FadeCurve crossfadeCurve = FadeCurve.EqualPower, int bus = 0, bool preservePitch = false)
         {
             FilePath = filePath;
             if (originalFilePath == null) originalFilePath = filePath;
@@ -172,6 +533,26 @@ namespace KarrotSoundProduction
             MaxVolume = maxVolume;
             MinVolume = minVolume;
             PlaybackSpeed = speed;
+            PreservePitch = preservePitch;
+
+            MaxPolyphony = maxPolyphony;
+            Retrigger = retrigger;
+            ChokeGroup = chokeGroup;
+
+            PreWait = preWait;
+            AutoFollow = autoFollow;
+
+            Loop = loop;
+            LoopStart = loopStart;
+            LoopEnd = loopEnd;
+            LoopCrossfade = loopCrossfade;
+
+            FadeShape = fadeShape;
+            CrossfadeInto = crossfadeInto;
+            CrossfadeTime = crossfadeTime;
+            CrossfadeCurve = crossfadeCurve;
+
+            Bus = bus;
 
             player = new();
         }
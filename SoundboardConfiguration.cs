@@ -5,11 +5,14 @@
 */
 using System;
 using System.IO;
+using System.Linq;
 using System.Text;
 using System.Collections.Generic;
+using System.Diagnostics;
 using System.Threading.Tasks;
 using KarrotObjectNotation;
 using NetCoreAudio;
+using NetCoreAudio.Players;
 using System.Threading;
 
 namespace KarrotSoundProduction
@@ -54,21 +57,87 @@ namespace KarrotSoundProduction
         public string Name = "New Soundboard";
         public bool ChangedSinceLastSave { get; private set; }
 
+        /// <summary>
+        /// Whether sounds on this board are locked into memory when they are preloaded.
+        /// </summary>
+        public bool LockSamples = false;
+
+        /// <summary>
+        /// How cleanly the native engine resamples sounds on this board, at the cost of CPU time.
+        /// </summary>
+        internal NativeEngine.ResampleQuality ResampleQuality = NativeEngine.ResampleQuality.Medium;
+
+        /// <summary>
+        /// Which voice the native engine cuts off when a sound on this board is started with every voice in use.
+        /// </summary>
+        internal NativeEngine.StealPolicy StealPolicy = NativeEngine.StealPolicy.Oldest;
+
+        /// <summary>
+        /// The total number of bytes of audio from this board currently resident in memory, measured in one call to the
+        /// engine however many sounds there are.
+        /// </summary>
+        public long ResidentBytes
+        {
+            get
+            {
+                if (!NativeEngine.Available)
+                    return 0;
+                int[] sampleIds = Sounds.Select(x => x.SampleId).ToArray();
+                unsafe
+                {
+                    fixed (int* sampleIdsPtr = sampleIds)
+                        return (long)NativeEngine.Interop.ksp_bank_resident_bytes_total(NativeEngine.Handle, sampleIdsPtr, sampleIds.Length);
+                }
+            }
+        }
+
         public List<SoundConfiguration> Sounds = new List<SoundConfiguration>();
 
+        /// <summary>
+        /// The engine's buses that are set up differently from the default: full volume, unmuted, through the main output.
+        /// </summary>
+        public List<BusConfiguration> Buses = new();
+
+        /// <summary>
+        /// The filters and limiter everything played through the main output goes through last. The limiter is on
+        /// unless the board turns it off, so sounds played over one another don't clip.
+        /// </summary>
+        public DspConfiguration MasterDsp = new(true);
+
         public Dictionary<Gdk.Key, Keybinding> Keybindings = new Dictionary<Gdk.Key, Keybinding>();
 
         public List<Player> CurrentlyPlaying = new();
 
+        /// <summary>
+        /// Completes once every sound on this board has been decoded and preloaded, or the board has been unloaded.
+        /// </summary>
+        public Task Loading { get; private set; } = Task.CompletedTask;
+
+        /// <summary>
+        /// The number of sounds on this board that are still being decoded and preloaded.
+        /// </summary>
+        public int SoundsLoading => Sounds.Count(x => !x.Ready);
+
+        private CancellationTokenSource loadCancellation = new();
+
         public SoundboardConfiguration()
         {
             Keybindings.Add(Gdk.Key.Tab, new(Gdk.Key.Tab));
             Keybindings[Gdk.Key.Tab].KeyTriggered += KillAllSounds;
         }
 
-        public void AddSound(SoundConfiguration sound)
+        /// <summary>
+        /// Adds a sound to the board. It is preloaded in the background, and can be played once it is ready.
+        /// </summary>
+        /// <param name="sound"></param>
+        /// <param name="progress">Told once the sound has been loaded.</param>
+        public void AddSound(SoundConfiguration sound, IProgress<int> progress = null) => AddSound(sound, true, progress);
+
+        private void AddSound(SoundConfiguration sound, bool preload, IProgress<int> progress = null)
         {
             Sounds.Add(sound);
+            if (preload)
+                PreloadInBackground(sound, progress);
             Keybinding binding = null;
             if (!Keybindings.TryGetValue(sound.Key, out binding))
             {
@@ -83,15 +152,30 @@ namespace KarrotSoundProduction
         {
             SoundConfiguration sound = Sounds[index];
             Keybindings[sound.Key].KeyTriggered -= sound.PlaySound;
+            sound.Unload();
             Sounds.RemoveAt(index);
             ChangedSinceLastSave = true;
         }
 
-        public void EditSound(int index, SoundConfiguration sound)
+        /// <summary>
+        /// Replaces a sound on the board with an edited copy, which is preloaded in the background like an added one.
+        /// </summary>
+        /// <param name="index"></param>
+        /// <param name="sound"></param>
+        /// <param name="progress">Told once the edited sound has been loaded.</param>
+        public void EditSound(int index, SoundConfiguration sound, IProgress<int> progress = null)
         {
             SoundConfiguration soundBefore = Sounds[index];
             Sounds[index] = sound;
+            PreloadInBackground(sound, progress);
             Keybindings[soundBefore.Key].KeyTriggered -= soundBefore.PlaySound;
+            soundBefore.Unload();
+            //A sound that is still playing picks up the new speed straight away
+            if (sound.PlaybackSpeed != soundBefore.PlaybackSpeed)
+                _ = soundBefore.SetPlayingSpeed(sound.PlaybackSpeed);
+            //And is moved to its new bus without being restarted
+            if (sound.Bus != soundBefore.Bus)
+                _ = soundBefore.SetPlayingBus(sound.Bus);
             Keybinding binding = null;
             if (!Keybindings.TryGetValue(sound.Key, out binding))
             {
@@ -102,6 +186,34 @@ namespace KarrotSoundProduction
             ChangedSinceLastSave = true;
         }
 
+        /// <summary>
+        /// Releases every sound on this board from the native sample bank.
+        /// </summary>
+        public void Unload()
+        {
+            loadCancellation.Cancel();
+            foreach (SoundConfiguration sound in Sounds)
+            {
+                sound.Unload();
+            }
+        }
+
+        /// <summary>
+        /// Sets up every one of the engine's buses as this board has it, putting those it doesn't mention back to the
+        /// default. Sounds that are playing carry on.
+        /// </summary>
+        public void ApplyBuses()
+        {
+            if (!NativeEngine.Available)
+                return;
+            for (int i = 0; i < NativeEngine.MaxBuses; i++)
+            {
+                BusConfiguration bus = Buses.Find(x => x.Index == i) ?? new(i);
+                bus.Apply();
+            }
+            MasterDsp.Apply(NativeEngine.MasterBus);
+        }
+
         public async Task KillAllSounds()
         {
             foreach (var player in CurrentlyPlaying.ToArray())
@@ -127,12 +239,95 @@ namespace KarrotSoundProduction
             return result == "" ? "No Sounds" : result + '\n';
         }
 
-        public static async Task<SoundboardConfiguration> Load(string filePath)
+        /// <summary>
+        /// Decodes and preloads sounds on a pool of worker threads, one per core, so a large board doesn't load one sound
+        /// at a time. Each sound can be played as soon as it is ready.
+        /// </summary>
+        /// <param name="sounds"></param>
+        /// <param name="progress">Told the number of sounds loaded so far each time another finishes.</param>
+        /// <returns></returns>
+        private async Task PreloadSounds(List<SoundConfiguration> sounds, IProgress<int> progress)
+        {
+            ParallelOptions options = new()
+            {
+                MaxDegreeOfParallelism = Environment.ProcessorCount,
+                CancellationToken = loadCancellation.Token
+            };
+            bool lockSamples = LockSamples;
+            int loaded = 0;
+            Stopwatch stopwatch = new();
+            stopwatch.Start();
+            try
+            {
+                //Decoding and parsing block on the disk and on external decoders, so the workers run them synchronously
+                await Parallel.ForEachAsync(sounds, options, (sound, token) =>
+                {
+                    sound.Prepare(lockSamples);
+                    progress?.Report(Interlocked.Increment(ref loaded));
+                    return ValueTask.CompletedTask;
+                });
+            }
+            catch (OperationCanceledException)
+            {
+                return;
+            }
+            stopwatch.Stop();
+            Console.WriteLine($"Loaded {sounds.Count} sounds in {stopwatch.ElapsedMilliseconds} ms");
+        }
+
+        /// <summary>
+        /// Preloads a sound added to the board after it was loaded on the same workers as the rest, so decoding it and
+        /// reading its peaks doesn't hold up the UI. <see cref="Loading"/> then also waits for it.
+        /// </summary>
+        /// <param name="sound"></param>
+        /// <param name="progress"></param>
+        private void PreloadInBackground(SoundConfiguration sound, IProgress<int> progress)
+        {
+            Task previous = Loading;
+            Loading = Task.WhenAll(previous, PreloadSounds(new() { sound }, progress));
+        }
+
+        /// <summary>
+        /// Reads a soundboard file. The board is returned as soon as the file has been read; its sounds keep loading in
+        /// the background until <see cref="Loading"/> completes.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="progress">Told the number of sounds loaded so far each time another finishes.</param>
+        /// <returns></returns>
+        public static async Task<SoundboardConfiguration> Load(string filePath, IProgress<int> progress = null)
+        {
+            if (!NativeEngine.Available || !NativeEngine.Interop.ksp_bundle_probe(filePath))
+                return await Load(filePath, await File.ReadAllTextAsync(filePath), IntPtr.Zero, progress);
+
+            IntPtr bundle = NativeEngine.Interop.ksp_bundle_open(filePath);
+            if (bundle == IntPtr.Zero)
+            {
+                ErrorDialog error = new("This bundle could not be read. It may have been cut short while it was being copied.");
+                error.Show();
+                return null;
+            }
+            //The sounds loaded from the bundle keep it mapped once this reference has gone
+            try
+            {
+                return await Load(filePath, NativeEngine.GetBundleMetadata(bundle), bundle, progress);
+            }
+            finally
+            {
+                NativeEngine.Interop.ksp_bundle_release(bundle);
+            }
+        }
+
+        /// <summary>
+        /// Reads a soundboard from the text of its file, loading its sounds from bundle instead of their own files
+        /// unless it is IntPtr.Zero.
+        /// </summary>
+        private static async Task<SoundboardConfiguration> Load(string filePath, string text, IntPtr bundle, IProgress<int> progress)
         {
             SoundboardConfiguration output = new();
-            output.FilePath = filePath;
+            //Bundles are only ever exported, so saving a board loaded from one asks where to put its own file
+            output.FilePath = bundle == IntPtr.Zero ? filePath : null;
 
-            if (!KONParser.Default.TryParse(await File.ReadAllTextAsync(filePath), out KONNode node))
+            if (!KONParser.Default.TryParse(text, out KONNode node))
             {
                 ErrorDialog error = new("This file could not be read as a KSP soundboard file.");
                 error.Show();
@@ -144,6 +339,21 @@ namespace KarrotSoundProduction
             else
                 output.Name = "Untitled Soundboard";
 
+            if (node.Values.ContainsKey("lockSamples"))
+                output.LockSamples = Convert.ToBoolean(node.Values["lockSamples"]);
+
+            if (node.Values.ContainsKey("resampleQuality") &&
+                Enum.TryParse((string)node.Values["resampleQuality"], true, out NativeEngine.ResampleQuality quality))
+                output.ResampleQuality = quality;
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_engine_set_resample_quality(NativeEngine.Handle, (int)output.ResampleQuality);
+
+            if (node.Values.ContainsKey("stealPolicy") &&
+                Enum.TryParse((string)node.Values["stealPolicy"], true, out NativeEngine.StealPolicy stealPolicy))
+                output.StealPolicy = stealPolicy;
+            if (NativeEngine.Available)
+                NativeEngine.Interop.ksp_engine_set_steal_policy(NativeEngine.Handle, (int)output.StealPolicy);
+
             if (node.Values.ContainsKey("formatVersion"))
             {
                 int formatVersion = (int)node.Values["formatVersion"];
@@ -173,10 +383,27 @@ namespace KarrotSoundProduction
                 }
             }
 
+            List<SoundConfiguration> pending = new();
+            //A bundle's cues are in the same order as the sounds in its board file
+            uint cue = 0;
             foreach (KONNode childNode in node.Children)
             {
-                if (childNode.Name == "SOUND")
+                if (childNode.Name == "BUS")
+                {
+                    BusConfiguration bus = BusConfiguration.FromNode(childNode);
+                    if (bus != null)
+                    {
+                        output.Buses.RemoveAll(x => x.Index == bus.Index);
+                        output.Buses.Add(bus);
+                    }
+                }
+                else if (childNode.Name == "MASTER")
+                {
+                    output.MasterDsp.ReadNode(childNode);
+                }
+                else if (childNode.Name == "SOUND")
                 {
+                    uint soundCue = cue++;
                     string soundPath = null;
                     if (childNode.Values.ContainsKey("filePath"))
                     {
@@ -218,11 +445,15 @@ namespace KarrotSoundProduction
                     if (childNode.Values.ContainsKey("fadeOutTime"))
                         fadeOutTime = (int)childNode.Values["fadeOutTime"];
 
+                    //Older versions wrote the key with a capital P but read it back without one
                     float speed = 1;
-                    if (childNode.Values.ContainsKey("playbackSpeed"))
-                        speed = (float)childNode.Values["playbackSpeed"];
+                    if (childNode.Values.ContainsKey("PlaybackSpeed"))
+                        speed = Convert.ToSingle(childNode.Values["PlaybackSpeed"]);
+                    else if (childNode.Values.ContainsKey("playbackSpeed"))
+                        speed = Convert.ToSingle(childNode.Values["playbackSpeed"]);
+                    bool preservePitch = childNode.Values.ContainsKey("preservePitch") && (int)childNode.Values["preservePitch"] != 0;
 
-                    float maxVolume = 1;
+                    float maxVolume = 100;
                     float minVolume = 0;
 
                     if (childNode.Values.ContainsKey("maxVolume"))
@@ -230,13 +461,74 @@ namespace KarrotSoundProduction
                     if (childNode.Values.ContainsKey("minVolume"))
                         minVolume = (float)childNode.Values["minVolume"];
 
-                    string wavePath = Utils.GetWavePath(soundPath);
+                    int maxPolyphony = 0;
+                    if (childNode.Values.ContainsKey("maxPolyphony"))
+                        maxPolyphony = Math.Max(0, (int)childNode.Values["maxPolyphony"]);
+
+                    SoundConfiguration.RetriggerPolicy retrigger = SoundConfiguration.RetriggerPolicy.Stack;
+                    if (childNode.Values.ContainsKey("retrigger") &&
+                        !Enum.TryParse((string)childNode.Values["retrigger"], true, out retrigger))
+                        retrigger = SoundConfiguration.RetriggerPolicy.Stack;
+
+                    int chokeGroup = 0;
+                    if (childNode.Values.ContainsKey("chokeGroup"))
+                        chokeGroup = (int)childNode.Values["chokeGroup"];
 
-                    SoundConfiguration sound = new(wavePath, key, stopKey, fadeInTime: fadeInTime, fadeOutTime: fadeOutTime, maxVolume: maxVolume, minVolume: minVolume);
-                    output.AddSound(sound);
+                    int preWait = 0;
+                    if (childNode.Values.ContainsKey("preWait"))
+                        preWait = Math.Max(0, (int)childNode.Values["preWait"]);
+
+                    Gdk.Key? autoFollow = null;
+                    if (childNode.Values.ContainsKey("autoFollowKeyCode"))
+                        autoFollow = (Gdk.Key)(int)childNode.Values["autoFollowKeyCode"];
+
+                    bool loop = childNode.Values.ContainsKey("loop") && (int)childNode.Values["loop"] != 0;
+                    int loopStart = 0;
+                    int loopEnd = 0;
+                    if (childNode.Values.ContainsKey("loopStart"))
+                        loopStart = Math.Max(0, (int)childNode.Values["loopStart"]);
+                    if (childNode.Values.ContainsKey("loopEnd"))
+                        loopEnd = Math.Max(0, (int)childNode.Values["loopEnd"]);
+                    int loopCrossfade = 0;
+                    if (childNode.Values.ContainsKey("loopCrossfade"))
+                        loopCrossfade = Math.Max(0, (int)childNode.Values["loopCrossfade"]);
+
+                    SoundConfiguration.FadeCurve fadeShape = SoundConfiguration.FadeCurve.Linear;
+                    if (childNode.Values.ContainsKey("fadeCurve") &&
+                        !Enum.TryParse((string)childNode.Values["fadeCurve"], true, out fadeShape))
+                        fadeShape = SoundConfiguration.FadeCurve.Linear;
+
+                    Gdk.Key? crossfadeInto = null;
+                    if (childNode.Values.ContainsKey("crossfadeIntoKeyCode"))
+                        crossfadeInto = (Gdk.Key)(int)childNode.Values["crossfadeIntoKeyCode"];
+                    int crossfadeTime = 0;
+                    if (childNode.Values.ContainsKey("crossfadeTime"))
+                        crossfadeTime = Math.Max(0, (int)childNode.Values["crossfadeTime"]);
+                    SoundConfiguration.FadeCurve crossfadeCurve = SoundConfiguration.FadeCurve.EqualPower;
+                    if (childNode.Values.ContainsKey("crossfadeCurve") &&
+                        !Enum.TryParse((string)childNode.Values["crossfadeCurve"], true, out crossfadeCurve))
+                        crossfadeCurve = SoundConfiguration.FadeCurve.EqualPower;
+
+                    int bus = 0;
+                    if (childNode.Values.ContainsKey("bus"))
+                        bus = Math.Clamp((int)childNode.Values["bus"], 0, NativeEngine.MaxBuses - 1);
+
+                    SoundConfiguration sound = new(soundPath, key, stopKey, fadeInTime: fadeInTime, fadeOutTime: fadeOutTime, maxVolume: maxVolume, minVolume: minVolume, speed: speed,
+                                                   maxPolyphony: maxPolyphony, retrigger: retrigger, chokeGroup: chokeGroup, preWait: preWait, autoFollow: autoFollow,
+                                                   loop: loop, loopStart: loopStart, loopEnd: loopEnd, loopCrossfade: loopCrossfade,
+                                                   fadeShape: fadeShape, crossfadeInto: crossfadeInto, crossfadeTime: crossfadeTime, crossfadeCurve: crossfadeCurve,
+                                                   bus: bus, preservePitch: preservePitch);
+                    output.AddSound(sound, false);
+                    //Nothing needs decoding, and a cue is found by its index, so bundled sounds are loaded straight away
+                    if (bundle != IntPtr.Zero)
+                        sound.PreloadBundled(bundle, soundCue, output.LockSamples);
+                    else
+                        pending.Add(sound);
                 }
             }
 
+            output.ApplyBuses();
+            output.Loading = output.PreloadSounds(pending, progress);
             output.ChangedSinceLastSave = false;
             return output;
         }
@@ -246,15 +538,59 @@ namespace KarrotSoundProduction
         public void Save(string filePath)
         {
             FilePath = filePath;
+            File.WriteAllText(filePath, KONWriter.Default.Write(GetNode()));
+            ChangedSinceLastSave = false;
+        }
+
+        /// <summary>
+        /// Writes the board and the decoded audio, loop points and peak index of every sound on it into one bundle
+        /// file, which loads with a single mapping and nothing to decode, and can be moved to another machine on its
+        /// own. Waits for the board to finish loading first. Returns false if the bundle couldn't be written.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <returns></returns>
+        public async Task<bool> ExportBundle(string filePath)
+        {
+            if (!NativeEngine.Available)
+                return false;
+            await Loading;
+            //Sounds that failed to load are left as empty cues, so every other cue keeps its sound's index
+            int[] sampleIds = Sounds.Select(x => x.SampleId).ToArray();
+            byte[] metadata = Encoding.UTF8.GetBytes(KONWriter.Default.Write(GetNode()));
+            //Sounds that were streamed are decoded as they are written, which can take a while
+            return await Task.Run(() =>
+            {
+                unsafe
+                {
+                    fixed (int* sampleIdsPtr = sampleIds)
+                        return NativeEngine.Interop.ksp_bank_export(NativeEngine.Handle, filePath, sampleIdsPtr, sampleIds.Length, metadata, (nuint)metadata.Length);
+                }
+            });
+        }
+
+        private KONNode GetNode()
+        {
             KONNode node = new("SOUNDBOARD_CONFIGURATION");
             node.AddValue("name", Name);
             node.AddValue("formatVersion", Utils.KSPFormatVersion);
+            if (LockSamples)
+                node.AddValue("lockSamples", LockSamples);
+            if (ResampleQuality != NativeEngine.ResampleQuality.Medium)
+                node.AddValue("resampleQuality", ResampleQuality.ToString());
+            if (StealPolicy != NativeEngine.StealPolicy.Oldest)
+                node.AddValue("stealPolicy", StealPolicy.ToString());
+            foreach (BusConfiguration bus in Buses)
+            {
+                node.AddChild(bus.GetNode());
+            }
+            KONNode masterNode = new("MASTER");
+            MasterDsp.AddToNode(masterNode);
+            node.AddChild(masterNode);
             foreach (SoundConfiguration sound in Sounds)
             {
                 node.AddChild(sound.GetNode());
             }
-            File.WriteAllText(filePath, KONWriter.Default.Write(node));
-            ChangedSinceLastSave = false;
+            return node;
         }
     }
 }
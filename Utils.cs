@@ -5,6 +5,7 @@
 */
 //#define DEV_BUILD
 using System;
+using System.Collections.Concurrent;
 using System.Diagnostics;
 using System.IO;
 
@@ -21,6 +22,14 @@ public static class Utils
     public static readonly string cacheDir = $"{Environment.GetEnvironmentVariable("HOME")}/.cache/KarrotSoundProduction";
     public static readonly string configDir = $"{Environment.GetEnvironmentVariable("HOME")}/.config/KarrotSoundProduction";
 
+    /// <summary>
+    /// A monotonic timestamp in nanoseconds. On Linux this is CLOCK_MONOTONIC, the clock the native engine's latency
+    /// measurements use, so the two can be compared directly.
+    /// </summary>
+    /// <returns></returns>
+    public static long MonotonicNanoseconds() =>
+        (long)(Stopwatch.GetTimestamp() * (1_000_000_000.0 / Stopwatch.Frequency));
+
     public static bool CheckForCommand(string command)
     {
         Process whichProcess = new();
@@ -47,19 +56,42 @@ public static class Utils
         Unknown
     }
 
+    /// <summary>
+    /// Works out a file's format from its first bytes. Uses the native engine's probe when it is available, so loading a
+    /// board never has to start a process per sound.
+    /// </summary>
+    /// <param name="filePath"></param>
+    /// <returns></returns>
     public static AudioFormat GetFileFormat(string filePath)
     {
-        ProcessStartInfo fileCommand = new("file", $"--mime-type \"{filePath.Replace("\"", "\\\"")}\"");
-        fileCommand.RedirectStandardOutput = true;
-        string fileResults = Process.Start(fileCommand).StandardOutput.ReadToEnd();
-        string mimeType = fileResults.Split(':')[^1].Trim();
-        return mimeType switch
+        if (NetCoreAudio.Players.NativeEngine.Available)
+            return (AudioFormat)NetCoreAudio.Players.NativeEngine.Interop.ksp_bank_probe(filePath);
+
+        byte[] magic = new byte[12];
+        int length;
+        try
         {
-            "audio/x-wav" or "audio/wav" or "audio/vnd.wav" => AudioFormat.Wave,
-            "audio/flac" => AudioFormat.Flac,
-            "audio/mpeg" => AudioFormat.MP3,
-            _ => AudioFormat.Unknown
-        };
+            using FileStream file = File.OpenRead(filePath);
+            length = file.ReadAtLeast(magic, magic.Length, false);
+        }
+        catch (IOException)
+        {
+            return AudioFormat.Unknown;
+        }
+        catch (UnauthorizedAccessException)
+        {
+            return AudioFormat.Unknown;
+        }
+        string header = System.Text.Encoding.ASCII.GetString(magic, 0, length);
+        if (header.StartsWith("fLaC"))
+            return AudioFormat.Flac;
+        if (length >= 12 && header.Substring(8, 4) == "WAVE" &&
+            (header.StartsWith("RIFF") || header.StartsWith("RF64") || header.StartsWith("BW64")))
+            return AudioFormat.Wave;
+        //Either an ID3v2 tag or the sync word of the first MPEG audio frame
+        if (header.StartsWith("ID3") || (length >= 2 && magic[0] == 0xFF && (magic[1] & 0xE0) == 0xE0))
+            return AudioFormat.MP3;
+        return AudioFormat.Unknown;
     }
 
     /// <summary>
@@ -94,8 +126,52 @@ public static class Utils
         else return input.Substring(startIndex, length);
     }
 
+    /// <summary>
+    /// Formats a byte count for display, e.g. "12.3 MiB".
+    /// </summary>
+    /// <param name="bytes"></param>
+    /// <returns></returns>
+    public static string FormatBytes(long bytes)
+    {
+        string[] units = { "B", "KiB", "MiB", "GiB", "TiB" };
+        double value = bytes;
+        int unit = 0;
+        while (value >= 1024 && unit < units.Length - 1)
+        {
+            value /= 1024;
+            unit++;
+        }
+        return unit == 0 ? $"{bytes} B" : $"{value:0.0} {units[unit]}";
+    }
+
+    //Sounds are decoded in parallel while a board loads, and two sounds can share a file
+    private static readonly ConcurrentDictionary<string, object> decodeLocks = new();
+
+    /// <summary>
+    /// Gets the path a decoded copy of a file is cached at. The name depends on where the file is and on its size and
+    /// modification time, so files with the same name never share a copy and an edited file is decoded again.
+    /// </summary>
+    /// <param name="fileName"></param>
+    /// <returns></returns>
+    private static string GetCachedWavePath(string fileName)
+    {
+        FileInfo info = new(fileName);
+        string key = $"{info.FullName}\0{info.Length}\0{info.LastWriteTimeUtc.Ticks}";
+        byte[] hash = System.Security.Cryptography.SHA256.HashData(System.Text.Encoding.UTF8.GetBytes(key));
+        return $"{cacheDir}/{Path.GetFileNameWithoutExtension(fileName)}-{Convert.ToHexString(hash, 0, 8).ToLowerInvariant()}.wav";
+    }
+
+    /// <summary>
+    /// Gets the path of a file the current player backend can play, decoding it to a cached WAV first if necessary.
+    /// The native engine decodes FLAC and MP3 itself, so those are only decoded for the other backends.
+    /// </summary>
+    /// <param name="fileName"></param>
+    /// <returns></returns>
     public static string GetWavePath(string fileName)
     {
+        //The native engine probes the file itself when it loads it
+        if (NetCoreAudio.Players.NativeEngine.Available)
+            return fileName;
         AudioFormat fmt = GetFileFormat(fileName);
         if (fmt == AudioFormat.Flac)
         {
@@ -106,9 +182,12 @@ public static class Utils
             Console.WriteLine($"Decoding {fileName}");
             Stopwatch stopwatch = new();
             stopwatch.Start();
-            string wavFileName = $"{cacheDir}/{System.IO.Path.GetFileName(System.IO.Path.ChangeExtension(fileName, ".wav"))}";
-            if (!File.Exists(wavFileName))
-                Process.Start($"flac", $"-fd \"{fileName}\" -o \"{wavFileName}\"").WaitForExit();
+            string wavFileName = GetCachedWavePath(fileName);
+            lock (decodeLocks.GetOrAdd(wavFileName, _ => new object()))
+            {
+                if (!File.Exists(wavFileName))
+                    Process.Start($"flac", $"-fd \"{fileName}\" -o \"{wavFileName}\"").WaitForExit();
+            }
             stopwatch.Stop();
             Console.WriteLine($"Decode elapsed time: {stopwatch.ElapsedMilliseconds} ms");
             fileName = wavFileName;
@@ -122,9 +201,12 @@ public static class Utils
             Console.WriteLine($"Decoding {fileName}");
             Stopwatch stopwatch = new();
             stopwatch.Start();
-            string wavFileName = $"{cacheDir}/{System.IO.Path.GetFileName(System.IO.Path.ChangeExtension(fileName, ".wav"))}";
-            if (!File.Exists(wavFileName))
-                Process.Start($"ffmpeg", $"-i \"{fileName.Replace("\"", "\\\"")}\" -acodec pcm_s16le -ar 44100 \"{wavFileName.Replace("\"", "\\\"")}\"").WaitForExit();
+            string wavFileName = GetCachedWavePath(fileName);
+            lock (decodeLocks.GetOrAdd(wavFileName, _ => new object()))
+            {
+                if (!File.Exists(wavFileName))
+                    Process.Start($"ffmpeg", $"-i \"{fileName.Replace("\"", "\\\"")}\" -acodec pcm_s16le -ar 44100 \"{wavFileName.Replace("\"", "\\\"")}\"").WaitForExit();
+            }
             stopwatch.Stop();
             Console.WriteLine($"Decode elapsed time: {stopwatch.ElapsedMilliseconds} ms");
             fileName = wavFileName;
@@ -0,0 +1,372 @@
+#include <pipewire-0.3/pipewire/pipewire.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksp_pw_process_funcs.h"
+#include "ksp_pw_structs.h"
+
+/* Times the mixing code paths on synthetic data, for every sample format, channel count and quantum the engine can
+ * be asked for, with each set of kernels the CPU supports. Results are written to stdout as one JSON object, and
+ * progress to stderr. Names of paths given on the command line limit the run to those paths. */
+
+//Frames of synthetic source audio; more than the largest quantum, so a voice never reaches its end
+#define BENCH_SOURCE_FRAMES 4096
+
+#define BENCH_MAX_CHANNELS 8
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_MIN_QUANTUM 32
+#define BENCH_MAX_QUANTUM 2048
+
+//Each measurement repeats the path until it has run for at least this long, and the best of several is kept
+#define BENCH_TARGET_NS 200000
+#define BENCH_REPEATS 5
+
+typedef struct bench_context
+{
+    ksp_engine *engine;
+    const ksp_kernels *kernels;
+    ksp_sample sample;
+    uint32_t channels;
+    uint32_t quantum;
+
+    //Stand-ins for a buffer dequeued from the stream
+    struct spa_chunk chunk;
+    struct spa_data data;
+    struct spa_buffer buffer;
+    struct pw_buffer pwBuffer;
+
+    uint8_t *source;
+    float *mix;
+} bench_context;
+
+typedef struct bench_path
+{
+    const char *name;
+    void (*run)(bench_context *context);
+} bench_path;
+
+static const char *formatNames[KSP_SAMPLE_FORMAT_COUNT] = { "u8", "s16", "s24", "s32", "f32", "f64" };
+
+//Conversion of a quantum of interleaved samples to float
+static void run_convert(bench_context *context)
+{
+    context->kernels->convert[context->sample.sampleFormat](context->source, context->mix,
+                                                            context->quantum * context->channels);
+}
+
+//Conversion, gain ramp and mix of a voice at the engine's rate and channel layout
+static void run_mix(bench_context *context)
+{
+    context->kernels->mix[context->sample.sampleFormat](context->source, context->mix, context->quantum,
+                                                        context->channels, 0.25f, 0.5f / context->quantum);
+}
+
+//Peak analysis of a quantum of float audio, as done for every bucket of a sound's peak index
+static void run_peak(bench_context *context)
+{
+    float min[BENCH_MAX_CHANNELS], max[BENCH_MAX_CHANNELS], sumSquares[BENCH_MAX_CHANNELS];
+    for (uint32_t c = 0; c < context->channels; c++)
+    {
+        min[c] = INFINITY;
+        max[c] = -INFINITY;
+        sumSquares[c] = 0;
+    }
+    context->kernels->peak(context->mix, context->quantum, context->channels, min, max, sumSquares);
+}
+
+static void reset_voice(ksp_voice *voice, bool fading)
+{
+    voice->position = 0;
+    voice->gain = fading ? 0.2f : 0.5f;
+    voice->gainTarget = 0.5f;
+    //A fade in overlapping a volume ramp is the worst case for the envelope, which is then applied in short pieces
+    voice->fadeInFrames = fading ? BENCH_SOURCE_FRAMES : 0;
+    voice->gainRampFrames = fading ? BENCH_MAX_QUANTUM : 0;
+}
+
+//A whole process cycle of one steady voice, filling a stream buffer
+static void run_process(bench_context *context)
+{
+    reset_voice(&context->engine->voices[0], false);
+    ksp_fill_buffer(context->engine, &context->pwBuffer);
+}
+
+//A whole process cycle of one voice that is fading in while its volume is being changed
+static void run_fade(bench_context *context)
+{
+    reset_voice(&context->engine->voices[0], true);
+    ksp_fill_buffer(context->engine, &context->pwBuffer);
+}
+
+//A whole process cycle of one steady voice on a bus with three filters, played through the master's limiter, which
+//is set low enough to be turning it down
+static void run_dsp(bench_context *context)
+{
+    ksp_engine *engine = context->engine;
+    if (!atomic_load(&engine->master.limiterEnabled))
+    {
+        ksp_dsp_set_filter(&engine->buses[0].dsp, 0, KSP_FILTER_HIGH_PASS, 80, 0, 0.707f);
+        ksp_dsp_set_filter(&engine->buses[0].dsp, 1, KSP_FILTER_PEAK, 1000, -3, 1);
+        ksp_dsp_set_filter(&engine->buses[0].dsp, 2, KSP_FILTER_HIGH_SHELF, 8000, 2, 0.707f);
+        ksp_dsp_set_limiter(&engine->master, true, -18, KSP_LIMITER_DEFAULT_RELEASE_MILLISECONDS);
+    }
+    reset_voice(&engine->voices[0], false);
+    ksp_fill_buffer(engine, &context->pwBuffer);
+}
+
+//A whole process cycle of one voice played at 1.5 times its speed through the time stretch, so every grain is searched
+//for. Its real-time factor is what each stretched voice costs.
+static void run_stretch(bench_context *context)
+{
+    ksp_voice *voice = &context->engine->voices[0];
+    if (voice->stretch == NULL)
+    {
+        voice->stretch = ksp_stretch_create(context->channels, BENCH_SAMPLE_RATE, BENCH_SAMPLE_RATE);
+        voice->step = 1.5;
+    }
+    reset_voice(voice, false);
+    ksp_fill_buffer(context->engine, &context->pwBuffer);
+}
+
+static const bench_path paths[] = {
+    { "convert", run_convert },
+    { "mix", run_mix },
+    { "peak", run_peak },
+    { "process", run_process },
+    { "fade", run_fade },
+    { "dsp", run_dsp },
+    { "stretch", run_stretch },
+};
+
+//Noise at half scale, stored in the given format
+static void fill_source(uint8_t *source, ksp_sample_format format, size_t samples)
+{
+    srand(1);
+    for (size_t i = 0; i < samples; i++)
+    {
+        double val = ((double)rand() / RAND_MAX - 0.5);
+        int32_t s32 = (int32_t)(val * 2147483647.0);
+        float f32 = (float)val;
+        switch (format)
+        {
+            case KSP_SAMPLE_U8:
+                source[i] = (uint8_t)((s32 >> 24) + 128);
+                break;
+            case KSP_SAMPLE_S16:
+                ((int16_t *)source)[i] = (int16_t)(s32 >> 16);
+                break;
+            case KSP_SAMPLE_S24:
+                source[i * 3] = (uint8_t)(s32 >> 8);
+                source[i * 3 + 1] = (uint8_t)(s32 >> 16);
+                source[i * 3 + 2] = (uint8_t)(s32 >> 24);
+                break;
+            case KSP_SAMPLE_S32:
+                ((int32_t *)source)[i] = s32;
+                break;
+            case KSP_SAMPLE_F32:
+                memcpy(source + i * sizeof(float), &f32, sizeof(float));
+                break;
+            case KSP_SAMPLE_F64:
+                memcpy(source + i * sizeof(double), &val, sizeof(double));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void destroy_engine(ksp_engine *engine)
+{
+    for (int i = 0; i < KSP_MAX_BUSES; i++)
+        ksp_bus_destroy(&engine->buses[i]);
+    ksp_dsp_destroy(&engine->master);
+    ksp_stretch_destroy(engine->voices[0].stretch);
+    sem_destroy(&engine->voices[0].finished);
+    free(engine);
+}
+
+//An engine with no stream, playing the context's sample on its first voice
+static ksp_engine *create_engine(bench_context *context)
+{
+    ksp_engine *engine = calloc(1, sizeof(ksp_engine));
+    if (engine == NULL)
+        return NULL;
+    engine->sampleRate = BENCH_SAMPLE_RATE;
+    engine->channels = context->channels;
+    engine->kernels = context->kernels;
+    engine->resampleQuality = KSP_RESAMPLE_DEFAULT_QUALITY;
+    ksp_command_queue_init(&engine->commands);
+    for (int i = 0; i < KSP_MAX_BUSES; i++)
+    {
+        if (!ksp_bus_init(&engine->buses[i], context->channels, engine->sampleRate))
+        {
+            destroy_engine(engine);
+            return NULL;
+        }
+    }
+    if (!ksp_dsp_init(&engine->master, context->channels, engine->sampleRate, KSP_BUS_BLOCK_FRAMES))
+    {
+        destroy_engine(engine);
+        return NULL;
+    }
+
+    ksp_voice *voice = &engine->voices[0];
+    sem_init(&voice->finished, 0, 0);
+    voice->sample = &context->sample;
+    voice->params = (ksp_voice_params){ .volume = 0.5f, .speedFactor = 1, .minVolume = 0, .maxVolume = 1 };
+    voice->step = 1;
+    voice->follower = -1;
+    voice->fadesOut = -1;
+    voice->queued = true;
+    reset_voice(voice, false);
+    atomic_store(&voice->state, KSP_VOICE_PLAYING);
+    return engine;
+}
+
+
+//Nanoseconds per frame of the best of BENCH_REPEATS runs
+static double measure(const bench_path *path, bench_context *context)
+{
+    uint64_t iterations = 1;
+    for (;;)
+    {
+        int64_t start = ksp_now_ns();
+        for (uint64_t i = 0; i < iterations; i++)
+            path->run(context);
+        if (ksp_now_ns() - start >= BENCH_TARGET_NS)
+            break;
+        iterations *= 2;
+    }
+
+    int64_t best = INT64_MAX;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        int64_t start = ksp_now_ns();
+        for (uint64_t i = 0; i < iterations; i++)
+            path->run(context);
+        int64_t elapsed = ksp_now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return (double)best / ((double)iterations * context->quantum);
+}
+
+static bool path_selected(const char *name, int argc, char **argv)
+{
+    if (argc < 2)
+        return true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    const ksp_kernels *kernelSets[] = { ksp_kernels_get(KSP_ISA_SCALAR), ksp_kernels_get(KSP_ISA_SSE2),
+                                        ksp_kernels_get(KSP_ISA_AVX2) };
+    const size_t kernelSetCount = sizeof(kernelSets) / sizeof(kernelSets[0]);
+
+    bench_context context = { 0 };
+    context.source = aligned_alloc(64, BENCH_SOURCE_FRAMES * BENCH_MAX_CHANNELS * sizeof(double));
+    context.mix = aligned_alloc(64, BENCH_MAX_QUANTUM * BENCH_MAX_CHANNELS * sizeof(float));
+    if (context.source == NULL || context.mix == NULL)
+    {
+        fputs("Could not allocate the benchmark buffers!\n", stderr);
+        return 1;
+    }
+    memset(context.mix, 0, BENCH_MAX_QUANTUM * BENCH_MAX_CHANNELS * sizeof(float));
+
+    context.data.maxsize = BENCH_MAX_QUANTUM * BENCH_MAX_CHANNELS * sizeof(float);
+    context.data.data = context.mix;
+    context.data.chunk = &context.chunk;
+    context.buffer.n_datas = 1;
+    context.buffer.datas = &context.data;
+    context.pwBuffer.buffer = &context.buffer;
+
+    printf("{\"kernels\":[");
+    bool first = true;
+    for (size_t k = 0; k < kernelSetCount; k++)
+    {
+        if (kernelSets[k] == NULL)
+            continue;
+        printf("%s\"%s\"", first ? "" : ",", kernelSets[k]->name);
+        first = false;
+    }
+    printf("],\"sourceFrames\":%d,\"results\":[", BENCH_SOURCE_FRAMES);
+
+    first = true;
+    for (size_t p = 0; p < sizeof(paths) / sizeof(paths[0]); p++)
+    {
+        const bench_path *path = &paths[p];
+        if (!path_selected(path->name, argc, argv))
+            continue;
+        fprintf(stderr, "Timing %s\n", path->name);
+
+        for (int format = 0; format < KSP_SAMPLE_FORMAT_COUNT; format++)
+        {
+            for (uint32_t channels = 1; channels <= BENCH_MAX_CHANNELS; channels++)
+            {
+                fill_source(context.source, format, (size_t)BENCH_SOURCE_FRAMES * channels);
+                context.channels = channels;
+                context.sample = (ksp_sample){
+                    .refCount = 1,
+                    .format = Wave,
+                    .sampleFormat = format,
+                    .data = context.source,
+                    .channels = channels,
+                    .sampleRate = BENCH_SAMPLE_RATE,
+                    .frameCount = BENCH_SOURCE_FRAMES,
+                    .bytesPerFrame = ksp_sample_format_size(format) * channels,
+                };
+                //Like every sound the app loads, it has a peak index, which the voice meters read their levels from.
+                //There's no file behind it, so nothing is cached.
+                if (!ksp_peaks_load(&context.sample.peaks, NULL, "", &context.sample, kernelSets[0]))
+                    return 1;
+
+                for (uint32_t quantum = BENCH_MIN_QUANTUM; quantum <= BENCH_MAX_QUANTUM; quantum *= 2)
+                {
+                    context.quantum = quantum;
+                    context.pwBuffer.requested = quantum;
+                    double scalar = 0;
+
+                    for (size_t k = 0; k < kernelSetCount; k++)
+                    {
+                        if (kernelSets[k] == NULL)
+                            continue;
+                        context.kernels = kernelSets[k];
+                        context.engine = create_engine(&context);
+                        if (context.engine == NULL)
+                        {
+                            fputs("Could not allocate the audio engine!\n", stderr);
+                            return 1;
+                        }
+                        double nsPerFrame = measure(path, &context);
+                        destroy_engine(context.engine);
+
+                        //Each case is measured with the scalar kernels first, so the others can be compared to them
+                        if (k == 0)
+                            scalar = nsPerFrame;
+                        //The real-time factor is the share of each second of audio it takes to work out
+                        printf("%s{\"path\":\"%s\",\"kernels\":\"%s\",\"format\":\"%s\",\"channels\":%u,\"quantum\":%u,"
+                               "\"nsPerFrame\":%.4f,\"framesPerSecond\":%.0f,\"realtimeFactor\":%.6f,\"speedup\":%.3f}",
+                               first ? "" : ",", path->name, context.kernels->name, formatNames[format], channels,
+                               quantum, nsPerFrame, 1e9 / nsPerFrame, nsPerFrame * BENCH_SAMPLE_RATE / 1e9,
+                               scalar / nsPerFrame);
+                        first = false;
+                    }
+                }
+                ksp_peaks_free(&context.sample.peaks);
+            }
+        }
+    }
+    puts("]}");
+
+    free(context.source);
+    free(context.mix);
+    return 0;
+}
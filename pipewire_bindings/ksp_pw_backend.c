@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ksp_pw_backend.h"
+#include "ksp_pw_process_funcs.h"
+#include "ksp_pw_structs.h"
+
+#define WAVE_FORMAT_IEEE_FLOAT 3
+
+//Sizes in a wave header can't describe a data chunk any longer than this
+#define WAVE_MAX_DATA_BYTES (UINT32_MAX - 36)
+
+const ksp_backend_ops *ksp_backend_get(int32_t type)
+{
+    switch (type)
+    {
+        case KSP_BACKEND_PIPEWIRE:
+            return &ksp_pipewire_backend;
+        case KSP_BACKEND_NULL:
+            return &ksp_null_backend;
+        case KSP_BACKEND_OFFLINE:
+            return &ksp_offline_backend;
+        default:
+            return NULL;
+    }
+}
+
+/* Null backend: a thread that wakes once a quantum, on the same schedule a device would, and mixes into a buffer
+ * nobody listens to. Playback, fades and voice lifetimes all behave as they do on a real device, without one. */
+
+typedef struct ksp_null
+{
+    ksp_engine *engine;
+    pthread_t thread;
+    _Atomic bool running;
+    float *buffer;
+} ksp_null;
+
+static void add_ns(struct timespec *time, int64_t ns)
+{
+    time->tv_sec += ns / 1000000000;
+    time->tv_nsec += ns % 1000000000;
+    if (time->tv_nsec >= 1000000000)
+    {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000;
+    }
+}
+
+static void *null_thread(void *userdata)
+{
+    ksp_null *null = userdata;
+    ksp_engine *engine = null->engine;
+    int64_t period = (int64_t)KSP_BACKEND_QUANTUM * 1000000000 / engine->sampleRate;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    while (atomic_load_explicit(&null->running, memory_order_relaxed))
+    {
+        ksp_process_cycle(engine, null->buffer, KSP_BACKEND_QUANTUM, 0);
+
+        add_ns(&deadline, period);
+        //A cycle that started late doesn't make the ones after it late too; the ones it missed count as xruns
+        int64_t behind = ksp_now_ns() - ((int64_t)deadline.tv_sec * 1000000000 + deadline.tv_nsec);
+        if (behind > period)
+        {
+            atomic_fetch_add_explicit(&engine->stats.xruns, behind / period, memory_order_relaxed);
+            add_ns(&deadline, behind / period * period);
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void null_close(ksp_engine *engine, void *backend)
+{
+    ksp_null *null = backend;
+    if (atomic_exchange(&null->running, false))
+        pthread_join(null->thread, NULL);
+    free(null->buffer);
+    free(null);
+}
+
+static void *null_open(ksp_engine *engine, const char *output)
+{
+    ksp_null *null = calloc(1, sizeof(ksp_null));
+    if (null == NULL)
+        return NULL;
+    null->engine = engine;
+    null->buffer = malloc((size_t)KSP_BACKEND_QUANTUM * engine->channels * sizeof(float));
+    if (null->buffer == NULL)
+    {
+        fputs("Could not allocate the null backend's buffer!\n", stderr);
+        null_close(engine, null);
+        return NULL;
+    }
+
+    atomic_store(&null->running, true);
+    if (pthread_create(&null->thread, NULL, null_thread, null) != 0)
+    {
+        fputs("Could not start the null backend's thread!\n", stderr);
+        atomic_store(&null->running, false);
+        null_close(engine, null);
+        return NULL;
+    }
+    return null;
+}
+
+const ksp_backend_ops ksp_null_backend = {
+    .name = "null",
+    .open = null_open,
+    .close = null_close,
+};
+
+/* Offline backend: nothing happens until ksp_engine_render asks for audio, which is then mixed as fast as the CPU
+ * allows. Streamed voices are topped up before every cycle instead of in the background, so the result never depends
+ * on timing and can be compared sample for sample. */
+
+typedef struct ksp_offline
+{
+    FILE *file; //Wave file being written, or NULL
+    char *filePath;
+    uint64_t dataBytes; //Written to the file's data chunk so far
+    float *buffer;
+} ksp_offline;
+
+static inline void put_u16(uint8_t *p, uint16_t val)
+{
+    memcpy(p, &val, sizeof(val));
+}
+
+static inline void put_u32(uint8_t *p, uint32_t val)
+{
+    memcpy(p, &val, sizeof(val));
+}
+
+//A header for 32-bit float audio with the given amount of data. Wave files are little endian, as is the CPU.
+static void wave_header(uint8_t header[44], const ksp_engine *engine, uint64_t dataBytes)
+{
+    uint32_t size = dataBytes < WAVE_MAX_DATA_BYTES ? (uint32_t)dataBytes : WAVE_MAX_DATA_BYTES;
+    uint16_t blockAlign = engine->channels * sizeof(float);
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, 36 + size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);
+    put_u16(header + 20, WAVE_FORMAT_IEEE_FLOAT);
+    put_u16(header + 22, engine->channels);
+    put_u32(header + 24, engine->sampleRate);
+    put_u32(header + 28, engine->sampleRate * blockAlign);
+    put_u16(header + 32, blockAlign);
+    put_u16(header + 34, 32);
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, size);
+}
+
+static void offline_close(ksp_engine *engine, void *backend)
+{
+    ksp_offline *offline = backend;
+    if (offline->file != NULL)
+    {
+        //The header was written with no data, and only now is its length known
+        uint8_t header[44];
+        wave_header(header, engine, offline->dataBytes);
+        if (offline->dataBytes > WAVE_MAX_DATA_BYTES)
+            fprintf(stderr, "%s: too long for a wave file, so its header only covers the first 4GB\n",
+                    offline->filePath);
+        if (fseek(offline->file, 0, SEEK_SET) != 0 || fwrite(header, sizeof(header), 1, offline->file) != 1 ||
+            fclose(offline->file) != 0)
+            fprintf(stderr, "Could not finish writing %s: %s\n", offline->filePath, strerror(errno));
+    }
+    free(offline->filePath);
+    free(offline->buffer);
+    free(offline);
+}
+
+static void *offline_open(ksp_engine *engine, const char *output)
+{
+    ksp_offline *offline = calloc(1, sizeof(ksp_offline));
+    if (offline == NULL)
+        return NULL;
+    offline->buffer = malloc((size_t)KSP_BACKEND_QUANTUM * engine->channels * sizeof(float));
+    if (offline->buffer == NULL)
+    {
+        fputs("Could not allocate the offline backend's buffer!\n", stderr);
+        offline_close(engine, offline);
+        return NULL;
+    }
+
+    if (output != NULL)
+    {
+        uint8_t header[44];
+        wave_header(header, engine, 0);
+        offline->filePath = strdup(output);
+        offline->file = fopen(output, "wb");
+        if (offline->filePath == NULL || offline->file == NULL || fwrite(header, sizeof(header), 1, offline->file) != 1)
+        {
+            fprintf(stderr, "Could not write %s: %s\n", output, strerror(errno));
+            if (offline->file != NULL)
+                fclose(offline->file);
+            offline->file = NULL;
+            offline_close(engine, offline);
+            return NULL;
+        }
+    }
+    return offline;
+}
+
+const ksp_backend_ops ksp_offline_backend = {
+    .name = "offline",
+    .open = offline_open,
+    .close = offline_close,
+};
+
+uint32_t ksp_engine_render(ksp_engine *engine, float *dst, uint32_t frames)
+{
+    if (engine->backend != &ksp_offline_backend)
+        return 0;
+    ksp_offline *offline = engine->backendData;
+
+    uint32_t done = 0;
+    while (done < frames)
+    {
+        uint32_t cycle = frames - done < KSP_BACKEND_QUANTUM ? frames - done : KSP_BACKEND_QUANTUM;
+        float *mix = dst != NULL ? dst + (size_t)done * engine->channels : offline->buffer;
+        ksp_streamer_fill_all(&engine->streamer);
+        ksp_process_cycle(engine, mix, cycle, 0);
+
+        if (offline->file != NULL)
+        {
+            size_t bytes = (size_t)cycle * engine->channels * sizeof(float);
+            if (fwrite(mix, bytes, 1, offline->file) == 1)
+            {
+                offline->dataBytes += bytes;
+            }
+            else
+            {
+                fprintf(stderr, "Could not write %s: %s\n", offline->filePath, strerror(errno));
+                fclose(offline->file);
+                offline->file = NULL;
+            }
+        }
+        done += cycle;
+    }
+    return done;
+}
@@ -0,0 +1,49 @@
+#ifndef KSP_PW_BACKEND_H
+#define KSP_PW_BACKEND_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+//Length of a cycle, in frames, for the backends that choose their own
+#define KSP_BACKEND_QUANTUM 1024
+
+//In the same order as NativeEngine.Backend on the managed side
+typedef enum ksp_backend_type
+{
+    KSP_BACKEND_PIPEWIRE, //Plays through a PipeWire stream, which sets the pace
+    KSP_BACKEND_NULL,     //Mixes on its own thread in real time, clocked by a timer, and throws the audio away
+    KSP_BACKEND_OFFLINE,  //Mixes only when ksp_engine_render is called, as fast as it can, to a wave file or memory
+    KSP_BACKEND_COUNT
+} ksp_backend_type;
+
+struct ksp_engine;
+
+//Whatever pulls audio out of an engine. Each backend plays the part of the audio thread for the engine it drives.
+typedef struct ksp_backend_ops
+{
+    const char *name;
+    //Starts pulling audio from the engine. output is backend specific, and may be NULL. Returns the backend's state,
+    //or NULL on failure.
+    void *(*open)(struct ksp_engine *engine, const char *output);
+    //Stops pulling audio. Once this returns the engine is no longer touched.
+    void (*close)(struct ksp_engine *engine, void *backend);
+    //Plays a bus through an output of its own, connected to target, or back through the main output if target is
+    //NULL. Returns false if that couldn't be done. NULL for backends with only the one output.
+    bool (*route)(struct ksp_engine *engine, void *backend, uint32_t bus, const char *target);
+} ksp_backend_ops;
+
+extern const ksp_backend_ops ksp_pipewire_backend;
+extern const ksp_backend_ops ksp_null_backend;
+extern const ksp_backend_ops ksp_offline_backend; //output is the path of a wave file to write, or NULL for none
+
+//NULL for an unknown type
+const ksp_backend_ops *ksp_backend_get(int32_t type);
+
+//Renders frames of an engine on the offline backend, in cycles of at most KSP_BACKEND_QUANTUM frames. The audio is
+//written to the backend's wave file, if it has one, and to dst, if it isn't NULL. Streamed voices are decoded as far
+//as each cycle needs first, so the output is the same however fast the disk is. Returns the number of frames
+//rendered, which is 0 if the engine isn't on the offline backend.
+uint32_t ksp_engine_render(struct ksp_engine *engine, float *dst, uint32_t frames);
+
+#endif
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ksp_pw_bundle.h"
+#include "ksp_pw_structs.h"
+
+/* The table of contents comes straight after the header and holds one fixed-size entry per cue, in the order the
+ * board lists its sounds, so finding a cue is an index into it. Each cue's audio starts on an aligned boundary, as
+ * the decoded PCM the engine plays from, and its peak index follows it as the peak cache stores it. */
+
+static const char bundleMagic[8] = "KSPBUNDL";
+
+_Static_assert(sizeof(ksp_bundle_entry) == 64, "bundle entries are stored in the table of contents as is");
+_Static_assert(sizeof(ksp_bundle_header) % _Alignof(ksp_bundle_entry) == 0, "the table of contents is read in place");
+
+//Frames of a streamed sample decoded into the bundle at a time
+#define KSP_BUNDLE_DECODE_FRAMES 65536
+
+bool ksp_bundle_probe(const char *path)
+{
+    char magic[sizeof(bundleMagic)];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    size_t length = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    return length == sizeof(magic) && memcmp(magic, bundleMagic, sizeof(magic)) == 0;
+}
+
+//Whether a mapped file has a whole header and table of contents of this version
+static bool header_valid(const uint8_t *map, size_t length)
+{
+    if (length < sizeof(ksp_bundle_header))
+        return false;
+    const ksp_bundle_header *header = (const ksp_bundle_header *)map;
+    if (memcmp(header->magic, bundleMagic, sizeof(bundleMagic)) != 0 || header->version != KSP_BUNDLE_VERSION ||
+        header->length != length)
+        return false;
+    uint64_t contentsEnd = sizeof(ksp_bundle_header) + (uint64_t)header->cueCount * sizeof(ksp_bundle_entry);
+    return contentsEnd <= length && header->metadataOffset >= contentsEnd && header->metadataOffset <= length &&
+           header->metadataBytes <= length - header->metadataOffset;
+}
+
+ksp_bundle *ksp_bundle_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    //Faulted in up front like a preloaded wave file, so no cue ever waits on the disk when it is triggered
+    void *map = status.st_size > 0 ? mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)
+                                   : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (!header_valid(map, status.st_size))
+    {
+        fprintf(stderr, "%s: not a bundle of this version, or cut short\n", path);
+        munmap(map, status.st_size);
+        return NULL;
+    }
+
+    ksp_bundle *bundle = calloc(1, sizeof(ksp_bundle));
+    if (bundle == NULL)
+    {
+        munmap(map, status.st_size);
+        return NULL;
+    }
+    atomic_init(&bundle->refCount, 1);
+    bundle->map = map;
+    bundle->length = status.st_size;
+    bundle->header = map;
+    bundle->entries = (const ksp_bundle_entry *)(bundle->map + sizeof(ksp_bundle_header));
+    return bundle;
+}
+
+void ksp_bundle_ref(ksp_bundle *bundle)
+{
+    atomic_fetch_add_explicit(&bundle->refCount, 1, memory_order_relaxed);
+}
+
+void ksp_bundle_release(ksp_bundle *bundle)
+{
+    if (bundle == NULL || atomic_fetch_sub_explicit(&bundle->refCount, 1, memory_order_acq_rel) != 1)
+        return;
+    munmap(bundle->map, bundle->length);
+    free(bundle);
+}
+
+uint32_t ksp_bundle_cue_count(const ksp_bundle *bundle)
+{
+    return bundle->header->cueCount;
+}
+
+int32_t ksp_bundle_metadata(const ksp_bundle *bundle, char *buffer, int32_t size)
+{
+    uint64_t length = bundle->header->metadataBytes;
+    if (buffer != NULL && size > 0)
+    {
+        size_t copied = length < (uint64_t)size - 1 ? (size_t)length : (size_t)size - 1;
+        memcpy(buffer, bundle->map + bundle->header->metadataOffset, copied);
+        buffer[copied] = '\0';
+    }
+    return length <= INT32_MAX ? (int32_t)length : INT32_MAX;
+}
+
+//Whether offset and bytes lie inside the file
+static bool in_file(const ksp_bundle *bundle, uint64_t offset, uint64_t bytes)
+{
+    return offset <= bundle->length && bytes <= bundle->length - offset;
+}
+
+const ksp_bundle_entry *ksp_bundle_cue(const ksp_bundle *bundle, uint32_t cue)
+{
+    if (cue >= bundle->header->cueCount)
+        return NULL;
+    const ksp_bundle_entry *entry = &bundle->entries[cue];
+    if (entry->pcmOffset == 0)
+        return NULL;
+
+    uint32_t formatSize = entry->sampleFormat < KSP_SAMPLE_FORMAT_COUNT ? ksp_sample_format_size(entry->sampleFormat)
+                                                                         : 0;
+    if (formatSize == 0 || entry->channels == 0 || entry->channels > KSP_MAX_SAMPLE_CHANNELS ||
+        entry->sampleRate == 0 || entry->frameCount == 0 || entry->frameCount > UINT32_MAX ||
+        entry->pcmBytes != entry->frameCount * formatSize * entry->channels ||
+        entry->pcmOffset % KSP_BUNDLE_ALIGNMENT != 0 || !in_file(bundle, entry->pcmOffset, entry->pcmBytes) ||
+        entry->loopEnd > entry->frameCount || (entry->loopEnd > 0 && entry->loopStart >= entry->loopEnd) ||
+        (entry->peaksOffset != 0 && !in_file(bundle, entry->peaksOffset, entry->peaksBytes)))
+    {
+        fprintf(stderr, "Cue %u of the bundle is damaged\n", cue);
+        return NULL;
+    }
+    return entry;
+}
+
+static bool write_at(int fd, const void *data, size_t length, uint64_t offset)
+{
+    const uint8_t *bytes = data;
+    while (length > 0)
+    {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//Decodes a streamed sample from its source file into the bundle at offset. Returns false if the file couldn't be
+//written; if the sample couldn't be decoded, the entry's frameCount is left at 0.
+static bool write_streamed(int fd, const ksp_sample *sample, uint64_t offset, ksp_bundle_entry *entry)
+{
+    ksp_stream_info info;
+    void *decoder = sample->decoder->open(sample->filePath, &info);
+    if (decoder == NULL)
+        return true;
+    uint32_t bytesPerFrame = ksp_sample_format_size(info.sampleFormat) * info.channels;
+    uint8_t *buffer = malloc((size_t)KSP_BUNDLE_DECODE_FRAMES * bytesPerFrame);
+    if (buffer == NULL)
+    {
+        sample->decoder->close(decoder);
+        return true;
+    }
+    bool written = true;
+    uint64_t frames = 0;
+    while (written && frames < UINT32_MAX)
+    {
+        uint32_t wanted = UINT32_MAX - frames < KSP_BUNDLE_DECODE_FRAMES ? (uint32_t)(UINT32_MAX - frames)
+                                                                          : KSP_BUNDLE_DECODE_FRAMES;
+        uint32_t decoded = sample->decoder->read(decoder, buffer, wanted);
+        if (decoded == 0)
+            break;
+        written = write_at(fd, buffer, (size_t)decoded * bytesPerFrame, offset + frames * bytesPerFrame);
+        frames += decoded;
+    }
+    free(buffer);
+    sample->decoder->close(decoder);
+    if (!written || frames == 0)
+        return written;
+
+    entry->sampleFormat = info.sampleFormat;
+    entry->channels = info.channels;
+    entry->sampleRate = info.sampleRate;
+    entry->frameCount = frames;
+    entry->pcmBytes = frames * bytesPerFrame;
+    return true;
+}
+
+//Writes one cue's audio and peak index from offset on, and fills in its entry. Returns false if the file couldn't
+//be written; a streamed sample that can't be decoded only leaves its cue empty.
+static bool write_cue(int fd, const ksp_sample *sample, uint32_t cue, uint64_t *offset, ksp_bundle_entry *entry)
+{
+    uint64_t pcmOffset = (*offset + KSP_BUNDLE_ALIGNMENT - 1) / KSP_BUNDLE_ALIGNMENT * KSP_BUNDLE_ALIGNMENT;
+    if (sample->data != NULL)
+    {
+        entry->sampleFormat = sample->sampleFormat;
+        entry->channels = sample->channels;
+        entry->sampleRate = sample->sampleRate;
+        entry->frameCount = sample->frameCount;
+        entry->pcmBytes = (uint64_t)sample->frameCount * sample->bytesPerFrame;
+        if (!write_at(fd, sample->data, entry->pcmBytes, pcmOffset))
+            return false;
+    }
+    else if (sample->decoder != NULL && !write_streamed(fd, sample, pcmOffset, entry))
+    {
+        return false;
+    }
+    if (entry->frameCount == 0)
+    {
+        fprintf(stderr, "Cue %u could not be decoded, and is left out of the bundle\n", cue);
+        return true;
+    }
+    entry->pcmOffset = pcmOffset;
+    entry->format = sample->format;
+    entry->loopStart = sample->loopStart;
+    entry->loopEnd = sample->loopEnd <= entry->frameCount ? sample->loopEnd : 0;
+    *offset = pcmOffset + entry->pcmBytes;
+
+    const ksp_peaks *peaks = &sample->peaks;
+    if (peaks->header != NULL && peaks->header->channels == entry->channels)
+    {
+        uint64_t peaksOffset = (*offset + _Alignof(ksp_peak_header) - 1) / _Alignof(ksp_peak_header) *
+                               _Alignof(ksp_peak_header);
+        if (!write_at(fd, peaks->header, peaks->length, peaksOffset))
+            return false;
+        entry->peaksOffset = peaksOffset;
+        entry->peaksBytes = peaks->length;
+        *offset = peaksOffset + peaks->length;
+    }
+    return true;
+}
+
+bool ksp_bundle_write(const char *path, const ksp_sample *const *samples, uint32_t count, const char *metadata,
+                      size_t metadataBytes)
+{
+    ksp_bundle_entry *entries = calloc(count > 0 ? count : 1, sizeof(ksp_bundle_entry));
+    char *temporary = NULL;
+    if (entries == NULL || asprintf(&temporary, "%s.XXXXXX", path) < 0)
+    {
+        fprintf(stderr, "Could not allocate memory to write %s\n", path);
+        free(entries);
+        return false;
+    }
+    int fd = mkostemp(temporary, O_CLOEXEC);
+    //Readable by everyone, like the board file it is exported next to, rather than only by its owner
+    bool written = fd >= 0 && fchmod(fd, 0644) == 0;
+
+    ksp_bundle_header header = {
+        .version = KSP_BUNDLE_VERSION,
+        .cueCount = count,
+        .metadataOffset = sizeof(ksp_bundle_header) + (uint64_t)count * sizeof(ksp_bundle_entry),
+        .metadataBytes = metadataBytes,
+    };
+    memcpy(header.magic, bundleMagic, sizeof(bundleMagic));
+    uint64_t offset = header.metadataOffset + metadataBytes;
+    if (written)
+        written = write_at(fd, metadata, metadataBytes, header.metadataOffset);
+    for (uint32_t cue = 0; written && cue < count; cue++)
+    {
+        if (samples[cue] != NULL)
+            written = write_cue(fd, samples[cue], cue, &offset, &entries[cue]);
+    }
+
+    //Cut back to the end of the last cue, in case a streamed sample that failed part way wrote beyond it
+    header.length = offset;
+    if (written)
+        written = ftruncate(fd, offset) == 0 &&
+                  write_at(fd, entries, (size_t)count * sizeof(ksp_bundle_entry), sizeof(ksp_bundle_header)) &&
+                  write_at(fd, &header, sizeof(header), 0);
+    if (fd >= 0)
+    {
+        written = close(fd) == 0 && written;
+        if (written)
+            written = rename(temporary, path) == 0;
+    }
+    if (!written)
+    {
+        fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            unlink(temporary);
+    }
+    free(temporary);
+    free(entries);
+    return written;
+}
@@ -0,0 +1,87 @@
+#ifndef KSP_PW_BUNDLE_H
+#define KSP_PW_BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define KSP_BUNDLE_VERSION 1
+
+//Every cue's audio starts on a multiple of this, so it is page-aligned in the mapping on any common page size
+#define KSP_BUNDLE_ALIGNMENT 65536
+
+//Where one cue's audio and peak index are in the bundle, and how to play it. Exactly 64 bytes, as it is stored in the
+//table of contents as is.
+typedef struct ksp_bundle_entry
+{
+    uint64_t pcmOffset; //From the start of the file; 0 for a cue that has no audio
+    uint64_t pcmBytes;
+    uint64_t frameCount;
+    uint64_t peaksOffset; //0 if the cue has no peak index
+    uint64_t peaksBytes;
+    uint32_t sampleRate;
+    uint32_t loopStart;
+    uint32_t loopEnd; //As in ksp_sample: one past the last frame of the loop, or 0 if none
+    uint16_t channels;
+    uint8_t sampleFormat; //ksp_sample_format of the PCM
+    uint8_t format; //AudioFormat of the source file the audio was decoded from
+    uint64_t reserved;
+} ksp_bundle_entry;
+
+//Start of a bundle file, followed by the table of contents, one entry per cue, and then the board's metadata
+typedef struct ksp_bundle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t cueCount;
+    uint64_t metadataOffset;
+    uint64_t metadataBytes;
+    uint64_t length; //Of the whole file, so a copy that was cut short is turned away
+    uint64_t reserved;
+} ksp_bundle_header;
+
+/* A bundle is a whole board in one file: the board's own file as metadata, and every cue's decoded audio, loop points
+ * and peak index, laid out so they can be used straight from a mapping of the file. Opening one maps it once, and a
+ * cue is found by its index in the table of contents, so loading a board from it decodes and parses nothing. Every
+ * sample loaded from a bundle holds a reference to it, and it is unmapped once the last is released. The file is
+ * written in the byte order of the machine, like the decode cache. */
+typedef struct ksp_bundle
+{
+    _Atomic uint32_t refCount; //One held by whoever opened it plus one per sample loaded from it
+    uint8_t *map;
+    size_t length;
+    const ksp_bundle_header *header;
+    const ksp_bundle_entry *entries;
+} ksp_bundle;
+
+struct ksp_sample;
+
+//Whether a file starts like a bundle, so it can be told apart from a board's own file
+bool ksp_bundle_probe(const char *path);
+
+//Maps a bundle and checks its header and table of contents. Prints why and returns NULL if it can't be used.
+ksp_bundle *ksp_bundle_open(const char *path);
+
+void ksp_bundle_ref(ksp_bundle *bundle);
+
+//Drops a reference, unmapping the bundle once the last is gone
+void ksp_bundle_release(ksp_bundle *bundle);
+
+uint32_t ksp_bundle_cue_count(const ksp_bundle *bundle);
+
+//Copies as much of the board's metadata as fits into buffer. Returns its whole length, like snprintf.
+int32_t ksp_bundle_metadata(const ksp_bundle *bundle, char *buffer, int32_t size);
+
+//The table of contents entry of a cue, checked against the file. Returns NULL if the cue is out of range, has no
+//audio, or its entry doesn't make sense.
+const ksp_bundle_entry *ksp_bundle_cue(const ksp_bundle *bundle, uint32_t cue);
+
+/* Writes count samples, in cue order, and the board's metadata into a new bundle at path. A NULL sample leaves its
+ * cue empty. Streamed samples are decoded from their source files as they are written, so every cue of the bundle
+ * is resident once it is loaded. The file is written under a temporary name and renamed into place, so a bundle
+ * that is open, even the one being replaced, is never seen half written. Prints why and returns false on failure. */
+bool ksp_bundle_write(const char *path, const struct ksp_sample *const *samples, uint32_t count, const char *metadata,
+                      size_t metadataBytes);
+
+#endif
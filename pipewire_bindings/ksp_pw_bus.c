@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksp_pw_bus.h"
+
+_Static_assert((KSP_BUS_RING_FRAMES & (KSP_BUS_RING_FRAMES - 1)) == 0, "the ring is indexed with a mask");
+
+bool ksp_bus_init(ksp_bus *bus, uint32_t channels, uint32_t sampleRate)
+{
+    memset(bus, 0, sizeof(*bus));
+    bus->channels = channels;
+    bus->level = 1;
+    bus->rampTarget = 1;
+    atomic_init(&bus->gain, 1.0f);
+    bus->mix = malloc((size_t)KSP_BUS_BLOCK_FRAMES * channels * sizeof(float));
+    bool dsp = ksp_dsp_init(&bus->dsp, channels, sampleRate, KSP_BUS_BLOCK_FRAMES);
+    return bus->mix != NULL && dsp;
+}
+
+void ksp_bus_destroy(ksp_bus *bus)
+{
+    ksp_dsp_destroy(&bus->dsp);
+    free(bus->mix);
+    free(bus->ring);
+    bus->mix = NULL;
+    bus->ring = NULL;
+}
+
+bool ksp_bus_open_ring(ksp_bus *bus)
+{
+    if (bus->ring == NULL)
+    {
+        bus->ring = malloc((size_t)KSP_BUS_RING_FRAMES * bus->channels * sizeof(float));
+        if (bus->ring == NULL)
+        {
+            fputs("Could not allocate a bus's output buffer!\n", stderr);
+            return false;
+        }
+    }
+    //The audio thread may still be writing, if the bus is being moved from one output to another
+    atomic_store_explicit(&bus->read, atomic_load_explicit(&bus->written, memory_order_acquire), memory_order_release);
+    return true;
+}
+
+void ksp_bus_read(ksp_bus *bus, float *dst, uint32_t frames)
+{
+    uint64_t written = atomic_load_explicit(&bus->written, memory_order_acquire);
+    uint64_t read = atomic_load_explicit(&bus->read, memory_order_relaxed);
+    if (written - read > (uint64_t)frames + KSP_BUS_BACKLOG_FRAMES)
+        read = written - frames;
+
+    uint32_t available = written - read < frames ? (uint32_t)(written - read) : frames;
+    uint32_t done = 0;
+    while (done < available)
+    {
+        uint32_t index = (uint32_t)((read + done) & (KSP_BUS_RING_FRAMES - 1));
+        uint32_t run = KSP_BUS_RING_FRAMES - index < available - done ? KSP_BUS_RING_FRAMES - index : available - done;
+        memcpy(dst + (size_t)done * bus->channels, bus->ring + (size_t)index * bus->channels,
+               (size_t)run * bus->channels * sizeof(float));
+        done += run;
+    }
+    memset(dst + (size_t)available * bus->channels, 0, (size_t)(frames - available) * bus->channels * sizeof(float));
+    atomic_store_explicit(&bus->read, read + available, memory_order_release);
+}
+
+void ksp_bus_begin(ksp_bus *bus, uint32_t rampFrames)
+{
+    float target = atomic_load_explicit(&bus->muted, memory_order_relaxed)
+                       ? 0
+                       : atomic_load_explicit(&bus->gain, memory_order_relaxed);
+    //The new ramp starts from wherever the previous one had got to
+    if (target != bus->rampTarget)
+    {
+        bus->rampTarget = target;
+        bus->rampRemaining = rampFrames;
+        if (rampFrames == 0)
+            bus->level = target;
+    }
+    bus->toRing = atomic_load_explicit(&bus->routed, memory_order_acquire);
+    bool processed = ksp_dsp_update(&bus->dsp);
+    bus->direct = !bus->toRing && !processed && bus->rampRemaining == 0 && bus->level == 1;
+    bus->active = false;
+}
+
+float *ksp_bus_buffer(ksp_bus *bus, float *out, uint32_t frames)
+{
+    if (bus->direct)
+        return out;
+    if (!bus->active)
+    {
+        memset(bus->mix, 0, (size_t)frames * bus->channels * sizeof(float));
+        bus->active = true;
+    }
+    return bus->mix;
+}
+
+//Adds frames of src to dst with the bus's gain applied, and moves the gain along its ramp. A NULL src is silent, so
+//only the gain moves.
+static void add_with_gain(ksp_bus *bus, ksp_mix_kernel mix, const float *src, float *dst, uint32_t frames)
+{
+    uint32_t done = 0;
+    while (done < frames)
+    {
+        uint32_t segment = frames - done;
+        float gainStep = 0;
+        if (bus->rampRemaining > 0)
+        {
+            if (segment > bus->rampRemaining)
+                segment = bus->rampRemaining;
+            gainStep = (bus->rampTarget - bus->level) / bus->rampRemaining;
+        }
+        if (src != NULL && (bus->level != 0 || gainStep != 0))
+            mix((const uint8_t *)(src + (size_t)done * bus->channels), dst + (size_t)done * bus->channels, segment,
+                bus->channels, bus->level, gainStep);
+        if (bus->rampRemaining > 0)
+        {
+            bus->rampRemaining -= segment;
+            bus->level = bus->rampRemaining > 0 ? bus->level + gainStep * segment : bus->rampTarget;
+        }
+        done += segment;
+    }
+}
+
+//Writes the block to the ring. Whatever there is no room for is dropped, since the output reading it has stalled.
+static void write_ring(ksp_bus *bus, ksp_mix_kernel mix, uint32_t frames)
+{
+    uint64_t written = atomic_load_explicit(&bus->written, memory_order_relaxed);
+    uint64_t read = atomic_load_explicit(&bus->read, memory_order_acquire);
+    uint64_t space = KSP_BUS_RING_FRAMES - (written - read);
+    uint32_t count = frames < space ? frames : (uint32_t)space;
+
+    const float *src = bus->active ? bus->mix : NULL;
+    uint32_t done = 0;
+    while (done < count)
+    {
+        uint32_t index = (uint32_t)((written + done) & (KSP_BUS_RING_FRAMES - 1));
+        uint32_t run = KSP_BUS_RING_FRAMES - index < count - done ? KSP_BUS_RING_FRAMES - index : count - done;
+        float *dst = bus->ring + (size_t)index * bus->channels;
+        memset(dst, 0, (size_t)run * bus->channels * sizeof(float));
+        add_with_gain(bus, mix, src != NULL ? src + (size_t)done * bus->channels : NULL, dst, run);
+        done += run;
+    }
+    add_with_gain(bus, mix, NULL, NULL, frames - count);
+    atomic_store_explicit(&bus->written, written + count, memory_order_release);
+}
+
+void ksp_bus_end(ksp_bus *bus, const ksp_kernels *kernels, float *out, uint32_t frames)
+{
+    if (bus->direct)
+        return;
+    //Runs even when nothing was mixed into the bus, so filters ring out and the limiter's delay empties
+    if (bus->dsp.active)
+        ksp_dsp_process(&bus->dsp, kernels, ksp_bus_buffer(bus, out, frames), frames);
+    ksp_mix_kernel mix = kernels->mix[KSP_SAMPLE_F32];
+    if (bus->toRing)
+        write_ring(bus, mix, frames);
+    else
+        add_with_gain(bus, mix, bus->active ? bus->mix : NULL, out, frames);
+}
@@ -0,0 +1,82 @@
+#ifndef KSP_PW_BUS_H
+#define KSP_PW_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "ksp_pw_kernels.h"
+#include "ksp_pw_dsp.h"
+
+//Number of submix buses in an engine. Voices play on bus 0 unless they are put on another.
+#define KSP_MAX_BUSES 8
+
+//Stands for the master, which every bus playing through the main output is added to, in the functions that set up DSP
+#define KSP_BUS_MASTER -1
+
+//Longest block mixed at once, so every bus's buffer has room for a block whatever length cycles PipeWire asks for
+#define KSP_BUS_BLOCK_FRAMES 1024
+
+//Frames a bus with its own output can get ahead of that output by. Must be a power of two.
+#define KSP_BUS_RING_FRAMES 16384
+
+//Frames a bus's own output lets build up beyond what it has been asked for before it skips to the newest audio, which
+//bounds the latency added by two outputs' clocks drifting apart, or by one that was only just connected
+#define KSP_BUS_BACKLOG_FRAMES 2048
+
+struct pw_stream;
+
+/* A submix that voices are mixed into before it goes to an output, with a gain and mute of its own. A bus is played
+ * through the engine's main output, or through an output of its own if the backend can give it one. Everything is
+ * still mixed in the one pass, by the engine's audio thread; a bus's own output just reads what has been mixed for it
+ * from a ring, at whatever pace its device runs at. */
+typedef struct ksp_bus
+{
+    _Atomic float gain;
+    _Atomic bool muted;
+    _Atomic bool routed; //Played through its own output, fed from ring, rather than the engine's main output
+    uint32_t channels;
+
+    //Single-producer single-consumer ring of mixed frames. The audio thread writes to it and the bus's own output
+    //reads from it. Frames are counted from when the bus was first routed.
+    float *ring; //Allocated the first time the bus is routed, and kept until the engine is destroyed
+    _Atomic uint64_t written;
+    _Atomic uint64_t read;
+    struct pw_stream *stream; //The bus's own output on the PipeWire backend, or NULL
+    ksp_dsp dsp; //Filters and limiter the bus's voices are run through, before its gain
+
+    //Only touched by the audio thread
+    float *mix; //The bus's voices, for the block being mixed
+    float level; //Gain the bus is at, moving towards rampTarget
+    float rampTarget;
+    uint32_t rampRemaining; //Frames left before level reaches rampTarget
+    bool toRing; //routed, as it was at the start of the block
+    bool direct; //The bus's voices are mixed straight into the main output, since it leaves them as they are
+    bool active; //Some voice has been mixed into mix in this block
+} ksp_bus;
+
+bool ksp_bus_init(ksp_bus *bus, uint32_t channels, uint32_t sampleRate);
+
+void ksp_bus_destroy(ksp_bus *bus);
+
+//Makes sure the bus has a ring, and discards whatever is in it, before an output starts reading it. Only called by a
+//backend, while nothing reads the ring. Returns false if the ring couldn't be allocated.
+bool ksp_bus_open_ring(ksp_bus *bus);
+
+//Reads frames from the ring into dst, padded with silence if not enough have been mixed yet. Called by the bus's own
+//output.
+void ksp_bus_read(ksp_bus *bus, float *dst, uint32_t frames);
+
+//Picks up the gain, mute, routing and DSP settings control threads have asked for, at the start of a block. A change
+//of gain is ramped over rampFrames.
+void ksp_bus_begin(ksp_bus *bus, uint32_t rampFrames);
+
+//Where a voice on the bus mixes frames of the block into: out, the main output, or the bus's own buffer
+float *ksp_bus_buffer(ksp_bus *bus, float *out, uint32_t frames);
+
+//Runs the block through the bus's DSP, applies its gain and adds it to out, or writes it to the ring if the bus has its
+//own output
+void ksp_bus_end(ksp_bus *bus, const ksp_kernels *kernels, float *out, uint32_t frames);
+
+#endif
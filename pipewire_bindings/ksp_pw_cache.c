@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ksp_pw_cache.h"
+
+/* A cached sound is found by the device, inode, size and modification time of its source file, so a warm load is one
+ * stat() and one lookup, with no decoder opened and no header parsed. Its PCM is stored under a hash of the source
+ * file's contents, so two different files with the same name never collide, and copies of one file share the PCM. */
+
+static const char indexMagic[8] = "KSPCACHE";
+
+_Static_assert(sizeof(ksp_cache_entry) == 64, "cache entries are stored in the index as is");
+
+static size_t index_length(uint32_t capacity)
+{
+    return sizeof(ksp_cache_index) + (size_t)capacity * sizeof(ksp_cache_entry);
+}
+
+static int64_t mtime_ns(const struct stat *status)
+{
+    return (int64_t)status->st_mtim.tv_sec * 1000000000 + status->st_mtim.tv_nsec;
+}
+
+static uint64_t slot_hash(uint64_t device, uint64_t inode)
+{
+    return (inode ^ (device * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull;
+}
+
+//Where the probe for a source file starts
+static uint32_t slot_of(const ksp_cache_index *index, uint64_t device, uint64_t inode)
+{
+    return (uint32_t)(slot_hash(device, inode) >> 32) & (index->capacity - 1);
+}
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+//64-bit hash of a whole file, four independent lanes of eight bytes at a time
+static uint64_t hash_bytes(const uint8_t *data, size_t length)
+{
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    uint64_t lanes[4] = { prime1, prime2, ~prime1, ~prime2 };
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        for (int l = 0; l < 4; l++)
+        {
+            uint64_t word;
+            memcpy(&word, data + i + l * 8, 8);
+            lanes[l] = rotl(lanes[l] + word * prime2, 31) * prime1;
+        }
+    }
+    uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + length;
+    for (; i < length; i++)
+        h = rotl(h ^ (data[i] * prime1), 11) * prime2;
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    return h;
+}
+
+static bool make_directory(const char *path)
+{
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return false;
+    //Creates every missing parent on the way down
+    for (char *p = copy + 1; *p != '\0'; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(copy, 0755);
+        *p = '/';
+    }
+    free(copy);
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+void ksp_cache_init(ksp_cache *cache)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd = -1;
+    cache->pcmDirectory = NULL;
+    cache->index = NULL;
+    cache->indexLength = 0;
+}
+
+bool ksp_cache_open(ksp_cache *cache, const char *directory)
+{
+    size_t pathLength = strlen(directory) + sizeof("/decoded/index");
+    char *indexPath = malloc(pathLength);
+    char *pcmDirectory = malloc(pathLength);
+    if (indexPath == NULL || pcmDirectory == NULL)
+    {
+        free(indexPath);
+        free(pcmDirectory);
+        return false;
+    }
+    snprintf(pcmDirectory, pathLength, "%s/decoded", directory);
+    snprintf(indexPath, pathLength, "%s/decoded/index", directory);
+
+    int fd = -1;
+    if (make_directory(pcmDirectory))
+        fd = open(indexPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Could not open the decode cache in %s: %s\n", directory, strerror(errno));
+        free(indexPath);
+        free(pcmDirectory);
+        return false;
+    }
+    free(indexPath);
+
+    //A new, truncated or outdated index is started over; it only ever holds what can be decoded again
+    flock(fd, LOCK_EX);
+    ksp_cache_index header = { 0 };
+    struct stat status;
+    bool valid = fstat(fd, &status) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, indexMagic, sizeof(indexMagic)) == 0 && header.version == KSP_CACHE_VERSION &&
+                 header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+                 (size_t)status.st_size == index_length(header.capacity);
+    if (!valid)
+    {
+        memcpy(header.magic, indexMagic, sizeof(indexMagic));
+        header.version = KSP_CACHE_VERSION;
+        header.capacity = KSP_CACHE_CAPACITY;
+        header.count = 0;
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, index_length(header.capacity)) != 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            fprintf(stderr, "Could not create the decode cache index: %s\n", strerror(errno));
+            flock(fd, LOCK_UN);
+            close(fd);
+            free(pcmDirectory);
+            return false;
+        }
+    }
+    size_t length = index_length(header.capacity);
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    flock(fd, LOCK_UN);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map the decode cache index: %s\n", strerror(errno));
+        close(fd);
+        free(pcmDirectory);
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->index != NULL)
+    {
+        munmap(cache->index, cache->indexLength);
+        close(cache->fd);
+        free(cache->pcmDirectory);
+    }
+    cache->fd = fd;
+    cache->index = map;
+    cache->indexLength = length;
+    cache->pcmDirectory = pcmDirectory;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+void ksp_cache_close(ksp_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    if (cache->index != NULL)
+    {
+        munmap(cache->index, cache->indexLength);
+        close(cache->fd);
+    }
+    free(cache->pcmDirectory);
+    cache->index = NULL;
+    cache->fd = -1;
+    cache->pcmDirectory = NULL;
+    pthread_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+//Finds the slot for a source file: either the one it is in, or the empty one it would go in. The index must be locked.
+static ksp_cache_entry *find_slot(ksp_cache_index *index, uint64_t device, uint64_t inode)
+{
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = slot_of(index, device, inode), n = 0; n < index->capacity; i = (i + 1) & mask, n++)
+    {
+        ksp_cache_entry *entry = &index->entries[i];
+        if (entry->frameCount == 0 || (entry->device == device && entry->inode == inode))
+            return entry;
+    }
+    return NULL;
+}
+
+bool ksp_cache_lookup(ksp_cache *cache, const struct stat *source, ksp_cache_entry *output)
+{
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->index != NULL)
+    {
+        flock(cache->fd, LOCK_SH);
+        ksp_cache_entry *entry = find_slot(cache->index, source->st_dev, source->st_ino);
+        //An entry for an older version of the file is as good as none
+        if (entry != NULL && entry->frameCount > 0 && entry->size == (uint64_t)source->st_size &&
+            entry->mtime == mtime_ns(source))
+        {
+            *output = *entry;
+            found = true;
+        }
+        flock(cache->fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+//Path of the PCM file for a content hash. The caller frees it.
+static char *pcm_path(ksp_cache *cache, uint64_t contentHash)
+{
+    char *path = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->pcmDirectory != NULL &&
+        asprintf(&path, "%s/%016" PRIx64 ".pcm", cache->pcmDirectory, contentHash) < 0)
+        path = NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return path;
+}
+
+uint8_t *ksp_cache_map(ksp_cache *cache, const ksp_cache_entry *entry)
+{
+    char *path = pcm_path(cache, entry->contentHash);
+    if (path == NULL)
+        return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0 || (uint64_t)status.st_size != entry->pcmBytes || entry->pcmBytes == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    //Faulted in up front, like a preloaded wave file
+    void *map = mmap(NULL, entry->pcmBytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+//Writes all of length bytes, retrying short writes
+static bool write_all(int fd, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool ksp_cache_write_file(const char *path, const uint8_t *data, size_t length)
+{
+    char *temporary = NULL;
+    if (asprintf(&temporary, "%s.XXXXXX", path) < 0)
+        return false;
+    int fd = mkostemp(temporary, O_CLOEXEC);
+    bool written = fd >= 0;
+    if (written)
+    {
+        written = write_all(fd, data, length);
+        close(fd);
+        if (written)
+            written = rename(temporary, path) == 0;
+        if (!written)
+        {
+            int error = errno;
+            unlink(temporary);
+            errno = error;
+        }
+    }
+    free(temporary);
+    return written;
+}
+
+char *ksp_cache_peaks_path(ksp_cache *cache, const struct stat *source)
+{
+    //Named after the version of the source file rather than its contents, so finding it doesn't mean reading them
+    uint64_t h = slot_hash(source->st_dev, source->st_ino);
+    h = (h ^ (uint64_t)source->st_size) * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (uint64_t)mtime_ns(source)) * 0xFF51AFD7ED558CCDull;
+    h ^= h >> 32;
+    char *path = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (cache->pcmDirectory != NULL && asprintf(&path, "%s/%016" PRIx64 ".peaks", cache->pcmDirectory, h) < 0)
+        path = NULL;
+    pthread_mutex_unlock(&cache->lock);
+    return path;
+}
+
+//Hashes the contents of a source file. Returns false if it can't be read.
+static bool hash_file(const char *filePath, const struct stat *source, uint64_t *output)
+{
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    void *map = source->st_size > 0 ? mmap(NULL, source->st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, source->st_size, MADV_SEQUENTIAL);
+    *output = hash_bytes(map, source->st_size);
+    munmap(map, source->st_size);
+    return true;
+}
+
+void ksp_cache_store(ksp_cache *cache, const char *filePath, const struct stat *source, const ksp_cache_entry *entry,
+                     const uint8_t *pcm)
+{
+    pthread_mutex_lock(&cache->lock);
+    bool open = cache->index != NULL;
+    pthread_mutex_unlock(&cache->lock);
+    if (!open)
+        return;
+
+    ksp_cache_entry stored = *entry;
+    stored.device = source->st_dev;
+    stored.inode = source->st_ino;
+    stored.size = source->st_size;
+    stored.mtime = mtime_ns(source);
+    if (stored.frameCount == 0 || stored.pcmBytes == 0 || !hash_file(filePath, source, &stored.contentHash))
+        return;
+
+    char *path = pcm_path(cache, stored.contentHash);
+    if (path == NULL)
+        return;
+    struct stat existing;
+    bool written = stat(path, &existing) == 0 && (uint64_t)existing.st_size == stored.pcmBytes;
+    if (!written)
+    {
+        written = ksp_cache_write_file(path, pcm, stored.pcmBytes);
+        if (!written)
+            fprintf(stderr, "Could not cache the decoded audio of %s: %s\n", filePath, strerror(errno));
+    }
+    free(path);
+    if (!written)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->index != NULL)
+    {
+        flock(cache->fd, LOCK_EX);
+        ksp_cache_index *index = cache->index;
+        ksp_cache_entry *slot = find_slot(index, stored.device, stored.inode);
+        //Nothing is ever removed from the table, so instead of filling up it starts over
+        if (slot == NULL || (slot->frameCount == 0 && index->count + 1 > index->capacity / 4 * 3))
+        {
+            memset(index->entries, 0, (size_t)index->capacity * sizeof(ksp_cache_entry));
+            index->count = 0;
+            slot = find_slot(index, stored.device, stored.inode);
+        }
+        if (slot->frameCount == 0)
+            index->count++;
+        *slot = stored;
+        flock(cache->fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
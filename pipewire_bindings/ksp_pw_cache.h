@@ -0,0 +1,80 @@
+#ifndef KSP_PW_CACHE_H
+#define KSP_PW_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+//Slots in a new index. It is cleared when it gets three quarters full.
+#define KSP_CACHE_CAPACITY 4096
+
+#define KSP_CACHE_VERSION 1
+
+//What is known about one decoded source file. Exactly 64 bytes, as it is stored in the index as is.
+typedef struct ksp_cache_entry
+{
+    //Identify the version of the source file that was decoded; it is decoded again once it is replaced or modified
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime; //Nanoseconds
+
+    uint64_t contentHash; //Of the source file's bytes. Names the PCM file, so copies of a sound share one.
+    uint64_t frameCount; //0 for an empty slot
+    uint64_t pcmBytes;
+    uint32_t sampleRate;
+    uint16_t channels;
+    uint8_t sampleFormat; //ksp_sample_format of the cached PCM
+    uint8_t format; //AudioFormat of the source file
+} ksp_cache_entry;
+
+//Layout of the index file, which is mapped shared so that every engine using the directory sees one table
+typedef struct ksp_cache_index
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity; //Power of two
+    uint32_t count;
+    uint32_t reserved;
+    ksp_cache_entry entries[];
+} ksp_cache_index;
+
+/* Decoded PCM of compressed sounds, kept on the disk so a board that has been loaded before only has to map it
+ * back in. The index is an open-addressed hash table keyed by the source file's device and inode. */
+typedef struct ksp_cache
+{
+    pthread_mutex_t lock; //Guards the index between threads; flock() guards it between processes
+    int fd; //Of the index; -1 while no cache is open
+    char *pcmDirectory;
+    ksp_cache_index *index;
+    size_t indexLength;
+} ksp_cache;
+
+void ksp_cache_init(ksp_cache *cache);
+
+//Opens, or creates, the cache in directory. Prints why and returns false if it can't be used.
+bool ksp_cache_open(ksp_cache *cache, const char *directory);
+
+void ksp_cache_close(ksp_cache *cache);
+
+//Finds the entry for the current version of a source file. Returns false if it hasn't been cached.
+bool ksp_cache_lookup(ksp_cache *cache, const struct stat *source, ksp_cache_entry *output);
+
+//Maps a cached sound's PCM. Returns NULL if the PCM file has gone missing or doesn't match its entry.
+uint8_t *ksp_cache_map(ksp_cache *cache, const ksp_cache_entry *entry);
+
+//Writes decoded PCM to the cache and records it under source. Only the layout fields of entry need be filled in.
+void ksp_cache_store(ksp_cache *cache, const char *filePath, const struct stat *source, const ksp_cache_entry *entry,
+                     const uint8_t *pcm);
+
+//Path in the cache of the peak index of the current version of a source file, or NULL if no cache is open. The caller
+//frees it.
+char *ksp_cache_peaks_path(ksp_cache *cache, const struct stat *source);
+
+//Writes a file in the cache under a temporary name and renames it into place, so a reader never maps a partly written
+//file. Returns false, with errno set, if that fails.
+bool ksp_cache_write_file(const char *path, const uint8_t *data, size_t length);
+
+#endif
@@ -0,0 +1,54 @@
+#include "ksp_pw_command_queue.h"
+
+void ksp_command_queue_init(ksp_command_queue *queue)
+{
+    for (size_t i = 0; i < KSP_COMMAND_QUEUE_SIZE; i++)
+        atomic_init(&queue->slots[i].sequence, i);
+    atomic_init(&queue->head, 0);
+    queue->tail = 0;
+}
+
+bool ksp_command_push(ksp_command_queue *queue, const ksp_command *command)
+{
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;)
+    {
+        ksp_command_slot *slot = &queue->slots[position & (KSP_COMMAND_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            //Slot is free for this lap; try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                slot->command = *command;
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return true;
+            }
+            //position now holds the current head; retry with it
+        }
+        else if (difference < 0)
+        {
+            //The audio thread has not consumed this slot from the previous lap yet
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+bool ksp_command_pop(ksp_command_queue *queue, ksp_command *output)
+{
+    ksp_command_slot *slot = &queue->slots[queue->tail & (KSP_COMMAND_QUEUE_SIZE - 1)];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != queue->tail + 1)
+        return false;
+
+    *output = slot->command;
+    atomic_store_explicit(&slot->sequence, queue->tail + KSP_COMMAND_QUEUE_SIZE, memory_order_release);
+    queue->tail++;
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef KSP_PW_COMMAND_QUEUE_H
+#define KSP_PW_COMMAND_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+//Number of commands that can be waiting for the audio thread at once. Must be a power of two.
+#define KSP_COMMAND_QUEUE_SIZE 1024
+
+//Set in a command's time to make the rest of it a number of frames after the start of the cycle the command is read
+//in, rather than a frame of the engine's clock
+#define KSP_TIME_NEXT_CYCLE (1ull << 63)
+
+typedef enum ksp_command_type
+{
+    KSP_COMMAND_SET_VOLUME, //Ramp the voice's volume to value over frames
+    KSP_COMMAND_PAUSE,
+    KSP_COMMAND_RESUME,
+    KSP_COMMAND_STOP,       //Fade the voice out over frames, then finish it
+    KSP_COMMAND_SET_SPEED,  //Play the voice at value times its normal speed from now on
+    KSP_COMMAND_START,      //Start the voice, which its control thread has set up and left LOADING, along with the rest
+                            //of its group; each voice waits out its pre-wait first
+    KSP_COMMAND_EXIT_LOOP,  //Play the rest of the voice's current pass through its loop, then carry on to its end
+    KSP_COMMAND_SET_BUS     //Mix the voice into bus number frames from now on
+} ksp_command_type;
+
+//Fixed-size message from a control thread to the audio thread
+typedef struct ksp_command
+{
+    ksp_command_type type;
+    int32_t voice; //Voice handle; commands for a handle whose slot has since been reused are dropped
+    float value;
+    uint32_t frames;
+    uint64_t at; //Frame of the engine's clock the command takes effect at, or KSP_TIME_NEXT_CYCLE plus an offset.
+                 //Commands for times that have already passed, like 0, take effect as soon as they are read.
+} ksp_command;
+
+typedef struct ksp_command_slot
+{
+    _Atomic size_t sequence;
+    ksp_command command;
+} ksp_command_slot;
+
+//Bounded lock-free queue with any number of producers and a single consumer, the audio thread.
+//Each slot's sequence number tells a producer whether the slot is free and the consumer whether it has been filled.
+typedef struct ksp_command_queue
+{
+    _Atomic size_t head; //Next slot a producer will claim
+    size_t tail; //Next slot the consumer will read; only touched by the audio thread
+    ksp_command_slot slots[KSP_COMMAND_QUEUE_SIZE];
+} ksp_command_queue;
+
+void ksp_command_queue_init(ksp_command_queue *queue);
+
+bool ksp_command_push(ksp_command_queue *queue, const ksp_command *command);
+
+bool ksp_command_pop(ksp_command_queue *queue, ksp_command *output);
+
+#endif
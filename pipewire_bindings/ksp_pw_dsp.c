@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksp_pw_dsp.h"
+
+//Filter state smaller than this is flushed to zero after every block. A filter left ringing on silence decays into
+//denormals, which are far slower to work with than ordinary floats.
+#define KSP_DSP_DENORMAL_LIMIT 1e-15f
+
+_Static_assert(KSP_DSP_FILTERS <= KSP_BIQUAD_MAX_SECTIONS, "every filter has to fit in one pass of the kernels");
+
+static float db_to_gain(float db)
+{
+    return powf(10, db / 20);
+}
+
+static void reset_limiter(ksp_limiter *limiter, uint32_t channels)
+{
+    memset(limiter->delay, 0, (size_t)(limiter->lookahead - 1) * channels * sizeof(float));
+    limiter->minHead = 0;
+    limiter->minCount = 0;
+    limiter->held = 1;
+    for (uint32_t i = 0; i < limiter->lookahead; i++)
+        limiter->window[i] = 1;
+    limiter->windowSum = limiter->lookahead;
+    limiter->windowScale = 1.0 / limiter->lookahead;
+    limiter->windowIndex = 0;
+    limiter->frame = 0;
+}
+
+bool ksp_dsp_init(ksp_dsp *dsp, uint32_t channels, uint32_t sampleRate, uint32_t maxFrames)
+{
+    memset(dsp, 0, sizeof(*dsp));
+    pthread_mutex_init(&dsp->settingsLock, NULL);
+    dsp->channels = channels;
+    dsp->sampleRate = sampleRate;
+    for (int i = 0; i < KSP_DSP_FILTERS; i++)
+    {
+        atomic_init(&dsp->filters[i].type, KSP_FILTER_OFF);
+        atomic_init(&dsp->filters[i].frequency, 1000.0f);
+        atomic_init(&dsp->filters[i].gain, 0.0f);
+        atomic_init(&dsp->filters[i].q, (float)M_SQRT1_2);
+        dsp->sectionOf[i] = -1;
+    }
+    atomic_init(&dsp->ceiling, KSP_LIMITER_DEFAULT_CEILING);
+    atomic_init(&dsp->release, KSP_LIMITER_DEFAULT_RELEASE_MILLISECONDS);
+    dsp->lowestGain = 1;
+
+    ksp_limiter *limiter = &dsp->limiter;
+    limiter->lookahead = KSP_LIMITER_LOOKAHEAD_MILLISECONDS * sampleRate / 1000;
+    if (limiter->lookahead == 0)
+        limiter->lookahead = 1;
+    dsp->state = calloc((size_t)KSP_DSP_FILTERS * 2 * channels, sizeof(float));
+    dsp->spareState = calloc((size_t)KSP_DSP_FILTERS * 2 * channels, sizeof(float));
+    limiter->delay = malloc((size_t)(limiter->lookahead - 1 + maxFrames) * channels * sizeof(float));
+    limiter->peaks = malloc((size_t)maxFrames * sizeof(float));
+    limiter->gains = malloc((size_t)maxFrames * sizeof(float));
+    limiter->minGains = malloc((size_t)limiter->lookahead * sizeof(float));
+    limiter->minFrames = malloc((size_t)limiter->lookahead * sizeof(uint64_t));
+    limiter->window = malloc((size_t)limiter->lookahead * sizeof(float));
+    if (dsp->state == NULL || dsp->spareState == NULL || limiter->delay == NULL || limiter->peaks == NULL ||
+        limiter->gains == NULL || limiter->minGains == NULL || limiter->minFrames == NULL || limiter->window == NULL)
+        return false;
+    reset_limiter(limiter, channels);
+    return true;
+}
+
+void ksp_dsp_destroy(ksp_dsp *dsp)
+{
+    free(dsp->state);
+    free(dsp->spareState);
+    free(dsp->limiter.delay);
+    free(dsp->limiter.peaks);
+    free(dsp->limiter.gains);
+    free(dsp->limiter.minGains);
+    free(dsp->limiter.minFrames);
+    free(dsp->limiter.window);
+    dsp->state = NULL;
+    dsp->spareState = NULL;
+    memset(&dsp->limiter, 0, sizeof(dsp->limiter));
+    pthread_mutex_destroy(&dsp->settingsLock);
+}
+
+static void begin_change(ksp_dsp *dsp)
+{
+    pthread_mutex_lock(&dsp->settingsLock);
+    uint32_t sequence = atomic_load_explicit(&dsp->sequence, memory_order_relaxed);
+    atomic_store_explicit(&dsp->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void end_change(ksp_dsp *dsp)
+{
+    uint32_t sequence = atomic_load_explicit(&dsp->sequence, memory_order_relaxed);
+    atomic_store_explicit(&dsp->sequence, sequence + 1, memory_order_release);
+    pthread_mutex_unlock(&dsp->settingsLock);
+}
+
+void ksp_dsp_set_filter(ksp_dsp *dsp, uint32_t filter, ksp_filter_type type, float frequency, float gain, float q)
+{
+    if (filter >= KSP_DSP_FILTERS || type < KSP_FILTER_OFF || type >= KSP_FILTER_TYPE_COUNT)
+        return;
+    float nyquist = dsp->sampleRate / 2.0f;
+    frequency = frequency < 10 ? 10 : frequency > nyquist * 0.95f ? nyquist * 0.95f : frequency;
+    gain = gain < -48 ? -48 : gain > 48 ? 48 : gain;
+    q = q < 0.1f ? 0.1f : q > 40 ? 40 : q;
+
+    begin_change(dsp);
+    atomic_store_explicit(&dsp->filters[filter].type, type, memory_order_relaxed);
+    atomic_store_explicit(&dsp->filters[filter].frequency, frequency, memory_order_relaxed);
+    atomic_store_explicit(&dsp->filters[filter].gain, gain, memory_order_relaxed);
+    atomic_store_explicit(&dsp->filters[filter].q, q, memory_order_relaxed);
+    end_change(dsp);
+}
+
+void ksp_dsp_set_limiter(ksp_dsp *dsp, bool enabled, float ceiling, float releaseMilliseconds)
+{
+    begin_change(dsp);
+    atomic_store_explicit(&dsp->limiterEnabled, enabled, memory_order_relaxed);
+    atomic_store_explicit(&dsp->ceiling, ceiling > 0 ? 0 : ceiling < -60 ? -60 : ceiling, memory_order_relaxed);
+    atomic_store_explicit(&dsp->release, releaseMilliseconds < 1 ? 1 : releaseMilliseconds, memory_order_relaxed);
+    end_change(dsp);
+}
+
+//Coefficients from Robert Bristow-Johnson's Audio EQ Cookbook
+static ksp_biquad design_filter(ksp_filter_type type, double frequency, double gain, double q, uint32_t sampleRate)
+{
+    double w0 = 2 * M_PI * frequency / sampleRate;
+    double cosW0 = cos(w0);
+    double alpha = sin(w0) / (2 * q);
+    double a = pow(10, gain / 40);
+    double shelf = 2 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    switch (type)
+    {
+        case KSP_FILTER_HIGH_PASS:
+            b0 = (1 + cosW0) / 2;
+            b1 = -(1 + cosW0);
+            b2 = (1 + cosW0) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosW0;
+            a2 = 1 - alpha;
+            break;
+        case KSP_FILTER_LOW_PASS:
+            b0 = (1 - cosW0) / 2;
+            b1 = 1 - cosW0;
+            b2 = (1 - cosW0) / 2;
+            a0 = 1 + alpha;
+            a1 = -2 * cosW0;
+            a2 = 1 - alpha;
+            break;
+        case KSP_FILTER_PEAK:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cosW0;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cosW0;
+            a2 = 1 - alpha / a;
+            break;
+        case KSP_FILTER_LOW_SHELF:
+            b0 = a * ((a + 1) - (a - 1) * cosW0 + shelf);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cosW0);
+            b2 = a * ((a + 1) - (a - 1) * cosW0 - shelf);
+            a0 = (a + 1) + (a - 1) * cosW0 + shelf;
+            a1 = -2 * ((a - 1) + (a + 1) * cosW0);
+            a2 = (a + 1) + (a - 1) * cosW0 - shelf;
+            break;
+        case KSP_FILTER_HIGH_SHELF:
+            b0 = a * ((a + 1) + (a - 1) * cosW0 + shelf);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cosW0);
+            b2 = a * ((a + 1) + (a - 1) * cosW0 - shelf);
+            a0 = (a + 1) - (a - 1) * cosW0 + shelf;
+            a1 = 2 * ((a - 1) - (a + 1) * cosW0);
+            a2 = (a + 1) - (a - 1) * cosW0 - shelf;
+            break;
+        default:
+            return (ksp_biquad){ .b0 = 1 };
+    }
+    return (ksp_biquad){ (float)(b0 / a0), (float)(b1 / a0), (float)(b2 / a0), (float)(a1 / a0), (float)(a2 / a0) };
+}
+
+bool ksp_dsp_update(ksp_dsp *dsp)
+{
+    uint32_t before = atomic_load_explicit(&dsp->sequence, memory_order_acquire);
+    if (before == dsp->applied || (before & 1))
+        return dsp->active;
+
+    //Read into locals first, so settings a control thread was halfway through changing can be thrown away
+    ksp_filter_type types[KSP_DSP_FILTERS];
+    float frequencies[KSP_DSP_FILTERS], gains[KSP_DSP_FILTERS], qs[KSP_DSP_FILTERS];
+    for (int i = 0; i < KSP_DSP_FILTERS; i++)
+    {
+        types[i] = atomic_load_explicit(&dsp->filters[i].type, memory_order_relaxed);
+        frequencies[i] = atomic_load_explicit(&dsp->filters[i].frequency, memory_order_relaxed);
+        gains[i] = atomic_load_explicit(&dsp->filters[i].gain, memory_order_relaxed);
+        qs[i] = atomic_load_explicit(&dsp->filters[i].q, memory_order_relaxed);
+    }
+    bool limiting = atomic_load_explicit(&dsp->limiterEnabled, memory_order_relaxed);
+    float ceiling = atomic_load_explicit(&dsp->ceiling, memory_order_relaxed);
+    float release = atomic_load_explicit(&dsp->release, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    //Changed while it was being read; tried again next block rather than waiting
+    if (atomic_load_explicit(&dsp->sequence, memory_order_relaxed) != before)
+        return dsp->active;
+    dsp->applied = before;
+
+    //The filters that are on are packed into a chain, and their state moved along with them
+    size_t stateSize = (size_t)2 * dsp->channels * sizeof(float);
+    uint32_t sections = 0;
+    for (int i = 0; i < KSP_DSP_FILTERS; i++)
+    {
+        int32_t previous = dsp->sectionOf[i];
+        if (types[i] == KSP_FILTER_OFF)
+        {
+            dsp->sectionOf[i] = -1;
+            continue;
+        }
+        //A filter that is switched to another type starts from silence; one that is only retuned carries on
+        float *state = dsp->spareState + (size_t)sections * 2 * dsp->channels;
+        if (types[i] == dsp->types[i] && previous >= 0)
+            memcpy(state, dsp->state + (size_t)previous * 2 * dsp->channels, stateSize);
+        else
+            memset(state, 0, stateSize);
+        dsp->biquads[sections] = design_filter(types[i], frequencies[i], gains[i], qs[i], dsp->sampleRate);
+        dsp->sectionOf[i] = (int32_t)sections++;
+    }
+    memcpy(dsp->types, types, sizeof(types));
+    float *spare = dsp->state;
+    dsp->state = dsp->spareState;
+    dsp->spareState = spare;
+    dsp->sections = sections;
+    bool active = limiting || sections > 0;
+    if (limiting && !dsp->limiting)
+        reset_limiter(&dsp->limiter, dsp->channels);
+    dsp->limiting = limiting;
+    dsp->limiter.ceilingGain = db_to_gain(ceiling);
+    dsp->limiter.releaseCoefficient = 1 - expf(-1000.0f / (release * dsp->sampleRate));
+    dsp->active = active;
+    return active;
+}
+
+static void limit(ksp_dsp *dsp, const ksp_kernels *kernels, float *buf, uint32_t frames)
+{
+    ksp_limiter *limiter = &dsp->limiter;
+    uint32_t lookahead = limiter->lookahead;
+    kernels->framePeak(buf, frames, dsp->channels, limiter->peaks);
+
+    //Working out each frame's gain depends on the frame before, so this part can't be vectorised
+    float lowest = dsp->lowestGain;
+    float held = limiter->held;
+    for (uint32_t i = 0; i < frames; i++, limiter->frame++)
+    {
+        float peak = limiter->peaks[i];
+        float needed = peak > limiter->ceilingGain ? limiter->ceilingGain / peak : 1;
+
+        if (limiter->minCount > 0 && limiter->minFrames[limiter->minHead] + lookahead <= limiter->frame)
+        {
+            limiter->minHead = limiter->minHead + 1 == lookahead ? 0 : limiter->minHead + 1;
+            limiter->minCount--;
+        }
+        //Frames that needed less turning down than this one can never be the quietest of the lookahead frames again
+        uint32_t back = limiter->minHead + limiter->minCount;
+        for (;;)
+        {
+            if (back >= lookahead)
+                back -= lookahead;
+            if (limiter->minCount == 0)
+                break;
+            uint32_t last = back == 0 ? lookahead - 1 : back - 1;
+            if (limiter->minGains[last] < needed)
+                break;
+            back = last;
+            limiter->minCount--;
+        }
+        limiter->minGains[back] = needed;
+        limiter->minFrames[back] = limiter->frame;
+        limiter->minCount++;
+
+        //Moving towards a lower gain overshoots it, so the lower of the two is the gain needed right away. The release
+        //stops short once its steps are too small for a float, so it finishes the move then.
+        float lowestNeeded = limiter->minGains[limiter->minHead];
+        float released = held + (lowestNeeded - held) * limiter->releaseCoefficient;
+        held = released == held ? lowestNeeded : fminf(released, lowestNeeded);
+
+        limiter->windowSum += held - limiter->window[limiter->windowIndex];
+        limiter->window[limiter->windowIndex] = held;
+        limiter->windowIndex = limiter->windowIndex + 1 == lookahead ? 0 : limiter->windowIndex + 1;
+        float gain = (float)(limiter->windowSum * limiter->windowScale);
+        limiter->gains[i] = gain;
+        if (gain < lowest)
+            lowest = gain;
+    }
+    limiter->held = held;
+    dsp->lowestGain = lowest;
+
+    //The gains line up with the frames lookahead - 1 behind the ones they were worked out for
+    size_t history = (size_t)(lookahead - 1) * dsp->channels;
+    memcpy(limiter->delay + history, buf, (size_t)frames * dsp->channels * sizeof(float));
+    kernels->frameGain(limiter->delay, buf, frames, dsp->channels, limiter->gains);
+    memmove(limiter->delay, limiter->delay + (size_t)frames * dsp->channels, history * sizeof(float));
+}
+
+void ksp_dsp_process(ksp_dsp *dsp, const ksp_kernels *kernels, float *buf, uint32_t frames)
+{
+    if (dsp->sections > 0)
+    {
+        kernels->biquad(buf, frames, dsp->channels, dsp->biquads, dsp->sections, dsp->state);
+        for (size_t i = 0; i < (size_t)dsp->sections * 2 * dsp->channels; i++)
+        {
+            if (fabsf(dsp->state[i]) < KSP_DSP_DENORMAL_LIMIT)
+                dsp->state[i] = 0;
+        }
+    }
+    if (dsp->limiting)
+        limit(dsp, kernels, buf, frames);
+}
+
+float ksp_dsp_publish_reduction(ksp_dsp *dsp)
+{
+    float lowest = dsp->lowestGain;
+    dsp->lowestGain = 1;
+    float reduction = lowest >= 1 ? 0 : lowest <= 0 ? -KSP_DSP_MIN_DB : -20 * log10f(lowest);
+    if (reduction > -KSP_DSP_MIN_DB)
+        reduction = -KSP_DSP_MIN_DB;
+    atomic_store_explicit(&dsp->reduction, reduction, memory_order_relaxed);
+    return reduction;
+}
@@ -0,0 +1,122 @@
+#ifndef KSP_PW_DSP_H
+#define KSP_PW_DSP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "ksp_pw_kernels.h"
+
+//Filters each bus and the master can run, one after another
+#define KSP_DSP_FILTERS 4
+
+//How far the limiter looks ahead, which is also how long it takes to turn the gain down and the latency it adds
+#define KSP_LIMITER_LOOKAHEAD_MILLISECONDS 2
+
+#define KSP_LIMITER_DEFAULT_CEILING -1.0f
+#define KSP_LIMITER_DEFAULT_RELEASE_MILLISECONDS 100.0f
+
+//Gains below this are treated as silence when a reduction is turned into decibels
+#define KSP_DSP_MIN_DB -120.0f
+
+typedef enum ksp_filter_type
+{
+    KSP_FILTER_OFF,
+    KSP_FILTER_HIGH_PASS,
+    KSP_FILTER_LOW_PASS,
+    KSP_FILTER_PEAK,
+    KSP_FILTER_LOW_SHELF,
+    KSP_FILTER_HIGH_SHELF,
+    KSP_FILTER_TYPE_COUNT
+} ksp_filter_type;
+
+//One filter as control threads set it up
+typedef struct ksp_filter_settings
+{
+    _Atomic int32_t type; //A ksp_filter_type
+    _Atomic float frequency; //Cutoff or centre, in Hz
+    _Atomic float gain; //Boost or cut in dB, for peak and shelf filters
+    _Atomic float q;
+} ksp_filter_settings;
+
+/* Look-ahead brickwall limiter. The input is delayed by lookahead - 1 frames, and the gain each delayed frame gets is
+ * the average, over lookahead frames, of the lowest gain any frame in the lookahead frames before it needed. Each of
+ * those is no more than the delayed frame itself needed, so no frame ever comes out above the ceiling, and the gain
+ * moves smoothly down to where it has to be by the time the frame that needs it arrives. */
+typedef struct ksp_limiter
+{
+    uint32_t lookahead;
+    float ceilingGain;
+    float releaseCoefficient; //Share of the way back up the gain moves each frame
+    float *delay; //lookahead - 1 frames of history, followed by the block being limited
+    float *peaks; //Largest magnitude of each frame of the block
+    float *gains; //Gain applied to each frame of the block
+    //Frames that could still be the quietest of the lookahead frames, oldest first: a ring of lookahead entries,
+    //in which each gain is lower than the one before it
+    float *minGains;
+    uint64_t *minFrames;
+    uint32_t minHead;
+    uint32_t minCount;
+    float held; //Lowest gain needed over the last lookahead frames, with the release applied
+    float *window; //The last lookahead values of held, which the gain is the average of
+    double windowSum;
+    double windowScale; //1 / lookahead
+    uint32_t windowIndex;
+    uint64_t frame;
+} ksp_limiter;
+
+/* The filters and limiter a bus or the master runs its audio through. Control threads change the settings whenever
+ * they like, and the audio thread picks them up at the start of the next block; it never waits for a control thread,
+ * and nothing it uses is allocated after ksp_dsp_init. */
+typedef struct ksp_dsp
+{
+    //Settings, written behind a sequence count that is odd while they are being changed
+    pthread_mutex_t settingsLock; //Serialises control threads; never taken by the audio thread
+    _Atomic uint32_t sequence;
+    ksp_filter_settings filters[KSP_DSP_FILTERS];
+    _Atomic bool limiterEnabled;
+    _Atomic float ceiling; //dBFS
+    _Atomic float release; //Milliseconds for the gain to get most of the way back up after a peak
+    //Most the limiter turned the audio down by in the last cycle, in dB; set by the audio thread
+    _Atomic float reduction;
+
+    uint32_t channels;
+    uint32_t sampleRate;
+
+    //Only touched by the audio thread
+    uint32_t applied; //Sequence count of the settings below
+    bool active; //Some filter or the limiter is on
+    ksp_filter_type types[KSP_DSP_FILTERS];
+    int32_t sectionOf[KSP_DSP_FILTERS]; //Where each filter is in the chain, or -1 if it is off
+    ksp_biquad biquads[KSP_DSP_FILTERS]; //The filters that are on, in order
+    uint32_t sections;
+    float *state; //2 * channels floats for each filter in the chain
+    float *spareState; //Where the state is moved to when filters are switched on or off
+    bool limiting;
+    ksp_limiter limiter;
+    float lowestGain; //Lowest gain the limiter has applied since the reduction was last published
+} ksp_dsp;
+
+//Allocates everything the audio thread will need for blocks of up to maxFrames. Everything starts off.
+bool ksp_dsp_init(ksp_dsp *dsp, uint32_t channels, uint32_t sampleRate, uint32_t maxFrames);
+
+void ksp_dsp_destroy(ksp_dsp *dsp);
+
+//Sets up one of the filters; KSP_FILTER_OFF takes it out. Frequencies are kept below Nyquist.
+void ksp_dsp_set_filter(ksp_dsp *dsp, uint32_t filter, ksp_filter_type type, float frequency, float gain, float q);
+
+//Turns the limiter on or off, with the ceiling in dBFS that nothing gets past, and its release in milliseconds
+void ksp_dsp_set_limiter(ksp_dsp *dsp, bool enabled, float ceiling, float releaseMilliseconds);
+
+//Picks up changed settings at the start of a block. Returns whether there is anything to run. Runs on the audio thread.
+bool ksp_dsp_update(ksp_dsp *dsp);
+
+//Runs a block of interleaved frames through the filters and then the limiter, in place. Runs on the audio thread.
+void ksp_dsp_process(ksp_dsp *dsp, const ksp_kernels *kernels, float *buf, uint32_t frames);
+
+//Publishes how far the limiter has turned the audio down since the last call, and returns it in dB as a positive
+//number. Runs on the audio thread, once a cycle.
+float ksp_dsp_publish_reduction(ksp_dsp *dsp);
+
+#endif
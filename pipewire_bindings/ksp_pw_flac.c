@@ -0,0 +1,154 @@
+#include <FLAC/stream_decoder.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksp_pw_flac.h"
+
+typedef struct ksp_flac
+{
+    FLAC__StreamDecoder *decoder;
+    ksp_stream_info info; //Filled in from the STREAMINFO block
+
+    //libFLAC hands over a whole block at a time, which may not fit in the ring, so it is kept here until it does
+    int32_t *block;
+    uint32_t blockCapacity; //In frames
+    uint32_t blockFrames;
+    uint32_t blockOffset;
+} ksp_flac;
+
+static FLAC__StreamDecoderWriteStatus write_block(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+                                                  const FLAC__int32 *const buffer[], void *client_data)
+{
+    ksp_flac *flac = client_data;
+    uint32_t frames = frame->header.blocksize;
+    uint32_t channels = flac->info.channels;
+    if (frame->header.channels != channels)
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+    if (frames > flac->blockCapacity)
+    {
+        int32_t *block = realloc(flac->block, (size_t)frames * channels * sizeof(int32_t));
+        if (block == NULL)
+            return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+        flac->block = block;
+        flac->blockCapacity = frames;
+    }
+
+    //Interleave, and shift up so every bit depth fills the whole 32 bits
+    uint32_t shift = 32 - frame->header.bits_per_sample;
+    int32_t *dst = flac->block;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        for (uint32_t c = 0; c < channels; c++)
+            *dst++ = (int32_t)((uint32_t)buffer[c][i] << shift);
+    }
+    flac->blockFrames = frames;
+    flac->blockOffset = 0;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void read_metadata(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *metadata, void *client_data)
+{
+    ksp_flac *flac = client_data;
+    if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO)
+        return;
+    flac->info.channels = metadata->data.stream_info.channels;
+    flac->info.sampleRate = metadata->data.stream_info.sample_rate;
+    flac->info.frameCount = metadata->data.stream_info.total_samples;
+}
+
+static void report_error(const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *client_data)
+{
+    fprintf(stderr, "FLAC decoder error: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+static void flac_close(void *decoder)
+{
+    ksp_flac *flac = decoder;
+    if (flac == NULL)
+        return;
+    if (flac->decoder != NULL)
+    {
+        FLAC__stream_decoder_finish(flac->decoder);
+        FLAC__stream_decoder_delete(flac->decoder);
+    }
+    free(flac->block);
+    free(flac);
+}
+
+static void *flac_open(const char *filePath, ksp_stream_info *info)
+{
+    ksp_flac *flac = calloc(1, sizeof(ksp_flac));
+    if (flac == NULL)
+        return NULL;
+    flac->info.sampleFormat = KSP_SAMPLE_S32;
+
+    flac->decoder = FLAC__stream_decoder_new();
+    if (flac->decoder == NULL)
+    {
+        flac_close(flac);
+        return NULL;
+    }
+
+    FLAC__StreamDecoderInitStatus status =
+        FLAC__stream_decoder_init_file(flac->decoder, filePath, write_block, read_metadata, report_error, flac);
+    if (status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
+    {
+        fprintf(stderr, "%s: could not open FLAC stream: %s\n", filePath, FLAC__StreamDecoderInitStatusString[status]);
+        flac_close(flac);
+        return NULL;
+    }
+    if (!FLAC__stream_decoder_process_until_end_of_metadata(flac->decoder) || flac->info.channels == 0 ||
+        flac->info.sampleRate == 0)
+    {
+        fprintf(stderr, "%s: could not read FLAC stream info\n", filePath);
+        flac_close(flac);
+        return NULL;
+    }
+
+    *info = flac->info;
+    return flac;
+}
+
+static uint32_t flac_read(void *decoder, uint8_t *dst, uint32_t frames)
+{
+    ksp_flac *flac = decoder;
+    size_t bytesPerFrame = (size_t)flac->info.channels * sizeof(int32_t);
+    uint32_t total = 0;
+
+    while (total < frames)
+    {
+        if (flac->blockOffset == flac->blockFrames)
+        {
+            flac->blockFrames = 0;
+            flac->blockOffset = 0;
+            if (FLAC__stream_decoder_get_state(flac->decoder) == FLAC__STREAM_DECODER_END_OF_STREAM ||
+                !FLAC__stream_decoder_process_single(flac->decoder))
+                break;
+            //process_single can return without a block, at the end of the stream or after a metadata block
+            if (flac->blockFrames == 0)
+            {
+                if (FLAC__stream_decoder_get_state(flac->decoder) >= FLAC__STREAM_DECODER_END_OF_STREAM)
+                    break;
+                continue;
+            }
+        }
+
+        uint32_t count = flac->blockFrames - flac->blockOffset;
+        if (count > frames - total)
+            count = frames - total;
+        memcpy(dst + total * bytesPerFrame, flac->block + (size_t)flac->blockOffset * flac->info.channels,
+               count * bytesPerFrame);
+        flac->blockOffset += count;
+        total += count;
+    }
+    return total;
+}
+
+const ksp_decoder_ops ksp_flac_decoder = {
+    .name = "FLAC",
+    .open = flac_open,
+    .read = flac_read,
+    .close = flac_close,
+};
@@ -0,0 +1,9 @@
+#ifndef KSP_PW_FLAC_H
+#define KSP_PW_FLAC_H
+
+#include "ksp_pw_stream.h"
+
+//Streams FLAC files through libFLAC as interleaved, left-justified 32-bit samples
+extern const ksp_decoder_ops ksp_flac_decoder;
+
+#endif
@@ -0,0 +1,886 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ksp_pw_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KSP_KERNELS_X86
+#endif
+
+/* Sample conversion, gain, mix and filter kernels used by the process path.
+ *
+ * Every kernel has a scalar version; on x86 there are SSE2 and AVX2 versions as well, and
+ * ksp_kernels_get picks the best one the CPU supports at runtime. Callers work out how many
+ * frames are available before calling a kernel, so none of them check for the end of the data. */
+
+static inline float load_u8(const uint8_t *src, size_t i)
+{
+    //8-bit wave data is unsigned
+    return ((int)src[i] - 128) * (1.0f / 128);
+}
+
+static inline float load_s16(const uint8_t *src, size_t i)
+{
+    int16_t val;
+    memcpy(&val, src + i * 2, 2);
+    return val * (1.0f / 32768);
+}
+
+static inline float load_s24(const uint8_t *src, size_t i)
+{
+    //Assemble the three bytes at the top of an int32 and shift back down to sign extend
+    const uint8_t *p = src + i * 3;
+    int32_t val = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8;
+    return val * (1.0f / 8388608);
+}
+
+static inline float load_s32(const uint8_t *src, size_t i)
+{
+    int32_t val;
+    memcpy(&val, src + i * 4, 4);
+    return val * (1.0f / 2147483648.0f);
+}
+
+static inline float load_f32(const uint8_t *src, size_t i)
+{
+    float val;
+    memcpy(&val, src + i * 4, 4);
+    return val;
+}
+
+static inline float load_f64(const uint8_t *src, size_t i)
+{
+    double val;
+    memcpy(&val, src + i * 8, 8);
+    return (float)val;
+}
+
+#define KSP_SCALAR_KERNELS(fmt)                                                                                        \
+    static void convert_##fmt##_scalar(const uint8_t *src, float *dst, uint32_t samples)                              \
+    {                                                                                                                  \
+        for (uint32_t i = 0; i < samples; i++)                                                                         \
+            dst[i] = load_##fmt(src, i);                                                                               \
+    }                                                                                                                  \
+    static void mix_##fmt##_scalar(const uint8_t *src, float *mix, uint32_t frames, uint32_t channels, float gain,    \
+                                   float gainStep)                                                                     \
+    {                                                                                                                  \
+        size_t s = 0;                                                                                                  \
+        for (uint32_t i = 0; i < frames; i++)                                                                          \
+        {                                                                                                              \
+            float g = gain + i * gainStep;                                                                             \
+            for (uint32_t c = 0; c < channels; c++, s++)                                                               \
+                mix[s] += load_##fmt(src, s) * g;                                                                      \
+        }                                                                                                              \
+    }
+
+KSP_SCALAR_KERNELS(u8)
+KSP_SCALAR_KERNELS(s16)
+KSP_SCALAR_KERNELS(s24)
+KSP_SCALAR_KERNELS(s32)
+KSP_SCALAR_KERNELS(f32)
+KSP_SCALAR_KERNELS(f64)
+
+static float fir_scalar(const float *src, const float *a, const float *b, float frac, uint32_t taps)
+{
+    float sum = 0;
+    for (uint32_t k = 0; k < taps; k++)
+        sum += src[k] * (a[k] + (b[k] - a[k]) * frac);
+    return sum;
+}
+
+static void peak_scalar(const float *src, uint32_t frames, uint32_t channels, float *min, float *max,
+                        float *sumSquares)
+{
+    size_t s = 0;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        for (uint32_t c = 0; c < channels; c++, s++)
+        {
+            float val = src[s];
+            if (val < min[c])
+                min[c] = val;
+            if (val > max[c])
+                max[c] = val;
+            sumSquares[c] += val * val;
+        }
+    }
+}
+
+/* Runs channel c of the frames through every section. Each frame goes through the whole chain before the next, so
+ * the sections' dependency chains overlap rather than following one another. The vector kernels use this for
+ * channels left over. */
+static void biquad_channel(float *buf, uint32_t frames, uint32_t channels, uint32_t c, const ksp_biquad *biquads,
+                           uint32_t sections, float *state)
+{
+    float s1[KSP_BIQUAD_MAX_SECTIONS], s2[KSP_BIQUAD_MAX_SECTIONS];
+    for (uint32_t k = 0; k < sections; k++)
+    {
+        s1[k] = state[k * 2 * channels + c];
+        s2[k] = state[k * 2 * channels + channels + c];
+    }
+    size_t s = c;
+    for (uint32_t i = 0; i < frames; i++, s += channels)
+    {
+        float x = buf[s];
+        for (uint32_t k = 0; k < sections; k++)
+        {
+            const ksp_biquad *biquad = &biquads[k];
+            float y = biquad->b0 * x + s1[k];
+            s1[k] = (biquad->b1 * x + s2[k]) - biquad->a1 * y;
+            s2[k] = biquad->b2 * x - biquad->a2 * y;
+            x = y;
+        }
+        buf[s] = x;
+    }
+    for (uint32_t k = 0; k < sections; k++)
+    {
+        state[k * 2 * channels + c] = s1[k];
+        state[k * 2 * channels + channels + c] = s2[k];
+    }
+}
+
+static void biquad_scalar(float *buf, uint32_t frames, uint32_t channels, const ksp_biquad *biquads,
+                          uint32_t sections, float *state)
+{
+    for (uint32_t c = 0; c < channels; c++)
+        biquad_channel(buf, frames, channels, c, biquads, sections, state);
+}
+
+static void frame_peak_scalar(const float *src, uint32_t frames, uint32_t channels, float *peaks)
+{
+    size_t s = 0;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        float peak = 0;
+        for (uint32_t c = 0; c < channels; c++, s++)
+        {
+            float val = fabsf(src[s]);
+            if (val > peak)
+                peak = val;
+        }
+        peaks[i] = peak;
+    }
+}
+
+static void frame_gain_scalar(const float *src, float *dst, uint32_t frames, uint32_t channels, const float *gains)
+{
+    size_t s = 0;
+    for (uint32_t i = 0; i < frames; i++)
+    {
+        for (uint32_t c = 0; c < channels; c++, s++)
+            dst[s] = src[s] * gains[i];
+    }
+}
+
+static void correlate_scalar(const float *src, const float *ref, uint32_t length, uint32_t offsets, float *dots)
+{
+    for (uint32_t i = 0; i < offsets; i++)
+    {
+        float sum = 0;
+        for (uint32_t k = 0; k < length; k++)
+            sum += ref[k] * src[i + k];
+        dots[i] = sum;
+    }
+}
+
+static const ksp_kernels scalarKernels = {
+    .name = "scalar",
+    .convert = { convert_u8_scalar, convert_s16_scalar, convert_s24_scalar, convert_s32_scalar, convert_f32_scalar,
+                 convert_f64_scalar },
+    .mix = { mix_u8_scalar, mix_s16_scalar, mix_s24_scalar, mix_s32_scalar, mix_f32_scalar, mix_f64_scalar },
+    .fir = fir_scalar,
+    .peak = peak_scalar,
+    .biquad = biquad_scalar,
+    .framePeak = frame_peak_scalar,
+    .frameGain = frame_gain_scalar,
+    .correlate = correlate_scalar,
+};
+
+/* The vector mix kernels apply a per-frame gain to interleaved data. A vector of L lanes covers L / channels
+ * frames, so the frame each lane belongs to repeats in a pattern that is `channels` vectors long, after which
+ * exactly L frames have gone by. ramp_offsets fills in that pattern, already multiplied by the gain step. */
+static void ramp_offsets(float *offsets, uint32_t lanes, uint32_t channels, float gainStep)
+{
+    for (uint32_t p = 0; p < channels; p++)
+    {
+        for (uint32_t k = 0; k < lanes; k++)
+            offsets[p * lanes + k] = (float)((p * lanes + k) / channels) * gainStep;
+    }
+}
+
+#ifdef KSP_KERNELS_X86
+
+//Vector mix kernels handle up to this many channels; wider layouts use the scalar loop
+#define KSP_VECTOR_MAX_CHANNELS 8
+
+/* The vector peak kernels need every vector to start on the same channel, so they handle the channel counts that
+ * divide the number of lanes. Lane k then always holds channel k % channels, and the lanes are only folded together
+ * by channel at the end. Other layouts use the scalar loop. */
+static void fold_peaks(const float *laneMin, const float *laneMax, const float *laneSum, uint32_t lanes,
+                       uint32_t channels, float *min, float *max, float *sumSquares)
+{
+    for (uint32_t k = 0; k < lanes; k++)
+    {
+        uint32_t c = k % channels;
+        if (laneMin[k] < min[c])
+            min[c] = laneMin[k];
+        if (laneMax[k] > max[c])
+            max[c] = laneMax[k];
+        sumSquares[c] += laneSum[k];
+    }
+}
+
+/* SSE2 */
+
+__attribute__((target("sse2"))) static inline __m128 load4_u8_sse2(const uint8_t *src, size_t i)
+{
+    int32_t bytes;
+    memcpy(&bytes, src + i, 4);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+    v = _mm_sub_epi32(v, _mm_set1_epi32(128));
+    return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 128));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load4_s16_sse2(const uint8_t *src, size_t i)
+{
+    __m128i v = _mm_loadl_epi64((const __m128i *)(src + i * 2));
+    v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 32768));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load4_s24_sse2(const uint8_t *src, size_t i)
+{
+    //SSE2 has no byte shuffle, so the packed samples are widened in scalar code
+    const uint8_t *p = src + i * 3;
+    __m128i v = _mm_setr_epi32((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24),
+                               (int32_t)((uint32_t)p[3] << 8 | (uint32_t)p[4] << 16 | (uint32_t)p[5] << 24),
+                               (int32_t)((uint32_t)p[6] << 8 | (uint32_t)p[7] << 16 | (uint32_t)p[8] << 24),
+                               (int32_t)((uint32_t)p[9] << 8 | (uint32_t)p[10] << 16 | (uint32_t)p[11] << 24));
+    v = _mm_srai_epi32(v, 8);
+    return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 8388608));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load4_s32_sse2(const uint8_t *src, size_t i)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.0f / 2147483648.0f));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load4_f32_sse2(const uint8_t *src, size_t i)
+{
+    return _mm_loadu_ps((const float *)(src + i * 4));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load4_f64_sse2(const uint8_t *src, size_t i)
+{
+    const double *p = (const double *)(src + i * 8);
+    return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+}
+
+#define KSP_SSE2_KERNELS(fmt)                                                                                          \
+    __attribute__((target("sse2"))) static void convert_##fmt##_sse2(const uint8_t *src, float *dst, uint32_t samples) \
+    {                                                                                                                  \
+        size_t i = 0;                                                                                                  \
+        for (; i + 4 <= samples; i += 4)                                                                               \
+            _mm_storeu_ps(dst + i, load4_##fmt##_sse2(src, i));                                                        \
+        for (; i < samples; i++)                                                                                       \
+            dst[i] = load_##fmt(src, i);                                                                               \
+    }                                                                                                                  \
+    __attribute__((target("sse2"))) static void mix_##fmt##_sse2(const uint8_t *src, float *mix, uint32_t frames,     \
+                                                                 uint32_t channels, float gain, float gainStep)        \
+    {                                                                                                                  \
+        size_t samples = (size_t)frames * channels;                                                                    \
+        size_t s = 0;                                                                                                  \
+        if (channels <= KSP_VECTOR_MAX_CHANNELS)                                                                       \
+        {                                                                                                              \
+            float offsets[KSP_VECTOR_MAX_CHANNELS * 4];                                                                \
+            ramp_offsets(offsets, 4, channels, gainStep);                                                              \
+            __m128 base = _mm_set1_ps(gain);                                                                           \
+            __m128 advance = _mm_set1_ps(4 * gainStep);                                                                \
+            uint32_t phase = 0;                                                                                        \
+            for (; s + 4 <= samples; s += 4)                                                                           \
+            {                                                                                                          \
+                __m128 g = _mm_add_ps(base, _mm_loadu_ps(offsets + phase * 4));                                        \
+                __m128 v = _mm_mul_ps(load4_##fmt##_sse2(src, s), g);                                                  \
+                _mm_storeu_ps(mix + s, _mm_add_ps(_mm_loadu_ps(mix + s), v));                                          \
+                if (++phase == channels)                                                                               \
+                {                                                                                                      \
+                    phase = 0;                                                                                         \
+                    base = _mm_add_ps(base, advance);                                                                  \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; s < samples; s++)                                                                                       \
+            mix[s] += load_##fmt(src, s) * (gain + (float)(s / channels) * gainStep);                                  \
+    }
+
+KSP_SSE2_KERNELS(u8)
+KSP_SSE2_KERNELS(s16)
+KSP_SSE2_KERNELS(s24)
+KSP_SSE2_KERNELS(s32)
+KSP_SSE2_KERNELS(f32)
+KSP_SSE2_KERNELS(f64)
+
+__attribute__((target("sse2"))) static float fir_sse2(const float *src, const float *a, const float *b, float frac,
+                                                      uint32_t taps)
+{
+    __m128 f = _mm_set1_ps(frac);
+    __m128 sum = _mm_setzero_ps();
+    for (uint32_t k = 0; k < taps; k += 4)
+    {
+        __m128 va = _mm_loadu_ps(a + k);
+        __m128 coefficients = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + k), va), f));
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(src + k), coefficients));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("sse2"))) static void peak_sse2(const float *src, uint32_t frames, uint32_t channels,
+                                                      float *min, float *max, float *sumSquares)
+{
+    if (4 % channels != 0)
+    {
+        peak_scalar(src, frames, channels, min, max, sumSquares);
+        return;
+    }
+    size_t samples = (size_t)frames * channels;
+    __m128 vmin = _mm_set1_ps(INFINITY);
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    __m128 vsum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(src + i);
+        vmin = _mm_min_ps(vmin, v);
+        vmax = _mm_max_ps(vmax, v);
+        vsum = _mm_add_ps(vsum, _mm_mul_ps(v, v));
+    }
+    float laneMin[4], laneMax[4], laneSum[4];
+    _mm_storeu_ps(laneMin, vmin);
+    _mm_storeu_ps(laneMax, vmax);
+    _mm_storeu_ps(laneSum, vsum);
+    fold_peaks(laneMin, laneMax, laneSum, 4, channels, min, max, sumSquares);
+    //What is left is less than a vector of whole frames
+    peak_scalar(src + i, (uint32_t)((samples - i) / channels), channels, min, max, sumSquares);
+}
+
+/* The filters and the limiter's kernels work across channels: the biquad kernels run a vector of channels through
+ * every frame, since each sample depends on the ones before it on its own channel, and the per-frame kernels cover
+ * as many whole frames as fit in a vector. Stereo, mono and multiples of the vector's width are handled that way;
+ * other layouts use the scalar loop for whatever doesn't fit. */
+
+__attribute__((target("sse2"))) static inline __m128 abs_sse2(__m128 v)
+{
+    return _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+}
+
+__attribute__((target("sse2"))) static inline __m128 load2_sse2(const float *src)
+{
+    return _mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)src));
+}
+
+__attribute__((target("sse2"))) static inline void store2_sse2(float *dst, __m128 v)
+{
+    _mm_storel_epi64((__m128i *)dst, _mm_castps_si128(v));
+}
+
+//Runs a vector of channels of one frame through every section
+__attribute__((target("sse2"))) static inline __m128 biquad_step_sse2(const __m128 (*k)[5], uint32_t sections,
+                                                                       __m128 x, __m128 *s1, __m128 *s2)
+{
+    for (uint32_t j = 0; j < sections; j++)
+    {
+        __m128 y = _mm_add_ps(_mm_mul_ps(k[j][0], x), s1[j]);
+        s1[j] = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(k[j][1], x), s2[j]), _mm_mul_ps(k[j][3], y));
+        s2[j] = _mm_sub_ps(_mm_mul_ps(k[j][2], x), _mm_mul_ps(k[j][4], y));
+        x = y;
+    }
+    return x;
+}
+
+//Filters channels c onwards, four at a time and then a pair at a time
+__attribute__((target("sse2"))) static void biquad_from_sse2(float *buf, uint32_t frames, uint32_t channels,
+                                                             uint32_t c, const ksp_biquad *biquads, uint32_t sections,
+                                                             float *state)
+{
+    __m128 k[KSP_BIQUAD_MAX_SECTIONS][5];
+    __m128 s1[KSP_BIQUAD_MAX_SECTIONS], s2[KSP_BIQUAD_MAX_SECTIONS];
+    for (uint32_t j = 0; j < sections; j++)
+    {
+        k[j][0] = _mm_set1_ps(biquads[j].b0);
+        k[j][1] = _mm_set1_ps(biquads[j].b1);
+        k[j][2] = _mm_set1_ps(biquads[j].b2);
+        k[j][3] = _mm_set1_ps(biquads[j].a1);
+        k[j][4] = _mm_set1_ps(biquads[j].a2);
+    }
+    for (; c + 4 <= channels; c += 4)
+    {
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            s1[j] = _mm_loadu_ps(state + j * 2 * channels + c);
+            s2[j] = _mm_loadu_ps(state + j * 2 * channels + channels + c);
+        }
+        float *p = buf + c;
+        for (uint32_t i = 0; i < frames; i++, p += channels)
+            _mm_storeu_ps(p, biquad_step_sse2(k, sections, _mm_loadu_ps(p), s1, s2));
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            _mm_storeu_ps(state + j * 2 * channels + c, s1[j]);
+            _mm_storeu_ps(state + j * 2 * channels + channels + c, s2[j]);
+        }
+    }
+    for (; c + 2 <= channels; c += 2)
+    {
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            s1[j] = load2_sse2(state + j * 2 * channels + c);
+            s2[j] = load2_sse2(state + j * 2 * channels + channels + c);
+        }
+        float *p = buf + c;
+        for (uint32_t i = 0; i < frames; i++, p += channels)
+            store2_sse2(p, biquad_step_sse2(k, sections, load2_sse2(p), s1, s2));
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            store2_sse2(state + j * 2 * channels + c, s1[j]);
+            store2_sse2(state + j * 2 * channels + channels + c, s2[j]);
+        }
+    }
+    for (; c < channels; c++)
+        biquad_channel(buf, frames, channels, c, biquads, sections, state);
+}
+
+__attribute__((target("sse2"))) static void biquad_sse2(float *buf, uint32_t frames, uint32_t channels,
+                                                        const ksp_biquad *biquads, uint32_t sections, float *state)
+{
+    biquad_from_sse2(buf, frames, channels, 0, biquads, sections, state);
+}
+
+__attribute__((target("sse2"))) static void frame_peak_sse2(const float *src, uint32_t frames, uint32_t channels,
+                                                            float *peaks)
+{
+    uint32_t i = 0;
+    if (channels == 1)
+    {
+        for (; i + 4 <= frames; i += 4)
+            _mm_storeu_ps(peaks + i, abs_sse2(_mm_loadu_ps(src + i)));
+    }
+    else if (channels == 2)
+    {
+        for (; i + 2 <= frames; i += 2)
+        {
+            __m128 v = abs_sse2(_mm_loadu_ps(src + (size_t)i * 2));
+            v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+            store2_sse2(peaks + i, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 2, 0)));
+        }
+    }
+    else if (channels % 4 == 0)
+    {
+        for (; i < frames; i++)
+        {
+            const float *p = src + (size_t)i * channels;
+            __m128 v = abs_sse2(_mm_loadu_ps(p));
+            for (uint32_t c = 4; c < channels; c += 4)
+                v = _mm_max_ps(v, abs_sse2(_mm_loadu_ps(p + c)));
+            v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+            v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+            peaks[i] = _mm_cvtss_f32(v);
+        }
+    }
+    frame_peak_scalar(src + (size_t)i * channels, frames - i, channels, peaks + i);
+}
+
+__attribute__((target("sse2"))) static void frame_gain_sse2(const float *src, float *dst, uint32_t frames,
+                                                            uint32_t channels, const float *gains)
+{
+    uint32_t i = 0;
+    if (channels == 1)
+    {
+        for (; i + 4 <= frames; i += 4)
+            _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), _mm_loadu_ps(gains + i)));
+    }
+    else if (channels == 2)
+    {
+        for (; i + 2 <= frames; i += 2)
+        {
+            __m128 g = load2_sse2(gains + i);
+            g = _mm_unpacklo_ps(g, g);
+            _mm_storeu_ps(dst + (size_t)i * 2, _mm_mul_ps(_mm_loadu_ps(src + (size_t)i * 2), g));
+        }
+    }
+    else if (channels % 4 == 0)
+    {
+        for (; i < frames; i++)
+        {
+            __m128 g = _mm_set1_ps(gains[i]);
+            size_t s = (size_t)i * channels;
+            for (uint32_t c = 0; c < channels; c += 4)
+                _mm_storeu_ps(dst + s + c, _mm_mul_ps(_mm_loadu_ps(src + s + c), g));
+        }
+    }
+    frame_gain_scalar(src + (size_t)i * channels, dst + (size_t)i * channels, frames - i, channels, gains + i);
+}
+
+//Four offsets at a time, so each load of ref is shared between them
+__attribute__((target("sse2"))) static void correlate_sse2(const float *src, const float *ref, uint32_t length,
+                                                           uint32_t offsets, float *dots)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= offsets; i += 4)
+    {
+        const float *s = src + i;
+        __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps(), sum2 = _mm_setzero_ps(), sum3 = _mm_setzero_ps();
+        for (uint32_t k = 0; k < length; k += 4)
+        {
+            __m128 r = _mm_loadu_ps(ref + k);
+            sum0 = _mm_add_ps(sum0, _mm_mul_ps(r, _mm_loadu_ps(s + k)));
+            sum1 = _mm_add_ps(sum1, _mm_mul_ps(r, _mm_loadu_ps(s + k + 1)));
+            sum2 = _mm_add_ps(sum2, _mm_mul_ps(r, _mm_loadu_ps(s + k + 2)));
+            sum3 = _mm_add_ps(sum3, _mm_mul_ps(r, _mm_loadu_ps(s + k + 3)));
+        }
+        //Transposed, each vector holds one lane of every sum, so adding them up gives the four totals in order
+        _MM_TRANSPOSE4_PS(sum0, sum1, sum2, sum3);
+        _mm_storeu_ps(dots + i, _mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3)));
+    }
+    correlate_scalar(src + i, ref, length, offsets - i, dots + i);
+}
+
+static const ksp_kernels sse2Kernels = {
+    .name = "sse2",
+    .convert = { convert_u8_sse2, convert_s16_sse2, convert_s24_sse2, convert_s32_sse2, convert_f32_sse2,
+                 convert_f64_sse2 },
+    .mix = { mix_u8_sse2, mix_s16_sse2, mix_s24_sse2, mix_s32_sse2, mix_f32_sse2, mix_f64_sse2 },
+    .fir = fir_sse2,
+    .peak = peak_sse2,
+    .biquad = biquad_sse2,
+    .framePeak = frame_peak_sse2,
+    .frameGain = frame_gain_sse2,
+    .correlate = correlate_sse2,
+};
+
+/* AVX2 */
+
+__attribute__((target("avx2"))) static inline __m256 load8_u8_avx2(const uint8_t *src, size_t i)
+{
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+    v = _mm256_sub_epi32(v, _mm256_set1_epi32(128));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.0f / 128));
+}
+
+__attribute__((target("avx2"))) static inline __m256 load8_s16_avx2(const uint8_t *src, size_t i)
+{
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i * 2)));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.0f / 32768));
+}
+
+/* Eight packed 24-bit samples span 24 bytes. The load reads 32, so callers must leave KSP_S24_OVERREAD
+ * samples of slack after the last vector. Dwords 3-6 are moved into the upper lane so that both 128-bit
+ * lanes start at the first byte of their four samples; the same byte shuffle in each lane then places every
+ * sample in the top three bytes of its own dword, ready to be sign extended by the arithmetic shift. */
+#define KSP_S24_OVERREAD 3
+
+__attribute__((target("avx2"))) static inline __m256 load8_s24_avx2(const uint8_t *src, size_t i)
+{
+    __m256i raw = _mm256_loadu_si256((const __m256i *)(src + i * 3));
+    raw = _mm256_permutevar8x32_epi32(raw, _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6));
+    const __m256i shuffle = _mm256_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                                             -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    __m256i v = _mm256_srai_epi32(_mm256_shuffle_epi8(raw, shuffle), 8);
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.0f / 8388608));
+}
+
+__attribute__((target("avx2"))) static inline __m256 load8_s32_avx2(const uint8_t *src, size_t i)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.0f / 2147483648.0f));
+}
+
+__attribute__((target("avx2"))) static inline __m256 load8_f32_avx2(const uint8_t *src, size_t i)
+{
+    return _mm256_loadu_ps((const float *)(src + i * 4));
+}
+
+__attribute__((target("avx2"))) static inline __m256 load8_f64_avx2(const uint8_t *src, size_t i)
+{
+    const double *p = (const double *)(src + i * 8);
+    __m128 low = _mm256_cvtpd_ps(_mm256_loadu_pd(p));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low), _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)), 1);
+}
+
+#define KSP_AVX2_KERNELS(fmt, overread)                                                                                \
+    __attribute__((target("avx2"))) static void convert_##fmt##_avx2(const uint8_t *src, float *dst, uint32_t samples) \
+    {                                                                                                                  \
+        size_t i = 0;                                                                                                  \
+        for (; i + 8 + (overread) <= samples; i += 8)                                                                  \
+            _mm256_storeu_ps(dst + i, load8_##fmt##_avx2(src, i));                                                     \
+        for (; i < samples; i++)                                                                                       \
+            dst[i] = load_##fmt(src, i);                                                                               \
+    }                                                                                                                  \
+    __attribute__((target("avx2"))) static void mix_##fmt##_avx2(const uint8_t *src, float *mix, uint32_t frames,     \
+                                                                 uint32_t channels, float gain, float gainStep)        \
+    {                                                                                                                  \
+        size_t samples = (size_t)frames * channels;                                                                    \
+        size_t s = 0;                                                                                                  \
+        if (channels <= KSP_VECTOR_MAX_CHANNELS)                                                                       \
+        {                                                                                                              \
+            float offsets[KSP_VECTOR_MAX_CHANNELS * 8];                                                                \
+            ramp_offsets(offsets, 8, channels, gainStep);                                                              \
+            __m256 base = _mm256_set1_ps(gain);                                                                        \
+            __m256 advance = _mm256_set1_ps(8 * gainStep);                                                             \
+            uint32_t phase = 0;                                                                                        \
+            for (; s + 8 + (overread) <= samples; s += 8)                                                              \
+            {                                                                                                          \
+                __m256 g = _mm256_add_ps(base, _mm256_loadu_ps(offsets + phase * 8));                                  \
+                __m256 v = _mm256_mul_ps(load8_##fmt##_avx2(src, s), g);                                               \
+                _mm256_storeu_ps(mix + s, _mm256_add_ps(_mm256_loadu_ps(mix + s), v));                                 \
+                if (++phase == channels)                                                                               \
+                {                                                                                                      \
+                    phase = 0;                                                                                         \
+                    base = _mm256_add_ps(base, advance);                                                               \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; s < samples; s++)                                                                                       \
+            mix[s] += load_##fmt(src, s) * (gain + (float)(s / channels) * gainStep);                                  \
+    }
+
+KSP_AVX2_KERNELS(u8, 0)
+KSP_AVX2_KERNELS(s16, 0)
+KSP_AVX2_KERNELS(s24, KSP_S24_OVERREAD)
+KSP_AVX2_KERNELS(s32, 0)
+KSP_AVX2_KERNELS(f32, 0)
+KSP_AVX2_KERNELS(f64, 0)
+
+__attribute__((target("avx2"))) static float fir_avx2(const float *src, const float *a, const float *b, float frac,
+                                                      uint32_t taps)
+{
+    __m256 f = _mm256_set1_ps(frac);
+    __m256 sum = _mm256_setzero_ps();
+    for (uint32_t k = 0; k < taps; k += 8)
+    {
+        __m256 va = _mm256_loadu_ps(a + k);
+        __m256 coefficients = _mm256_add_ps(va, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b + k), va), f));
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(src + k), coefficients));
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return _mm_cvtss_f32(half);
+}
+
+__attribute__((target("avx2"))) static void peak_avx2(const float *src, uint32_t frames, uint32_t channels,
+                                                      float *min, float *max, float *sumSquares)
+{
+    if (8 % channels != 0)
+    {
+        peak_scalar(src, frames, channels, min, max, sumSquares);
+        return;
+    }
+    size_t samples = (size_t)frames * channels;
+    __m256 vmin = _mm256_set1_ps(INFINITY);
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    __m256 vsum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256 v = _mm256_loadu_ps(src + i);
+        vmin = _mm256_min_ps(vmin, v);
+        vmax = _mm256_max_ps(vmax, v);
+        vsum = _mm256_add_ps(vsum, _mm256_mul_ps(v, v));
+    }
+    float laneMin[8], laneMax[8], laneSum[8];
+    _mm256_storeu_ps(laneMin, vmin);
+    _mm256_storeu_ps(laneMax, vmax);
+    _mm256_storeu_ps(laneSum, vsum);
+    fold_peaks(laneMin, laneMax, laneSum, 8, channels, min, max, sumSquares);
+    peak_scalar(src + i, (uint32_t)((samples - i) / channels), channels, min, max, sumSquares);
+}
+
+__attribute__((target("avx2"))) static inline __m256 abs_avx2(__m256 v)
+{
+    return _mm256_and_ps(v, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff)));
+}
+
+//Filters eight channels at a time, and leaves the rest to the SSE2 kernel
+__attribute__((target("avx2"))) static void biquad_avx2(float *buf, uint32_t frames, uint32_t channels,
+                                                        const ksp_biquad *biquads, uint32_t sections, float *state)
+{
+    __m256 k[KSP_BIQUAD_MAX_SECTIONS][5];
+    __m256 s1[KSP_BIQUAD_MAX_SECTIONS], s2[KSP_BIQUAD_MAX_SECTIONS];
+    for (uint32_t j = 0; j < sections; j++)
+    {
+        k[j][0] = _mm256_set1_ps(biquads[j].b0);
+        k[j][1] = _mm256_set1_ps(biquads[j].b1);
+        k[j][2] = _mm256_set1_ps(biquads[j].b2);
+        k[j][3] = _mm256_set1_ps(biquads[j].a1);
+        k[j][4] = _mm256_set1_ps(biquads[j].a2);
+    }
+    uint32_t c = 0;
+    for (; c + 8 <= channels; c += 8)
+    {
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            s1[j] = _mm256_loadu_ps(state + j * 2 * channels + c);
+            s2[j] = _mm256_loadu_ps(state + j * 2 * channels + channels + c);
+        }
+        float *p = buf + c;
+        for (uint32_t i = 0; i < frames; i++, p += channels)
+        {
+            __m256 x = _mm256_loadu_ps(p);
+            for (uint32_t j = 0; j < sections; j++)
+            {
+                __m256 y = _mm256_add_ps(_mm256_mul_ps(k[j][0], x), s1[j]);
+                s1[j] = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(k[j][1], x), s2[j]), _mm256_mul_ps(k[j][3], y));
+                s2[j] = _mm256_sub_ps(_mm256_mul_ps(k[j][2], x), _mm256_mul_ps(k[j][4], y));
+                x = y;
+            }
+            _mm256_storeu_ps(p, x);
+        }
+        for (uint32_t j = 0; j < sections; j++)
+        {
+            _mm256_storeu_ps(state + j * 2 * channels + c, s1[j]);
+            _mm256_storeu_ps(state + j * 2 * channels + channels + c, s2[j]);
+        }
+    }
+    biquad_from_sse2(buf, frames, channels, c, biquads, sections, state);
+}
+
+__attribute__((target("avx2"))) static void frame_peak_avx2(const float *src, uint32_t frames, uint32_t channels,
+                                                            float *peaks)
+{
+    uint32_t i = 0;
+    if (channels == 1)
+    {
+        for (; i + 8 <= frames; i += 8)
+            _mm256_storeu_ps(peaks + i, abs_avx2(_mm256_loadu_ps(src + i)));
+    }
+    else if (channels == 2)
+    {
+        __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m256 v = abs_avx2(_mm256_loadu_ps(src + (size_t)i * 2));
+            v = _mm256_max_ps(v, _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1)));
+            _mm_storeu_ps(peaks + i, _mm256_castps256_ps128(_mm256_permutevar8x32_ps(v, evens)));
+        }
+    }
+    else if (channels % 8 == 0)
+    {
+        for (; i < frames; i++)
+        {
+            const float *p = src + (size_t)i * channels;
+            __m256 v = abs_avx2(_mm256_loadu_ps(p));
+            for (uint32_t c = 8; c < channels; c += 8)
+                v = _mm256_max_ps(v, abs_avx2(_mm256_loadu_ps(p + c)));
+            __m128 half = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+            half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+            peaks[i] = _mm_cvtss_f32(half);
+        }
+    }
+    frame_peak_sse2(src + (size_t)i * channels, frames - i, channels, peaks + i);
+}
+
+__attribute__((target("avx2"))) static void frame_gain_avx2(const float *src, float *dst, uint32_t frames,
+                                                            uint32_t channels, const float *gains)
+{
+    uint32_t i = 0;
+    if (channels == 1)
+    {
+        for (; i + 8 <= frames; i += 8)
+            _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), _mm256_loadu_ps(gains + i)));
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= frames; i += 4)
+        {
+            __m128 g = _mm_loadu_ps(gains + i);
+            __m256 pairs = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_unpacklo_ps(g, g)),
+                                                _mm_unpackhi_ps(g, g), 1);
+            _mm256_storeu_ps(dst + (size_t)i * 2, _mm256_mul_ps(_mm256_loadu_ps(src + (size_t)i * 2), pairs));
+        }
+    }
+    else if (channels % 8 == 0)
+    {
+        for (; i < frames; i++)
+        {
+            __m256 g = _mm256_set1_ps(gains[i]);
+            size_t s = (size_t)i * channels;
+            for (uint32_t c = 0; c < channels; c += 8)
+                _mm256_storeu_ps(dst + s + c, _mm256_mul_ps(_mm256_loadu_ps(src + s + c), g));
+        }
+    }
+    frame_gain_sse2(src + (size_t)i * channels, dst + (size_t)i * channels, frames - i, channels, gains + i);
+}
+
+__attribute__((target("avx2"))) static void correlate_avx2(const float *src, const float *ref, uint32_t length,
+                                                           uint32_t offsets, float *dots)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= offsets; i += 4)
+    {
+        const float *s = src + i;
+        __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+        __m256 sum2 = _mm256_setzero_ps(), sum3 = _mm256_setzero_ps();
+        for (uint32_t k = 0; k < length; k += 8)
+        {
+            __m256 r = _mm256_loadu_ps(ref + k);
+            sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(r, _mm256_loadu_ps(s + k)));
+            sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(r, _mm256_loadu_ps(s + k + 1)));
+            sum2 = _mm256_add_ps(sum2, _mm256_mul_ps(r, _mm256_loadu_ps(s + k + 2)));
+            sum3 = _mm256_add_ps(sum3, _mm256_mul_ps(r, _mm256_loadu_ps(s + k + 3)));
+        }
+        //Each half of the pairwise sums holds the four totals of its half of the lanes, in order
+        __m256 sums = _mm256_hadd_ps(_mm256_hadd_ps(sum0, sum1), _mm256_hadd_ps(sum2, sum3));
+        _mm_storeu_ps(dots + i, _mm_add_ps(_mm256_castps256_ps128(sums), _mm256_extractf128_ps(sums, 1)));
+    }
+    correlate_sse2(src + i, ref, length, offsets - i, dots + i);
+}
+
+static const ksp_kernels avx2Kernels = {
+    .name = "avx2",
+    .convert = { convert_u8_avx2, convert_s16_avx2, convert_s24_avx2, convert_s32_avx2, convert_f32_avx2,
+                 convert_f64_avx2 },
+    .mix = { mix_u8_avx2, mix_s16_avx2, mix_s24_avx2, mix_s32_avx2, mix_f32_avx2, mix_f64_avx2 },
+    .fir = fir_avx2,
+    .peak = peak_avx2,
+    .biquad = biquad_avx2,
+    .framePeak = frame_peak_avx2,
+    .frameGain = frame_gain_avx2,
+    .correlate = correlate_avx2,
+};
+
+#endif
+
+const ksp_kernels *ksp_kernels_get(ksp_kernel_isa isa)
+{
+#ifdef KSP_KERNELS_X86
+    __builtin_cpu_init();
+    bool hasSse2 = __builtin_cpu_supports("sse2");
+    bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+    switch (isa)
+    {
+        case KSP_ISA_SCALAR:
+            return &scalarKernels;
+        case KSP_ISA_SSE2:
+            return hasSse2 ? &sse2Kernels : NULL;
+        case KSP_ISA_AVX2:
+            return hasAvx2 ? &avx2Kernels : NULL;
+        case KSP_ISA_BEST:
+        default:
+            if (hasAvx2)
+                return &avx2Kernels;
+            if (hasSse2)
+                return &sse2Kernels;
+            return &scalarKernels;
+    }
+#else
+    return isa == KSP_ISA_SCALAR || isa == KSP_ISA_BEST ? &scalarKernels : NULL;
+#endif
+}
@@ -0,0 +1,103 @@
+#ifndef KSP_PW_KERNELS_H
+#define KSP_PW_KERNELS_H
+
+#include <stdint.h>
+
+//Sample layouts the kernels can read. Every layout is converted to float in [-1, 1).
+typedef enum ksp_sample_format
+{
+    KSP_SAMPLE_U8,
+    KSP_SAMPLE_S16,
+    KSP_SAMPLE_S24,
+    KSP_SAMPLE_S32,
+    KSP_SAMPLE_F32,
+    KSP_SAMPLE_F64,
+    KSP_SAMPLE_FORMAT_COUNT
+} ksp_sample_format;
+
+//Bytes taken up by one sample in the given layout
+static inline uint32_t ksp_sample_format_size(ksp_sample_format format)
+{
+    switch (format)
+    {
+        case KSP_SAMPLE_U8:
+            return 1;
+        case KSP_SAMPLE_S16:
+            return 2;
+        case KSP_SAMPLE_S24:
+            return 3;
+        case KSP_SAMPLE_F64:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+typedef enum ksp_kernel_isa
+{
+    KSP_ISA_SCALAR,
+    KSP_ISA_SSE2,
+    KSP_ISA_AVX2,
+    KSP_ISA_BEST //Whatever the running CPU supports best
+} ksp_kernel_isa;
+
+//Converts samples of interleaved PCM to float
+typedef void (*ksp_convert_kernel)(const uint8_t *src, float *dst, uint32_t samples);
+
+//Converts frames of interleaved PCM to float, applies a gain that starts at gain and moves by gainStep
+//every frame, and adds the result to mix, which has the same channel layout as the source.
+typedef void (*ksp_mix_kernel)(const uint8_t *src, float *mix, uint32_t frames, uint32_t channels, float gain,
+                               float gainStep);
+
+//Filters one channel at one point: the dot product of taps samples of src with a filter whose coefficients are
+//interpolated between the phases a and b by frac. taps is always a multiple of 8.
+typedef float (*ksp_fir_kernel)(const float *src, const float *a, const float *b, float frac, uint32_t taps);
+
+//Scans frames of interleaved float samples, and for each channel lowers min to the smallest sample, raises max to the
+//largest and adds the squares of the samples to sumSquares
+typedef void (*ksp_peak_kernel)(const float *src, uint32_t frames, uint32_t channels, float *min, float *max,
+                                float *sumSquares);
+
+//Coefficients of a biquad filter, divided through by a0
+typedef struct ksp_biquad
+{
+    float b0, b1, b2, a1, a2;
+} ksp_biquad;
+
+//Longest chain of biquad filters the kernels run in one pass
+#define KSP_BIQUAD_MAX_SECTIONS 8
+
+/* Runs frames of interleaved float samples through a chain of biquad filters, the same on every channel, in place, in
+ * transposed direct form II. Each section's state is each channel's first delay followed by each channel's second,
+ * 2 * channels floats, and the sections' states follow one another. */
+typedef void (*ksp_biquad_kernel)(float *buf, uint32_t frames, uint32_t channels, const ksp_biquad *biquads,
+                                  uint32_t sections, float *state);
+
+//Writes the largest magnitude of any channel of each frame of interleaved float samples to peaks
+typedef void (*ksp_frame_peak_kernel)(const float *src, uint32_t frames, uint32_t channels, float *peaks);
+
+//Multiplies every sample of each frame of interleaved float samples by that frame's gain, and writes it to dst
+typedef void (*ksp_frame_gain_kernel)(const float *src, float *dst, uint32_t frames, uint32_t channels,
+                                      const float *gains);
+
+//Cross-correlates ref with src: dots[i] is the dot product of length samples of ref with length samples of src from
+//i on, for each of offsets offsets. length is always a multiple of 8.
+typedef void (*ksp_correlate_kernel)(const float *src, const float *ref, uint32_t length, uint32_t offsets,
+                                     float *dots);
+
+typedef struct ksp_kernels
+{
+    const char *name;
+    ksp_convert_kernel convert[KSP_SAMPLE_FORMAT_COUNT];
+    ksp_mix_kernel mix[KSP_SAMPLE_FORMAT_COUNT];
+    ksp_fir_kernel fir;
+    ksp_peak_kernel peak;
+    ksp_biquad_kernel biquad;
+    ksp_frame_peak_kernel framePeak;
+    ksp_frame_gain_kernel frameGain;
+    ksp_correlate_kernel correlate;
+} ksp_kernels;
+
+const ksp_kernels *ksp_kernels_get(ksp_kernel_isa isa);
+
+#endif
@@ -0,0 +1,124 @@
+#include <mpg123.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ksp_pw_mp3.h"
+
+typedef struct ksp_mp3
+{
+    mpg123_handle *handle;
+    size_t bytesPerFrame;
+} ksp_mp3;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_library(void)
+{
+    //Only needed by libmpg123 older than 1.27, but harmless on newer versions
+    mpg123_init();
+}
+
+static void mp3_close(void *decoder)
+{
+    ksp_mp3 *mp3 = decoder;
+    if (mp3 == NULL)
+        return;
+    if (mp3->handle != NULL)
+    {
+        mpg123_close(mp3->handle);
+        mpg123_delete(mp3->handle);
+    }
+    free(mp3);
+}
+
+static void *mp3_open(const char *filePath, ksp_stream_info *info)
+{
+    pthread_once(&init_once, init_library);
+
+    ksp_mp3 *mp3 = calloc(1, sizeof(ksp_mp3));
+    if (mp3 == NULL)
+        return NULL;
+
+    int error;
+    mp3->handle = mpg123_new(NULL, &error);
+    if (mp3->handle == NULL)
+    {
+        fprintf(stderr, "Could not create MP3 decoder: %s\n", mpg123_plain_strerror(error));
+        mp3_close(mp3);
+        return NULL;
+    }
+    //Float output skips a conversion, and the file is never resampled; the mixer handles its rate
+    mpg123_param(mp3->handle, MPG123_FLAGS, MPG123_FORCE_FLOAT | MPG123_QUIET, 0);
+
+    if (mpg123_open(mp3->handle, filePath) != MPG123_OK)
+    {
+        fprintf(stderr, "%s: could not open MP3 stream: %s\n", filePath, mpg123_strerror(mp3->handle));
+        mp3_close(mp3);
+        return NULL;
+    }
+
+    long rate;
+    int channels, encoding;
+    if (mpg123_getformat(mp3->handle, &rate, &channels, &encoding) != MPG123_OK)
+    {
+        fprintf(stderr, "%s: could not read MP3 format: %s\n", filePath, mpg123_strerror(mp3->handle));
+        mp3_close(mp3);
+        return NULL;
+    }
+    switch (encoding)
+    {
+        case MPG123_ENC_FLOAT_32:
+            info->sampleFormat = KSP_SAMPLE_F32;
+            break;
+        case MPG123_ENC_SIGNED_16:
+            info->sampleFormat = KSP_SAMPLE_S16;
+            break;
+        default:
+            fprintf(stderr, "%s: unsupported MP3 output encoding: %d\n", filePath, encoding);
+            mp3_close(mp3);
+            return NULL;
+    }
+    //Pin the format, so a stream with a change of rate or channels partway through can't change it under the ring
+    mpg123_format_none(mp3->handle);
+    mpg123_format(mp3->handle, rate, channels, encoding);
+
+    info->channels = channels;
+    info->sampleRate = rate;
+    //May be an estimate for files without a Xing/LAME header; 0 if the library can't tell at all
+    off_t length = mpg123_length(mp3->handle);
+    info->frameCount = length > 0 ? (uint64_t)length : 0;
+
+    mp3->bytesPerFrame = ksp_sample_format_size(info->sampleFormat) * info->channels;
+    return mp3;
+}
+
+static uint32_t mp3_read(void *decoder, uint8_t *dst, uint32_t frames)
+{
+    ksp_mp3 *mp3 = decoder;
+    size_t wanted = frames * mp3->bytesPerFrame;
+    size_t total = 0;
+
+    while (total < wanted)
+    {
+        size_t done = 0;
+        int result = mpg123_read(mp3->handle, dst + total, wanted - total, &done);
+        total += done;
+        if (result == MPG123_DONE)
+            break;
+        if (result != MPG123_OK && result != MPG123_NEW_FORMAT)
+        {
+            fprintf(stderr, "MP3 decoder error: %s\n", mpg123_strerror(mp3->handle));
+            break;
+        }
+    }
+    //The library only hands out whole frames, except when a damaged file ends partway through one
+    return (uint32_t)(total / mp3->bytesPerFrame);
+}
+
+const ksp_decoder_ops ksp_mp3_decoder = {
+    .name = "MP3",
+    .open = mp3_open,
+    .read = mp3_read,
+    .close = mp3_close,
+};
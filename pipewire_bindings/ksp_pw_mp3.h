@@ -0,0 +1,9 @@
+#ifndef KSP_PW_MP3_H
+#define KSP_PW_MP3_H
+
+#include "ksp_pw_stream.h"
+
+//Decodes MP3 files through libmpg123 at their own sample rate, as interleaved float where the library supports it
+extern const ksp_decoder_ops ksp_mp3_decoder;
+
+#endif
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ksp_pw_peaks.h"
+#include "ksp_pw_structs.h"
+
+/* A peak index holds the smallest and largest sample and the RMS level of every channel over each bucket of frames,
+ * at a few bucket sizes, so a waveform can be drawn at any zoom from a handful of buckets per column. Level 0 is
+ * worked out from the audio; every coarser level is folded together from the one before it. The index of a sound is
+ * kept in the decode cache under the version of its source file, so it is only ever worked out once. */
+
+static const char peaksMagic[8] = "KSPPEAKS";
+
+_Static_assert(sizeof(ksp_peak) == 6, "peaks are stored in the index as is");
+
+//Level 0 buckets a streamed sound is decoded in at a time
+#define KSP_PEAK_READ_BUCKETS 64
+
+static inline int16_t to_peak(float val)
+{
+    if (val > 1)
+        val = 1;
+    else if (val < -1)
+        val = -1;
+    return (int16_t)lrintf(val * 32767);
+}
+
+static inline uint64_t bucket_frames(uint32_t level)
+{
+    return (uint64_t)KSP_PEAK_BASE_FRAMES << (KSP_PEAK_LEVEL_SHIFT * level);
+}
+
+//Works out one level 0 bucket of frames frames of float audio
+static void analyse_bucket(const ksp_kernels *kernels, const float *src, uint32_t frames, uint32_t channels,
+                           ksp_peak *output)
+{
+    float min[KSP_MAX_SAMPLE_CHANNELS], max[KSP_MAX_SAMPLE_CHANNELS], sumSquares[KSP_MAX_SAMPLE_CHANNELS];
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        min[c] = INFINITY;
+        max[c] = -INFINITY;
+        sumSquares[c] = 0;
+    }
+    kernels->peak(src, frames, channels, min, max, sumSquares);
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        output[c].min = frames > 0 ? to_peak(min[c]) : 0;
+        output[c].max = frames > 0 ? to_peak(max[c]) : 0;
+        output[c].rms = frames > 0 ? (uint16_t)to_peak(sqrtf(sumSquares[c] / frames)) : 0;
+    }
+}
+
+//A run of level 0 buckets of a resident sound, analysed by one thread
+typedef struct peak_job
+{
+    const ksp_kernels *kernels;
+    const ksp_sample *sample;
+    uint64_t firstBucket;
+    uint64_t endBucket;
+    ksp_peak *buckets; //All of level 0
+    bool failed;
+} peak_job;
+
+static void *analyse_range(void *userdata)
+{
+    peak_job *job = userdata;
+    const ksp_sample *sample = job->sample;
+    float *scratch = malloc((size_t)KSP_PEAK_BASE_FRAMES * sample->channels * sizeof(float));
+    if (scratch == NULL)
+    {
+        job->failed = true;
+        return NULL;
+    }
+    for (uint64_t b = job->firstBucket; b < job->endBucket; b++)
+    {
+        uint64_t first = b * KSP_PEAK_BASE_FRAMES;
+        uint64_t left = sample->frameCount - first;
+        uint32_t frames = left < KSP_PEAK_BASE_FRAMES ? (uint32_t)left : KSP_PEAK_BASE_FRAMES;
+        job->kernels->convert[sample->sampleFormat](sample->data + first * sample->bytesPerFrame, scratch,
+                                                    frames * sample->channels);
+        analyse_bucket(job->kernels, scratch, frames, sample->channels, job->buckets + b * sample->channels);
+    }
+    free(scratch);
+    return NULL;
+}
+
+//Level 0 of a resident sound, split between as many threads as it is worth. Returns NULL if it couldn't be allocated.
+static ksp_peak *analyse_resident(const ksp_sample *sample, const ksp_kernels *kernels, uint64_t *bucketCount)
+{
+    uint64_t count = ((uint64_t)sample->frameCount + KSP_PEAK_BASE_FRAMES - 1) / KSP_PEAK_BASE_FRAMES;
+    ksp_peak *buckets = malloc(count * sample->channels * sizeof(ksp_peak));
+    if (buckets == NULL)
+        return NULL;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = count / KSP_PEAK_MIN_THREAD_BUCKETS;
+    if (threads > (uint64_t)cpus)
+        threads = cpus;
+    if (threads > KSP_PEAK_MAX_THREADS)
+        threads = KSP_PEAK_MAX_THREADS;
+    if (threads < 1)
+        threads = 1;
+
+    peak_job jobs[KSP_PEAK_MAX_THREADS];
+    pthread_t handles[KSP_PEAK_MAX_THREADS];
+    bool started[KSP_PEAK_MAX_THREADS] = { false };
+    for (uint64_t t = 0; t < threads; t++)
+    {
+        jobs[t] = (peak_job){
+            .kernels = kernels,
+            .sample = sample,
+            .firstBucket = count * t / threads,
+            .endBucket = count * (t + 1) / threads,
+            .buckets = buckets,
+        };
+        //The last run is done on this thread, as is any a thread couldn't be started for
+        if (t + 1 < threads)
+            started[t] = pthread_create(&handles[t], NULL, analyse_range, &jobs[t]) == 0;
+        if (!started[t])
+            analyse_range(&jobs[t]);
+    }
+    bool failed = false;
+    for (uint64_t t = 0; t < threads; t++)
+    {
+        if (started[t])
+            pthread_join(handles[t], NULL);
+        failed |= jobs[t].failed;
+    }
+    if (failed)
+    {
+        free(buckets);
+        return NULL;
+    }
+    *bucketCount = count;
+    return buckets;
+}
+
+//Level 0 of a streamed sound, decoded from the start. Returns NULL if it couldn't be decoded or allocated.
+static ksp_peak *analyse_streamed(const ksp_sample *sample, const char *filePath, const ksp_kernels *kernels,
+                                  uint64_t *bucketCount, uint64_t *frameCount)
+{
+    ksp_stream_info info;
+    void *decoder = sample->decoder->open(filePath, &info);
+    if (decoder == NULL)
+        return NULL;
+
+    const uint32_t chunkFrames = KSP_PEAK_BASE_FRAMES * KSP_PEAK_READ_BUCKETS;
+    uint8_t *chunk = malloc((size_t)chunkFrames * sample->bytesPerFrame);
+    float *scratch = malloc((size_t)KSP_PEAK_BASE_FRAMES * sample->channels * sizeof(float));
+    size_t capacity = KSP_PEAK_READ_BUCKETS;
+    ksp_peak *buckets = malloc(capacity * sample->channels * sizeof(ksp_peak));
+    uint64_t count = 0, frames = 0;
+    bool ended = false;
+    while (!ended && chunk != NULL && scratch != NULL && buckets != NULL)
+    {
+        //Decoders can return fewer frames than asked for before the end, so only a final bucket is ever partial
+        uint32_t filled = 0;
+        while (filled < chunkFrames)
+        {
+            uint32_t decoded = sample->decoder->read(decoder, chunk + (size_t)filled * sample->bytesPerFrame,
+                                                     chunkFrames - filled);
+            if (decoded == 0)
+            {
+                ended = true;
+                break;
+            }
+            filled += decoded;
+        }
+        if (count + KSP_PEAK_READ_BUCKETS > capacity)
+        {
+            capacity *= 2;
+            ksp_peak *grown = realloc(buckets, capacity * sample->channels * sizeof(ksp_peak));
+            if (grown == NULL)
+            {
+                free(buckets);
+                buckets = NULL;
+                break;
+            }
+            buckets = grown;
+        }
+        for (uint32_t first = 0; first < filled; first += KSP_PEAK_BASE_FRAMES, count++)
+        {
+            uint32_t length = filled - first < KSP_PEAK_BASE_FRAMES ? filled - first : KSP_PEAK_BASE_FRAMES;
+            kernels->convert[sample->sampleFormat](chunk + (size_t)first * sample->bytesPerFrame, scratch,
+                                                   length * sample->channels);
+            analyse_bucket(kernels, scratch, length, sample->channels, buckets + count * sample->channels);
+        }
+        frames += filled;
+    }
+    sample->decoder->close(decoder);
+    free(chunk);
+    free(scratch);
+    if (buckets != NULL && (chunk == NULL || scratch == NULL || frames == 0))
+    {
+        free(buckets);
+        buckets = NULL;
+    }
+    *bucketCount = count;
+    *frameCount = frames;
+    return buckets;
+}
+
+//Folds each run of buckets of one level into one bucket of the next. frames is the length of the sound.
+static void fold_level(const ksp_peak *fine, uint64_t fineCount, uint32_t level, uint64_t frames, uint32_t channels,
+                       ksp_peak *coarse, uint64_t coarseCount)
+{
+    const uint64_t fan = 1 << KSP_PEAK_LEVEL_SHIFT;
+    const uint64_t fineFrames = bucket_frames(level - 1);
+    for (uint64_t j = 0; j < coarseCount; j++)
+    {
+        uint64_t first = j * fan;
+        uint64_t end = first + fan < fineCount ? first + fan : fineCount;
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            int16_t min = INT16_MAX, max = INT16_MIN;
+            double power = 0, weight = 0;
+            for (uint64_t i = first; i < end; i++)
+            {
+                const ksp_peak *peak = &fine[i * channels + c];
+                if (peak->min < min)
+                    min = peak->min;
+                if (peak->max > max)
+                    max = peak->max;
+                //The last bucket can be short, and counts for only as many frames as it has
+                uint64_t length = frames - i * fineFrames < fineFrames ? frames - i * fineFrames : fineFrames;
+                power += (double)peak->rms * peak->rms * length;
+                weight += length;
+            }
+            coarse[j * channels + c] = (ksp_peak){
+                .min = min,
+                .max = max,
+                .rms = weight > 0 ? (uint16_t)lrint(sqrt(power / weight)) : 0,
+            };
+        }
+    }
+}
+
+//Lays out a whole index around its level 0 and fills in the rest. Returns false if it couldn't be allocated.
+static bool build_index(ksp_peaks *peaks, const ksp_peak *level0, uint64_t frames, uint32_t channels,
+                        const struct stat *source)
+{
+    ksp_peak_header header = {
+        .version = KSP_PEAK_VERSION,
+        .channels = channels,
+        .frameCount = frames,
+    };
+    memcpy(header.magic, peaksMagic, sizeof(peaksMagic));
+    if (source != NULL)
+    {
+        header.device = source->st_dev;
+        header.inode = source->st_ino;
+        header.size = source->st_size;
+        header.mtime = (int64_t)source->st_mtim.tv_sec * 1000000000 + source->st_mtim.tv_nsec;
+    }
+    size_t length = sizeof(header);
+    for (uint32_t level = 0; level < KSP_PEAK_LEVELS; level++)
+    {
+        header.bucketCounts[level] = (frames + bucket_frames(level) - 1) / bucket_frames(level);
+        header.offsets[level] = length;
+        length += header.bucketCounts[level] * channels * sizeof(ksp_peak);
+    }
+
+    uint8_t *index = malloc(length);
+    if (index == NULL)
+        return false;
+    memcpy(index, &header, sizeof(header));
+    memcpy(index + header.offsets[0], level0, header.bucketCounts[0] * channels * sizeof(ksp_peak));
+    for (uint32_t level = 1; level < KSP_PEAK_LEVELS; level++)
+        fold_level((const ksp_peak *)(index + header.offsets[level - 1]), header.bucketCounts[level - 1], level,
+                   frames, channels, (ksp_peak *)(index + header.offsets[level]), header.bucketCounts[level]);
+
+    peaks->header = (ksp_peak_header *)index;
+    peaks->length = length;
+    peaks->mapped = false;
+    return true;
+}
+
+//Whether an index that has been mapped, or copied, is whole and is for a sound with this many channels
+static bool index_complete(const ksp_peak_header *header, size_t length, uint32_t channels)
+{
+    if (length < sizeof(ksp_peak_header) || memcmp(header->magic, peaksMagic, sizeof(peaksMagic)) != 0 ||
+        header->version != KSP_PEAK_VERSION || header->channels != channels || header->frameCount == 0)
+        return false;
+    for (uint32_t level = 0; level < KSP_PEAK_LEVELS; level++)
+    {
+        uint64_t expected = (header->frameCount + bucket_frames(level) - 1) / bucket_frames(level);
+        if (header->bucketCounts[level] != expected || header->offsets[level] > length ||
+            (length - header->offsets[level]) / channels / sizeof(ksp_peak) < expected)
+            return false;
+    }
+    return true;
+}
+
+//Whether a mapped file is a whole index of the current version of source, for a sound with this many channels
+static bool index_valid(const ksp_peak_header *header, size_t length, const struct stat *source, uint32_t channels)
+{
+    return index_complete(header, length, channels) && header->device == (uint64_t)source->st_dev &&
+           header->inode == (uint64_t)source->st_ino && header->size == (uint64_t)source->st_size &&
+           header->mtime == (int64_t)source->st_mtim.tv_sec * 1000000000 + source->st_mtim.tv_nsec;
+}
+
+static bool map_cached(ksp_peaks *peaks, const char *path, const struct stat *source, uint32_t channels)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat status;
+    void *map = MAP_FAILED;
+    //Faulted in up front, so drawing from the index never waits on the disk
+    if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(ksp_peak_header))
+        map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    if (!index_valid(map, status.st_size, source, channels))
+    {
+        munmap(map, status.st_size);
+        return false;
+    }
+    peaks->header = map;
+    peaks->length = status.st_size;
+    peaks->mapped = true;
+    return true;
+}
+
+bool ksp_peaks_borrow(ksp_peaks *peaks, const void *index, size_t length, uint32_t channels)
+{
+    //Its alignment is only checked here; the fields are read in place from then on
+    if (((uintptr_t)index & (_Alignof(ksp_peak_header) - 1)) != 0 || !index_complete(index, length, channels))
+        return false;
+    peaks->header = (ksp_peak_header *)index;
+    peaks->length = length;
+    peaks->mapped = false;
+    peaks->borrowed = true;
+    return true;
+}
+
+bool ksp_peaks_load(ksp_peaks *peaks, ksp_cache *cache, const char *filePath, const ksp_sample *sample,
+                    const ksp_kernels *kernels)
+{
+    struct stat source;
+    bool cacheable = stat(filePath, &source) == 0;
+    char *path = cacheable ? ksp_cache_peaks_path(cache, &source) : NULL;
+    if (path != NULL && map_cached(peaks, path, &source, sample->channels))
+    {
+        free(path);
+        return true;
+    }
+
+    uint64_t bucketCount = 0, frames = sample->frameCount;
+    ksp_peak *level0 = sample->data != NULL ? analyse_resident(sample, kernels, &bucketCount)
+                                            : analyse_streamed(sample, filePath, kernels, &bucketCount, &frames);
+    bool built = level0 != NULL && build_index(peaks, level0, frames, sample->channels, cacheable ? &source : NULL);
+    free(level0);
+    if (!built)
+    {
+        fprintf(stderr, "Could not work out the peaks of %s\n", filePath);
+        free(path);
+        return false;
+    }
+    if (path != NULL && !ksp_cache_write_file(path, (const uint8_t *)peaks->header, peaks->length))
+        fprintf(stderr, "Could not cache the peaks of %s: %s\n", filePath, strerror(errno));
+    free(path);
+    return true;
+}
+
+void ksp_peaks_free(ksp_peaks *peaks)
+{
+    if (peaks->header != NULL && !peaks->borrowed)
+    {
+        if (peaks->mapped)
+            munmap(peaks->header, peaks->length);
+        else
+            free(peaks->header);
+    }
+    peaks->header = NULL;
+    peaks->length = 0;
+    peaks->mapped = false;
+    peaks->borrowed = false;
+}
+
+uint32_t ksp_peaks_read(const ksp_peaks *peaks, uint64_t start, uint64_t end, int32_t channel,
+                        ksp_peak_column *columns, uint32_t pixels)
+{
+    const ksp_peak_header *header = peaks->header;
+    if (header == NULL || pixels == 0 || channel >= (int32_t)header->channels)
+        return 0;
+    if (end == 0 || end > header->frameCount)
+        end = header->frameCount;
+    if (start >= end)
+        return 0;
+
+    //The coarsest level that still has at least one bucket per column
+    double framesPerPixel = (double)(end - start) / pixels;
+    uint32_t level = 0;
+    while (level + 1 < KSP_PEAK_LEVELS && (double)bucket_frames(level + 1) <= framesPerPixel)
+        level++;
+    const uint64_t frames = bucket_frames(level);
+    const uint64_t count = header->bucketCounts[level];
+    const ksp_peak *buckets = (const ksp_peak *)((const uint8_t *)header + header->offsets[level]);
+    uint32_t firstChannel = channel < 0 ? 0 : (uint32_t)channel;
+    uint32_t endChannel = channel < 0 ? header->channels : (uint32_t)channel + 1;
+
+    for (uint32_t p = 0; p < pixels; p++)
+    {
+        uint64_t from = start + (uint64_t)(framesPerPixel * p);
+        uint64_t to = start + (uint64_t)(framesPerPixel * (p + 1));
+        //Columns narrower than a bucket repeat the bucket they are in
+        uint64_t first = from / frames;
+        uint64_t last = to > from ? (to - 1) / frames + 1 : first + 1;
+        if (last > count)
+            last = count;
+        if (first >= last)
+            first = last - 1;
+
+        int16_t min = INT16_MAX, max = INT16_MIN;
+        double power = 0, weight = 0;
+        for (uint64_t b = first; b < last; b++)
+        {
+            uint64_t length = header->frameCount - b * frames < frames ? header->frameCount - b * frames : frames;
+            for (uint32_t c = firstChannel; c < endChannel; c++)
+            {
+                const ksp_peak *peak = &buckets[b * header->channels + c];
+                if (peak->min < min)
+                    min = peak->min;
+                if (peak->max > max)
+                    max = peak->max;
+                power += (double)peak->rms * peak->rms * length;
+                weight += length;
+            }
+        }
+        columns[p] = (ksp_peak_column){
+            .min = min / 32767.0f,
+            .max = max / 32767.0f,
+            .rms = (float)(sqrt(power / weight) / 32767.0),
+        };
+    }
+    return pixels;
+}
+
+bool ksp_peaks_measure(const ksp_peaks *peaks, uint64_t start, uint64_t end, uint32_t channels, float *magnitudes,
+                       float *meanSquares)
+{
+    const ksp_peak_header *header = peaks->header;
+    if (header == NULL || channels > header->channels)
+        return false;
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        magnitudes[c] = 0;
+        meanSquares[c] = 0;
+    }
+    if (end > header->frameCount)
+        end = header->frameCount;
+    if (start >= end)
+        return true;
+
+    const ksp_peak *buckets = (const ksp_peak *)((const uint8_t *)header + header->offsets[0]);
+    uint64_t first = start / KSP_PEAK_BASE_FRAMES;
+    uint64_t last = (end - 1) / KSP_PEAK_BASE_FRAMES + 1;
+    for (uint64_t b = first; b < last; b++)
+    {
+        const ksp_peak *peak = &buckets[b * header->channels];
+        for (uint32_t c = 0; c < channels; c++)
+        {
+            int32_t magnitude = -peak[c].min > peak[c].max ? -peak[c].min : peak[c].max;
+            if (magnitude > magnitudes[c])
+                magnitudes[c] = (float)magnitude;
+            meanSquares[c] += (float)peak[c].rms * peak[c].rms;
+        }
+    }
+    float scale = 1.0f / (32767.0f * 32767.0f * (float)(last - first));
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        magnitudes[c] /= 32767.0f;
+        meanSquares[c] *= scale;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#ifndef KSP_PW_PEAKS_H
+#define KSP_PW_PEAKS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ksp_pw_kernels.h"
+#include "ksp_pw_cache.h"
+
+//Levels of a peak index. Each bucket of level 0 covers KSP_PEAK_BASE_FRAMES frames, and each of every level after it
+//1 << KSP_PEAK_LEVEL_SHIFT times as many as the level before: 256, 4096 and 65536.
+#define KSP_PEAK_LEVELS 3
+#define KSP_PEAK_BASE_FRAMES 256
+#define KSP_PEAK_LEVEL_SHIFT 4
+
+#define KSP_PEAK_VERSION 1
+
+//Most threads the analysis of one resident sound is split across
+#define KSP_PEAK_MAX_THREADS 8
+
+//Fewest level 0 buckets worth handing to a thread of their own
+#define KSP_PEAK_MIN_THREAD_BUCKETS 4096
+
+//One channel of one bucket, scaled so that full scale is 32767
+typedef struct ksp_peak
+{
+    int16_t min;
+    int16_t max;
+    uint16_t rms;
+} ksp_peak;
+
+//Start of a peak index, which is stored in the decode cache as is. It is followed by the levels, finest first, each an
+//array of buckets of one ksp_peak per channel.
+typedef struct ksp_peak_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t channels;
+    uint64_t frameCount;
+
+    //Identify the version of the source file the index was made from, like a decode cache entry
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime; //Nanoseconds
+
+    uint64_t bucketCounts[KSP_PEAK_LEVELS];
+    uint64_t offsets[KSP_PEAK_LEVELS]; //Of each level, in bytes from the start of the header
+} ksp_peak_header;
+
+typedef struct ksp_peaks
+{
+    ksp_peak_header *header; //NULL if the sample has no index
+    size_t length;
+    bool mapped; //Mapped from the cache, rather than allocated
+    bool borrowed; //Part of memory that something else owns and releases, such as a bundle
+} ksp_peaks;
+
+//One column of a waveform display, in the same scale as the audio
+typedef struct ksp_peak_column
+{
+    float min;
+    float max;
+    float rms;
+} ksp_peak_column;
+
+struct ksp_sample;
+
+/* Maps the peak index of a sample from the cache, or failing that analyses the sample and stores its index in the
+ * cache, if one is open. Resident samples are analysed on several threads at once; streamed ones are decoded from
+ * filePath, the sound's source file, front to back. Returns false if the sample couldn't be analysed. */
+bool ksp_peaks_load(ksp_peaks *peaks, ksp_cache *cache, const char *filePath, const struct ksp_sample *sample,
+                    const ksp_kernels *kernels);
+
+//Uses an index kept in memory something else owns, such as a mapped bundle, in place. Returns false if it isn't a
+//whole index for a sound with this many channels.
+bool ksp_peaks_borrow(ksp_peaks *peaks, const void *index, size_t length, uint32_t channels);
+
+void ksp_peaks_free(ksp_peaks *peaks);
+
+/* Fills columns with pixels columns spread evenly over frames start to end of the sound, from whichever level has
+ * the largest buckets that still fit in a column, so the cost depends on the number of columns and not the length
+ * of the sound. end is clamped to the length of the sound, and 0 means all of it. channel picks one channel, or -1
+ * takes every channel together. Returns the number of columns filled, which is 0 if there is no index. */
+uint32_t ksp_peaks_read(const ksp_peaks *peaks, uint64_t start, uint64_t end, int32_t channel,
+                        ksp_peak_column *columns, uint32_t pixels);
+
+/* Measures frames start to end of the sound from the finest level of the index, a bucket at a time: the largest
+ * magnitude of each of the first channels channels, and its mean square. Cheap enough for the audio thread, which
+ * meters voices with it. Returns false if there is no index. */
+bool ksp_peaks_measure(const ksp_peaks *peaks, uint64_t start, uint64_t end, uint32_t channels, float *magnitudes,
+                       float *meanSquares);
+
+#endif
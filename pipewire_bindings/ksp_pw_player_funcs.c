@@ -1,54 +1,448 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
-#include <pipewire/pipewire.h>
-#include <spa/param/props.h>
-
+#include <string.h>
+#include <time.h>
 
 #include "ksp_pw_structs.h"
+#include "ksp_pw_player_funcs.h"
+#include "ksp_pw_sample_bank.h"
+
+//How often a waiting thread rechecks a voice, in case the wakeup was meant for another waiter
+#define KSP_VOICE_WAIT_INTERVAL_NS 50000000
+
+int ksp_voice_claim(ksp_engine *engine)
+{
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        ksp_voice *voice = &engine->voices[i];
+        ksp_voice_state expected = KSP_VOICE_FREE;
+        if (!atomic_compare_exchange_strong(&voice->state, &expected, KSP_VOICE_LOADING))
+        {
+            //Finished voices are reclaimed lazily, since nothing may be unmapped on the audio thread
+            expected = KSP_VOICE_FINISHED;
+            if (!atomic_compare_exchange_strong(&voice->state, &expected, KSP_VOICE_LOADING))
+                continue;
+            ksp_voice_release(engine, voice);
+        }
+        atomic_fetch_add(&voice->generation, 1);
+        //Wake anyone still waiting on the previous occupant of this slot
+        sem_post(&voice->finished);
+        return i;
+    }
+    return -1;
+}
+
+void ksp_voice_reap(ksp_engine *engine)
+{
+    pthread_mutex_lock(&engine->voiceLock);
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        ksp_voice *voice = &engine->voices[i];
+        ksp_voice_state expected = KSP_VOICE_FINISHED;
+        //Held as LOADING while it is released, so it can't be claimed halfway through
+        if (!atomic_compare_exchange_strong(&voice->state, &expected, KSP_VOICE_LOADING))
+            continue;
+        ksp_voice_release(engine, voice);
+        atomic_store(&voice->state, KSP_VOICE_FREE);
+    }
+    pthread_mutex_unlock(&engine->voiceLock);
+}
+
+void ksp_voice_release(ksp_engine *engine, ksp_voice *voice)
+{
+    if (voice->stream != NULL)
+    {
+        uint32_t underruns = atomic_load(&voice->underruns);
+        if (underruns > 0)
+            fprintf(stderr, "%s ran out of streamed audio %u times\n", voice->sample->filePath, underruns);
+        ksp_streamer_remove(&engine->streamer, voice->stream);
+        ksp_stream_close(voice->stream);
+        voice->stream = NULL;
+    }
+    ksp_stretch_destroy(voice->stretch);
+    voice->stretch = NULL;
+    ksp_sample_unref(&engine->bank, voice->sample);
+    voice->sample = NULL;
+}
+
+ksp_voice *ksp_voice_lookup(ksp_engine *engine, int32_t handle)
+{
+    if (engine == NULL || handle < 0)
+        return NULL;
+    int slot = KSP_VOICE_SLOT(handle);
+    if (slot >= KSP_MAX_VOICES)
+        return NULL;
+    ksp_voice *voice = &engine->voices[slot];
+    if ((atomic_load(&voice->generation) & 0x7FFFFF) != KSP_VOICE_GENERATION(handle))
+        return NULL;
+    return voice;
+}
+
+static void send_command_at(ksp_engine *engine, ksp_command_type type, int32_t handle, float value, uint32_t frames,
+                            uint64_t at)
+{
+    ksp_command command = { .type = type, .voice = handle, .value = value, .frames = frames, .at = at };
+    if (!ksp_command_push(&engine->commands, &command))
+        fputs("Engine command queue is full, dropping command\n", stderr);
+}
+
+static void send_command(ksp_engine *engine, ksp_command_type type, int32_t handle, float value, uint32_t frames)
+{
+    send_command_at(engine, type, handle, value, frames, 0);
+}
+
+static uint32_t milliseconds_to_frames(const ksp_engine *engine, int32_t milliseconds)
+{
+    if (milliseconds <= 0)
+        return 0;
+    return (uint32_t)((uint64_t)milliseconds * engine->sampleRate / 1000);
+}
+
+double ksp_voice_step(const ksp_engine *engine, const ksp_sample *sample, float speedFactor)
+{
+    //Playback speed and any difference between the file's rate and the engine's rate are both handled by
+    //stepping through the source at a different rate, instead of advertising a fake rate to PipeWire.
+    if (speedFactor <= 0)
+        speedFactor = 1;
+    return (double)sample->sampleRate * speedFactor / engine->sampleRate;
+}
+
+//Whether the voice in a slot is in use and hasn't been told to stop by anything that makes room for new voices
+static bool voice_live(const ksp_voice *voice)
+{
+    ksp_voice_state state = atomic_load(&voice->state);
+    return !voice->cutOff && (state == KSP_VOICE_LOADING || state == KSP_VOICE_PLAYING || state == KSP_VOICE_PAUSED);
+}
+
+//Fades a live voice out quickly enough not to be heard as anything but a click avoided
+static void cut_off(ksp_engine *engine, int slot)
+{
+    ksp_voice *voice = &engine->voices[slot];
+    voice->cutOff = true;
+    send_command(engine, KSP_COMMAND_STOP, KSP_VOICE_HANDLE(slot, atomic_load(&voice->generation)), 0,
+                 milliseconds_to_frames(engine, KSP_DECLICK_MILLISECONDS));
+}
+
+//Cuts off the live voice that the engine's steal policy would rather lose, out of those of sample, or out of every
+//voice if sample is NULL. Returns false if there was none.
+static bool steal_voice(ksp_engine *engine, const ksp_sample *sample)
+{
+    bool quietest = atomic_load(&engine->stealPolicy) == KSP_STEAL_QUIETEST;
+    int victim = -1;
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        const ksp_voice *voice = &engine->voices[i];
+        if (!voice_live(voice) || (sample != NULL && voice->sample != sample))
+            continue;
+        if (victim < 0)
+        {
+            victim = i;
+            continue;
+        }
+        const ksp_voice *best = &engine->voices[victim];
+        float level = atomic_load_explicit(&voice->level, memory_order_relaxed);
+        float bestLevel = atomic_load_explicit(&best->level, memory_order_relaxed);
+        //Equally quiet voices, silent ones especially, go oldest first
+        if ((quietest && level != bestLevel) ? level < bestLevel : voice->startNs < best->startNs)
+            victim = i;
+    }
+    if (victim < 0)
+        return false;
+    cut_off(engine, victim);
+    atomic_fetch_add_explicit(&engine->stats.voicesStolen, 1, memory_order_relaxed);
+    return true;
+}
+
+bool ksp_voice_make_room(ksp_engine *engine, const ksp_sample *sample, const ksp_voice_params *params)
+{
+    int live = 0;
+    int liveOfSample = 0;
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        const ksp_voice *voice = &engine->voices[i];
+        if (!voice_live(voice))
+            continue;
+        live++;
+        if (voice->sample != sample)
+            continue;
+        if (params->retrigger == KSP_RETRIGGER_IGNORE)
+            return false;
+        liveOfSample++;
+    }
+
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        const ksp_voice *voice = &engine->voices[i];
+        if (!voice_live(voice))
+            continue;
+        bool ownSample = voice->sample == sample;
+        bool choked = params->chokeGroup != 0 && voice->params.retrigger == KSP_RETRIGGER_CHOKE &&
+                      voice->params.chokeGroup == params->chokeGroup;
+        if ((params->retrigger == KSP_RETRIGGER_RESTART && ownSample) ||
+            (params->retrigger == KSP_RETRIGGER_CHOKE && (ownSample || choked)))
+        {
+            cut_off(engine, i);
+            live--;
+            liveOfSample -= ownSample;
+        }
+    }
+
+    for (; params->maxPolyphony > 0 && liveOfSample >= params->maxPolyphony; liveOfSample--, live--)
+        steal_voice(engine, sample);
+    if (live >= KSP_MAX_VOICES - KSP_VOICE_RESERVE)
+        steal_voice(engine, NULL);
+    return true;
+}
+
+void ksp_engine_set_steal_policy(ksp_engine *engine, int32_t policy)
+{
+    if (policy < 0 || policy >= KSP_STEAL_POLICY_COUNT)
+    {
+        fprintf(stderr, "Unknown voice steal policy: %d\n", policy);
+        return;
+    }
+    atomic_store(&engine->stealPolicy, (ksp_steal_policy)policy);
+}
+
+void ksp_voice_stop(ksp_engine *engine, int32_t handle)
+{
+    ksp_voice_fade_out(engine, handle, 0);
+}
+
+void ksp_voice_fade_out(ksp_engine *engine, int32_t handle, int32_t fadeMilliseconds)
+{
+    if (ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command(engine, KSP_COMMAND_STOP, handle, 0, milliseconds_to_frames(engine, fadeMilliseconds));
+}
+
+void ksp_voice_stop_at(ksp_engine *engine, int32_t handle, int32_t fadeMilliseconds, uint64_t at)
+{
+    if (ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command_at(engine, KSP_COMMAND_STOP, handle, 0, milliseconds_to_frames(engine, fadeMilliseconds), at);
+}
 
-void setPaused(const pw_player_info *info, bool paused)
+void ksp_voice_exit_loop(ksp_engine *engine, int32_t handle)
 {
-    struct waveData *data = (struct waveData*)info->data;
-    pw_stream_set_active(data->stream, !paused);
+    if (ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command(engine, KSP_COMMAND_EXIT_LOOP, handle, 0, 0);
 }
 
-void stopPlayer(pw_player_info *info)
+uint64_t ksp_engine_get_time(ksp_engine *engine)
 {
-    puts("Stopping player");
-    struct waveData *data = (struct waveData*)info->data;
-    info->playing = false;
-    pw_main_loop_quit(data->loop);
+    return atomic_load_explicit(&engine->time, memory_order_relaxed);
 }
 
-void internalStopPlayer(void *userdata, int signal)
+void ksp_voice_set_paused(ksp_engine *engine, int32_t handle, bool paused)
 {
-    puts("Stopping player");
-    struct waveData *data = userdata;
-    pw_main_loop_quit(data->loop);
+    if (ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command(engine, paused ? KSP_COMMAND_PAUSE : KSP_COMMAND_RESUME, handle, 0, 0);
 }
 
-void setStreamVolume(struct pw_stream *stream, uint32_t channels, float volume)
+void ksp_voice_set_volume(ksp_engine *engine, int32_t handle, float volume)
 {
-    float values[channels];
-    for (uint32_t i = 0; i < channels; i++)
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL)
+        return;
+    atomic_store(&voice->volume, volume);
+    send_command(engine, KSP_COMMAND_SET_VOLUME, handle, volume,
+                 milliseconds_to_frames(engine, KSP_VOLUME_RAMP_MILLISECONDS));
+}
+
+void ksp_voice_set_speed(ksp_engine *engine, int32_t handle, float speedFactor)
+{
+    if (speedFactor <= 0 || ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command(engine, KSP_COMMAND_SET_SPEED, handle, speedFactor, 0);
+}
+
+void ksp_voice_set_bus(ksp_engine *engine, int32_t handle, int32_t bus)
+{
+    if (bus < 0 || bus >= KSP_MAX_BUSES || ksp_voice_lookup(engine, handle) == NULL)
+        return;
+    send_command(engine, KSP_COMMAND_SET_BUS, handle, 0, (uint32_t)bus);
+}
+
+static bool bus_valid(int32_t bus)
+{
+    if (bus >= 0 && bus < KSP_MAX_BUSES)
+        return true;
+    fprintf(stderr, "No bus %d; buses go from 0 to %d\n", bus, KSP_MAX_BUSES - 1);
+    return false;
+}
+
+void ksp_bus_set_gain(ksp_engine *engine, int32_t bus, float gain)
+{
+    if (bus_valid(bus))
+        atomic_store(&engine->buses[bus].gain, gain > 0 ? gain : 0);
+}
+
+void ksp_bus_set_muted(ksp_engine *engine, int32_t bus, bool muted)
+{
+    if (bus_valid(bus))
+        atomic_store(&engine->buses[bus].muted, muted);
+}
+
+bool ksp_bus_set_target(ksp_engine *engine, int32_t bus, const char *target)
+{
+    if (!bus_valid(bus))
+        return false;
+    if (target != NULL && target[0] == '\0')
+        target = NULL;
+    if (bus == 0 && target != NULL)
+    {
+        fputs("Bus 0 always plays through the main output\n", stderr);
+        return false;
+    }
+    if (bus == 0)
+        return true;
+    if (engine->backend->route == NULL)
+    {
+        if (target != NULL)
+            fprintf(stderr, "The %s backend can't give a bus an output of its own\n", engine->backend->name);
+        return target == NULL;
+    }
+    return engine->backend->route(engine, engine->backendData, (uint32_t)bus, target);
+}
+
+//The DSP of a bus, or of the master for KSP_BUS_MASTER
+static ksp_dsp *dsp_of(ksp_engine *engine, int32_t bus)
+{
+    if (bus == KSP_BUS_MASTER)
+        return &engine->master;
+    return bus_valid(bus) ? &engine->buses[bus].dsp : NULL;
+}
+
+void ksp_bus_set_filter(ksp_engine *engine, int32_t bus, int32_t filter, int32_t type, float frequency, float gain,
+                        float q)
+{
+    ksp_dsp *dsp = dsp_of(engine, bus);
+    if (dsp == NULL)
+        return;
+    if (filter < 0 || filter >= KSP_DSP_FILTERS || type < 0 || type >= KSP_FILTER_TYPE_COUNT)
+    {
+        fprintf(stderr, "No filter %d of type %d; filters go from 0 to %d\n", filter, type, KSP_DSP_FILTERS - 1);
+        return;
+    }
+    ksp_dsp_set_filter(dsp, (uint32_t)filter, type, frequency, gain, q);
+}
+
+void ksp_bus_set_limiter(ksp_engine *engine, int32_t bus, bool enabled, float ceiling, float releaseMilliseconds)
+{
+    ksp_dsp *dsp = dsp_of(engine, bus);
+    if (dsp != NULL)
+        ksp_dsp_set_limiter(dsp, enabled, ceiling, releaseMilliseconds);
+}
+
+float ksp_bus_get_gain_reduction(ksp_engine *engine, int32_t bus)
+{
+    ksp_dsp *dsp = dsp_of(engine, bus);
+    return dsp != NULL ? atomic_load_explicit(&dsp->reduction, memory_order_relaxed) : 0;
+}
+
+void ksp_engine_set_resample_quality(ksp_engine *engine, int32_t quality)
+{
+    if (quality < 0 || quality >= KSP_RESAMPLE_QUALITY_COUNT)
     {
-        memcpy(&values[i], &volume, sizeof(float));
+        fprintf(stderr, "Unknown resampling quality: %d\n", quality);
+        return;
     }
-    pw_stream_set_control(stream, SPA_PROP_channelVolumes, channels, values);
+    //Every filter was built when the engine started, so the audio thread simply uses the new ones from its next cycle
+    atomic_store(&engine->resampleQuality, (ksp_resample_quality)quality);
+}
+
+float ksp_voice_get_volume(ksp_engine *engine, int32_t handle)
+{
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL)
+        return 0;
+    return atomic_load(&voice->volume);
 }
 
-void setVolume(const pw_player_info *info, float volume)
+uint32_t ksp_voice_get_underruns(ksp_engine *engine, int32_t handle)
 {
-    assert(info != NULL);
-    struct waveData *data = info->data;
-    
-    assert(data != NULL);
-    uint32_t channels = data->file.formatChunk.channels;
-    setStreamVolume(data->stream, channels, volume);
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL)
+        return 0;
+    return atomic_load(&voice->underruns);
 }
 
-float getVolume(const pw_player_info *info)
+uint64_t ksp_engine_get_underruns(ksp_engine *engine)
 {
-    const struct pw_stream_control *result = pw_stream_get_control(info->data->stream, SPA_PROP_channelVolumes);
-    return result->values[0];
-}
\ No newline at end of file
+    return atomic_load(&engine->underruns);
+}
+
+void ksp_engine_get_stats(ksp_engine *engine, ksp_stats_snapshot *output)
+{
+    ksp_stats_snapshot_read(&engine->stats, output);
+    output->underruns = atomic_load(&engine->underruns);
+}
+
+int32_t ksp_engine_stats_json(ksp_engine *engine, char *buffer, int32_t size)
+{
+    return ksp_stats_json(&engine->stats, atomic_load(&engine->underruns), buffer, size > 0 ? (size_t)size : 0);
+}
+
+int32_t ksp_engine_get_voices(ksp_engine *engine, ksp_voice_snapshot *voices, int32_t max)
+{
+    ksp_voice_meters *meters = &engine->meters;
+    uint32_t limit = max > 0 ? (uint32_t)max : 0;
+    uint32_t before, after, count;
+    do
+    {
+        before = atomic_load_explicit(&meters->sequence, memory_order_acquire);
+        count = atomic_load_explicit(&meters->count, memory_order_relaxed);
+        if (count > limit)
+            count = limit;
+        //A copy torn by the audio thread is thrown away by the check below
+        memcpy(voices, meters->voices, count * sizeof(*voices));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&meters->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return (int32_t)count;
+}
+
+bool ksp_voice_is_playing(ksp_engine *engine, int32_t handle)
+{
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL)
+        return false;
+
+    //A voice whose handle has been handed out is only LOADING while its start command waits in the queue
+    ksp_voice_state state = atomic_load(&voice->state);
+    return state == KSP_VOICE_LOADING || state == KSP_VOICE_PLAYING || state == KSP_VOICE_PAUSED ||
+           state == KSP_VOICE_STOPPING;
+}
+
+bool ksp_voice_is_looping(ksp_engine *engine, int32_t handle)
+{
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL || !ksp_voice_is_playing(engine, handle))
+        return false;
+    return voice->loopEnd > 0 && !voice->loopExit;
+}
+
+void ksp_voice_wait(ksp_engine *engine, int32_t handle)
+{
+    ksp_voice *voice = ksp_voice_lookup(engine, handle);
+    if (voice == NULL)
+        return;
+
+    while (ksp_voice_is_playing(engine, handle))
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += KSP_VOICE_WAIT_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&voice->finished, &deadline);
+    }
+    ksp_voice_reap(engine);
+}
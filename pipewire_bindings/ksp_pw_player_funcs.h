@@ -3,16 +3,105 @@
 
 #include "ksp_pw_structs.h"
 
-void setPaused(const pw_player_info *info, bool paused);
+int ksp_voice_claim(ksp_engine *engine);
 
-void stopPlayer(pw_player_info *info);
+void ksp_voice_release(ksp_engine *engine, ksp_voice *voice);
 
-void internalStopPlayer(void *userdata, int signal);
+//Releases the resources of every voice the audio thread has finished with. Those are otherwise only released once
+//their slot is claimed again, and until then hold on to their sample, its mapping and any stream.
+void ksp_voice_reap(ksp_engine *engine);
 
-void setStreamVolume(struct pw_stream *stream, uint32_t channels, float volume);
+ksp_voice *ksp_voice_lookup(ksp_engine *engine, int32_t handle);
 
-void setVolume(const pw_player_info *info, float volume);
+//Source frames a voice of sample advances by per output frame at the given speed
+double ksp_voice_step(const ksp_engine *engine, const ksp_sample *sample, float speedFactor);
 
-float getVolume(const pw_player_info *info);
+/* Applies a sample's retrigger policy and polyphony limit before another voice of it is started, and steals a voice
+ * if the pool is full. Voices are cut off with a short fade, and keep their slots until it ends. Must be called with
+ * the engine's voiceLock held. Returns false if the voice shouldn't be started at all. */
+bool ksp_voice_make_room(ksp_engine *engine, const ksp_sample *sample, const ksp_voice_params *params);
 
-#endif
\ No newline at end of file
+//Picks which voice is stolen when the pool is full, as a ksp_steal_policy
+void ksp_engine_set_steal_policy(ksp_engine *engine, int32_t policy);
+
+void ksp_voice_stop(ksp_engine *engine, int32_t handle);
+
+void ksp_voice_fade_out(ksp_engine *engine, int32_t handle, int32_t fadeMilliseconds);
+
+//Fades the voice out over fadeMilliseconds from frame at of the engine's clock, which may be offset from the next
+//cycle with KSP_TIME_NEXT_CYCLE. A voice stopped before it has started never starts.
+void ksp_voice_stop_at(ksp_engine *engine, int32_t handle, int32_t fadeMilliseconds, uint64_t at);
+
+//Lets a looping voice carry on past its loop to the end of the sound, once it has finished the pass it is on. Voices
+//that aren't looping are left alone.
+void ksp_voice_exit_loop(ksp_engine *engine, int32_t handle);
+
+//The engine's clock: frames mixed since it started, up to the start of the cycle after the one being mixed. Commands
+//stamped with this time or later take effect on the exact frame, unless they are read after it has been mixed.
+uint64_t ksp_engine_get_time(ksp_engine *engine);
+
+void ksp_voice_set_paused(ksp_engine *engine, int32_t handle, bool paused);
+
+void ksp_voice_set_volume(ksp_engine *engine, int32_t handle, float volume);
+
+//Changes the speed of a playing voice without restarting it. A voice started with timeStretch keeps its pitch; any
+//other changes pitch along with speed.
+void ksp_voice_set_speed(ksp_engine *engine, int32_t handle, float speedFactor);
+
+//Moves a voice to another bus without restarting it
+void ksp_voice_set_bus(ksp_engine *engine, int32_t handle, int32_t bus);
+
+//Sets the gain every voice on the bus is multiplied by. Changes are ramped, so they don't click.
+void ksp_bus_set_gain(ksp_engine *engine, int32_t bus, float gain);
+
+void ksp_bus_set_muted(ksp_engine *engine, int32_t bus, bool muted);
+
+/* Plays a bus through an output of its own, connected to the PipeWire node named by target, or back through the
+ * engine's main output if target is NULL or empty. Voices on the bus carry on playing throughout. Bus 0 always plays
+ * through the main output. Returns false if the bus couldn't be given its own output, in which case it plays through
+ * the main output instead. */
+bool ksp_bus_set_target(ksp_engine *engine, int32_t bus, const char *target);
+
+/* Sets up one of the KSP_DSP_FILTERS filters a bus's voices are run through, before the bus's gain, or one of the
+ * master's with KSP_BUS_MASTER. type is a ksp_filter_type; KSP_FILTER_OFF takes the filter out. frequency is in Hz,
+ * and gain, in dB, only matters to peak and shelf filters. Changes take effect from the next block. */
+void ksp_bus_set_filter(ksp_engine *engine, int32_t bus, int32_t filter, int32_t type, float frequency, float gain,
+                        float q);
+
+/* Turns a bus's look-ahead limiter on or off, or the master's with KSP_BUS_MASTER. Nothing gets past ceiling, in
+ * dBFS, and the gain recovers over releaseMilliseconds. The limiter delays the audio by
+ * KSP_LIMITER_LOOKAHEAD_MILLISECONDS. */
+void ksp_bus_set_limiter(ksp_engine *engine, int32_t bus, bool enabled, float ceiling, float releaseMilliseconds);
+
+//Most a bus's limiter, or the master's with KSP_BUS_MASTER, turned its audio down by in the last cycle, in dB
+float ksp_bus_get_gain_reduction(ksp_engine *engine, int32_t bus);
+
+void ksp_engine_set_resample_quality(ksp_engine *engine, int32_t quality);
+
+float ksp_voice_get_volume(ksp_engine *engine, int32_t handle);
+
+//Number of audio cycles in which a streamed voice ran out of audio read from the disk
+uint32_t ksp_voice_get_underruns(ksp_engine *engine, int32_t handle);
+
+uint64_t ksp_engine_get_underruns(ksp_engine *engine);
+
+void ksp_engine_get_stats(ksp_engine *engine, ksp_stats_snapshot *output);
+
+//Writes every counter and histogram the engine keeps as JSON. Returns the length needed, like snprintf.
+int32_t ksp_engine_stats_json(ksp_engine *engine, char *buffer, int32_t size);
+
+/* Copies up to max voices' playheads and level meters, as of the end of the engine's last cycle, into voices, and
+ * returns how many there were. Every voice that is playing, paused or stopping is there. Never waits for the audio
+ * thread, which publishes them every cycle, so it can be called as often as a display is redrawn. */
+int32_t ksp_engine_get_voices(ksp_engine *engine, ksp_voice_snapshot *voices, int32_t max);
+
+bool ksp_voice_is_playing(ksp_engine *engine, int32_t handle);
+
+//Whether a voice is going round a loop and hasn't been told to leave it. A voice that was asked to loop doesn't if its
+//sample is streamed or its loop is empty. Set up before the voice starts, so it is known as soon as it is triggered.
+bool ksp_voice_is_looping(ksp_engine *engine, int32_t handle);
+
+//Blocks until the voice has finished, then releases it along with any other finished voices
+void ksp_voice_wait(ksp_engine *engine, int32_t handle);
+
+#endif
@@ -38,12 +38,11 @@ Audio source using \ref pw_stream "pw_stream".
 */
 
 #include <assert.h>
-#include <FLAC/stream_decoder.h>
 #include <errno.h>
 #include <libgen.h>
 #include <math.h>
 #include <pipewire-0.3/pipewire/loop.h>
-#include <pipewire-0.3/pipewire/main-loop.h>
+#include <pipewire-0.3/pipewire/thread-loop.h>
 #include <pipewire-0.3/pipewire/stream.h>
 #include <pipewire/context.h>
 #include <pipewire/keys.h>
@@ -57,6 +56,7 @@ Audio source using \ref pw_stream "pw_stream".
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -68,243 +68,628 @@ Audio source using \ref pw_stream "pw_stream".
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "ksp_pw_structs.h"
 #include "ksp_pw_process_funcs.h"
 #include "ksp_pw_player_funcs.h"
+#include "ksp_pw_player_main.h"
+#include "ksp_pw_sample_bank.h"
+#include "ksp_pw_wave.h"
 
-void setVolume(const pw_player_info *info, float volume);
-void setStreamVolume(struct pw_stream *stream, uint32_t channels, float volume);
-
-waveFileLoadInfo ReadWave(const char *filePath)
+/* Maps the whole file once and parses it in place. The returned descriptor's data pointer points straight at the
+ * PCM data inside the mapping, which stays mapped until UnloadWave. On failure the data pointer is NULL. */
+waveFileLoadInfo ReadWave(const char *filePath, bool preload)
 {
-    //size_t read = 0;
-    FILE *file = fopen(filePath, "rb");
     struct waveFileLoadInfo output = {0};
-    fread(output.file.chunkId, 1, 4, file);
-    output.file.chunkId[4] = '\0';
-    /*if (strcmp(output.chunkId, "fLaC") == 0) //Toto, I don't think we're in
-    Redmond anymore
-    {
-        int8_t metadataBlockHeader;
-        read += fread(&metadataBlockHeader, 1, 1, file);
-        bool lastMetadataBlock = metadataBlockHeader & 0x70000000;
-        uint8_t blockType = *(uint8_t*)&metadataBlockHeader & 0b01111111;
-        int24 blockDataSize;
-        read += fread(&blockDataSize, 3, 1, file);
-        fputs("FLAC decoder support is not implemented!", stderr);
-    }*/
-    fread(&output.file.chunkSize, 4, 1, file);
-    fread(output.file.format, 1, 4, file);
-    output.file.format[4] = '\0';
-
-    while (ftello(file) < output.file.chunkSize)
-    {
-        char blockId[5] = {0};
-        fread(blockId, 1, 4, file);
-        if (blockId[0] == '\0')
-            break;
-        if (strncmp(blockId, "fmt ", 4) == 0)
-        {
-            uint32_t fmtSize;
-            fread(&fmtSize, 4, 1, file);
-            fread(&output.file.formatChunk, sizeof(struct waveFormatSubChunk), 1, file);
-            uint16_t dummy;
-            size_t bytesRead = sizeof(struct waveFormatSubChunk);
-            while (bytesRead < fmtSize)
-            {
-                fread(&dummy, 2, 1, file);
-                bytesRead += 2;
-            }
-        }
-        else if (strncmp(blockId, "data", 4) == 0)
-        {
-            uint32_t size;
-            fread(&size, 4, 1, file);
-            output.file.dataChunk.dataSize = size;
-
-#ifdef USE_OLD_SOUND_FILE_READER
-            output.dataChunk.data = malloc(size);
-            if (output.dataChunk.data == NULL)
-            {
-                fprintf(stderr, "Could not allocate %u bytes for wave data!\n", output.dataChunk.dataSize);
-                return output;
-            }
-            fread(output.dataChunk.data, 1, output.dataChunk.dataSize, file);
-#else
-            //Map the file into memory for faster reading and lower memory usage
-            int fd = open(filePath, O_RDONLY);
-            output.mmapUsed = true;
-            output.mmapOffset = ftello(file);
-            output.file.dataChunk.data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) + output.mmapOffset;
+    int fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filePath, strerror(errno));
+        if (fd >= 0)
             close(fd);
-            fseeko(file, size, ftello(file));
-            if (output.file.dataChunk.data == MAP_FAILED) 
-            {
-                fprintf(stderr, "Could not map file: %s\n", strerror(errno));
-                output.file.dataChunk.data = NULL;
-            }
-#endif
+        return output;
+    }
 
-        }
-        else
-        {
-            uint32_t chunkSize;
-            fread(&chunkSize, 4, 1, file);
-            uint8_t dummy;
-            for (uint32_t i = 0; i < chunkSize && !feof(file); i++)
-            {
-                fread(&dummy, 1, 1, file);
-            }
-        }
+    //Preloaded files are faulted in up front so the audio thread never waits on the disk
+    int mapFlags = MAP_PRIVATE | (preload ? MAP_POPULATE : 0);
+    void *map = status.st_size > 0 ? mmap(NULL, status.st_size, PROT_READ, mapFlags, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", filePath, status.st_size > 0 ? strerror(errno) : "file is empty");
+        return output;
+    }
+
+    if (!ksp_wave_parse(filePath, map, status.st_size, &output.file))
+    {
+        munmap(map, status.st_size);
+        output.file.dataChunk.data = NULL;
+        return output;
     }
-    fclose(file);
+    output.mmapUsed = true;
+    output.mmapOffset = output.file.dataChunk.data - (uint8_t *)map;
+    output.mmapLength = status.st_size;
+    if (preload)
+        madvise(output.file.dataChunk.data, output.file.dataChunk.dataSize, MADV_WILLNEED);
     return output;
 }
 
-/* our data processing function is in general:
- *
- *  struct pw_buffer *b;
- *  b = pw_stream_dequeue_buffer(stream);
- *
- *  .. generate stuff in the buffer ...
- *
- *  pw_stream_queue_buffer(stream, b);
- */
+void UnloadWave(waveFileLoadInfo *loadInfo)
+{
+    struct waveFile *file = &loadInfo->file;
+    if (file->dataChunk.data == NULL)
+        return;
 
+    if (loadInfo->mmapUsed)
+    {
+        munmap(file->dataChunk.data - loadInfo->mmapOffset, loadInfo->mmapLength);
+    }
+    else
+    {
+        free(file->dataChunk.data);
+    }
+    file->dataChunk.data = NULL;
+}
 
+/* The stream events must outlive the stream, which now lives as long as the engine does. */
+static const struct pw_stream_events stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .process = ksp_process_engine,
+};
 
-void startPlayer(pw_player_info *info, int argc, char **argv)
+//Hands a bus's own output whatever the engine has mixed for it since the last cycle
+static void process_bus(void *userdata)
 {
-    puts("Native Pipewire backend: starting");
-    info->format = Wave;
-    clock_t start = clock();
-    char *filePath = info->fileName;
-    const struct spa_pod *params[2];
+    ksp_bus *bus = userdata;
+    struct pw_buffer *b;
+    if ((b = pw_stream_dequeue_buffer(bus->stream)) == NULL)
+        return;
+
+    struct spa_buffer *buf = b->buffer;
+    float *dst = buf->datas[0].data;
+    //Handed straight back, or the stream would run out of buffers
+    if (dst == NULL)
+    {
+        pw_stream_queue_buffer(bus->stream, b);
+        return;
+    }
+    uint32_t stride = sizeof(float) * bus->channels;
+    uint32_t n_frames = buf->datas[0].maxsize / stride;
+    if (b->requested)
+        n_frames = SPA_MIN(b->requested, n_frames);
+
+    ksp_bus_read(bus, dst, n_frames);
+
+    buf->datas[0].chunk->offset = 0;
+    buf->datas[0].chunk->stride = stride;
+    buf->datas[0].chunk->size = n_frames * stride;
+    pw_stream_queue_buffer(bus->stream, b);
+}
+
+static const struct pw_stream_events bus_stream_events = {
+    PW_VERSION_STREAM_EVENTS,
+    .process = process_bus,
+};
+
+/* Creates and connects an output stream in the engine's format. target is the name or serial of the node to connect
+ * to, or NULL for whichever the session manager picks. Must be called with the loop locked. */
+static struct pw_stream *connect_stream(ksp_engine *engine, const char *name, const char *target,
+                                        const struct pw_stream_events *events, void *userdata)
+{
+    const struct spa_pod *params[1];
     uint8_t buffer[1024];
-    struct pw_properties *props;
     struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-    pw_init(&argc, &argv);
-
-    struct waveFileLoadInfo fileLoadInfo = ReadWave(filePath);
-    if (fileLoadInfo.file.dataChunk.data == NULL) return;
-    struct waveFile file = fileLoadInfo.file;
-    struct waveData waveData = {0};
-    //printf("%p\n", &waveData);
-    info->data = &waveData;
-    waveData.sampleIndex = 0;
-    waveData.file = file;
-    waveData.loop = pw_main_loop_new(NULL);
-    waveData.playerInfo = info;
-    pw_loop_add_signal(pw_main_loop_get_loop(waveData.loop), SIGINT, internalStopPlayer, &waveData);
-    pw_loop_add_signal(pw_main_loop_get_loop(waveData.loop), SIGTERM, internalStopPlayer, &waveData);
-
-    enum spa_audio_format format = SPA_AUDIO_FORMAT_UNKNOWN;
-
-    struct pw_stream_events stream_events = {
-        PW_VERSION_STREAM_EVENTS,
-        .process = ksp_process_16,
-        .command = NULL,
-    };
-
-    switch (file.formatChunk.bitsPerSample)
-    {
-        case 8:
-            format = SPA_AUDIO_FORMAT_U8;
-            stream_events.process = ksp_process_8;
-            break;
-        case 16:
-            format = SPA_AUDIO_FORMAT_S16;
-            stream_events.process = ksp_process_16;
-            break;
-        case 24:
-            format = SPA_AUDIO_FORMAT_S24;
-            stream_events.process = ksp_process_24;
-            break;
-        case 32:
-            format = SPA_AUDIO_FORMAT_S32;
-            stream_events.process = ksp_process_32;
-            break;
-        default:
-            fprintf(stderr, "Unsupported audio bits per sample: %u", file.formatChunk.bitsPerSample);
-    }
-
-    //Samples for a time length- sampleRate * seconds
-
-    /*uint32_t fadeInSamples = info->fadeInMilliseconds * file.formatChunk.sampleRate / 1000;
-    //uint32_t fadeOutSamples = info->fadeOutMilliseconds * file.formatChunk.sampleRate / 1000;
-    uint32_t bytesPerSample = file.formatChunk.bitsPerSample / 8; //Maybe replace with preprocessor constant later
-    for (uint32_t i = 0; i < fadeInSamples && i < file.dataChunk.dataSize / bytesPerSample; i++)
-    {
-        for (int j = 0; j < bytesPerSample; j++)
+    struct pw_properties *props =
+        pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio", PW_KEY_MEDIA_CATEGORY, "Playback", PW_KEY_MEDIA_ROLE, "Music",
+                          PW_KEY_APP_ID, "com.calebmharper.ksp", PW_KEY_APP_NAME, "KarrotSoundProduction", NULL);
+    if (target != NULL)
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, target);
+    struct pw_stream *stream =
+        pw_stream_new_simple(pw_thread_loop_get_loop(engine->loop), name, props, events, userdata);
+    if (stream == NULL)
+        return NULL;
+
+    /* The engine always produces interleaved float. Each voice is converted from its own
+     * format and rate while it is mixed, so the format is negotiated exactly once. */
+    struct spa_audio_info_raw info = SPA_AUDIO_INFO_RAW_INIT(
+        .format = SPA_AUDIO_FORMAT_F32, .channels = engine->channels, .rate = engine->sampleRate);
+    if (engine->channels == 2)
+    {
+        info.position[0] = SPA_AUDIO_CHANNEL_FL;
+        info.position[1] = SPA_AUDIO_CHANNEL_FR;
+    }
+    params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &info);
+
+    if (pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+                          PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS,
+                          params, 1) < 0)
+    {
+        pw_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static void pipewire_close(ksp_engine *engine, void *backend)
+{
+    if (engine->loop != NULL)
+    {
+        pw_thread_loop_lock(engine->loop);
+        for (int i = 0; i < KSP_MAX_BUSES; i++)
         {
-            file.dataChunk.data[(i * bytesPerSample) + j] *= (float)i / fadeInSamples;
+            if (engine->buses[i].stream != NULL)
+                pw_stream_destroy(engine->buses[i].stream);
+            engine->buses[i].stream = NULL;
         }
-    }*/
-
-    /*struct data data = {
-        0,
-    };*/
-
-    /* make a main loop. If you already have another main loop, you can add
-     * the fd of this pipewire mainloop to it. */
-    // data.loop = pw_main_loop_new(NULL);
-
-    // pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGINT, do_quit,
-    // &data); pw_loop_add_signal(pw_main_loop_get_loop(data.loop), SIGTERM,
-    // do_quit, &data);
-
-    /* Create a simple stream, the simple stream manages the core and remote
-     * objects for you if you don't need to deal with them.
-     *
-     * If you plan to autoconnect your stream, you need to provide at least
-     * media, category and role properties.
-     *
-     * Pass your events and a user_data pointer as the last arguments. This
-     * will inform you about the stream state. The most important event
-     * you need to listen to is the process event where you need to produce
-     * the data.
-     */
-    props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio", PW_KEY_MEDIA_CATEGORY, "Playback", PW_KEY_MEDIA_ROLE, "Music",
-                              PW_KEY_APP_ID, "com.calebmharper.ksp", PW_KEY_APP_NAME, "KarrotSoundProduction", NULL);
-    /* Set stream target if given on command line */
-    pw_properties_set(props, PW_KEY_MEDIA_FILENAME, filePath);
-    waveData.stream = pw_stream_new_simple(pw_main_loop_get_loop(waveData.loop), basename(filePath), props,
-                                           &stream_events, info);
-
-    /* Make one parameter with the supported formats. The SPA_PARAM_EnumFormat
-     * id means that this is a format enumeration (of 1 value). */
-    uint32_t sampleRate = file.formatChunk.sampleRate * info->speedFactor;
-    fprintf(stderr, "Using sample rate of %dHz(Actual rate is %dHz)\n", sampleRate, file.formatChunk.sampleRate);
-    params[0] =
-        spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
-                                   &SPA_AUDIO_INFO_RAW_INIT(.format = format, .channels = file.formatChunk.channels,
-                                                            .rate = sampleRate));
-
-    clock_t end = clock();
-    double elapsed = (end - start) / (double)CLOCKS_PER_SEC;
-    printf("File load time: %.15gms\n", elapsed * 1000);
-
-    /* Now connect this stream. We ask that our process function is
-     * called in a realtime thread. */
-    pw_stream_connect(waveData.stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
-                      PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS, params, 1);
-
-    /* and wait while we let things run */
-    pw_main_loop_run(waveData.loop);
-
-    pw_stream_destroy(waveData.stream);
-    pw_main_loop_destroy(waveData.loop);
+        if (engine->stream != NULL)
+            pw_stream_destroy(engine->stream);
+        pw_thread_loop_unlock(engine->loop);
+        pw_thread_loop_stop(engine->loop);
+        pw_thread_loop_destroy(engine->loop);
+    }
+    engine->stream = NULL;
+    engine->loop = NULL;
     pw_deinit();
+}
 
-    if (fileLoadInfo.mmapUsed)
+//The PipeWire backend keeps its state in the engine's loop and streams
+static void *pipewire_open(ksp_engine *engine, const char *output)
+{
+    pw_init(NULL, NULL);
+
+    /* One thread loop serves every voice. The stream's process callback runs in
+     * PipeWire's realtime data thread and mixes all active voices into a single buffer. */
+    engine->loop = pw_thread_loop_new("ksp-engine", NULL);
+    if (engine->loop == NULL || pw_thread_loop_start(engine->loop) < 0)
     {
-        munmap(file.dataChunk.data - fileLoadInfo.mmapOffset, file.dataChunk.dataSize + fileLoadInfo.mmapOffset);
+        fputs("Could not start the PipeWire thread loop!\n", stderr);
+        pipewire_close(engine, engine);
+        return NULL;
     }
-    else
+
+    pw_thread_loop_lock(engine->loop);
+    engine->stream = connect_stream(engine, "KarrotSoundProduction", NULL, &stream_events, engine);
+    pw_thread_loop_unlock(engine->loop);
+    if (engine->stream == NULL)
+    {
+        fputs("Could not create the PipeWire stream!\n", stderr);
+        pipewire_close(engine, engine);
+        return NULL;
+    }
+    return engine;
+}
+
+/* Each routed bus gets a stream of its own, which only copies out what the main stream's cycle mixed for it. A bus
+ * being moved to another node keeps its ring, and goes on being mixed into it throughout, so only the new stream's
+ * first cycle or two is lost; a bus going back to the main output is mixed into it from the next block. */
+static bool pipewire_route(ksp_engine *engine, void *backend, uint32_t index, const char *target)
+{
+    ksp_bus *bus = &engine->buses[index];
+    bool routed = true;
+    pw_thread_loop_lock(engine->loop);
+    if (target == NULL)
+        atomic_store_explicit(&bus->routed, false, memory_order_release);
+    if (bus->stream != NULL)
+        pw_stream_destroy(bus->stream);
+    bus->stream = NULL;
+
+    if (target != NULL)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "KarrotSoundProduction bus %u", index);
+        if (ksp_bus_open_ring(bus))
+            bus->stream = connect_stream(engine, name, target, &bus_stream_events, bus);
+        routed = bus->stream != NULL;
+        atomic_store_explicit(&bus->routed, routed, memory_order_release);
+    }
+    pw_thread_loop_unlock(engine->loop);
+    return routed;
+}
+
+const ksp_backend_ops ksp_pipewire_backend = {
+    .name = "PipeWire",
+    .open = pipewire_open,
+    .close = pipewire_close,
+    .route = pipewire_route,
+};
+
+ksp_engine *ksp_engine_create(uint32_t sampleRate, uint32_t channels)
+{
+    return ksp_engine_create_backend(sampleRate, channels, KSP_BACKEND_PIPEWIRE, NULL);
+}
+
+ksp_engine *ksp_engine_create_backend(uint32_t sampleRate, uint32_t channels, int32_t backend, const char *output)
+{
+    if (channels == 0 || channels > SPA_AUDIO_MAX_CHANNELS)
+    {
+        fprintf(stderr, "Unsupported engine channel count: %u\n", channels);
+        return NULL;
+    }
+    if (ksp_backend_get(backend) == NULL)
     {
-        free(file.dataChunk.data);
+        fprintf(stderr, "Unknown audio backend: %d\n", backend);
+        return NULL;
     }
+
+    ksp_engine *engine = calloc(1, sizeof(ksp_engine));
+    if (engine == NULL)
+    {
+        fputs("Could not allocate the audio engine!\n", stderr);
+        return NULL;
+    }
+    engine->sampleRate = sampleRate;
+    engine->channels = channels;
+    engine->kernels = ksp_kernels_get(KSP_ISA_BEST);
+    printf("Using %s mixing kernels\n", engine->kernels->name);
+    ksp_bank_init(&engine->bank);
+    ksp_command_queue_init(&engine->commands);
+    pthread_mutex_init(&engine->voiceLock, NULL);
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        sem_init(&engine->voices[i].finished, 0, 0);
+    }
+    for (int i = 0; i < KSP_MAX_BUSES; i++)
+    {
+        if (!ksp_bus_init(&engine->buses[i], channels, sampleRate))
+        {
+            fputs("Could not allocate the engine's buses!\n", stderr);
+            ksp_engine_destroy(engine);
+            return NULL;
+        }
+    }
+    if (!ksp_dsp_init(&engine->master, channels, sampleRate, KSP_BUS_BLOCK_FRAMES))
+    {
+        fputs("Could not allocate the engine's limiter!\n", stderr);
+        ksp_engine_destroy(engine);
+        return NULL;
+    }
+    for (int i = 0; i < KSP_RESAMPLE_QUALITY_COUNT; i++)
+    {
+        if (!ksp_resampler_init(&engine->resamplers[i], i))
+        {
+            fputs("Could not allocate the resampling filters!\n", stderr);
+            ksp_engine_destroy(engine);
+            return NULL;
+        }
+    }
+    engine->resampleQuality = KSP_RESAMPLE_DEFAULT_QUALITY;
+    if (!ksp_streamer_start(&engine->streamer))
+    {
+        fputs("Could not start the streaming thread!\n", stderr);
+        ksp_engine_destroy(engine);
+        return NULL;
+    }
+
+    //Everything the audio thread touches has to be ready before the backend starts pulling from the engine
+    engine->backend = ksp_backend_get(backend);
+    printf("Using the %s audio backend\n", engine->backend->name);
+    engine->backendData = engine->backend->open(engine, output);
+    if (engine->backendData == NULL)
+    {
+        fprintf(stderr, "Could not start the %s audio backend!\n", engine->backend->name);
+        ksp_engine_destroy(engine);
+        return NULL;
+    }
+
+    return engine;
+}
+
+void ksp_engine_destroy(ksp_engine *engine)
+{
+    if (engine == NULL)
+        return;
+
+    if (engine->backendData != NULL)
+        engine->backend->close(engine, engine->backendData);
+    engine->backendData = NULL;
+
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        ksp_voice_release(engine, &engine->voices[i]);
+        sem_destroy(&engine->voices[i].finished);
+    }
+    pthread_mutex_destroy(&engine->voiceLock);
+    ksp_streamer_stop(&engine->streamer);
+    ksp_bank_destroy(&engine->bank);
+    for (int i = 0; i < KSP_MAX_BUSES; i++)
+        ksp_bus_destroy(&engine->buses[i]);
+    ksp_dsp_destroy(&engine->master);
+    for (int i = 0; i < KSP_RESAMPLE_QUALITY_COUNT; i++)
+        ksp_resampler_destroy(&engine->resamplers[i]);
+    free(engine);
+}
+
+//How the voices started by start_cues relate to one another
+typedef enum cue_mode
+{
+    CUE_NOW,   //A single voice, started straight away unless it has a pre-wait
+    CUE_GROUP, //Every voice starts on the same frame, each after its own pre-wait
+    CUE_CHAIN  //Each voice starts when the one before it reaches its end, after its own pre-wait
+} cue_mode;
+
+//Opens what a voice of the sample needs before the engine's voices are locked: a reference to the sample, and a
+//decoder if it is streamed, which has the start of the sound ready by the time the voice is started
+static ksp_sample *open_cue(ksp_engine *engine, int32_t sampleId, ksp_stream **stream)
+{
+    *stream = NULL;
+    ksp_sample *sample = ksp_sample_ref(&engine->bank, sampleId);
+    if (sample == NULL)
+    {
+        fprintf(stderr, "No sample is loaded with ID %d\n", sampleId);
+        return NULL;
+    }
+    if (sample->decoder != NULL)
+    {
+        *stream = ksp_stream_open(sample->decoder, sample->filePath);
+        if (*stream == NULL)
+        {
+            ksp_sample_unref(&engine->bank, sample);
+            return NULL;
+        }
+    }
+    return sample;
+}
+
+static void close_cue(ksp_engine *engine, ksp_sample *sample, ksp_stream *stream)
+{
+    ksp_stream_close(stream);
+    ksp_sample_unref(&engine->bank, sample);
+}
+
+/* Works out where a voice loops: between the points in its params, or those stored in the sample, or around the whole
+ * sample. Streamed samples can't be read twice, so they never loop; loading with KSP_BANK_RESIDENT keeps a sample
+ * from being streamed. The seam's crossfade takes less than half the loop, so there is always some of it that plays
+ * on its own, and where the loop can be let go of. */
+static void set_loop(const ksp_engine *engine, ksp_voice *voice, const ksp_voice_params *params)
+{
+    const ksp_sample *sample = voice->sample;
+    voice->loopStart = 0;
+    voice->loopEnd = 0;
+    voice->loopCrossfade = 0;
+    voice->loopExit = false;
+    if (!params->loop)
+        return;
+    if (voice->stream != NULL)
+    {
+        fprintf(stderr, "%s is streamed, so it can't loop; playing it once\n", sample->filePath);
+        return;
+    }
+
+    uint32_t start = 0;
+    uint32_t end = sample->frameCount;
+    if (params->loopEnd > 0)
+    {
+        start = params->loopStart > 0 ? (uint32_t)params->loopStart : 0;
+        end = (uint32_t)params->loopEnd < sample->frameCount ? (uint32_t)params->loopEnd : sample->frameCount;
+    }
+    else if (sample->loopEnd > 0)
+    {
+        start = sample->loopStart;
+        end = sample->loopEnd;
+    }
+    if (end <= start)
+    {
+        fprintf(stderr, "Loop from frame %u to %u is empty, playing the sound once\n", start, end);
+        return;
+    }
+
+    uint64_t crossfade = params->loopCrossfadeMilliseconds > 0
+                             ? (uint64_t)params->loopCrossfadeMilliseconds * sample->sampleRate / 1000
+                             : 0;
+    voice->loopStart = start;
+    voice->loopEnd = end;
+    voice->loopCrossfade = crossfade < (end - start - 1) / 2 ? (uint32_t)crossfade : (end - start - 1) / 2;
+}
+
+//Claims a voice and sets it up to play the sample, taking over the cue's references. The voice is left LOADING for
+//the caller to start. Must be called with voiceLock held. On failure the cue is closed and -1 returned.
+static int32_t prepare_voice(ksp_engine *engine, ksp_sample *sample, ksp_stream *stream,
+                             const ksp_voice_params *params)
+{
+    int slot = -1;
+    //A retrigger the sound's policy ignores is expected, so only running out of voices is reported
+    if (ksp_voice_make_room(engine, sample, params) && (slot = ksp_voice_claim(engine)) < 0)
+        fputs("No free voices!\n", stderr);
+    if (slot < 0)
+    {
+        close_cue(engine, sample, stream);
+        return -1;
+    }
+
+    ksp_voice *voice = &engine->voices[slot];
+    voice->sample = sample;
+    voice->stream = stream;
+    voice->params = *params;
+    voice->position = 0;
+    voice->cutOff = false;
+
+    voice->step = ksp_voice_step(engine, sample, params->speedFactor);
+    voice->stretch = NULL;
+    if (params->timeStretch)
+    {
+        voice->stretch = ksp_stretch_create(sample->channels, sample->sampleRate, engine->sampleRate);
+        if (voice->stretch == NULL)
+            fputs("Failed to allocate time stretching, the sound's pitch will follow its speed\n", stderr);
+    }
+    voice->fadeInFrames = (double)params->fadeInMilliseconds * sample->sampleRate / 1000;
+    //Without a known length there is no telling where the fade out at the end should start
+    voice->fadeOutFrames = sample->frameCount > 0 ? (double)params->fadeOutMilliseconds * sample->sampleRate / 1000 : 0;
+    voice->gain = params->volume;
+    voice->gainTarget = params->volume;
+    voice->gainRampFrames = 0;
+    voice->stopFrames = 0;
+    voice->stopRemaining = 0;
+    voice->preWaitFrames = params->preWaitMilliseconds > 0
+                               ? (uint32_t)((uint64_t)params->preWaitMilliseconds * engine->sampleRate / 1000)
+                               : 0;
+    voice->follower = -1;
+    voice->fadesOut = -1;
+    voice->fadeCurve = params->fadeCurve > 0 && params->fadeCurve < KSP_FADE_CURVE_COUNT ? params->fadeCurve
+                                                                                        : KSP_FADE_LINEAR;
+    voice->bus = params->bus > 0 && params->bus < KSP_MAX_BUSES ? (uint32_t)params->bus : 0;
+    voice->stopCurve = voice->fadeCurve;
+    set_loop(engine, voice, params);
+    atomic_store(&voice->group, 0);
+    atomic_store(&voice->volume, params->volume);
+    atomic_store(&voice->underruns, 0);
+    //Until it has been mixed, a voice counts as being as loud as it starts out
+    atomic_store(&voice->level, params->volume * (voice->fadeInFrames > 0 ? params->minVolume : params->maxVolume));
+    voice->startNs = ksp_now_ns();
+    voice->queued = false;
+    memset(voice->meterPeaks, 0, sizeof(voice->meterPeaks));
+    memset(voice->meterSquares, 0, sizeof(voice->meterSquares));
+    memset(voice->cyclePeaks, 0, sizeof(voice->cyclePeaks));
+    memset(voice->cycleSquares, 0, sizeof(voice->cycleSquares));
+
+    if (stream != NULL)
+        ksp_streamer_add(&engine->streamer, stream);
+
+    return KSP_VOICE_HANDLE(slot, atomic_load(&voice->generation));
+}
+
+/* Claims voices for count samples and starts them at frame at of the engine's clock, related as mode says. Voices are
+ * started one lot at a time, so each start's retrigger policy and the voice pool see the ones started before it.
+ * Returns the number of voices started, whose handles are written to handles if it isn't NULL; the others get -1. A
+ * chain stops at the first voice that can't be started. If fadesOut is a voice, it is faded out over the first
+ * voice's fade in, from the frame that voice starts on. */
+static int32_t start_cues(ksp_engine *engine, const int32_t *sampleIds, const ksp_voice_params *params, int32_t count,
+                          uint64_t at, cue_mode mode, int32_t *handles, int32_t fadesOut)
+{
+    if (count < 1 || count > KSP_MAX_VOICES)
+    {
+        fprintf(stderr, "Cannot start %d voices at once\n", count);
+        return 0;
+    }
+
+    //Everything that can block on the disk is done before the lock is taken
+    ksp_sample *samples[KSP_MAX_VOICES];
+    ksp_stream *streams[KSP_MAX_VOICES];
+    for (int32_t i = 0; i < count; i++)
+        samples[i] = open_cue(engine, sampleIds[i], &streams[i]);
+
+    pthread_mutex_lock(&engine->voiceLock);
+    int32_t started[KSP_MAX_VOICES];
+    int32_t startedCount = 0;
+    bool broken = false;
+    for (int32_t i = 0; i < count; i++)
+    {
+        int32_t handle = -1;
+        if (samples[i] != NULL && !broken)
+            handle = prepare_voice(engine, samples[i], streams[i], &params[i]);
+        else if (samples[i] != NULL)
+            close_cue(engine, samples[i], streams[i]);
+        if (handles != NULL)
+            handles[i] = handle;
+        if (handle >= 0)
+            started[startedCount++] = handle;
+        else if (mode == CUE_CHAIN)
+            broken = true;
+    }
+    if (startedCount == 0)
+    {
+        pthread_mutex_unlock(&engine->voiceLock);
+        return 0;
+    }
+
+    //The links are in place before the start command is sent, and belong to the audio thread from then on
+    uint32_t group = 0;
+    if (mode == CUE_GROUP && startedCount > 1)
+    {
+        while ((group = atomic_fetch_add(&engine->nextGroup, 1) + 1) == 0)
+            ;
+    }
+    for (int32_t i = 0; i < startedCount; i++)
+    {
+        ksp_voice *voice = &engine->voices[KSP_VOICE_SLOT(started[i])];
+        if (mode == CUE_CHAIN && i + 1 < startedCount)
+            voice->follower = started[i + 1];
+        atomic_store(&voice->group, group);
+    }
+
+    ksp_voice *first = &engine->voices[KSP_VOICE_SLOT(started[0])];
+    if (fadesOut >= 0)
+    {
+        first->fadesOut = fadesOut;
+        //The crossfade takes as long as it was asked to, whatever speed the voice plays at
+        first->fadeInFrames = (double)first->params.fadeInMilliseconds * engine->sampleRate / 1000 * first->step;
+    }
+    ksp_command command = { .type = KSP_COMMAND_START, .voice = started[0], .at = at };
+    if (mode == CUE_NOW && first->preWaitFrames == 0)
+    {
+        atomic_store_explicit(&first->state, KSP_VOICE_PLAYING, memory_order_release);
+    }
+    else if (!ksp_command_push(&engine->commands, &command))
+    {
+        //Starting straight away is no worse than ksp_voice_start_bank
+        fputs("Engine command queue is full, starting voices directly\n", stderr);
+        for (int32_t i = 0; i < (mode == CUE_CHAIN ? 1 : startedCount); i++)
+        {
+            ksp_voice *voice = &engine->voices[KSP_VOICE_SLOT(started[i])];
+            atomic_store(&voice->group, 0);
+            atomic_store_explicit(&voice->state, KSP_VOICE_PLAYING, memory_order_release);
+        }
+    }
+    //Stops sent to make room for later voices are queued after this start, so they can't overtake it
+    pthread_mutex_unlock(&engine->voiceLock);
+    return startedCount;
+}
+
+int32_t ksp_voice_start_bank(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params)
+{
+    int32_t handle;
+    start_cues(engine, &sampleId, params, 1, KSP_TIME_NEXT_CYCLE, CUE_NOW, &handle, -1);
+    return handle;
+}
+
+int32_t ksp_trigger(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params)
+{
+    return ksp_trigger_at(engine, sampleId, params, KSP_TIME_NEXT_CYCLE);
+}
+
+int32_t ksp_trigger_at(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params, uint64_t at)
+{
+    int32_t handle;
+    start_cues(engine, &sampleId, params, 1, at, CUE_GROUP, &handle, -1);
+    return handle;
+}
+
+int32_t ksp_trigger_group(ksp_engine *engine, const int32_t *sampleIds, const ksp_voice_params *params,
+                          int32_t count, uint64_t at, int32_t *handles)
+{
+    return start_cues(engine, sampleIds, params, count, at, CUE_GROUP, handles, -1);
+}
+
+int32_t ksp_trigger_chain(ksp_engine *engine, const int32_t *sampleIds, const ksp_voice_params *params,
+                          int32_t count, uint64_t at, int32_t *handles)
+{
+    return start_cues(engine, sampleIds, params, count, at, CUE_CHAIN, handles, -1);
+}
+
+int32_t ksp_crossfade(ksp_engine *engine, int32_t from, int32_t sampleId, const ksp_voice_params *params,
+                      int32_t milliseconds, int32_t curve)
+{
+    ksp_voice_params crossfade = *params;
+    crossfade.fadeInMilliseconds = milliseconds > 0 ? milliseconds : 0;
+    crossfade.minVolume = 0;
+    crossfade.fadeCurve = curve;
+    crossfade.preWaitMilliseconds = 0;
+    int32_t handle = -1;
+    start_cues(engine, &sampleId, &crossfade, 1, KSP_TIME_NEXT_CYCLE, CUE_GROUP, &handle, from);
+    return handle;
+}
+
+int32_t ksp_voice_start(ksp_engine *engine, const char *filePath, const ksp_voice_params *params)
+{
+    //Files that were never preloaded go through a temporary bank entry, which is freed along with the voice
+    int32_t sampleId = ksp_bank_load(engine, filePath, params->loop ? KSP_BANK_RESIDENT : 0);
+    if (sampleId < 0)
+        return -1;
+
+    int32_t voice = ksp_voice_start_bank(engine, sampleId, params);
+    ksp_bank_release(engine, sampleId);
+    return voice;
 }
@@ -1,3 +1,55 @@
+#ifndef KSP_PW_PLAYER_MAIN_H
+#define KSP_PW_PLAYER_MAIN_H
+
 #include "ksp_pw_structs.h"
 
-void startPlayer(pw_player_info *playerInfo, int argc, char **argv);
+waveFileLoadInfo ReadWave(const char *filePath, bool preload);
+
+void UnloadWave(waveFileLoadInfo *loadInfo);
+
+//Creates an engine that plays through PipeWire
+ksp_engine *ksp_engine_create(uint32_t sampleRate, uint32_t channels);
+
+//Creates an engine driven by the given ksp_backend_type. output is passed on to the backend, and may be NULL.
+ksp_engine *ksp_engine_create_backend(uint32_t sampleRate, uint32_t channels, int32_t backend, const char *output);
+
+void ksp_engine_destroy(ksp_engine *engine);
+
+/* Starts a voice of a preloaded sample straight away. Voices of it, or of its choke group, that are already playing
+ * are dealt with as params asks, and if the pool is full a voice is stolen to make room. Returns the voice handle,
+ * or -1 if the voice couldn't be started or its retrigger policy is to ignore it. */
+int32_t ksp_voice_start_bank(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params);
+
+/* Starts a voice of a preloaded sample at the beginning of the engine's next cycle. Everything that can block or
+ * allocate is done on the calling thread, and the audio thread is only sent a start command through the engine's
+ * queue, so the sound is heard one cycle plus the device's latency after the call at most. Otherwise the same as
+ * ksp_voice_start_bank, and the handle it returns can be used straight away. */
+int32_t ksp_trigger(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params);
+
+//ksp_trigger for frame at of the engine's clock, which may be offset from the next cycle with KSP_TIME_NEXT_CYCLE.
+//The voice's pre-wait, if it has one, starts counting from there.
+int32_t ksp_trigger_at(ksp_engine *engine, int32_t sampleId, const ksp_voice_params *params, uint64_t at);
+
+/* Starts a voice for each of count samples, with the matching entry of params, on the same frame: at of the engine's
+ * clock, plus each voice's own pre-wait. They are started by a single command, so they line up sample for sample
+ * however the cycles fall. Returns the number of voices started, and writes their handles to handles, if it isn't
+ * NULL, with -1 for those that couldn't be started. */
+int32_t ksp_trigger_group(ksp_engine *engine, const int32_t *sampleIds, const ksp_voice_params *params,
+                          int32_t count, uint64_t at, int32_t *handles);
+
+/* Like ksp_trigger_group, but only the first voice starts at at. Each of the others follows on from the frame after
+ * the one before it ends, once its own pre-wait is over, and is cancelled if the one before it is stopped instead.
+ * Nothing after a voice that couldn't be started is started. */
+int32_t ksp_trigger_chain(ksp_engine *engine, const int32_t *sampleIds, const ksp_voice_params *params,
+                          int32_t count, uint64_t at, int32_t *handles);
+
+/* Starts a voice of the sample fading in from silence over milliseconds, while the voice from fades out over the same
+ * frames, both along curve, a ksp_fade_curve. The two fades are applied by the mixer from the same frame, so with
+ * KSP_FADE_EQUAL_POWER their combined power stays level. from may have finished already, in which case the sample
+ * just fades in. Returns the new voice's handle, or -1. */
+int32_t ksp_crossfade(ksp_engine *engine, int32_t from, int32_t sampleId, const ksp_voice_params *params,
+                      int32_t milliseconds, int32_t curve);
+
+int32_t ksp_voice_start(ksp_engine *engine, const char *filePath, const ksp_voice_params *params);
+
+#endif
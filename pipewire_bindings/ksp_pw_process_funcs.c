@@ -1,248 +1,1112 @@
 #include <pipewire-0.3/pipewire/pipewire.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
 
 #include "ksp_pw_process_funcs.h"
 #include "ksp_pw_structs.h"
 #include "ksp_pw_player_funcs.h"
 
-inline float get_volume(pw_player_info *info, waveData *data)
+//Gain at fraction x of the way through a fade in along curve. A fade out is the same curve run backwards.
+static inline float fade_gain(ksp_fade_curve curve, float x)
 {
-    float volume = 1;
-    size_t sampleNumber = data->sampleIndex / (data->file.formatChunk.bitsPerSample / 8);
-    size_t dataSizeSamples = data->file.dataChunk.dataSize / (data->file.formatChunk.bitsPerSample / 8);
-    size_t fadeInSamples = info->fadeInMilliseconds * data->file.formatChunk.sampleRate / 1000 * data->file.formatChunk.channels;
-    size_t fadeOutSamples = info->fadeOutMilliseconds * data->file.formatChunk.sampleRate / 1000 * data->file.formatChunk.channels;
+    switch (curve)
+    {
+        case KSP_FADE_EQUAL_POWER:
+            return sinf(x * (float)(M_PI / 2));
+        case KSP_FADE_S_CURVE:
+            return 0.5f - 0.5f * cosf(x * (float)M_PI);
+        default:
+            return x;
+    }
+}
+
+//Gain of the voice t output frames from its current position, combining the fade in from minVolume to
+//maxVolume, the fade out at the end of the sample, the current volume ramp and the fade after a stop command. A voice
+//that is looping doesn't reach its end, so it doesn't fade out there.
+static inline float envelope_at(const ksp_voice *voice, bool stopping, uint32_t t)
+{
+    double position = voice->position + t * voice->step;
+    float volume = voice->params.maxVolume;
+
+    if (position < voice->fadeInFrames)
+        volume = voice->params.minVolume + (voice->params.maxVolume - voice->params.minVolume) *
+                                               fade_gain(voice->fadeCurve, (float)(position / voice->fadeInFrames));
+
+    double left = voice->sample->frameCount - position;
+    if (voice->fadeOutFrames > 0 && left < voice->fadeOutFrames && voice->loopEnd == 0)
+        volume *= fade_gain(voice->fadeCurve, (float)(left / voice->fadeOutFrames));
+
+    if (t < voice->gainRampFrames)
+        volume *= voice->gain + (voice->gainTarget - voice->gain) * ((float)t / voice->gainRampFrames);
+    else
+        volume *= voice->gainTarget;
+
+    if (stopping)
+        volume *= voice->stopRemaining > t
+                      ? fade_gain(voice->stopCurve, (float)(voice->stopRemaining - t) / voice->stopFrames)
+                      : 0;
 
-    if (sampleNumber < fadeInSamples)
+    return volume;
+}
+
+//Output frames until the voice's position reaches target
+static inline uint32_t frames_until(const ksp_voice *voice, double target, uint32_t limit)
+{
+    double frames = ceil((target - voice->position) / voice->step);
+    return frames < limit ? (uint32_t)frames : limit;
+}
+
+//Number of frames, at most limit, over which envelope_at can be treated as linear: up to the next point where an
+//envelope starts or ends or the voice reaches its loop's seam, and only a short stretch while more than one of them
+//is moving. The crossfade across the seam counts as one of them. Curved fades are only close to linear over a short
+//stretch, so they count as two.
+static uint32_t envelope_segment(const ksp_voice *voice, bool stopping, uint32_t limit)
+{
+    uint32_t segment = limit;
+    int ramps = 0;
+    int fadeRamps = voice->fadeCurve == KSP_FADE_LINEAR ? 1 : 2;
+
+    if (voice->loopEnd > 0)
     {
-        volume -= 1 - (float)sampleNumber / fadeInSamples;
+        double seam = voice->loopEnd - voice->loopCrossfade;
+        if (voice->position < seam)
+        {
+            segment = frames_until(voice, seam, segment);
+        }
+        else
+        {
+            ramps++;
+            segment = frames_until(voice, voice->loopEnd, segment);
+        }
     }
-    if (dataSizeSamples - sampleNumber < fadeOutSamples)
+    if (voice->position < voice->fadeInFrames)
     {
-        volume -= 1 - (float)(dataSizeSamples - sampleNumber) / fadeOutSamples;
+        ramps += fadeRamps;
+        segment = frames_until(voice, voice->fadeInFrames, segment);
     }
-    return volume;
+    if (voice->fadeOutFrames > 0 && voice->loopEnd == 0)
+    {
+        double fadeOutStart = voice->sample->frameCount - voice->fadeOutFrames;
+        if (voice->position < fadeOutStart)
+            segment = frames_until(voice, fadeOutStart, segment);
+        else
+            ramps += fadeRamps;
+    }
+    if (voice->gainRampFrames > 0)
+    {
+        ramps++;
+        if (voice->gainRampFrames < segment)
+            segment = voice->gainRampFrames;
+    }
+    if (stopping)
+    {
+        ramps += voice->stopCurve == KSP_FADE_LINEAR ? 1 : 2;
+        if (voice->stopRemaining < segment)
+            segment = voice->stopRemaining;
+    }
+
+    if (ramps > 1 && segment > KSP_ENVELOPE_SEGMENT_FRAMES)
+        segment = KSP_ENVELOPE_SEGMENT_FRAMES;
+    return segment > 0 ? segment : 1;
 }
 
-void ksp_process_32(void *userdata)
+static void advance_envelope(ksp_voice *voice, bool stopping, uint32_t frames)
 {
-    pw_player_info *info = userdata;
-    struct waveData *data = info->data;
-    /*if (info->firstRun)
+    if (frames >= voice->gainRampFrames)
     {
-        setStreamVolume(data->stream, data->file.formatChunk.channels, 1);
-        info->firstRun = false;
-    }*/
-    if (!data->playerInfo->playing)
-        return;
-    struct pw_buffer *b;
-    struct spa_buffer *buf;
-    int i, c, n_frames, stride;
-    uint32_t *dst, val;
+        voice->gain = voice->gainTarget;
+        voice->gainRampFrames = 0;
+    }
+    else
+    {
+        voice->gain += (voice->gainTarget - voice->gain) * ((float)frames / voice->gainRampFrames);
+        voice->gainRampFrames -= frames;
+    }
+
+    if (stopping)
+        voice->stopRemaining = frames < voice->stopRemaining ? voice->stopRemaining - frames : 0;
+}
+
+//The frames of a voice's source that can be read this cycle
+typedef struct ksp_source
+{
+    const uint8_t *data; //Address of frame first
+    uint64_t first;
+    uint64_t end; //One past the last frame that can be read
+    bool final; //end is the end of the sound, rather than just of what has been decoded so far
+} ksp_source;
 
-    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL)
+static inline void get_source(const ksp_voice *voice, ksp_source *source)
+{
+    if (voice->stream != NULL)
     {
-        pw_log_warn("out of buffers: %m");
-        return;
+        source->data = ksp_stream_peek(voice->stream, &source->first, &source->end, &source->final);
+    }
+    else
+    {
+        source->data = voice->sample->data;
+        source->first = 0;
+        source->end = voice->sample->frameCount;
+        source->final = true;
     }
+}
 
-    buf = b->buffer;
-    if ((dst = buf->datas[0].data) == NULL)
-        return;
+//Adds one sample of source channel c to an output frame. Mono sources are sent to every output channel; sources
+//with more channels than the engine wrap around onto the available outputs.
+static inline void add_to_frame(float *frame, uint32_t c, uint32_t channels, uint32_t outChannels, float val)
+{
+    if (channels == 1)
+    {
+        for (uint32_t o = 0; o < outChannels; o++)
+            frame[o] += val;
+    }
+    else
+    {
+        frame[c % outChannels] += val;
+    }
+}
 
-    stride = 4 * data->file.formatChunk.channels;
-    n_frames = buf->datas[0].maxsize / stride;
+/* Linear interpolation and remapping path: converts the source frames the block needs into the engine's scratch
+ * buffer with the conversion kernel, then interpolates between them. */
+static void mix_voice_linear(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, float *mix,
+                             uint32_t frames, float gain, float gainStep)
+{
+    const ksp_sample *sample = voice->sample;
+    ksp_convert_kernel convert = engine->kernels->convert[sample->sampleFormat];
+    uint32_t channels = sample->channels;
+    uint32_t outChannels = engine->channels;
+    size_t maxSourceFrames = KSP_SCRATCH_SAMPLES / channels;
+    double step = voice->step;
 
-    float volume = get_volume(info, data);
+    while (frames > 0)
+    {
+        //Output frames whose source frames (plus the one after the last, for interpolation) fit in scratch
+        uint32_t block = frames;
+        if ((block - 1) * step + 2 > maxSourceFrames)
+        {
+            block = (uint32_t)((maxSourceFrames - 2) / step) + 1;
+            if (block > frames)
+                block = frames;
+        }
+
+        uint64_t first = (uint64_t)voice->position;
+        if (first >= source->end)
+            first = source->end - 1;
+        uint64_t last = (uint64_t)(voice->position + (block - 1) * step) + 1;
+        if (last >= source->end)
+            last = source->end - 1;
+        size_t count = last - first + 1;
+        convert(source->data + (first - source->first) * sample->bytesPerFrame, engine->scratch,
+                (uint32_t)(count * channels));
+
+        for (uint32_t i = 0; i < block; i++)
+        {
+            double offset = voice->position - first;
+            size_t frame = (size_t)offset;
+            if (frame >= count)
+                frame = count - 1;
+            size_t next = frame + 1 < count ? frame + 1 : frame;
+            float frac = (float)(offset - frame);
+            const float *a = engine->scratch + frame * channels;
+            const float *b = engine->scratch + next * channels;
+
+            for (uint32_t c = 0; c < channels; c++)
+                add_to_frame(mix, c, channels, outChannels, (a[c] + (b[c] - a[c]) * frac) * gain);
+            mix += outChannels;
+            gain += gainStep;
+            voice->position += step;
+        }
+        frames -= block;
+    }
+}
 
-    for (i = 0; i < n_frames; i++)
+//Converts count source frames from start into the engine's planar buffer, as one run of count samples per
+//channel. Frames the source doesn't have, before its start or past what has been decoded, are silent.
+static void load_planar(ksp_engine *engine, const ksp_sample *sample, const ksp_source *source, int64_t start,
+                        size_t count)
+{
+    uint32_t channels = sample->channels;
+    int64_t from = start > (int64_t)source->first ? start : (int64_t)source->first;
+    int64_t to = start + (int64_t)count < (int64_t)source->end ? start + (int64_t)count : (int64_t)source->end;
+    size_t valid = to > from ? (size_t)(to - from) : 0;
+    size_t lead = valid > 0 ? (size_t)(from - start) : count;
+
+    if (valid > 0)
+        engine->kernels->convert[sample->sampleFormat](source->data + (from - source->first) * sample->bytesPerFrame,
+                                                       engine->scratch, (uint32_t)(valid * channels));
+
+    for (uint32_t c = 0; c < channels; c++)
     {
-        for (c = 0; c < data->file.formatChunk.channels; c++)
+        float *run = engine->planar + c * count;
+        size_t i = 0;
+        for (; i < lead; i++)
+            run[i] = 0;
+        for (size_t j = 0; j < valid; i++, j++)
+            run[i] = engine->scratch[j * channels + c];
+        for (; i < count; i++)
+            run[i] = 0;
+    }
+}
+
+/* Band-limited resampling path: every output sample is the dot product of the source frames around it with the
+ * filter phase nearest its fractional position, interpolated with the next phase. The source frames are split by
+ * channel first, so the filter kernel always reads contiguous samples. */
+static void mix_voice_filtered(ksp_engine *engine, ksp_voice *voice, const ksp_source *source,
+                               const ksp_fir_table *filter, float *mix, uint32_t frames, float gain, float gainStep)
+{
+    const ksp_sample *sample = voice->sample;
+    ksp_fir_kernel fir = engine->kernels->fir;
+    uint32_t channels = sample->channels;
+    uint32_t outChannels = engine->channels;
+    uint32_t taps = filter->taps;
+    uint32_t half = taps / 2;
+    size_t maxSourceFrames = KSP_SCRATCH_SAMPLES / channels;
+    double step = voice->step;
+
+    while (frames > 0)
+    {
+        //Output frames whose source frames, plus the filter's reach either side, fit in scratch. One spare frame
+        //covers the position adding up to slightly more than the multiplication below.
+        uint32_t block = frames;
+        if ((block - 1) * step + taps + 2 > maxSourceFrames)
+        {
+            block = (uint32_t)((maxSourceFrames - taps - 2) / step) + 1;
+            if (block > frames)
+                block = frames;
+        }
+
+        int64_t base = (int64_t)voice->position;
+        int64_t start = base - half + 1;
+        size_t count = (size_t)((int64_t)(voice->position + (block - 1) * step) + half + 2 - start);
+        load_planar(engine, sample, source, start, count);
+
+        for (uint32_t i = 0; i < block; i++)
+        {
+            int64_t frame = (int64_t)voice->position;
+            double phase = (voice->position - frame) * filter->phases;
+            uint32_t p = (uint32_t)phase;
+            float frac = (float)(phase - p);
+            const float *a = filter->coefficients + (size_t)p * taps;
+            const float *src = engine->planar + (frame - base);
+
+            for (uint32_t c = 0; c < channels; c++)
+                add_to_frame(mix, c, channels, outChannels, fir(src + c * count, a, a + taps, frac, taps) * gain);
+            mix += outChannels;
+            gain += gainStep;
+            voice->position += step;
+        }
+        frames -= block;
+    }
+}
+
+//Converts count source frames from start into dst, interleaved. Frames the source doesn't have are silent.
+static void load_frames(ksp_engine *engine, const ksp_sample *sample, const ksp_source *source, int64_t start,
+                        size_t count, float *dst)
+{
+    uint32_t channels = sample->channels;
+    int64_t from = start > (int64_t)source->first ? start : (int64_t)source->first;
+    int64_t to = start + (int64_t)count < (int64_t)source->end ? start + (int64_t)count : (int64_t)source->end;
+    size_t valid = to > from ? (size_t)(to - from) : 0;
+    size_t lead = valid > 0 ? (size_t)(from - start) : count;
+
+    memset(dst, 0, lead * channels * sizeof(float));
+    if (valid > 0)
+        engine->kernels->convert[sample->sampleFormat](source->data + (from - source->first) * sample->bytesPerFrame,
+                                                       dst + lead * channels, (uint32_t)(valid * channels));
+    memset(dst + (lead + valid) * channels, 0, (count - lead - valid) * channels * sizeof(float));
+}
+
+/* Converts count frames of the voice from start into dst, as the voice plays them: past the end of its loop they
+ * carry on from after its start, and across the seam they are crossfaded as mix_seam would. */
+static void load_looped(ksp_engine *engine, const ksp_voice *voice, const ksp_source *source, int64_t start,
+                        size_t count, float *dst)
+{
+    const ksp_sample *sample = voice->sample;
+    uint32_t channels = sample->channels;
+    int64_t loopEnd = voice->loopEnd;
+    int64_t seam = loopEnd - voice->loopCrossfade;
+    int64_t shift = seam - voice->loopStart;
+    size_t maxSeamFrames = KSP_SCRATCH_SAMPLES / channels;
+
+    while (count > 0)
+    {
+        if (loopEnd > 0 && start >= loopEnd)
         {
-            val = *(int32_t *)(data->file.dataChunk.data + data->sampleIndex) * volume;
-            data->sampleIndex += 4;
-            if (data->sampleIndex >= data->file.dataChunk.dataSize)
+            start -= shift;
+            continue;
+        }
+        size_t run = count;
+        bool crossfaded = loopEnd > 0 && start >= seam;
+        if (crossfaded)
+        {
+            if ((size_t)(loopEnd - start) < run)
+                run = (size_t)(loopEnd - start);
+            if (maxSeamFrames < run)
+                run = maxSeamFrames;
+        }
+        else if (loopEnd > 0 && (size_t)(seam - start) < run)
+        {
+            run = (size_t)(seam - start);
+        }
+
+        load_frames(engine, sample, source, start, run, dst);
+        if (crossfaded)
+        {
+            load_frames(engine, sample, source, start - shift, run, engine->scratch);
+            for (size_t i = 0; i < run; i++)
             {
-                puts("Reached end of wave file.");
-                pw_main_loop_quit(data->loop);
-                return;
+                float in = (float)(start + (int64_t)i - seam) / voice->loopCrossfade;
+                for (uint32_t c = 0; c < channels; c++)
+                {
+                    float *out = dst + i * channels + c;
+                    *out += (engine->scratch[i * channels + c] - *out) * in;
+                }
             }
-            *dst++ = val;
         }
+        dst += run * channels;
+        start += (int64_t)run;
+        count -= run;
     }
+}
 
-    buf->datas[0].chunk->offset = 0;
-    buf->datas[0].chunk->stride = stride;
-    buf->datas[0].chunk->size = n_frames * stride;
+//Starts the next grain of a stretched voice at its position, or wherever near it lines up best with the last one
+static void next_grain(ksp_engine *engine, ksp_voice *voice, const ksp_source *source)
+{
+    ksp_stretch *stretch = voice->stretch;
+    int64_t start = llround(voice->position);
+    if (stretch->primed && start != stretch->nextStart)
+    {
+        load_looped(engine, voice, source, start - (int64_t)stretch->search * stretch->decimation,
+                    stretch->regionFrames, stretch->input);
+        start += ksp_stretch_search(stretch, engine->kernels);
+    }
+    load_looped(engine, voice, source, start, stretch->grainFrames, stretch->input);
+    ksp_stretch_add_grain(stretch, engine->kernels, start);
+}
+
+/* Time stretching path: the voice's position moves on at its speed as usual, which is what every envelope and the
+ * end of the voice are worked out from, but the frames mixed are the stretch's grains, which keep the pitch. */
+static void mix_voice_stretched(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, float *mix,
+                                uint32_t frames, float gain, float gainStep)
+{
+    ksp_stretch *stretch = voice->stretch;
+    uint32_t channels = stretch->channels;
+    uint32_t outChannels = engine->channels;
 
-    pw_stream_queue_buffer(data->stream, b);
+    while (frames > 0)
+    {
+        if (stretch->readyIndex == stretch->hop)
+            next_grain(engine, voice, source);
+        uint32_t block = stretch->hop - stretch->readyIndex < frames ? stretch->hop - stretch->readyIndex : frames;
+        const float *src = stretch->ready + (size_t)stretch->readyIndex * channels;
+
+        if (channels == outChannels)
+        {
+            engine->kernels->mix[KSP_SAMPLE_F32]((const uint8_t *)src, mix, block, channels, gain, gainStep);
+        }
+        else
+        {
+            for (uint32_t i = 0; i < block; i++, src += channels)
+            {
+                float frameGain = gain + gainStep * i;
+                for (uint32_t c = 0; c < channels; c++)
+                    add_to_frame(mix + (size_t)i * outChannels, c, channels, outChannels, src[c] * frameGain);
+            }
+        }
+        stretch->readyIndex += block;
+        voice->position += block * voice->step;
+        mix += (size_t)block * outChannels;
+        gain += gainStep * block;
+        frames -= block;
+    }
 }
 
-void ksp_process_24(void *userdata)
+//Mixes frames of the voice with a linear gain ramp: through the stretch if the voice has one, through the mix kernel
+//if the voice plays at the engine's rate with its channel layout, through the filter if it needs resampling and one
+//is given, and through linear interpolation otherwise
+static void mix_frames(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, const ksp_fir_table *filter,
+                       float *mix, uint32_t frames, float gain, float gainStep)
 {
-    pw_player_info *info = userdata;
-    struct waveData *data = info->data;
-    /*if (info->firstRun)
+    const ksp_sample *sample = voice->sample;
+    uint32_t channels = sample->channels;
+
+    if (voice->stretch != NULL)
     {
-        setStreamVolume(data->stream, data->file.formatChunk.channels, 1);
-        info->firstRun = false;
-    }*/
-    if (!data->playerInfo->playing)
-        return;
-    struct pw_buffer *b;
-    struct spa_buffer *buf;
-    int i, c, n_frames, stride;
-    uint8_t *dst;
-    ksp_int24 val;
+        mix_voice_stretched(engine, voice, source, mix, frames, gain, gainStep);
+    }
+    else if (filter != NULL)
+    {
+        mix_voice_filtered(engine, voice, source, filter, mix, frames, gain, gainStep);
+    }
+    else if (voice->step == 1.0 && voice->position == (uint64_t)voice->position && channels == engine->channels)
+    {
+        const uint8_t *src = source->data + ((uint64_t)voice->position - source->first) * sample->bytesPerFrame;
+        engine->kernels->mix[sample->sampleFormat](src, mix, frames, channels, gain, gainStep);
+        voice->position += frames;
+    }
+    else
+    {
+        mix_voice_linear(engine, voice, source, mix, frames, gain, gainStep);
+    }
+}
+
+/* Mixes frames of the crossfade across a loop's seam: the end of the loop fading out, over the frames after its start
+ * fading in. Those are where the voice carries on from once it wraps, so the seam is never heard. */
+static void mix_seam(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, const ksp_fir_table *filter,
+                     float *mix, uint32_t frames, float gain, float gainStep)
+{
+    double seam = voice->loopEnd - voice->loopCrossfade;
+    double shift = seam - voice->loopStart;
+    //How far through the crossfade the block's first and last frames are. Segments across the seam are short, so
+    //the product of the two ramps is close enough to linear.
+    float in = (float)((voice->position - seam) / voice->loopCrossfade);
+    float inLast = (float)((voice->position + (frames - 1) * voice->step - seam) / voice->loopCrossfade);
+    float gainLast = gain + gainStep * (frames - 1);
+    uint32_t steps = frames > 1 ? frames - 1 : 1;
 
-    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL)
+    double start = voice->position;
+    mix_frames(engine, voice, source, filter, mix, frames, gain * (1 - in),
+               (gainLast * (1 - inLast) - gain * (1 - in)) / steps);
+    double end = voice->position;
+    voice->position = start - shift;
+    mix_frames(engine, voice, source, filter, mix, frames, gain * in, (gainLast * inLast - gain * in) / steps);
+    voice->position = end;
+}
+
+/* Keeps a looping voice inside its loop: once it reaches the end, it carries on from as far past the start as the
+ * seam's crossfade has already played. A voice told to exit its loop lets go of it once it is clear of the seam.
+ * Returns true if the voice has just stopped looping. */
+static bool wrap_loop(ksp_voice *voice)
+{
+    double seam = voice->loopEnd - voice->loopCrossfade;
+    if (voice->position >= voice->loopEnd)
     {
-        pw_log_warn("out of buffers: %m");
-        return;
+        voice->position -= seam - voice->loopStart;
+        //Only the first pass fades in
+        voice->fadeInFrames = 0;
+    }
+    if (voice->loopExit && voice->position < seam)
+    {
+        voice->loopEnd = 0;
+        return true;
+    }
+    return false;
+}
+
+//Output frames, at most limit, before the voice reaches end; all of them if it is looping
+static uint32_t frames_left(const ksp_voice *voice, uint64_t end, uint32_t limit)
+{
+    if (voice->loopEnd > 0)
+        return limit;
+    if (voice->position >= end)
+        return 0;
+    double remaining = ceil((end - voice->position) / voice->step);
+    return remaining < limit ? (uint32_t)remaining : limit;
+}
+
+//Measures frames first up to last of a source that has no peak index, as ksp_peaks_measure would. Only as many
+//frames as fit in the scratch buffer are measured, which is a whole block at any speed a voice is likely to play at.
+static void measure_source(ksp_engine *engine, const ksp_sample *sample, const ksp_source *source, uint64_t first,
+                           uint64_t last, uint32_t metered, float *magnitudes, float *meanSquares)
+{
+    uint32_t channels = sample->channels;
+    uint64_t maxFrames = KSP_SCRATCH_SAMPLES / channels;
+    uint32_t count = (uint32_t)(last - first < maxFrames ? last - first : maxFrames);
+    engine->kernels->convert[sample->sampleFormat](source->data + (first - source->first) * sample->bytesPerFrame,
+                                                   engine->scratch, count * channels);
+
+    float min[KSP_MAX_SAMPLE_CHANNELS], max[KSP_MAX_SAMPLE_CHANNELS], sumSquares[KSP_MAX_SAMPLE_CHANNELS];
+    for (uint32_t c = 0; c < channels; c++)
+    {
+        min[c] = 0;
+        max[c] = 0;
+        sumSquares[c] = 0;
     }
+    engine->kernels->peak(engine->scratch, count, channels, min, max, sumSquares);
+    for (uint32_t c = 0; c < metered; c++)
+    {
+        magnitudes[c] = fmaxf(-min[c], max[c]);
+        meanSquares[c] = sumSquares[c] / count;
+    }
+}
 
-    buf = b->buffer;
-    if ((dst = buf->datas[0].data) == NULL)
+/* Adds source frames first up to last of the voice to its meters for the cycle, with gain applied to the peaks and
+ * squareGain to the squares, which are weighted by the output frames they take up. Samples with a peak index are
+ * measured from that, which costs next to nothing; others are measured from the source itself. */
+static void meter_range(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, uint64_t first, uint64_t last,
+                        float gain, float squareGain)
+{
+    const ksp_sample *sample = voice->sample;
+    if (first < source->first)
+        first = source->first;
+    if (last > source->end)
+        last = source->end;
+    if (last <= first)
         return;
 
-    stride = 3 * data->file.formatChunk.channels;
-    n_frames = buf->datas[0].maxsize / stride;
+    uint32_t metered = sample->channels < KSP_METER_CHANNELS ? sample->channels : KSP_METER_CHANNELS;
+    float magnitudes[KSP_METER_CHANNELS], meanSquares[KSP_METER_CHANNELS];
+    if (!ksp_peaks_measure(&sample->peaks, first, last, metered, magnitudes, meanSquares))
+        measure_source(engine, sample, source, first, last, metered, magnitudes, meanSquares);
+    float weight = (float)((last - first) / voice->step) * squareGain;
+    for (uint32_t c = 0; c < metered; c++)
+    {
+        voice->cyclePeaks[c] = fmaxf(voice->cyclePeaks[c], magnitudes[c] * gain);
+        voice->cycleSquares[c] += meanSquares[c] * weight;
+    }
+}
+
+/* Meters what a voice has just played, from where it was at the start of the block to where it is now, going from
+ * gainFrom to gainTo. A voice that went round its loop is metered on both sides of the wrap. */
+static void meter_voice(ksp_engine *engine, ksp_voice *voice, const ksp_source *source, double from,
+                        uint32_t loopStart, uint32_t loopEnd, float gainFrom, float gainTo)
+{
+    float gain = fmaxf(gainFrom, gainTo);
+    float squareGain = (gainFrom + gainTo) * 0.5f * (gainFrom + gainTo) * 0.5f;
+    if (voice->position < from)
+    {
+        meter_range(engine, voice, source, (uint64_t)from, loopEnd, gain, squareGain);
+        from = loopStart;
+    }
+    meter_range(engine, voice, source, (uint64_t)from, (uint64_t)ceil(voice->position), gain, squareGain);
+}
+
+/* Mixes one voice into the engine's interleaved float buffer. The number of frames left in the source (or in the
+ * fade after a stop) is worked out once up front, so the kernels never have to check for the end of the data.
+ * The block is then split wherever the envelope changes shape, and each piece is mixed with a per-frame gain ramp.
+ * Returns the number of frames produced, and sets ended if the voice reached its end or the end of its stop fade
+ * in them. A streamed voice that has caught up with its decoder plays silence for the rest of the block instead. */
+static uint32_t mix_voice(ksp_engine *engine, ksp_voice *voice, const ksp_resampler *resampler, float *mix,
+                          uint32_t n_frames, bool stopping, bool *ended)
+{
+    ksp_source source;
+    get_source(voice, &source);
 
-    float volume = get_volume(info, data);
+    //A voice that lines up with the output frames doesn't need resampling, and the filter wouldn't leave it as is.
+    //Stretched voices are never resampled; their grains are read at the source's rate.
+    const ksp_fir_table *filter = NULL;
+    if (voice->stretch == NULL && (voice->step != 1.0 || voice->position != (uint64_t)voice->position))
+        filter = ksp_resampler_table(resampler, voice->step);
 
-    for (i = 0; i < n_frames; i++)
+    //Resampling and stretching need frames after the current one as well, which a stream may not have decoded yet.
+    //At the end of the sound they are taken to be silent.
+    uint64_t lookahead = voice->stretch != NULL ? voice->stretch->reach : filter != NULL ? filter->taps / 2 : 1;
+    uint64_t end = source.final ? source.end : source.end > lookahead ? source.end - lookahead : 0;
+    uint32_t frames = frames_left(voice, end, n_frames);
+    bool underrun = frames < n_frames && !source.final;
+    bool stopped = stopping && voice->stopRemaining <= frames;
+    if (stopped)
     {
-        for (c = 0; c < data->file.formatChunk.channels; c++)
+        frames = voice->stopRemaining;
+        underrun = false;
+    }
+
+    double from = voice->position;
+    uint32_t loopStart = voice->loopStart;
+    uint32_t loopEnd = voice->loopEnd;
+    float gainFrom = envelope_at(voice, stopping, 0);
+
+    uint32_t done = 0;
+    while (done < frames)
+    {
+        //Past its loop, the voice can reach its end in this block after all
+        if (voice->loopEnd > 0 && wrap_loop(voice))
         {
-            val = *(ksp_int24 *)(data->file.dataChunk.data + data->sampleIndex);
-            val.data *= volume;
-            data->sampleIndex += 3;
-            if (data->sampleIndex >= data->file.dataChunk.dataSize)
-            {
-                puts("Reached end of wave file.");
-                pw_main_loop_quit(data->loop);
-                return;
-            }
-            //*dst = val;
-            memcpy(dst, &val, 3);
-            dst += 3;
+            uint32_t left = done + frames_left(voice, end, n_frames - done);
+            if (left < frames)
+                frames = left;
+            continue;
         }
+        uint32_t segment = envelope_segment(voice, stopping, frames - done);
+        //The slope comes from the segment's own last frame, since the frame after it may be past a breakpoint
+        float gain = envelope_at(voice, stopping, 0);
+        float gainStep = segment > 1 ? (envelope_at(voice, stopping, segment - 1) - gain) / (segment - 1) : 0;
+        float *dst = mix + (size_t)done * engine->channels;
+        //A stretch reads across the seam itself, since it reads ahead of the position
+        if (voice->loopEnd > 0 && voice->position >= voice->loopEnd - voice->loopCrossfade && voice->stretch == NULL)
+            mix_seam(engine, voice, &source, filter, dst, segment, gain, gainStep);
+        else
+            mix_frames(engine, voice, &source, filter, dst, segment, gain, gainStep);
+        advance_envelope(voice, stopping, segment);
+        done += segment;
     }
+    //Wrapped now rather than at the start of the next block, so the position is always inside the loop
+    if (voice->loopEnd > 0)
+        wrap_loop(voice);
+    //Metered before a stream lets go of what was just played
+    meter_voice(engine, voice, &source, from, loopStart, loopEnd, gainFrom, envelope_at(voice, stopping, 0));
 
-    buf->datas[0].chunk->offset = 0;
-    buf->datas[0].chunk->stride = stride;
-    buf->datas[0].chunk->size = n_frames * stride;
+    if (voice->stream != NULL)
+    {
+        //The filters and the stretch's search reach back before the playhead, so a little of what has been played
+        //stays in the ring
+        uint64_t played = (uint64_t)voice->position;
+        uint64_t history = voice->stretch != NULL && voice->stretch->history > KSP_RESAMPLE_HISTORY
+                               ? voice->stretch->history
+                               : KSP_RESAMPLE_HISTORY;
+        ksp_stream_consume(&engine->streamer, voice->stream, played > history ? played - history : 0);
+        if (underrun)
+        {
+            atomic_fetch_add_explicit(&voice->underruns, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&engine->underruns, 1, memory_order_relaxed);
+            *ended = false;
+            return n_frames;
+        }
+    }
+    //Rounding can leave the position a hair short of the end, even though nothing is left to play
+    *ended = stopped || (source.final && voice->loopEnd == 0 && (done < n_frames || voice->position >= end));
+    return done;
+}
 
-    pw_stream_queue_buffer(data->stream, b);
+static void finish_voice(ksp_voice *voice)
+{
+    //Cleared first, so whatever claims the slot next can't be taken for part of a group that is yet to start
+    atomic_store_explicit(&voice->group, 0, memory_order_relaxed);
+    atomic_store_explicit(&voice->state, KSP_VOICE_FINISHED, memory_order_release);
+    sem_post(&voice->finished);
 }
 
-void ksp_process_16(void *userdata)
+//Finishes every voice waiting to follow this one, which will now never reach its end
+static void cancel_followers(ksp_engine *engine, ksp_voice *voice)
 {
-    pw_player_info *info = userdata;
-    struct waveData *data = info->data;
-    /*if (info->firstRun)
+    int32_t follower = voice->follower;
+    voice->follower = -1;
+    ksp_voice *next;
+    while ((next = ksp_voice_lookup(engine, follower)) != NULL &&
+           atomic_load_explicit(&next->state, memory_order_acquire) == KSP_VOICE_LOADING)
     {
-        setStreamVolume(data->stream, data->file.formatChunk.channels, 1);
-        info->firstRun = false;
-    }*/
-    if (!data->playerInfo->playing)
+        follower = next->follower;
+        next->follower = -1;
+        finish_voice(next);
+    }
+}
+
+//Holds on to a command until the frame it is due at. Returns false if there is no room left for it.
+static bool schedule_command(ksp_engine *engine, const ksp_command *command)
+{
+    if (engine->scheduledCount == KSP_MAX_SCHEDULED)
+        return false;
+    engine->scheduled[engine->scheduledCount++] = *command;
+    return true;
+}
+
+static void apply_command(ksp_engine *engine, const ksp_command *command, uint64_t when);
+
+//Fades out the voice a crossfade takes over from, over the frames the new voice fades in over and along its curve
+static void fade_out_from(ksp_engine *engine, ksp_voice *voice, uint64_t when)
+{
+    int32_t handle = voice->fadesOut;
+    voice->fadesOut = -1;
+    ksp_voice *from = ksp_voice_lookup(engine, handle);
+    if (from == NULL || from == voice)
         return;
-    struct pw_buffer *b;
-    struct spa_buffer *buf;
-    int i, c, n_frames, stride;
-    int16_t *dst;
-    int16_t val;
+    bool playing = atomic_load_explicit(&from->state, memory_order_acquire) == KSP_VOICE_PLAYING;
+    ksp_command stop = { .type = KSP_COMMAND_STOP, .voice = handle,
+                         .frames = (uint32_t)ceil(voice->fadeInFrames / voice->step) };
+    apply_command(engine, &stop, when);
+    //A voice that was already stopping carries on with the fade it had
+    if (playing)
+        from->stopCurve = voice->fadeCurve;
+}
 
-    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL)
+//Starts a voice at frame when of the engine's clock, or schedules it to start once its pre-wait is over
+static void begin_voice(ksp_engine *engine, ksp_voice *voice, int32_t handle, uint64_t when)
+{
+    atomic_store_explicit(&voice->group, 0, memory_order_relaxed);
+    if (voice->preWaitFrames > 0)
     {
-        pw_log_warn("out of buffers: %m");
-        return;
+        ksp_command start = { .type = KSP_COMMAND_START, .voice = handle, .at = when + voice->preWaitFrames };
+        voice->preWaitFrames = 0;
+        //Without room to wait, starting now is the best that can be done
+        if (schedule_command(engine, &start))
+            return;
     }
+    if (voice->fadesOut >= 0)
+        fade_out_from(engine, voice, when);
+    if (voice->follower >= 0)
+        engine->following = true;
+    atomic_store_explicit(&voice->state, KSP_VOICE_PLAYING, memory_order_release);
+}
 
-    buf = b->buffer;
-    if ((dst = buf->datas[0].data) == NULL)
+//Starts a voice along with every other voice in its group
+static void start_group(ksp_engine *engine, ksp_voice *voice, int32_t handle, uint64_t when)
+{
+    uint32_t group = atomic_load_explicit(&voice->group, memory_order_relaxed);
+    if (group == 0)
+    {
+        begin_voice(engine, voice, handle, when);
         return;
+    }
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
+    {
+        ksp_voice *member = &engine->voices[i];
+        if (atomic_load_explicit(&member->group, memory_order_relaxed) == group &&
+            atomic_load_explicit(&member->state, memory_order_acquire) == KSP_VOICE_LOADING)
+            begin_voice(engine, member, KSP_VOICE_HANDLE(i, atomic_load(&member->generation)), when);
+    }
+}
 
-    stride = 2 * data->file.formatChunk.channels;
-    n_frames = buf->datas[0].maxsize / stride;
+//Applies a control message from the command queue at frame when of the engine's clock. Runs on the audio thread.
+static void apply_command(ksp_engine *engine, const ksp_command *command, uint64_t when)
+{
+    ksp_voice *voice = ksp_voice_lookup(engine, command->voice);
+    if (voice == NULL)
+        return;
 
-    float volume = get_volume(info, data);
+    ksp_voice_state state = atomic_load_explicit(&voice->state, memory_order_acquire);
+    if (command->type == KSP_COMMAND_START)
+    {
+        if (state == KSP_VOICE_LOADING)
+            start_group(engine, voice, command->voice, when);
+        return;
+    }
+    //A voice that is still waiting to start can only be stopped, which means it never will
+    if (state == KSP_VOICE_LOADING && command->type == KSP_COMMAND_STOP)
+    {
+        cancel_followers(engine, voice);
+        finish_voice(voice);
+        return;
+    }
+    if (state != KSP_VOICE_PLAYING && state != KSP_VOICE_PAUSED && state != KSP_VOICE_STOPPING)
+        return;
 
-    for (i = 0; i < n_frames; i++)
+    switch (command->type)
     {
-        for (c = 0; c < data->file.formatChunk.channels; c++)
-        {
-            val = *(int16_t *)(data->file.dataChunk.data + data->sampleIndex) * volume;
-            data->sampleIndex += 2;
-            if (data->sampleIndex >= data->file.dataChunk.dataSize)
+        case KSP_COMMAND_SET_VOLUME:
+            //The new ramp starts from wherever the previous one had got to
+            voice->gainTarget = command->value;
+            voice->gainRampFrames = command->frames;
+            if (command->frames == 0)
+                voice->gain = command->value;
+            break;
+        case KSP_COMMAND_PAUSE:
+            if (state == KSP_VOICE_PLAYING)
+                atomic_store_explicit(&voice->state, KSP_VOICE_PAUSED, memory_order_release);
+            break;
+        case KSP_COMMAND_RESUME:
+            if (state == KSP_VOICE_PAUSED)
             {
-                puts("Reached end of wave file.");
-                pw_main_loop_quit(data->loop);
-                return;
+                engine->following |= voice->follower >= 0;
+                atomic_store_explicit(&voice->state, KSP_VOICE_PLAYING, memory_order_release);
             }
-            *dst++ = val;
-        }
+            break;
+        case KSP_COMMAND_SET_SPEED:
+            voice->params.speedFactor = command->value;
+            voice->step = ksp_voice_step(engine, voice->sample, command->value);
+            break;
+        case KSP_COMMAND_STOP:
+            //A stopped voice never reaches its end, so nothing follows it
+            cancel_followers(engine, voice);
+            //Paused voices are silent already, and a stop without a fade cuts any fade in progress short
+            if (state == KSP_VOICE_PAUSED || command->frames == 0)
+                finish_voice(voice);
+            else if (state == KSP_VOICE_PLAYING)
+            {
+                voice->stopFrames = command->frames;
+                voice->stopRemaining = command->frames;
+                atomic_store_explicit(&voice->state, KSP_VOICE_STOPPING, memory_order_release);
+            }
+            break;
+        case KSP_COMMAND_EXIT_LOOP:
+            voice->loopExit = true;
+            break;
+        case KSP_COMMAND_SET_BUS:
+            voice->bus = command->frames < KSP_MAX_BUSES ? command->frames : 0;
+            break;
+        case KSP_COMMAND_START:
+            //Handled above, since the voice isn't playing yet
+            break;
     }
+}
 
-    buf->datas[0].chunk->offset = 0;
-    buf->datas[0].chunk->stride = stride;
-    buf->datas[0].chunk->size = n_frames * stride;
+//Applies every scheduled command that is due by frame when, in the order they were sent
+static void apply_due(ksp_engine *engine, uint64_t when)
+{
+    uint32_t i = 0;
+    while (i < engine->scheduledCount)
+    {
+        if (engine->scheduled[i].at > when)
+        {
+            i++;
+            continue;
+        }
+        ksp_command command = engine->scheduled[i];
+        engine->scheduledCount--;
+        memmove(&engine->scheduled[i], &engine->scheduled[i + 1],
+                (engine->scheduledCount - i) * sizeof(engine->scheduled[0]));
+        apply_command(engine, &command, when);
+    }
+}
 
-    pw_stream_queue_buffer(data->stream, b);
+//Frames from when until the next scheduled command or voice that has a follower waiting for its end, at most limit.
+//Mixing stops at each of these, so whatever happens there happens on exactly the right frame.
+static uint32_t next_event(const ksp_engine *engine, uint64_t when, uint32_t limit)
+{
+    uint32_t frames = limit;
+    for (uint32_t i = 0; i < engine->scheduledCount; i++)
+    {
+        if (engine->scheduled[i].at - when < frames)
+            frames = (uint32_t)(engine->scheduled[i].at - when);
+    }
+    for (int i = 0; engine->following && i < KSP_MAX_VOICES; i++)
+    {
+        const ksp_voice *voice = &engine->voices[i];
+        //A voice that is leaving its loop is taken to be past it already, which can only make the block shorter
+        if (atomic_load_explicit(&voice->state, memory_order_acquire) != KSP_VOICE_PLAYING || voice->follower < 0 ||
+            voice->sample->frameCount == 0 || (voice->loopEnd > 0 && !voice->loopExit))
+            continue;
+        double left = ceil((voice->sample->frameCount - voice->position) / voice->step);
+        if (left > 0 && left < frames)
+            frames = (uint32_t)left;
+    }
+    return frames > 0 ? frames : 1;
 }
 
-void ksp_process_8(void *userdata)
+/* Mixes frames of every playing voice into its bus, or into dst, which is offset frames into the current cycle, for
+ * buses that leave their voices as they are. A voice that reaches its end starts its follower from the frame after its
+ * last. The first block of a cycle also counts the voices in use. */
+static void mix_block(ksp_engine *engine, const ksp_resampler *resampler, float *dst, uint32_t offset,
+                      uint32_t frames)
 {
-    pw_player_info *info = userdata;
-    struct waveData *data = info->data;
-    /*if (info->firstRun)
+    uint32_t occupied = 0;
+    bool following = false;
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
     {
-        setStreamVolume(data->stream, data->file.formatChunk.channels, 1);
-        info->firstRun = false;
-    }*/
-    if (!data->playerInfo->playing)
-        return;
-    struct pw_buffer *b;
-    struct spa_buffer *buf;
-    int i, c, n_frames, stride;
-    int8_t *dst;
-    int8_t val;
+        ksp_voice *voice = &engine->voices[i];
+        ksp_voice_state state = atomic_load_explicit(&voice->state, memory_order_acquire);
+        if (state != KSP_VOICE_FREE && state != KSP_VOICE_FINISHED)
+            occupied++;
+        if (state != KSP_VOICE_PLAYING && state != KSP_VOICE_STOPPING)
+            continue;
+
+        bool stopping = state == KSP_VOICE_STOPPING;
+        bool ended;
+        float *mix = ksp_bus_buffer(&engine->buses[voice->bus], dst, frames);
+        uint32_t written = mix_voice(engine, voice, resampler, mix, frames, stopping, &ended);
+        if (!voice->queued)
+        {
+            voice->queued = true;
+            engine->startedVoices[engine->startedCount++] = i;
+        }
+        if (!ended)
+        {
+            atomic_store_explicit(&voice->level, envelope_at(voice, stopping, 0), memory_order_relaxed);
+            following |= !stopping && voice->follower >= 0;
+            continue;
+        }
 
-    if ((b = pw_stream_dequeue_buffer(data->stream)) == NULL)
+        ksp_command start = { .type = KSP_COMMAND_START, .voice = voice->follower,
+                              .at = engine->frame + offset + written };
+        if (stopping)
+            cancel_followers(engine, voice);
+        else if (voice->follower >= 0 && !schedule_command(engine, &start))
+            apply_command(engine, &start, start.at);
+        voice->follower = -1;
+        finish_voice(voice);
+    }
+    engine->following = following;
+    if (offset == 0)
+        ksp_stats_voices(&engine->stats, occupied);
+}
+
+//Seconds until a voice ends at its current speed, or at the end of the fade it is stopping with; -1 if there's no
+//telling, because it is looping or its length isn't known
+static double remaining_seconds(const ksp_engine *engine, const ksp_voice *voice, bool stopping)
+{
+    double frames = -1;
+    if (voice->loopEnd == 0 && voice->sample->frameCount > 0)
+        frames = fmax(0, (voice->sample->frameCount - voice->position) / voice->step);
+    if (stopping && (frames < 0 || voice->stopRemaining < frames))
+        frames = voice->stopRemaining;
+    return frames < 0 ? -1 : frames / engine->sampleRate;
+}
+
+/* Takes the cycle's levels into each voice's meters, which fall back over KSP_METER_DECAY_MILLISECONDS, and publishes
+ * where every voice that is still around has got to. Readers can take it at any rate, and still see each peak. */
+static void publish_meters(ksp_engine *engine, uint32_t n_frames)
+{
+    ksp_voice_meters *meters = &engine->meters;
+    float decay = expf(-(float)n_frames * 1000 / ((float)KSP_METER_DECAY_MILLISECONDS * engine->sampleRate));
+    uint32_t sequence = atomic_load_explicit(&meters->sequence, memory_order_relaxed);
+    atomic_store_explicit(&meters->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint32_t count = 0;
+    for (int i = 0; i < KSP_MAX_VOICES; i++)
     {
-        pw_log_warn("out of buffers: %m");
-        return;
+        ksp_voice *voice = &engine->voices[i];
+        ksp_voice_state state = atomic_load_explicit(&voice->state, memory_order_acquire);
+        if (state != KSP_VOICE_PLAYING && state != KSP_VOICE_PAUSED && state != KSP_VOICE_STOPPING)
+            continue;
+
+        const ksp_sample *sample = voice->sample;
+        bool stopping = state == KSP_VOICE_STOPPING;
+        ksp_voice_snapshot *snapshot = &meters->voices[count++];
+        snapshot->handle = KSP_VOICE_HANDLE(i, atomic_load_explicit(&voice->generation, memory_order_relaxed));
+        snapshot->sampleId = (int32_t)(sample - engine->bank.samples);
+        snapshot->state = state;
+        snapshot->bus = (int32_t)voice->bus;
+        snapshot->position = (uint64_t)voice->position;
+        snapshot->frameCount = sample->frameCount;
+        snapshot->seconds = voice->position / sample->sampleRate;
+        snapshot->remaining = remaining_seconds(engine, voice, stopping);
+        snapshot->gain = envelope_at(voice, stopping, 0);
+        snapshot->channels = sample->channels < KSP_METER_CHANNELS ? sample->channels : KSP_METER_CHANNELS;
+        for (uint32_t c = 0; c < snapshot->channels; c++)
+        {
+            float square = voice->cycleSquares[c] / n_frames;
+            voice->meterPeaks[c] = fmaxf(voice->cyclePeaks[c], voice->meterPeaks[c] * decay);
+            voice->meterSquares[c] = square + (voice->meterSquares[c] - square) * decay;
+            voice->cyclePeaks[c] = 0;
+            voice->cycleSquares[c] = 0;
+            snapshot->peaks[c] = voice->meterPeaks[c];
+            snapshot->rms[c] = sqrtf(voice->meterSquares[c]);
+        }
     }
+    atomic_store_explicit(&meters->count, count, memory_order_relaxed);
+    atomic_store_explicit(&meters->sequence, sequence + 2, memory_order_release);
+}
 
-    buf = b->buffer;
-    if ((dst = buf->datas[0].data) == NULL)
-        return;
+void ksp_mix(ksp_engine *engine, float *dst, uint32_t n_frames)
+{
+    uint64_t now = engine->frame;
+    //Published before the queue is read, so a command stamped with it is either read this cycle or due the next
+    atomic_store_explicit(&engine->time, now + n_frames, memory_order_relaxed);
 
-    stride = 1 * data->file.formatChunk.channels;
-    n_frames = buf->datas[0].maxsize / stride;
+    ksp_command command;
+    while (ksp_command_pop(&engine->commands, &command))
+    {
+        if (command.at & KSP_TIME_NEXT_CYCLE)
+            command.at = now + (command.at & ~KSP_TIME_NEXT_CYCLE);
+        //A command there's no room to hold on to takes effect early rather than never
+        if (command.at <= now || !schedule_command(engine, &command))
+            apply_command(engine, &command, now);
+    }
 
-    float volume = get_volume(info, data);
+    memset(dst, 0, (size_t)n_frames * engine->channels * sizeof(float));
+    engine->startedCount = 0;
+    const ksp_resampler *resampler =
+        &engine->resamplers[atomic_load_explicit(&engine->resampleQuality, memory_order_relaxed)];
 
-    for (i = 0; i < n_frames; i++)
+    //The cycle is mixed in blocks that end wherever a scheduled command is due or a voice ends and starts another.
+    //Every bus is mixed in the same pass, a block at a time, and then sent on to its output.
+    uint32_t rampFrames = (uint32_t)((uint64_t)KSP_VOLUME_RAMP_MILLISECONDS * engine->sampleRate / 1000);
+    uint32_t done = 0;
+    for (;;)
     {
-        for (c = 0; c < data->file.formatChunk.channels; c++)
+        apply_due(engine, now + done);
+        if (done == n_frames)
+            break;
+        uint32_t limit = n_frames - done < KSP_BUS_BLOCK_FRAMES ? n_frames - done : KSP_BUS_BLOCK_FRAMES;
+        uint32_t block = next_event(engine, now + done, limit);
+        float *out = dst + (size_t)done * engine->channels;
+        bool dsp = ksp_dsp_update(&engine->master);
+        for (int i = 0; i < KSP_MAX_BUSES; i++)
         {
-            val = *(int8_t *)(data->file.dataChunk.data + data->sampleIndex) * volume;
-            data->sampleIndex += 1;
-            if (data->sampleIndex >= data->file.dataChunk.dataSize)
-            {
-                puts("Reached end of wave file.");
-                pw_main_loop_quit(data->loop);
-                return;
-            }
-            *dst++ = val;
+            ksp_bus_begin(&engine->buses[i], rampFrames);
+            dsp |= engine->buses[i].dsp.active;
         }
+        mix_block(engine, resampler, out, done, block);
+        int64_t dspStart = dsp ? ksp_now_ns() : 0;
+        for (int i = 0; i < KSP_MAX_BUSES; i++)
+            ksp_bus_end(&engine->buses[i], engine->kernels, out, block);
+        if (engine->master.active)
+            ksp_dsp_process(&engine->master, engine->kernels, out, block);
+        if (dsp)
+            ksp_stats_dsp(&engine->stats, dspStart, ksp_now_ns());
+        done += block;
     }
+    engine->frame = now + n_frames;
+
+    float reduction = ksp_dsp_publish_reduction(&engine->master);
+    for (int i = 0; i < KSP_MAX_BUSES; i++)
+    {
+        float busReduction = ksp_dsp_publish_reduction(&engine->buses[i].dsp);
+        if (busReduction > reduction)
+            reduction = busReduction;
+    }
+    ksp_stats_gain_reduction(&engine->stats, reduction);
+    publish_meters(engine, n_frames);
+}
+
+/* Works out how long the buffer just queued will take to be heard, and checks the graph's clock for cycles it ran
+ * without us. Returns the delay in nanoseconds, or 0 if PipeWire can't tell yet. */
+static int64_t read_device_delay(ksp_engine *engine, uint32_t n_frames)
+{
+    struct pw_time time;
+    if (pw_stream_get_time_n(engine->stream, &time, sizeof(time)) != 0 || time.rate.num == 0 || time.rate.denom == 0)
+        return 0;
+
+    //The clock counts in ticks of rate seconds, which needn't be the engine's own rate
+    uint64_t ticksPerCycle = (uint64_t)n_frames * time.rate.denom / ((uint64_t)time.rate.num * engine->sampleRate);
+    ksp_stats_clock(&engine->stats, time.ticks, ticksPerCycle);
+
+    int64_t delay = time.delay > 0 ? time.delay * SPA_NSEC_PER_SEC * time.rate.num / time.rate.denom : 0;
+    return delay + (int64_t)(time.buffered * SPA_NSEC_PER_SEC / engine->sampleRate);
+}
+
+uint32_t ksp_fill_buffer(ksp_engine *engine, struct pw_buffer *b)
+{
+    struct spa_buffer *buf = b->buffer;
+    float *dst = buf->datas[0].data;
+    uint32_t stride = sizeof(float) * engine->channels;
+    uint32_t n_frames = buf->datas[0].maxsize / stride;
+    if (b->requested)
+        n_frames = SPA_MIN(b->requested, n_frames);
+
+    ksp_mix(engine, dst, n_frames);
 
     buf->datas[0].chunk->offset = 0;
     buf->datas[0].chunk->stride = stride;
     buf->datas[0].chunk->size = n_frames * stride;
+    return n_frames;
+}
+
+//Records a cycle that started at start and was handed to the output at queued, along with the voices it started
+static void record_cycle(ksp_engine *engine, int64_t start, int64_t queued, int64_t deviceDelay, uint32_t n_frames)
+{
+    for (uint32_t i = 0; i < engine->startedCount; i++)
+    {
+        const ksp_voice *voice = &engine->voices[engine->startedVoices[i]];
+        ksp_latency_trace trace = {
+            .keyEvent = voice->params.keyEventNs,
+            .trigger = voice->params.triggerNs,
+            .voiceStart = voice->startNs,
+            .firstQueued = queued,
+            .deviceDelay = deviceDelay,
+        };
+        ksp_stats_trace(&engine->stats, &trace);
+    }
+    ksp_stats_callback(&engine->stats, start, ksp_now_ns(), (uint64_t)n_frames * SPA_NSEC_PER_SEC / engine->sampleRate);
+}
+
+void ksp_process_cycle(ksp_engine *engine, float *dst, uint32_t n_frames, int64_t deviceDelay)
+{
+    int64_t start = ksp_now_ns();
+    ksp_mix(engine, dst, n_frames);
+    record_cycle(engine, start, ksp_now_ns(), deviceDelay, n_frames);
+}
+
+void ksp_process_engine(void *userdata)
+{
+    ksp_engine *engine = userdata;
+    struct pw_buffer *b;
+
+    int64_t start = ksp_now_ns();
+    if ((b = pw_stream_dequeue_buffer(engine->stream)) == NULL)
+    {
+        atomic_fetch_add_explicit(&engine->stats.outOfBuffers, 1, memory_order_relaxed);
+        pw_log_warn("out of buffers: %m");
+        return;
+    }
+
+    if (b->buffer->datas[0].data == NULL)
+        return;
+    uint32_t n_frames = ksp_fill_buffer(engine, b);
 
-    pw_stream_queue_buffer(data->stream, b);
+    pw_stream_queue_buffer(engine->stream, b);
+    int64_t queued = ksp_now_ns();
+    record_cycle(engine, start, queued, read_device_delay(engine, n_frames), n_frames);
 }
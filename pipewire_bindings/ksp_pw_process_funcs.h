@@ -1,12 +1,20 @@
 #ifndef KSP_PW_PROCESS_FUNCS_H
 #define KSP_PW_PROCESS_FUNCS_H
 
-void ksp_process_32(void *userdata);
+#include "ksp_pw_structs.h"
 
-void ksp_process_24(void *userdata);
+struct pw_buffer;
 
-void ksp_process_16(void *userdata);
+void ksp_process_engine(void *userdata);
 
-void ksp_process_8(void *userdata);
+//Mixes the engine into a dequeued buffer, whose memory must be mapped, and fills in its chunk. Returns the number of
+//frames written.
+uint32_t ksp_fill_buffer(ksp_engine *engine, struct pw_buffer *b);
 
-#endif
\ No newline at end of file
+//Mixes one cycle into dst and records it in the engine's stats, for backends other than PipeWire. deviceDelay is
+//how long dst will take to be heard, in nanoseconds.
+void ksp_process_cycle(ksp_engine *engine, float *dst, uint32_t n_frames, int64_t deviceDelay);
+
+void ksp_mix(ksp_engine *engine, float *dst, uint32_t n_frames);
+
+#endif
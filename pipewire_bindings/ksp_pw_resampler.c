@@ -0,0 +1,116 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "ksp_pw_resampler.h"
+
+/* Filter tables for band-limited resampling. A voice that steps through its source faster than one frame per
+ * output frame has to be filtered below the output's Nyquist frequency rather than the source's, or it aliases,
+ * so each quality keeps filters for a few ratios and a voice uses the first one that covers its step. Filters for
+ * higher ratios have proportionally more taps, so their transition band stays as steep relative to the cutoff.
+ * Everything is built when the engine starts, so changing speed or quality never allocates on the audio thread. */
+
+typedef struct ksp_resample_preset
+{
+    uint32_t taps; //At a ratio of 1
+    uint32_t phases;
+    double beta; //Kaiser window shape; higher trades a wider transition band for more stopband attenuation
+    double cutoff; //Fraction of the Nyquist frequency the passband extends to
+} ksp_resample_preset;
+
+static const ksp_resample_preset presets[KSP_RESAMPLE_QUALITY_COUNT] = {
+    [KSP_RESAMPLE_LINEAR] = { 0 },
+    [KSP_RESAMPLE_LOW] = { .taps = 8, .phases = 64, .beta = 5, .cutoff = 0.80 },
+    [KSP_RESAMPLE_MEDIUM] = { .taps = 16, .phases = 128, .beta = 7, .cutoff = 0.88 },
+    [KSP_RESAMPLE_HIGH] = { .taps = 32, .phases = 256, .beta = 9, .cutoff = 0.93 },
+};
+
+static const double ratios[KSP_RESAMPLE_RATIOS] = { 1, 1.25, 1.5, 2, 3, 4 };
+
+//Zeroth order modified Bessel function of the first kind, for the Kaiser window
+static double bessel_i0(double x)
+{
+    double sum = 1;
+    double term = 1;
+    for (int k = 1; k < 32; k++)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static void build_table(ksp_fir_table *table, const ksp_resample_preset *preset, double ratio)
+{
+    uint32_t half = table->taps / 2;
+    //Relative to the source's Nyquist frequency
+    double cutoff = preset->cutoff / ratio;
+    double windowScale = 1 / bessel_i0(preset->beta);
+
+    for (uint32_t p = 0; p <= preset->phases; p++)
+    {
+        float *row = table->coefficients + (size_t)p * table->taps;
+        double frac = (double)p / preset->phases;
+        double sum = 0;
+        for (uint32_t k = 0; k < table->taps; k++)
+        {
+            //Distance from the output frame to the source frame this tap reads
+            double distance = (double)k - half + 1 - frac;
+            double x = distance / half;
+            double window = x * x < 1 ? bessel_i0(preset->beta * sqrt(1 - x * x)) * windowScale : 0;
+            double sinc = distance == 0 ? 1 : sin(M_PI * cutoff * distance) / (M_PI * cutoff * distance);
+            row[k] = (float)(cutoff * sinc * window);
+            sum += row[k];
+        }
+        //Normalising every phase to unity gain at DC keeps the phases from modulating a constant signal
+        for (uint32_t k = 0; k < table->taps; k++)
+            row[k] = (float)(row[k] / sum);
+    }
+}
+
+bool ksp_resampler_init(ksp_resampler *resampler, ksp_resample_quality quality)
+{
+    const ksp_resample_preset *preset = &presets[quality];
+    if (preset->taps == 0)
+        return true;
+
+    for (int i = 0; i < KSP_RESAMPLE_RATIOS; i++)
+    {
+        ksp_fir_table *table = &resampler->tables[i];
+        table->ratio = ratios[i];
+        table->phases = preset->phases;
+        //The filter kernels work on whole vectors of 8
+        table->taps = ((uint32_t)ceil(preset->taps * ratios[i]) + 7) & ~7u;
+        table->coefficients = malloc((size_t)(preset->phases + 1) * table->taps * sizeof(float));
+        if (table->coefficients == NULL)
+        {
+            ksp_resampler_destroy(resampler);
+            return false;
+        }
+        build_table(table, preset, ratios[i]);
+    }
+    return true;
+}
+
+void ksp_resampler_destroy(ksp_resampler *resampler)
+{
+    for (int i = 0; i < KSP_RESAMPLE_RATIOS; i++)
+    {
+        free(resampler->tables[i].coefficients);
+        resampler->tables[i].coefficients = NULL;
+    }
+}
+
+const ksp_fir_table *ksp_resampler_table(const ksp_resampler *resampler, double step)
+{
+    if (resampler->tables[0].coefficients == NULL)
+        return NULL;
+    //Past the highest ratio a voice aliases somewhat, rather than paying for an ever longer filter
+    for (int i = 0; i < KSP_RESAMPLE_RATIOS - 1; i++)
+    {
+        if (step <= resampler->tables[i].ratio)
+            return &resampler->tables[i];
+    }
+    return &resampler->tables[KSP_RESAMPLE_RATIOS - 1];
+}
@@ -0,0 +1,51 @@
+#ifndef KSP_PW_RESAMPLER_H
+#define KSP_PW_RESAMPLER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Trade-offs between CPU time and how cleanly voices are converted to the engine's rate
+typedef enum ksp_resample_quality
+{
+    KSP_RESAMPLE_LINEAR, //Linear interpolation; cheapest, but aliases and dulls the top end
+    KSP_RESAMPLE_LOW,    //8-tap windowed sinc
+    KSP_RESAMPLE_MEDIUM, //16-tap windowed sinc
+    KSP_RESAMPLE_HIGH,   //32-tap windowed sinc
+    KSP_RESAMPLE_QUALITY_COUNT
+} ksp_resample_quality;
+
+#define KSP_RESAMPLE_DEFAULT_QUALITY KSP_RESAMPLE_MEDIUM
+
+//Number of source-to-output rate ratios each quality has a filter for
+#define KSP_RESAMPLE_RATIOS 6
+
+//Longest filter of any quality, in taps
+#define KSP_RESAMPLE_MAX_TAPS 128
+
+//Frames before the playhead a filter can read, which streamed voices have to keep in their ring
+#define KSP_RESAMPLE_HISTORY (KSP_RESAMPLE_MAX_TAPS / 2)
+
+/* A windowed sinc low-pass filter, sampled at phases + 1 evenly spaced fractional offsets between two source frames.
+ * Row p holds the taps weights for the source frames from base - taps / 2 + 1 to base + taps / 2, for an output
+ * frame at base + p / phases. */
+typedef struct ksp_fir_table
+{
+    double ratio; //Largest step the filter cuts off low enough for
+    uint32_t taps;
+    uint32_t phases;
+    float *coefficients;
+} ksp_fir_table;
+
+typedef struct ksp_resampler
+{
+    ksp_fir_table tables[KSP_RESAMPLE_RATIOS]; //In order of ratio; none for linear interpolation
+} ksp_resampler;
+
+bool ksp_resampler_init(ksp_resampler *resampler, ksp_resample_quality quality);
+
+void ksp_resampler_destroy(ksp_resampler *resampler);
+
+//The filter for a voice stepping through its source step frames at a time. Returns NULL for linear interpolation.
+const ksp_fir_table *ksp_resampler_table(const ksp_resampler *resampler, double step);
+
+#endif
@@ -0,0 +1,538 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ksp_pw_structs.h"
+#include "ksp_pw_sample_bank.h"
+#include "ksp_pw_player_main.h"
+#include "ksp_pw_player_funcs.h"
+#include "ksp_pw_flac.h"
+#include "ksp_pw_mp3.h"
+#include "ksp_pw_wave.h"
+#include "ksp_pw_cache.h"
+
+/* The sample bank keeps every sound of a board parsed, mapped and pre-faulted for as long as the
+ * board is loaded, so that triggering a sound never touches the disk. A sample is shared by any
+ * number of voices; each holds a reference, and the mapping is only dropped once the last
+ * reference (including the bank's own) is gone. */
+
+void ksp_bank_init(ksp_sample_bank *bank)
+{
+    pthread_mutex_init(&bank->lock, NULL);
+    ksp_cache_init(&bank->cache);
+}
+
+static void unload_sample(ksp_sample *sample)
+{
+    UnloadWave(&sample->loadInfo);
+    ksp_peaks_free(&sample->peaks);
+    if (sample->bundle != NULL)
+    {
+        //Other samples of the bundle may still be using the rest of the mapping
+        if (sample->locked)
+            munlock(sample->data, (size_t)sample->frameCount * sample->bytesPerFrame);
+        ksp_bundle_release(sample->bundle);
+        sample->bundle = NULL;
+    }
+    free(sample->decoded);
+    sample->decoded = NULL;
+    sample->data = NULL;
+    free(sample->filePath);
+    sample->filePath = NULL;
+    sample->decoder = NULL;
+}
+
+void ksp_bank_destroy(ksp_sample_bank *bank)
+{
+    pthread_mutex_lock(&bank->lock);
+    for (int i = 0; i < KSP_MAX_SAMPLES; i++)
+    {
+        if (bank->samples[i].refCount > 0)
+        {
+            unload_sample(&bank->samples[i]);
+            bank->samples[i].refCount = 0;
+        }
+    }
+    pthread_mutex_unlock(&bank->lock);
+    pthread_mutex_destroy(&bank->lock);
+    ksp_cache_close(&bank->cache);
+}
+
+bool ksp_bank_open_cache(ksp_engine *engine, const char *directory)
+{
+    return ksp_cache_open(&engine->bank.cache, directory);
+}
+
+static bool check_channels(const char *filePath, uint32_t channels)
+{
+    if (channels == 0 || channels > KSP_MAX_SAMPLE_CHANNELS)
+    {
+        fprintf(stderr, "%s: unsupported channel count: %u\n", filePath, channels);
+        return false;
+    }
+    return true;
+}
+
+AudioFormat ksp_bank_probe(const char *filePath)
+{
+    uint8_t magic[12] = {0};
+    FILE *file = fopen(filePath, "rb");
+    if (file == NULL)
+        return Unknown;
+    size_t length = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    if (length >= 4 && memcmp(magic, "fLaC", 4) == 0)
+        return Flac;
+    if (length >= 12 && memcmp(magic + 8, "WAVE", 4) == 0 &&
+        (memcmp(magic, "RIFF", 4) == 0 || memcmp(magic, "RF64", 4) == 0 || memcmp(magic, "BW64", 4) == 0))
+        return Wave;
+    //Either an ID3v2 tag or the sync word of the first MPEG audio frame
+    if ((length >= 3 && memcmp(magic, "ID3", 3) == 0) || (length >= 2 && magic[0] == 0xFF && (magic[1] & 0xE0) == 0xE0))
+        return MP3;
+    return Unknown;
+}
+
+//Finds a free slot and fills it in. Returns -1 if the bank is full.
+static int32_t add_sample(ksp_sample_bank *bank, const ksp_sample *sample)
+{
+    pthread_mutex_lock(&bank->lock);
+    int32_t sampleId = -1;
+    for (int i = 0; i < KSP_MAX_SAMPLES; i++)
+    {
+        if (bank->samples[i].refCount == 0)
+        {
+            sampleId = i;
+            break;
+        }
+    }
+    if (sampleId >= 0)
+    {
+        bank->samples[sampleId] = *sample;
+        bank->samples[sampleId].refCount = 1;
+    }
+    pthread_mutex_unlock(&bank->lock);
+
+    if (sampleId < 0)
+        fputs("Sample bank is full!\n", stderr);
+    return sampleId;
+}
+
+//Decodes the rest of a stream into one buffer. Returns NULL if it could not be allocated.
+static uint8_t *decode_all(const ksp_decoder_ops *ops, void *decoder, size_t bytesPerFrame, uint64_t expectedFrames,
+                           uint32_t *frameCount)
+{
+    //The expected length can be an estimate, so the buffer grows if the stream turns out longer
+    size_t capacity = expectedFrames > 0 ? expectedFrames : 65536;
+    size_t frames = 0;
+    uint8_t *buffer = malloc(capacity * bytesPerFrame);
+    while (buffer != NULL)
+    {
+        if (frames == capacity)
+        {
+            capacity *= 2;
+            uint8_t *grown = realloc(buffer, capacity * bytesPerFrame);
+            if (grown == NULL)
+            {
+                free(buffer);
+                return NULL;
+            }
+            buffer = grown;
+        }
+        uint32_t wanted = capacity - frames > UINT32_MAX ? UINT32_MAX : (uint32_t)(capacity - frames);
+        uint32_t decoded = ops->read(decoder, buffer + frames * bytesPerFrame, wanted);
+        if (decoded == 0)
+            break;
+        frames += decoded;
+    }
+    *frameCount = frames <= UINT32_MAX ? (uint32_t)frames : UINT32_MAX;
+    return buffer;
+}
+
+//Start and length of the whole mapping behind a loaded sample, as passed to mmap
+static void *mapping_start(const waveFileLoadInfo *loadInfo, size_t *length)
+{
+    *length = loadInfo->mmapLength;
+    return loadInfo->file.dataChunk.data - loadInfo->mmapOffset;
+}
+
+static bool lock_mapping(const char *filePath, const waveFileLoadInfo *loadInfo)
+{
+    if (!loadInfo->mmapUsed)
+        return false;
+    size_t length;
+    void *start = mapping_start(loadInfo, &length);
+    if (mlock(start, length) == 0)
+        return true;
+    fprintf(stderr, "Could not lock %s in memory: %s\n", filePath, strerror(errno));
+    return false;
+}
+
+//Maps a sound's decoded audio back in from the cache, without opening a decoder. Returns -1 if that fails.
+static int32_t load_cached(ksp_sample_bank *bank, const char *filePath, AudioFormat format,
+                           const ksp_cache_entry *entry, uint32_t flags)
+{
+    if (entry->frameCount > UINT32_MAX || !check_channels(filePath, entry->channels))
+        return -1;
+    uint8_t *pcm = ksp_cache_map(&bank->cache, entry);
+    if (pcm == NULL)
+        return -1;
+
+    //The mapping is released like that of a wave file whose data chunk starts at the top of the file
+    ksp_sample sample = {
+        .format = format,
+        .sampleFormat = entry->sampleFormat,
+        .loadInfo = {
+            .mmapUsed = true,
+            .mmapOffset = 0,
+            .mmapLength = entry->pcmBytes,
+            .file.dataChunk = { .dataSize = entry->pcmBytes, .data = pcm },
+        },
+        .data = pcm,
+        .channels = entry->channels,
+        .sampleRate = entry->sampleRate,
+        .frameCount = (uint32_t)entry->frameCount,
+        .bytesPerFrame = ksp_sample_format_size(entry->sampleFormat) * entry->channels,
+    };
+    sample.locked = (flags & KSP_BANK_LOCK) && lock_mapping(filePath, &sample.loadInfo);
+
+    int32_t sampleId = add_sample(bank, &sample);
+    if (sampleId < 0)
+        unload_sample(&sample);
+    return sampleId;
+}
+
+/* Short compressed sounds are decoded into memory up front, so they play exactly like a wave file. Longer ones,
+ * and wave files too long to keep resident, would take too long to decode and too much memory to hold, so only
+ * their layout is read now and every voice streams them as it plays. */
+static int32_t load_decoded(ksp_sample_bank *bank, const char *filePath, AudioFormat format,
+                               const ksp_decoder_ops *ops, uint32_t flags)
+{
+    //Sounds that have been decoded before are mapped straight back in from the cache
+    struct stat source;
+    bool cacheable = stat(filePath, &source) == 0;
+    ksp_cache_entry entry;
+    if (cacheable && ksp_cache_lookup(&bank->cache, &source, &entry))
+    {
+        int32_t sampleId = load_cached(bank, filePath, format, &entry, flags);
+        if (sampleId >= 0)
+            return sampleId;
+    }
+
+    ksp_stream_info info;
+    void *decoder = ops->open(filePath, &info);
+    if (decoder == NULL)
+        return -1;
+    if (!check_channels(filePath, info.channels))
+    {
+        ops->close(decoder);
+        return -1;
+    }
+
+    ksp_sample sample = {
+        .format = format,
+        .sampleFormat = info.sampleFormat,
+        .channels = info.channels,
+        .sampleRate = info.sampleRate,
+        .frameCount = info.frameCount <= UINT32_MAX ? (uint32_t)info.frameCount : 0,
+        .bytesPerFrame = ksp_sample_format_size(info.sampleFormat) * info.channels,
+    };
+
+    if ((flags & KSP_BANK_RESIDENT) ||
+        (info.frameCount > 0 && info.frameCount * sample.bytesPerFrame <= KSP_BANK_DECODE_LIMIT))
+    {
+        sample.decoded = decode_all(ops, decoder, sample.bytesPerFrame, info.frameCount, &sample.frameCount);
+        ops->close(decoder);
+        if (sample.decoded == NULL)
+        {
+            fprintf(stderr, "Could not allocate memory to decode %s\n", filePath);
+            return -1;
+        }
+        if (sample.frameCount == 0)
+        {
+            fprintf(stderr, "%s: no audio could be decoded\n", filePath);
+            free(sample.decoded);
+            return -1;
+        }
+        sample.data = sample.decoded;
+        if (cacheable && ops != &ksp_wave_decoder)
+        {
+            ksp_cache_entry decoded = {
+                .frameCount = sample.frameCount,
+                .pcmBytes = (uint64_t)sample.frameCount * sample.bytesPerFrame,
+                .sampleRate = sample.sampleRate,
+                .channels = sample.channels,
+                .sampleFormat = sample.sampleFormat,
+                .format = format,
+            };
+            ksp_cache_store(&bank->cache, filePath, &source, &decoded, sample.decoded);
+        }
+        if (flags & KSP_BANK_LOCK)
+        {
+            if (mlock(sample.decoded, (size_t)sample.frameCount * sample.bytesPerFrame) == 0)
+                sample.locked = true;
+            else
+                fprintf(stderr, "Could not lock %s in memory: %s\n", filePath, strerror(errno));
+        }
+    }
+    else
+    {
+        ops->close(decoder);
+        sample.decoder = ops;
+        sample.filePath = strdup(filePath);
+        if (sample.filePath == NULL)
+            return -1;
+    }
+
+    int32_t sampleId = add_sample(bank, &sample);
+    if (sampleId < 0)
+        unload_sample(&sample);
+    return sampleId;
+}
+
+static int32_t load_sample(ksp_sample_bank *bank, const char *filePath, uint32_t flags)
+{
+    AudioFormat format = ksp_bank_probe(filePath);
+    if (format == Unknown)
+    {
+        fprintf(stderr, "%s: not a wave, FLAC or MP3 file\n", filePath);
+        return -1;
+    }
+    if (format == Flac)
+        return load_decoded(bank, filePath, format, &ksp_flac_decoder, flags);
+    if (format == MP3)
+        return load_decoded(bank, filePath, format, &ksp_mp3_decoder, flags);
+
+    struct stat status;
+    if (!(flags & KSP_BANK_RESIDENT) && stat(filePath, &status) == 0 && status.st_size > KSP_BANK_STREAM_THRESHOLD)
+        return load_decoded(bank, filePath, format, &ksp_wave_decoder, flags);
+
+    struct waveFileLoadInfo loadInfo = ReadWave(filePath, true);
+    if (loadInfo.file.dataChunk.data == NULL)
+        return -1;
+    ksp_sample_format sampleFormat;
+    if (!ksp_wave_sample_format(filePath, &loadInfo.file.formatChunk, &sampleFormat) ||
+        !check_channels(filePath, loadInfo.file.formatChunk.channels))
+    {
+        UnloadWave(&loadInfo);
+        return -1;
+    }
+
+    bool locked = (flags & KSP_BANK_LOCK) && lock_mapping(filePath, &loadInfo);
+
+    ksp_sample sample = {
+        .format = Wave,
+        .sampleFormat = sampleFormat,
+        .loadInfo = loadInfo,
+        .data = loadInfo.file.dataChunk.data,
+        .channels = loadInfo.file.formatChunk.channels,
+        .sampleRate = loadInfo.file.formatChunk.sampleRate,
+        .bytesPerFrame = ksp_sample_format_size(sampleFormat) * loadInfo.file.formatChunk.channels,
+        .loopStart = loadInfo.file.loopStart,
+        .loopEnd = loadInfo.file.loopEnd,
+        .locked = locked,
+    };
+    uint64_t frameCount = loadInfo.file.dataChunk.dataSize / sample.bytesPerFrame;
+    sample.frameCount = frameCount <= UINT32_MAX ? (uint32_t)frameCount : UINT32_MAX;
+    if (sample.frameCount == 0)
+    {
+        fprintf(stderr, "%s: no audio in the data chunk\n", filePath);
+        UnloadWave(&loadInfo);
+        return -1;
+    }
+
+    int32_t sampleId = add_sample(bank, &sample);
+    if (sampleId < 0)
+        UnloadWave(&loadInfo);
+    return sampleId;
+}
+
+int32_t ksp_bank_load(ksp_engine *engine, const char *filePath, uint32_t flags)
+{
+    ksp_sample_bank *bank = &engine->bank;
+    int32_t sampleId = load_sample(bank, filePath, flags);
+    if (sampleId < 0 || !(flags & KSP_BANK_PEAKS))
+        return sampleId;
+
+    //Nobody else knows the sample's ID yet, but the index is only put in place under the lock all the same
+    ksp_peaks peaks = { 0 };
+    if (ksp_peaks_load(&peaks, &bank->cache, filePath, &bank->samples[sampleId], engine->kernels))
+    {
+        pthread_mutex_lock(&bank->lock);
+        bank->samples[sampleId].peaks = peaks;
+        pthread_mutex_unlock(&bank->lock);
+    }
+    return sampleId;
+}
+
+int32_t ksp_bank_load_bundled(ksp_engine *engine, ksp_bundle *bundle, uint32_t cue, uint32_t flags)
+{
+    const ksp_bundle_entry *entry = ksp_bundle_cue(bundle, cue);
+    if (entry == NULL)
+        return -1;
+
+    //Played straight from the bundle's mapping, like a sound mapped from the cache
+    ksp_sample sample = {
+        .format = entry->format,
+        .sampleFormat = entry->sampleFormat,
+        .data = bundle->map + entry->pcmOffset,
+        .channels = entry->channels,
+        .sampleRate = entry->sampleRate,
+        .frameCount = (uint32_t)entry->frameCount,
+        .bytesPerFrame = ksp_sample_format_size(entry->sampleFormat) * entry->channels,
+        .loopStart = entry->loopStart,
+        .loopEnd = entry->loopEnd,
+        .bundle = bundle,
+    };
+    if (flags & KSP_BANK_LOCK)
+    {
+        if (mlock(sample.data, entry->pcmBytes) == 0)
+            sample.locked = true;
+        else
+            fprintf(stderr, "Could not lock cue %u of the bundle in memory: %s\n", cue, strerror(errno));
+    }
+    if ((flags & KSP_BANK_PEAKS) && entry->peaksOffset != 0 &&
+        !ksp_peaks_borrow(&sample.peaks, bundle->map + entry->peaksOffset, entry->peaksBytes, entry->channels))
+        fprintf(stderr, "The peaks of cue %u of the bundle are damaged\n", cue);
+
+    ksp_bundle_ref(bundle);
+    int32_t sampleId = add_sample(&engine->bank, &sample);
+    if (sampleId < 0)
+        unload_sample(&sample);
+    return sampleId;
+}
+
+bool ksp_bank_export(ksp_engine *engine, const char *path, const int32_t *sampleIds, int32_t count,
+                     const char *metadata, size_t metadataBytes)
+{
+    if (count < 0)
+        return false;
+    ksp_sample **samples = calloc(count > 0 ? count : 1, sizeof(ksp_sample *));
+    if (samples == NULL)
+        return false;
+    //Held for as long as the bundle is being written, so a sound removed meanwhile isn't unloaded under it
+    for (int32_t i = 0; i < count; i++)
+        samples[i] = ksp_sample_ref(&engine->bank, sampleIds[i]);
+    bool written = ksp_bundle_write(path, (const ksp_sample *const *)samples, count, metadata, metadataBytes);
+    for (int32_t i = 0; i < count; i++)
+        ksp_sample_unref(&engine->bank, samples[i]);
+    free(samples);
+    return written;
+}
+
+void ksp_bank_release(ksp_engine *engine, int32_t sampleId)
+{
+    if (sampleId < 0 || sampleId >= KSP_MAX_SAMPLES)
+        return;
+    //Finished voices of the sample still hold references to it, which would keep it loaded
+    ksp_voice_reap(engine);
+    ksp_sample_unref(&engine->bank, &engine->bank.samples[sampleId]);
+}
+
+size_t ksp_bank_resident_bytes(ksp_engine *engine, int32_t sampleId)
+{
+    if (sampleId < 0 || sampleId >= KSP_MAX_SAMPLES)
+        return 0;
+
+    ksp_sample_bank *bank = &engine->bank;
+    ksp_sample *sample = &bank->samples[sampleId];
+    size_t resident = 0;
+
+    pthread_mutex_lock(&bank->lock);
+    if (sample->refCount > 0 && sample->data != NULL)
+    {
+        void *start = NULL;
+        size_t length = 0;
+        if (sample->decoded != NULL)
+        {
+            resident = (size_t)sample->frameCount * sample->bytesPerFrame;
+        }
+        else if (sample->bundle != NULL)
+        {
+            //Only the sample's own part of the bundle, which starts on a page boundary
+            start = (void *)sample->data;
+            length = (size_t)sample->frameCount * sample->bytesPerFrame;
+        }
+        else if (!sample->loadInfo.mmapUsed)
+        {
+            resident = sample->loadInfo.file.dataChunk.dataSize;
+        }
+        else
+        {
+            start = mapping_start(&sample->loadInfo, &length);
+        }
+
+        if (start != NULL)
+        {
+            //Ask the kernel which pages are actually in memory rather than trusting the prefault
+            size_t pageSize = sysconf(_SC_PAGESIZE);
+            size_t pages = (length + pageSize - 1) / pageSize;
+            unsigned char *vec = malloc(pages);
+            if (vec != NULL && mincore(start, length, vec) == 0)
+            {
+                for (size_t i = 0; i < pages; i++)
+                {
+                    if (vec[i] & 1)
+                        resident += pageSize;
+                }
+            }
+            free(vec);
+        }
+    }
+    pthread_mutex_unlock(&bank->lock);
+
+    return resident;
+}
+
+size_t ksp_bank_resident_bytes_total(ksp_engine *engine, const int32_t *sampleIds, int32_t count)
+{
+    size_t total = 0;
+    for (int32_t i = 0; i < count; i++)
+        total += ksp_bank_resident_bytes(engine, sampleIds[i]);
+    return total;
+}
+
+int32_t ksp_bank_peaks(ksp_engine *engine, int32_t sampleId, uint64_t start, uint64_t end, int32_t channel,
+                       ksp_peak_column *columns, int32_t pixels)
+{
+    ksp_sample *sample = ksp_sample_ref(&engine->bank, sampleId);
+    if (sample == NULL)
+        return 0;
+    int32_t filled = pixels > 0 ? (int32_t)ksp_peaks_read(&sample->peaks, start, end, channel, columns, pixels) : 0;
+    ksp_sample_unref(&engine->bank, sample);
+    return filled;
+}
+
+ksp_sample *ksp_sample_ref(ksp_sample_bank *bank, int32_t sampleId)
+{
+    if (sampleId < 0 || sampleId >= KSP_MAX_SAMPLES)
+        return NULL;
+
+    ksp_sample *sample = &bank->samples[sampleId];
+    pthread_mutex_lock(&bank->lock);
+    if (sample->refCount == 0)
+        sample = NULL;
+    else
+        sample->refCount++;
+    pthread_mutex_unlock(&bank->lock);
+    return sample;
+}
+
+void ksp_sample_unref(ksp_sample_bank *bank, ksp_sample *sample)
+{
+    if (sample == NULL)
+        return;
+
+    pthread_mutex_lock(&bank->lock);
+    if (sample->refCount > 0 && --sample->refCount == 0)
+    {
+        //munmap also drops any mlock on the range
+        unload_sample(sample);
+        sample->locked = false;
+    }
+    pthread_mutex_unlock(&bank->lock);
+}
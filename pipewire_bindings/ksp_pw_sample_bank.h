@@ -0,0 +1,45 @@
+#ifndef KSP_PW_SAMPLE_BANK_H
+#define KSP_PW_SAMPLE_BANK_H
+
+#include "ksp_pw_structs.h"
+
+void ksp_bank_init(ksp_sample_bank *bank);
+
+void ksp_bank_destroy(ksp_sample_bank *bank);
+
+//Keeps the decoded audio of compressed sounds in directory, so they don't have to be decoded again the next time
+bool ksp_bank_open_cache(ksp_engine *engine, const char *directory);
+
+//Works out what kind of file this is from its first bytes rather than trusting the extension
+AudioFormat ksp_bank_probe(const char *filePath);
+
+//Safe to call from several threads at once, so a board's sounds can be loaded in parallel
+int32_t ksp_bank_load(ksp_engine *engine, const char *filePath, uint32_t flags);
+
+//Adds a cue of a bundle opened with ksp_bundle_open to the bank, played from the bundle's mapping. The sample holds a
+//reference to the bundle, so the caller can release its own once every cue it wants has been loaded.
+int32_t ksp_bank_load_bundled(ksp_engine *engine, ksp_bundle *bundle, uint32_t cue, uint32_t flags);
+
+//Writes the given samples, in cue order, and a board's metadata into a bundle at path, as ksp_bundle_write does. An
+//ID that isn't loaded leaves its cue empty.
+bool ksp_bank_export(ksp_engine *engine, const char *path, const int32_t *sampleIds, int32_t count,
+                     const char *metadata, size_t metadataBytes);
+
+void ksp_bank_release(ksp_engine *engine, int32_t sampleId);
+
+size_t ksp_bank_resident_bytes(ksp_engine *engine, int32_t sampleId);
+
+//The resident bytes of several samples added up, so a whole board can be measured in one call. IDs that aren't loaded
+//count for nothing.
+size_t ksp_bank_resident_bytes_total(ksp_engine *engine, const int32_t *sampleIds, int32_t count);
+
+//Draws a sample's waveform from its peak index into pixels columns, as ksp_peaks_read does. Returns 0 if the sample
+//wasn't loaded with KSP_BANK_PEAKS.
+int32_t ksp_bank_peaks(ksp_engine *engine, int32_t sampleId, uint64_t start, uint64_t end, int32_t channel,
+                       ksp_peak_column *columns, int32_t pixels);
+
+ksp_sample *ksp_sample_ref(ksp_sample_bank *bank, int32_t sampleId);
+
+void ksp_sample_unref(ksp_sample_bank *bank, ksp_sample *sample);
+
+#endif
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ksp_pw_stats.h"
+
+/* Nearly everything here is written by the audio thread with relaxed atomic adds and stores, so recording never
+ * blocks or allocates, and is read by control threads whenever they like. Counts read while a callback is being
+ * recorded may be a cycle apart from one another, which doesn't matter for statistics. */
+
+int64_t ksp_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Values below 4 get a bucket each. Above that, every power of two is split into four, by the two bits below the
+ * highest set one. */
+static uint32_t bucket_of(uint64_t value)
+{
+    if (value < KSP_HISTOGRAM_SUB_BUCKETS)
+        return (uint32_t)value;
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t bucket = KSP_HISTOGRAM_SUB_BUCKETS * (msb - 1) + ((value >> (msb - 2)) & (KSP_HISTOGRAM_SUB_BUCKETS - 1));
+    return bucket < KSP_HISTOGRAM_BUCKETS ? bucket : KSP_HISTOGRAM_BUCKETS - 1;
+}
+
+//Largest value that falls in a bucket
+static uint64_t bucket_limit(uint32_t bucket)
+{
+    if (bucket < KSP_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    uint32_t msb = bucket / KSP_HISTOGRAM_SUB_BUCKETS + 1;
+    uint64_t width = 1ull << (msb - 2);
+    return (KSP_HISTOGRAM_SUB_BUCKETS + bucket % KSP_HISTOGRAM_SUB_BUCKETS) * width + width - 1;
+}
+
+void ksp_histogram_record(ksp_histogram *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    //There is only one writer, so this can't lose a larger value to a race
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+uint64_t ksp_histogram_percentile(const ksp_histogram *histogram, double fraction)
+{
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    if (count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(fraction * count);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < KSP_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            //The top bucket's limit can be far past anything actually recorded
+            uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+            uint64_t limit = bucket_limit(i);
+            return limit < max ? limit : max;
+        }
+    }
+    return atomic_load_explicit(&histogram->max, memory_order_relaxed);
+}
+
+void ksp_stats_callback(ksp_stats *stats, int64_t start, int64_t end, uint64_t quantumNs)
+{
+    uint64_t duration = end > start ? (uint64_t)(end - start) : 0;
+    ksp_histogram_record(&stats->callback, duration);
+    atomic_fetch_add_explicit(&stats->callbacks, 1, memory_order_relaxed);
+    if (quantumNs > 0 && duration > quantumNs)
+        atomic_fetch_add_explicit(&stats->overruns, 1, memory_order_relaxed);
+}
+
+void ksp_stats_voices(ksp_stats *stats, uint32_t voices)
+{
+    atomic_store_explicit(&stats->voices, voices, memory_order_relaxed);
+    if (voices > atomic_load_explicit(&stats->voicesPeak, memory_order_relaxed))
+        atomic_store_explicit(&stats->voicesPeak, voices, memory_order_relaxed);
+}
+
+void ksp_stats_dsp(ksp_stats *stats, int64_t start, int64_t end)
+{
+    ksp_histogram_record(&stats->dsp, end > start ? (uint64_t)(end - start) : 0);
+}
+
+void ksp_stats_gain_reduction(ksp_stats *stats, float reduction)
+{
+    atomic_store_explicit(&stats->gainReduction, reduction, memory_order_relaxed);
+    if (reduction > atomic_load_explicit(&stats->gainReductionPeak, memory_order_relaxed))
+        atomic_store_explicit(&stats->gainReductionPeak, reduction, memory_order_relaxed);
+}
+
+void ksp_stats_clock(ksp_stats *stats, uint64_t ticks, uint64_t ticksExpected)
+{
+    //Half a cycle of slack, since the graph can adjust its rate a little to follow the device
+    if (stats->lastTicks != 0 && ticks > stats->lastTicks &&
+        ticks - stats->lastTicks > stats->lastTicksExpected + stats->lastTicksExpected / 2)
+        atomic_fetch_add_explicit(&stats->xruns, 1, memory_order_relaxed);
+    stats->lastTicks = ticks;
+    stats->lastTicksExpected = ticksExpected;
+}
+
+void ksp_stats_trace(ksp_stats *stats, const ksp_latency_trace *trace)
+{
+    if (trace->firstQueued > trace->voiceStart)
+        ksp_histogram_record(&stats->startToQueued, trace->firstQueued - trace->voiceStart);
+    int64_t from = trace->keyEvent != 0 ? trace->keyEvent : trace->trigger != 0 ? trace->trigger : trace->voiceStart;
+    int64_t audible = trace->firstQueued + trace->deviceDelay;
+    if (audible > from)
+        ksp_histogram_record(&stats->triggerToAudible, audible - from);
+
+    uint32_t sequence = atomic_load_explicit(&stats->traceSequence, memory_order_relaxed);
+    atomic_store_explicit(&stats->traceSequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&stats->lastTrace[0], trace->keyEvent, memory_order_relaxed);
+    atomic_store_explicit(&stats->lastTrace[1], trace->trigger, memory_order_relaxed);
+    atomic_store_explicit(&stats->lastTrace[2], trace->voiceStart, memory_order_relaxed);
+    atomic_store_explicit(&stats->lastTrace[3], trace->firstQueued, memory_order_relaxed);
+    atomic_store_explicit(&stats->lastTrace[4], trace->deviceDelay, memory_order_relaxed);
+    atomic_store_explicit(&stats->traceSequence, sequence + 2, memory_order_release);
+}
+
+static void read_trace(ksp_stats *stats, ksp_latency_trace *output)
+{
+    uint32_t before, after;
+    do
+    {
+        before = atomic_load_explicit(&stats->traceSequence, memory_order_acquire);
+        output->keyEvent = atomic_load_explicit(&stats->lastTrace[0], memory_order_relaxed);
+        output->trigger = atomic_load_explicit(&stats->lastTrace[1], memory_order_relaxed);
+        output->voiceStart = atomic_load_explicit(&stats->lastTrace[2], memory_order_relaxed);
+        output->firstQueued = atomic_load_explicit(&stats->lastTrace[3], memory_order_relaxed);
+        output->deviceDelay = atomic_load_explicit(&stats->lastTrace[4], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&stats->traceSequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+void ksp_stats_snapshot_read(ksp_stats *stats, ksp_stats_snapshot *output)
+{
+    memset(output, 0, sizeof(*output));
+    output->callbacks = atomic_load_explicit(&stats->callbacks, memory_order_relaxed);
+    output->overruns = atomic_load_explicit(&stats->overruns, memory_order_relaxed);
+    output->xruns = atomic_load_explicit(&stats->xruns, memory_order_relaxed);
+    output->outOfBuffers = atomic_load_explicit(&stats->outOfBuffers, memory_order_relaxed);
+    output->callbackP50 = ksp_histogram_percentile(&stats->callback, 0.5);
+    output->callbackP99 = ksp_histogram_percentile(&stats->callback, 0.99);
+    output->callbackMax = atomic_load_explicit(&stats->callback.max, memory_order_relaxed);
+    output->triggerP50 = ksp_histogram_percentile(&stats->triggerToAudible, 0.5);
+    output->triggerP99 = ksp_histogram_percentile(&stats->triggerToAudible, 0.99);
+    output->triggerMax = atomic_load_explicit(&stats->triggerToAudible.max, memory_order_relaxed);
+    read_trace(stats, &output->lastTrace);
+    output->voices = atomic_load_explicit(&stats->voices, memory_order_relaxed);
+    output->voicesPeak = atomic_load_explicit(&stats->voicesPeak, memory_order_relaxed);
+    output->voicesStolen = atomic_load_explicit(&stats->voicesStolen, memory_order_relaxed);
+    output->dspP50 = ksp_histogram_percentile(&stats->dsp, 0.5);
+    output->dspP99 = ksp_histogram_percentile(&stats->dsp, 0.99);
+    output->dspMax = atomic_load_explicit(&stats->dsp.max, memory_order_relaxed);
+    output->gainReduction = atomic_load_explicit(&stats->gainReduction, memory_order_relaxed);
+    output->gainReductionPeak = atomic_load_explicit(&stats->gainReductionPeak, memory_order_relaxed);
+}
+
+static void write_histogram(FILE *out, const char *name, const ksp_histogram *histogram)
+{
+    uint64_t count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    uint64_t sum = atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+    fprintf(out, "\"%s\":{\"count\":%" PRIu64 ",\"mean\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64
+            ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 ",\"buckets\":[",
+            name, count, count > 0 ? sum / count : 0, ksp_histogram_percentile(histogram, 0.5),
+            ksp_histogram_percentile(histogram, 0.9), ksp_histogram_percentile(histogram, 0.99),
+            atomic_load_explicit(&histogram->max, memory_order_relaxed));
+    //Only buckets with something in them, as [largest value in the bucket, count]
+    bool first = true;
+    for (uint32_t i = 0; i < KSP_HISTOGRAM_BUCKETS; i++)
+    {
+        uint64_t n = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (n == 0)
+            continue;
+        fprintf(out, "%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", bucket_limit(i), n);
+        first = false;
+    }
+    fputs("]}", out);
+}
+
+int32_t ksp_stats_json(ksp_stats *stats, uint64_t underruns, char *buffer, size_t size)
+{
+    char *json = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&json, &length);
+    if (out == NULL)
+        return -1;
+
+    ksp_stats_snapshot snapshot;
+    ksp_stats_snapshot_read(stats, &snapshot);
+    const ksp_latency_trace *trace = &snapshot.lastTrace;
+    fprintf(out, "{\"callbacks\":%" PRIu64 ",\"overruns\":%" PRIu64 ",\"xruns\":%" PRIu64 ",\"outOfBuffers\":%" PRIu64
+            ",\"underruns\":%" PRIu64 ",\"voices\":%" PRIu64 ",\"voicesPeak\":%" PRIu64 ",\"voicesStolen\":%" PRIu64
+            ",\"gainReductionDb\":%.2f,\"gainReductionPeakDb\":%.2f,\"histogramsNs\":{",
+            snapshot.callbacks, snapshot.overruns, snapshot.xruns, snapshot.outOfBuffers, underruns, snapshot.voices,
+            snapshot.voicesPeak, snapshot.voicesStolen, snapshot.gainReduction, snapshot.gainReductionPeak);
+    write_histogram(out, "callback", &stats->callback);
+    fputc(',', out);
+    write_histogram(out, "startToQueued", &stats->startToQueued);
+    fputc(',', out);
+    write_histogram(out, "triggerToAudible", &stats->triggerToAudible);
+    fputc(',', out);
+    write_histogram(out, "dsp", &stats->dsp);
+    fprintf(out, "},\"lastTriggerNs\":{\"keyEvent\":%" PRId64 ",\"trigger\":%" PRId64 ",\"voiceStart\":%" PRId64
+            ",\"firstQueued\":%" PRId64 ",\"deviceDelay\":%" PRId64 "}}",
+            trace->keyEvent, trace->trigger, trace->voiceStart, trace->firstQueued, trace->deviceDelay);
+    fclose(out);
+
+    if (buffer != NULL && size > 0)
+    {
+        size_t copied = length < size - 1 ? length : size - 1;
+        memcpy(buffer, json, copied);
+        buffer[copied] = '\0';
+    }
+    free(json);
+    return length <= INT32_MAX ? (int32_t)length : -1;
+}
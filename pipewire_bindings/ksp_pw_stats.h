@@ -0,0 +1,115 @@
+#ifndef KSP_PW_STATS_H
+#define KSP_PW_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//Each power of two is split into this many buckets, so no bucket is more than a quarter as wide as its values
+#define KSP_HISTOGRAM_SUB_BUCKETS 4
+
+//Enough buckets for durations up to about 9 minutes, in nanoseconds
+#define KSP_HISTOGRAM_BUCKETS (40 * KSP_HISTOGRAM_SUB_BUCKETS)
+
+//Durations in nanoseconds. Only ever recorded into by one thread, but readable from any.
+typedef struct ksp_histogram
+{
+    _Atomic uint64_t counts[KSP_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} ksp_histogram;
+
+//When each step between a key being pressed and its sound being heard happened, on CLOCK_MONOTONIC, in nanoseconds
+typedef struct ksp_latency_trace
+{
+    int64_t keyEvent; //The window received the key; 0 if the voice wasn't started from a key
+    int64_t trigger; //The keybinding fired; 0 if the voice wasn't started from a key
+    int64_t voiceStart; //ksp_voice_start_bank was called
+    int64_t firstQueued; //The first buffer with the voice in it was handed to PipeWire
+    int64_t deviceDelay; //How long that buffer would take to reach the device, as reported by PipeWire
+} ksp_latency_trace;
+
+typedef struct ksp_stats
+{
+    ksp_histogram callback; //Time spent in each process callback
+    ksp_histogram startToQueued; //From a voice being started to its first buffer being queued
+    ksp_histogram triggerToAudible; //From the earliest known timestamp of a trigger to it reaching the device
+    ksp_histogram dsp; //Time spent running and summing the buses and the master, in each block any DSP was on in
+
+    _Atomic uint64_t callbacks;
+    _Atomic uint64_t overruns; //Callbacks that took longer than the audio they produced lasts
+    _Atomic uint64_t xruns; //Cycles the graph ran without us, judged from jumps in its clock
+    _Atomic uint64_t outOfBuffers; //Callbacks that found no free buffer to fill
+    _Atomic uint32_t voices; //Voices mixed in the last cycle
+    _Atomic uint32_t voicesPeak; //Most voices ever mixed in one cycle
+    _Atomic uint64_t voicesStolen; //Voices cut off to make room for new ones; counted by control threads
+    _Atomic float gainReduction; //Most any limiter turned its audio down by in the last cycle, in dB
+    _Atomic float gainReductionPeak; //Most any limiter has ever turned its audio down by, in dB
+
+    //Last trace recorded, behind a sequence count that is odd while it is being written
+    _Atomic uint32_t traceSequence;
+    _Atomic int64_t lastTrace[5];
+
+    //Only touched by the audio thread
+    uint64_t lastTicks;
+    uint64_t lastTicksExpected;
+} ksp_stats;
+
+//What ksp_engine_get_stats reports, with every duration in nanoseconds
+typedef struct ksp_stats_snapshot
+{
+    uint64_t callbacks;
+    uint64_t overruns;
+    uint64_t xruns;
+    uint64_t outOfBuffers;
+    uint64_t underruns;
+    uint64_t callbackP50;
+    uint64_t callbackP99;
+    uint64_t callbackMax;
+    uint64_t triggerP50;
+    uint64_t triggerP99;
+    uint64_t triggerMax;
+    ksp_latency_trace lastTrace;
+    uint64_t voices;
+    uint64_t voicesPeak;
+    uint64_t voicesStolen;
+    uint64_t dspP50;
+    uint64_t dspP99;
+    uint64_t dspMax;
+    float gainReduction;
+    float gainReductionPeak;
+} ksp_stats_snapshot;
+
+//CLOCK_MONOTONIC, in nanoseconds; the same clock .NET's Stopwatch uses on Linux
+int64_t ksp_now_ns(void);
+
+void ksp_histogram_record(ksp_histogram *histogram, uint64_t value);
+
+//Upper bound of the bucket the given fraction of values fall at or below. 0 if nothing has been recorded.
+uint64_t ksp_histogram_percentile(const ksp_histogram *histogram, double fraction);
+
+//Records one process callback. Runs on the audio thread.
+void ksp_stats_callback(ksp_stats *stats, int64_t start, int64_t end, uint64_t quantumNs);
+
+//Records how many voices were mixed in a cycle. Runs on the audio thread.
+void ksp_stats_voices(ksp_stats *stats, uint32_t voices);
+
+//Records how long a block's DSP took. Runs on the audio thread.
+void ksp_stats_dsp(ksp_stats *stats, int64_t start, int64_t end);
+
+//Records the most any limiter turned its audio down by in a cycle, in dB. Runs on the audio thread.
+void ksp_stats_gain_reduction(ksp_stats *stats, float reduction);
+
+//Counts an xrun if the graph's clock moved on further than the last cycle accounted for. Runs on the audio thread.
+void ksp_stats_clock(ksp_stats *stats, uint64_t ticks, uint64_t ticksExpected);
+
+//Records when a voice was first queued. Runs on the audio thread.
+void ksp_stats_trace(ksp_stats *stats, const ksp_latency_trace *trace);
+
+void ksp_stats_snapshot_read(ksp_stats *stats, ksp_stats_snapshot *output);
+
+//Writes everything as a JSON object. Returns the length it needs, not counting the terminator, like snprintf.
+int32_t ksp_stats_json(ksp_stats *stats, uint64_t underruns, char *buffer, size_t size);
+
+#endif
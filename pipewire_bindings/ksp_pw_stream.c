@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksp_pw_stream.h"
+
+/* Streamed voices never read the file on the audio thread. The streamer thread decodes each stream up to
+ * KSP_STREAM_BUFFER_MILLISECONDS ahead of its playhead, and the audio thread only ever sees frames that are
+ * already in memory. When it catches up with the decoder it plays silence and counts an underrun rather
+ * than waiting. */
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b != 0)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//Maps a ring of at least minBytes bytes twice in a row. The size is a whole number of both pages and frames.
+static uint8_t *map_ring(size_t minBytes, uint32_t bytesPerFrame, size_t *ringBytes)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t unit = pageSize / gcd(pageSize, bytesPerFrame) * bytesPerFrame;
+    size_t size = (minBytes + unit - 1) / unit * unit;
+
+    int fd = memfd_create("ksp-stream", MFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    //Reserve room for both copies, then map the same pages over each half
+    uint8_t *ring = mmap(NULL, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(ring, size * 2);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    //The audio thread must never fault these pages in
+    mlock(ring, size * 2);
+    *ringBytes = size;
+    return ring;
+}
+
+ksp_stream *ksp_stream_open(const ksp_decoder_ops *ops, const char *filePath)
+{
+    ksp_stream *stream = calloc(1, sizeof(ksp_stream));
+    if (stream == NULL)
+        return NULL;
+
+    stream->ops = ops;
+    stream->decoder = ops->open(filePath, &stream->info);
+    if (stream->decoder == NULL)
+    {
+        free(stream);
+        return NULL;
+    }
+    stream->bytesPerFrame = ksp_sample_format_size(stream->info.sampleFormat) * stream->info.channels;
+
+    size_t frames = (size_t)stream->info.sampleRate * KSP_STREAM_BUFFER_MILLISECONDS / 1000;
+    stream->ring = map_ring(frames * stream->bytesPerFrame, stream->bytesPerFrame, &stream->ringBytes);
+    if (stream->ring == NULL)
+    {
+        fprintf(stderr, "Could not allocate a stream buffer for %s: %s\n", filePath, strerror(errno));
+        ops->close(stream->decoder);
+        free(stream);
+        return NULL;
+    }
+    stream->ringFrames = stream->ringBytes / stream->bytesPerFrame;
+
+    //Decode the start up front, so the voice has something to play on its first cycle
+    ksp_stream_fill(stream);
+    return stream;
+}
+
+void ksp_stream_close(ksp_stream *stream)
+{
+    if (stream == NULL)
+        return;
+    stream->ops->close(stream->decoder);
+    munmap(stream->ring, stream->ringBytes * 2);
+    free(stream);
+}
+
+//Decodes into whatever space the audio thread has freed up. Only ever called from one thread at a time.
+size_t ksp_stream_fill(ksp_stream *stream)
+{
+    size_t total = 0;
+    while (!atomic_load_explicit(&stream->ended, memory_order_relaxed))
+    {
+        uint64_t written = atomic_load_explicit(&stream->written, memory_order_relaxed);
+        uint64_t consumed = atomic_load_explicit(&stream->consumed, memory_order_acquire);
+        size_t space = stream->ringFrames - (size_t)(written - consumed);
+        if (space == 0)
+            break;
+
+        uint8_t *dst = stream->ring + (written % stream->ringFrames) * stream->bytesPerFrame;
+        uint32_t decoded = stream->ops->read(stream->decoder, dst, space > UINT32_MAX ? UINT32_MAX : (uint32_t)space);
+        if (decoded == 0)
+        {
+            atomic_store_explicit(&stream->ended, true, memory_order_release);
+            break;
+        }
+        atomic_store_explicit(&stream->written, written + decoded, memory_order_release);
+        total += decoded;
+    }
+    return total;
+}
+
+/* Returns the address of frame first, which is the oldest frame the audio thread still needs, and sets end to one
+ * past the newest decoded frame. final is set once end is the end of the sound. Called on the audio thread. */
+const uint8_t *ksp_stream_peek(ksp_stream *stream, uint64_t *first, uint64_t *end, bool *final)
+{
+    //ended has to be read before written, or the last frames decoded before the end could be missed
+    *final = atomic_load_explicit(&stream->ended, memory_order_acquire);
+    *end = atomic_load_explicit(&stream->written, memory_order_acquire);
+    *first = atomic_load_explicit(&stream->consumed, memory_order_relaxed);
+    return stream->ring + (*first % stream->ringFrames) * stream->bytesPerFrame;
+}
+
+//Hands every frame before frame back to the decoder, and wakes the streamer once the ring is half empty
+void ksp_stream_consume(ksp_streamer *streamer, ksp_stream *stream, uint64_t frame)
+{
+    uint64_t written = atomic_load_explicit(&stream->written, memory_order_relaxed);
+    if (frame > written)
+        frame = written;
+    if (frame > atomic_load_explicit(&stream->consumed, memory_order_relaxed))
+        atomic_store_explicit(&stream->consumed, frame, memory_order_release);
+
+    if (written - frame < stream->ringFrames / 2 && !atomic_load_explicit(&stream->ended, memory_order_relaxed) &&
+        !atomic_exchange_explicit(&stream->refillRequested, true, memory_order_relaxed))
+    {
+        sem_post(&streamer->wake);
+    }
+}
+
+static void *streamer_thread(void *userdata)
+{
+    ksp_streamer *streamer = userdata;
+    while (atomic_load(&streamer->running))
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += KSP_STREAMER_INTERVAL_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&streamer->wake, &deadline);
+
+        pthread_mutex_lock(&streamer->lock);
+        for (ksp_stream *stream = streamer->streams; stream != NULL; stream = stream->next)
+        {
+            atomic_store_explicit(&stream->refillRequested, false, memory_order_relaxed);
+            ksp_stream_fill(stream);
+        }
+        pthread_mutex_unlock(&streamer->lock);
+    }
+    return NULL;
+}
+
+bool ksp_streamer_start(ksp_streamer *streamer)
+{
+    pthread_mutex_init(&streamer->lock, NULL);
+    sem_init(&streamer->wake, 0, 0);
+    streamer->streams = NULL;
+    atomic_store(&streamer->running, true);
+    if (pthread_create(&streamer->thread, NULL, streamer_thread, streamer) != 0)
+    {
+        atomic_store(&streamer->running, false);
+        return false;
+    }
+    return true;
+}
+
+void ksp_streamer_stop(ksp_streamer *streamer)
+{
+    if (atomic_exchange(&streamer->running, false))
+    {
+        sem_post(&streamer->wake);
+        pthread_join(streamer->thread, NULL);
+    }
+    sem_destroy(&streamer->wake);
+    pthread_mutex_destroy(&streamer->lock);
+}
+
+void ksp_streamer_add(ksp_streamer *streamer, ksp_stream *stream)
+{
+    pthread_mutex_lock(&streamer->lock);
+    stream->next = streamer->streams;
+    streamer->streams = stream;
+    pthread_mutex_unlock(&streamer->lock);
+    sem_post(&streamer->wake);
+}
+
+//Once this returns, the streamer thread no longer touches the stream and it can be closed
+void ksp_streamer_remove(ksp_streamer *streamer, ksp_stream *stream)
+{
+    pthread_mutex_lock(&streamer->lock);
+    for (ksp_stream **link = &streamer->streams; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == stream)
+        {
+            *link = stream->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&streamer->lock);
+}
+
+//Tops up every stream on the calling thread, for a renderer that can't wait for the streamer thread to get to them
+void ksp_streamer_fill_all(ksp_streamer *streamer)
+{
+    pthread_mutex_lock(&streamer->lock);
+    for (ksp_stream *stream = streamer->streams; stream != NULL; stream = stream->next)
+        ksp_stream_fill(stream);
+    pthread_mutex_unlock(&streamer->lock);
+}
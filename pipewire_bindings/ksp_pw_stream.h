@@ -0,0 +1,91 @@
+#ifndef KSP_PW_STREAM_H
+#define KSP_PW_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "ksp_pw_kernels.h"
+
+//How far ahead of the playhead a streamed voice is decoded
+#define KSP_STREAM_BUFFER_MILLISECONDS 500
+
+//How often the streamer thread tops up its streams when nobody has asked it to
+#define KSP_STREAMER_INTERVAL_NS 20000000
+
+//Layout of the audio a decoder produces
+typedef struct ksp_stream_info
+{
+    ksp_sample_format sampleFormat;
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint64_t frameCount; //0 if the decoder can't tell up front
+} ksp_stream_info;
+
+//A source of interleaved PCM that is read front to back on the streamer thread
+typedef struct ksp_decoder_ops
+{
+    const char *name;
+    //Opens filePath and fills in info. Returns the decoder's state, or NULL on failure.
+    void *(*open)(const char *filePath, ksp_stream_info *info);
+    //Decodes up to frames frames into dst. Returns the number decoded, which is 0 only at the end of the stream.
+    uint32_t (*read)(void *decoder, uint8_t *dst, uint32_t frames);
+    void (*close)(void *decoder);
+} ksp_decoder_ops;
+
+/* Single-producer single-consumer ring of decoded frames. The streamer thread decodes into it and the audio thread
+ * reads from it. Frames are addressed by their absolute index in the sound. The ring is mapped twice back to back,
+ * so any run of up to ringFrames frames can be read as one contiguous block, whatever the wraparound. */
+typedef struct ksp_stream
+{
+    const ksp_decoder_ops *ops;
+    void *decoder;
+    ksp_stream_info info;
+    uint32_t bytesPerFrame;
+
+    uint8_t *ring;
+    size_t ringBytes; //Size of one of the two mappings
+    size_t ringFrames;
+
+    _Atomic uint64_t written; //Frames decoded into the ring so far; advanced by the streamer
+    _Atomic uint64_t consumed; //Frames before this one are no longer needed; advanced by the audio thread
+    _Atomic bool ended; //The decoder has nothing more to give
+    _Atomic bool refillRequested;
+
+    struct ksp_stream *next; //Guarded by the streamer's lock
+} ksp_stream;
+
+//One thread per engine keeps every streamed voice's ring topped up
+typedef struct ksp_streamer
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    sem_t wake;
+    ksp_stream *streams;
+    _Atomic bool running;
+} ksp_streamer;
+
+ksp_stream *ksp_stream_open(const ksp_decoder_ops *ops, const char *filePath);
+
+void ksp_stream_close(ksp_stream *stream);
+
+size_t ksp_stream_fill(ksp_stream *stream);
+
+const uint8_t *ksp_stream_peek(ksp_stream *stream, uint64_t *first, uint64_t *end, bool *final);
+
+void ksp_stream_consume(ksp_streamer *streamer, ksp_stream *stream, uint64_t frame);
+
+bool ksp_streamer_start(ksp_streamer *streamer);
+
+void ksp_streamer_stop(ksp_streamer *streamer);
+
+void ksp_streamer_add(ksp_streamer *streamer, ksp_stream *stream);
+
+void ksp_streamer_remove(ksp_streamer *streamer, ksp_stream *stream);
+
+void ksp_streamer_fill_all(ksp_streamer *streamer);
+
+#endif
@@ -0,0 +1,171 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksp_pw_stretch.h"
+
+static uint32_t milliseconds_to_points(uint32_t milliseconds, uint32_t sampleRate, uint32_t decimation)
+{
+    uint32_t points = (uint32_t)((uint64_t)sampleRate * milliseconds / 1000 / decimation);
+    return points > 0 ? points : 1;
+}
+
+ksp_stretch *ksp_stretch_create(uint32_t channels, uint32_t sampleRate, uint32_t engineRate)
+{
+    ksp_stretch *stretch = calloc(1, sizeof(ksp_stretch));
+    if (stretch == NULL)
+        return NULL;
+
+    stretch->channels = channels;
+    stretch->ratio = (double)sampleRate / engineRate;
+    stretch->hop = milliseconds_to_points(KSP_STRETCH_GRAIN_MILLISECONDS, engineRate, 2);
+    //High-rate sources are searched at about the engine's rate; what lines up there lines up closely enough
+    stretch->decimation = stretch->ratio >= 1.5 ? (uint32_t)lround(stretch->ratio) : 1;
+    stretch->search = milliseconds_to_points(KSP_STRETCH_SEARCH_MILLISECONDS, sampleRate, stretch->decimation);
+    uint32_t compare = milliseconds_to_points(KSP_STRETCH_COMPARE_MILLISECONDS, sampleRate, stretch->decimation);
+    stretch->compare = (compare + 7) & ~7u;
+    stretch->continuation = (uint32_t)lround(stretch->hop * stretch->ratio);
+
+    //The last output frame of a grain interpolates towards the frame after it. The reference is taken from the grain
+    //too, so the grain always reaches far enough for it.
+    uint32_t grainFrames = (uint32_t)ceil((2 * stretch->hop - 1) * stretch->ratio) + 2;
+    uint32_t referenceEnd = stretch->continuation + (stretch->compare - 1) * stretch->decimation + 1;
+    stretch->grainFrames = grainFrames > referenceEnd ? grainFrames : referenceEnd;
+    stretch->regionFrames = (stretch->compare + 2 * stretch->search - 1) * stretch->decimation + 1;
+    uint32_t inputFrames = stretch->grainFrames > stretch->regionFrames ? stretch->grainFrames : stretch->regionFrames;
+    stretch->history = stretch->search * stretch->decimation + 1;
+    stretch->reach = stretch->search * stretch->decimation + inputFrames + 1;
+
+    size_t hopSamples = (size_t)stretch->hop * channels;
+    stretch->window = malloc(2 * stretch->hop * sizeof(float));
+    stretch->input = malloc((size_t)inputFrames * channels * sizeof(float));
+    stretch->grain = stretch->ratio != 1 ? malloc(2 * hopSamples * sizeof(float)) : NULL;
+    stretch->tail = malloc(hopSamples * sizeof(float));
+    stretch->ready = malloc(hopSamples * sizeof(float));
+    stretch->reference = malloc(stretch->compare * sizeof(float));
+    stretch->candidates = malloc((stretch->compare + 2 * stretch->search) * sizeof(float));
+    stretch->dots = malloc((2 * stretch->search + 1) * sizeof(float));
+    if (stretch->window == NULL || stretch->input == NULL || (stretch->ratio != 1 && stretch->grain == NULL) ||
+        stretch->tail == NULL || stretch->ready == NULL || stretch->reference == NULL ||
+        stretch->candidates == NULL || stretch->dots == NULL)
+    {
+        ksp_stretch_destroy(stretch);
+        return NULL;
+    }
+
+    //sin² rising and cos² falling, so each frame's two overlapping gains add up to exactly 1
+    for (uint32_t n = 0; n < 2 * stretch->hop; n++)
+    {
+        double s = sin(M_PI * n / (2 * stretch->hop));
+        stretch->window[n] = (float)(s * s);
+    }
+    stretch->readyIndex = stretch->hop;
+    stretch->primed = false;
+    return stretch;
+}
+
+void ksp_stretch_destroy(ksp_stretch *stretch)
+{
+    if (stretch == NULL)
+        return;
+    free(stretch->window);
+    free(stretch->input);
+    free(stretch->grain);
+    free(stretch->tail);
+    free(stretch->ready);
+    free(stretch->reference);
+    free(stretch->candidates);
+    free(stretch->dots);
+    free(stretch);
+}
+
+//Sums the channels of every stride-th of count points' worth of interleaved frames
+static void downmix(const float *frames, uint32_t count, uint32_t channels, uint32_t stride, float *dst)
+{
+    size_t step = (size_t)stride * channels;
+    for (uint32_t i = 0; i < count; i++, frames += step)
+    {
+        float sum = 0;
+        for (uint32_t c = 0; c < channels; c++)
+            sum += frames[c];
+        dst[i] = sum;
+    }
+}
+
+int32_t ksp_stretch_search(ksp_stretch *stretch, const ksp_kernels *kernels)
+{
+    uint32_t compare = stretch->compare;
+    uint32_t offsets = 2 * stretch->search + 1;
+    const float *candidates = stretch->candidates;
+    downmix(stretch->input, compare + offsets - 1, stretch->channels, stretch->decimation, stretch->candidates);
+    kernels->correlate(candidates, stretch->reference, compare, offsets, stretch->dots);
+
+    //Normalised by each candidate's energy, so a louder stretch doesn't win just for being louder. The energy slides
+    //along with the offset, in double so it doesn't drift.
+    double energy = 0;
+    for (uint32_t k = 0; k < compare; k++)
+        energy += (double)candidates[k] * candidates[k];
+    uint32_t best = stretch->search;
+    uint32_t bestDistance = UINT32_MAX;
+    float bestScore = -INFINITY;
+    for (uint32_t i = 0; i < offsets; i++)
+    {
+        float score = stretch->dots[i] / sqrtf((float)energy + 1e-9f);
+        //Ties, such as across silence, go to the offset nearest the nominal start
+        uint32_t distance = i > stretch->search ? i - stretch->search : stretch->search - i;
+        if (score > bestScore || (score == bestScore && distance < bestDistance))
+        {
+            best = i;
+            bestDistance = distance;
+            bestScore = score;
+        }
+        if (i + 1 == offsets)
+            break;
+        energy += (double)candidates[i + compare] * candidates[i + compare] - (double)candidates[i] * candidates[i];
+        if (energy < 0)
+            energy = 0;
+    }
+    return ((int32_t)best - (int32_t)stretch->search) * (int32_t)stretch->decimation;
+}
+
+void ksp_stretch_add_grain(ksp_stretch *stretch, const ksp_kernels *kernels, int64_t start)
+{
+    uint32_t channels = stretch->channels;
+    uint32_t hop = stretch->hop;
+    size_t hopSamples = (size_t)hop * channels;
+
+    const float *grain = stretch->input;
+    if (stretch->grain != NULL)
+    {
+        //Interpolated linearly, as the linear resampling quality would; grains are short and there are a lot of them
+        for (uint32_t n = 0; n < 2 * hop; n++)
+        {
+            double position = n * stretch->ratio;
+            size_t frame = (size_t)position;
+            float frac = (float)(position - frame);
+            const float *a = stretch->input + frame * channels;
+            const float *b = a + channels;
+            for (uint32_t c = 0; c < channels; c++)
+                stretch->grain[n * channels + c] = a[c] + (b[c] - a[c]) * frac;
+        }
+        grain = stretch->grain;
+    }
+
+    if (stretch->primed)
+    {
+        kernels->frameGain(grain, stretch->ready, hop, channels, stretch->window);
+        kernels->mix[KSP_SAMPLE_F32]((const uint8_t *)stretch->tail, stretch->ready, hop, channels, 1, 0);
+    }
+    else
+    {
+        //Nothing to fade in under, so the first grain starts at full level
+        memcpy(stretch->ready, grain, hopSamples * sizeof(float));
+    }
+    kernels->frameGain(grain + hopSamples, stretch->tail, hop, channels, stretch->window + hop);
+
+    downmix(stretch->input + (size_t)stretch->continuation * channels, stretch->compare, channels,
+            stretch->decimation, stretch->reference);
+    stretch->nextStart = start + stretch->continuation;
+    stretch->primed = true;
+    stretch->readyIndex = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef KSP_PW_STRETCH_H
+#define KSP_PW_STRETCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ksp_pw_kernels.h"
+
+//Length of the grains a stretched voice is pieced together from. Each one overlaps the next by half.
+#define KSP_STRETCH_GRAIN_MILLISECONDS 20
+
+//How far either side of where a grain would start it can be moved to line up with the one before it
+#define KSP_STRETCH_SEARCH_MILLISECONDS 5
+
+//Length of the stretch of audio compared at each place a grain could start
+#define KSP_STRETCH_COMPARE_MILLISECONDS 5
+
+/* Time stretching by waveform-similarity overlap-add (WSOLA), so a voice can play faster or slower without changing
+ * pitch. Every hop output frames a new grain of twice that length is read from the source at the voice's position
+ * and faded in under the second half of the last one, with windows that add up to 1. Rather than starting right at
+ * the position, each grain starts at whichever point near it looks most like what followed the last grain in the
+ * source, so the two line up and the overlap doesn't comb or flutter. At the voice's normal speed that is always
+ * exactly where it would start anyway, and the voice comes out as it went in.
+ *
+ * The caller reads the source, since only it knows where the voice loops, and this does the rest. Positions are in
+ * source frames, and a grain is read at the source's rate divided by the engine's, so the stretch doesn't resample.
+ * Everything is allocated by ksp_stretch_create, on a control thread. */
+typedef struct ksp_stretch
+{
+    uint32_t channels;
+    double ratio; //Source frames per output frame at normal speed
+    uint32_t hop; //Output frames between the starts of two grains
+    uint32_t decimation; //Source frames per point of the mono signal searched
+    uint32_t search; //Points either side of a grain's nominal start it can be moved by
+    uint32_t compare; //Points compared at each offset; a multiple of 8
+    uint32_t continuation; //Source frames from the start of a grain to where the next would start at normal speed
+    uint32_t grainFrames; //Source frames read for each grain
+    uint32_t regionFrames; //Source frames read for a search, from search * decimation frames before the start
+    uint32_t reach; //Most source frames after the voice's position a grain or search can read
+    uint32_t history; //Most source frames before the voice's position a search can read
+
+    float *window; //2 * hop gains, the first hop rising and the rest falling
+    float *input; //Interleaved source frames, for a grain or a search
+    float *grain; //The grain at the output rate, if the source is at another one
+    float *tail; //Second half of the last grain, with its window applied
+    float *ready; //Output frames finished and waiting to be mixed
+    uint32_t readyIndex; //Frames of ready already mixed; hop once they all have been
+    float *reference; //What followed the last grain in the source, downmixed to mono
+    float *candidates; //The searched source frames, downmixed to mono
+    float *dots; //Correlation of the reference with each offset
+    bool primed; //A grain has been played, so there is something to line the next up with
+    int64_t nextStart; //Where the source carries on from after the last grain
+} ksp_stretch;
+
+//Sets up stretching for a voice of a sound with the given channels and rate, on an engine running at engineRate.
+//Returns NULL if it can't be allocated.
+ksp_stretch *ksp_stretch_create(uint32_t channels, uint32_t sampleRate, uint32_t engineRate);
+
+void ksp_stretch_destroy(ksp_stretch *stretch);
+
+//Finds where the next grain should start, given regionFrames source frames in input from search * decimation frames
+//before where it would otherwise start. Returns its offset from there in source frames. Runs on the audio thread.
+int32_t ksp_stretch_search(ksp_stretch *stretch, const ksp_kernels *kernels);
+
+//Overlaps the grain in input, grainFrames source frames from start, with the last one, and fills ready with the next
+//hop frames of output. Runs on the audio thread.
+void ksp_stretch_add_grain(ksp_stretch *stretch, const ksp_kernels *kernels, int64_t start);
+
+#endif
@@ -5,73 +5,326 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
 
-typedef struct ksp_int24
-{
-    signed int data : 24;
-} ksp_int24;
+#include "ksp_pw_kernels.h"
+#include "ksp_pw_command_queue.h"
+#include "ksp_pw_stream.h"
+#include "ksp_pw_resampler.h"
+#include "ksp_pw_stretch.h"
+#include "ksp_pw_cache.h"
+#include "ksp_pw_peaks.h"
+#include "ksp_pw_bundle.h"
+#include "ksp_pw_stats.h"
+#include "ksp_pw_bus.h"
+#include "ksp_pw_backend.h"
+
+//Maximum number of voices that can be mixed by one engine at once
+#define KSP_MAX_VOICES 64
+
+//Slots kept back for voices fading out after being stolen. Once every other slot is in use, starting a voice steals
+//one that is playing, which then finishes its fade in one of these.
+#define KSP_VOICE_RESERVE 8
+
+//Number of timed commands the audio thread can hold on to until they are due
+#define KSP_MAX_SCHEDULED 256
+
+//Length of the fade given to a voice that is cut off by a retrigger, a choke group or the voice pool being full
+#define KSP_DECLICK_MILLISECONDS 5
+
+//Maximum number of samples that can be resident in an engine's sample bank
+#define KSP_MAX_SAMPLES 1024
+
+//Size of the engine's conversion scratch buffer, in samples
+#define KSP_SCRATCH_SAMPLES 16384
+
+//Length of the ramp used when a voice's volume is changed while it is playing, so the change doesn't click
+#define KSP_VOLUME_RAMP_MILLISECONDS 10
+
+//Longest stretch of frames a linear gain ramp is used for while several envelopes overlap, since their product isn't linear
+#define KSP_ENVELOPE_SEGMENT_FRAMES 32
+
+//Flags for ksp_bank_load
+#define KSP_BANK_LOCK 0x1 //mlock() the sample data so it can never be paged back out
+#define KSP_BANK_PEAKS 0x2 //Map or work out the sample's peak index, for drawing its waveform
+#define KSP_BANK_RESIDENT 0x4 //Decode or map the whole sample however long it is, as streamed samples can't loop
+
+//Channels of each voice the level meters report; any after these aren't metered
+#define KSP_METER_CHANNELS 8
+
+//Time constant of the level meters: how long a peak takes to fall back by about 9 dB, and how far back the RMS averages
+#define KSP_METER_DECAY_MILLISECONDS 300
+
+//Maximum channel count a sample may have, so that at least a few frames always fit in the engine's scratch buffer
+#define KSP_MAX_SAMPLE_CHANNELS 64
+
+//Compressed sounds that decode to at most this many bytes are decoded into memory at load; longer ones are streamed
+#define KSP_BANK_DECODE_LIMIT (32 * 1024 * 1024)
+
+//Wave files larger than this are streamed from the disk instead of being mapped and locked into memory.
+//Must be above KSP_BANK_DECODE_LIMIT, or they would be read into a buffer instead.
+#define KSP_BANK_STREAM_THRESHOLD (64 * 1024 * 1024)
+
+//Voice handles carry the slot index in the low bits and a generation counter above it,
+//so that a stale handle can never address a slot that has since been reused.
+#define KSP_VOICE_SLOT_BITS 8
+#define KSP_VOICE_SLOT(handle) ((handle) & ((1 << KSP_VOICE_SLOT_BITS) - 1))
+#define KSP_VOICE_GENERATION(handle) ((uint32_t)(handle) >> KSP_VOICE_SLOT_BITS)
+#define KSP_VOICE_HANDLE(slot, generation) ((int32_t)((((generation) & 0x7FFFFF) << KSP_VOICE_SLOT_BITS) | (slot)))
 
 typedef struct waveFormatSubChunk
 {
-    uint16_t audioFormat;
+    uint16_t audioFormat; //For WAVE_FORMAT_EXTENSIBLE files, the format tag from the sub-format GUID
     uint16_t channels;
     uint32_t sampleRate;
     uint32_t avgBytesPerSec;
     uint16_t blockAlign; //(Bits per sample * channels) / 8
-    uint16_t bitsPerSample;
+    uint16_t bitsPerSample; //Size of the container each sample is stored in
+    uint16_t validBitsPerSample; //Bits of the container actually used; the same as bitsPerSample unless extensible
+    uint32_t channelMask; //Speaker positions of an extensible file's channels; 0 otherwise
 } waveFormatSubChunk;
 
 typedef struct waveDataSubChunk
 {
-    uint32_t dataSize;
-    uint8_t *data;
+    uint64_t dataSize;
+    uint8_t *data; //Points straight into the mapped file
 } waveDataSubChunk;
 
 typedef struct waveFile
 {
-    char chunkId[5]; //Should always be RIFF
-    uint32_t chunkSize;
+    char chunkId[5]; //RIFF, or RF64/BW64 for files with 64-bit sizes
+    uint64_t chunkSize;
     char format[5]; //Should always be WAVE
     struct waveFormatSubChunk formatChunk;
     struct waveDataSubChunk dataChunk;
+    uint32_t loopStart; //First frame of the loop in the smpl chunk, or between the first cue points if there isn't one
+    uint32_t loopEnd; //One past the loop's last frame; 0 if the file has no loop
 } waveFile;
 
 typedef struct waveFileLoadInfo
 {
     bool mmapUsed;
-    off_t mmapOffset;
+    off_t mmapOffset; //Offset of the data chunk's contents in the mapping
+    size_t mmapLength; //Length of the mapping, which covers the whole file
     waveFile file;
 } waveFileLoadInfo;
 
+//In the same order as Utils.AudioFormat on the managed side
 typedef enum AudioFormat
 {
     Wave,
     MP3,
-    Flac
+    Flac,
+    Unknown
 } AudioFormat;
 
-typedef struct pw_player_info
+typedef struct ksp_sample
 {
-    float volume;
-    char *fileName;
-    bool playing;
-    bool firstRun;
+    uint32_t refCount; //One reference held by the bank itself plus one per voice; the slot is free at 0
     AudioFormat format;
+    ksp_sample_format sampleFormat;
+    waveFileLoadInfo loadInfo; //Only used by resident wave files and sounds mapped from the decode cache
+    const uint8_t *data; //Start of the resident audio, or NULL if the sample is streamed
+    uint8_t *decoded; //Buffer behind data for compressed sounds decoded at load
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t frameCount; //0 if a streamed sample's length isn't known up front
+    uint32_t bytesPerFrame;
+    uint32_t loopStart; //Loop points stored in the file; loopEnd is one past the last frame of the loop, or 0 if none
+    uint32_t loopEnd;
+    bool locked;
+    ksp_peaks peaks; //Only filled in if the sample was loaded with KSP_BANK_PEAKS
+    ksp_bundle *bundle; //Bundle the audio and peak index are mapped from, which the sample holds a reference to
+
+    //Streamed samples are decoded afresh, from the start of the file, by every voice that plays them
+    const ksp_decoder_ops *decoder;
+    char *filePath;
+} ksp_sample;
+
+typedef struct ksp_sample_bank
+{
+    pthread_mutex_t lock; //Guards every refCount; only ever taken by control threads, never by the audio thread
+    ksp_sample samples[KSP_MAX_SAMPLES];
+    ksp_cache cache; //Decoded audio of compressed sounds, if a cache directory has been set
+} ksp_sample_bank;
+
+typedef enum ksp_voice_state
+{
+    KSP_VOICE_FREE,     //Slot is unused
+    KSP_VOICE_LOADING,  //Slot has been claimed by a control thread and is being filled in
+    KSP_VOICE_PLAYING,
+    KSP_VOICE_PAUSED,
+    KSP_VOICE_STOPPING, //Voice is fading out after a stop command and will be finished when the fade ends
+    KSP_VOICE_FINISHED  //Audio thread is done with the voice; its resources can be released
+} ksp_voice_state;
+
+//What happens when a sound is started while voices of it are still playing. Matches
+//SoundConfiguration.RetriggerPolicy on the managed side.
+typedef enum ksp_retrigger
+{
+    KSP_RETRIGGER_STACK,   //Start another voice, stealing the oldest of the sound's own once it has maxPolyphony
+    KSP_RETRIGGER_RESTART, //Cut off the voices already playing and start from the beginning
+    KSP_RETRIGGER_IGNORE,  //Don't start the sound again until it has finished
+    KSP_RETRIGGER_CHOKE,   //Cut off every voice in the same choke group, this sound's own included
+    KSP_RETRIGGER_COUNT
+} ksp_retrigger;
+
+//Which voice is stolen when the voice pool is full
+typedef enum ksp_steal_policy
+{
+    KSP_STEAL_OLDEST,
+    KSP_STEAL_QUIETEST,
+    KSP_STEAL_POLICY_COUNT
+} ksp_steal_policy;
+
+//Shape of a fade. Matches SoundConfiguration.FadeCurve on the managed side.
+typedef enum ksp_fade_curve
+{
+    KSP_FADE_LINEAR,      //Gain changes at a constant rate
+    KSP_FADE_EQUAL_POWER, //Quarter sine; two voices crossfaded along it keep the same total power throughout
+    KSP_FADE_S_CURVE,     //Half cosine, which leaves and arrives gently
+    KSP_FADE_CURVE_COUNT
+} ksp_fade_curve;
+
+//Parameters passed in from the managed side when a voice is started
+typedef struct ksp_voice_params
+{
+    float volume;
     int32_t fadeInMilliseconds;
     int32_t fadeOutMilliseconds;
     float speedFactor;
-    struct waveData *data;
-} pw_player_info;
+    float minVolume; //Gain the fade in starts from
+    float maxVolume; //Gain the fade in ends at, and the gain the sound plays at otherwise
+    int64_t keyEventNs; //When the key that started the voice was received, on CLOCK_MONOTONIC; 0 if unknown
+    int64_t triggerNs; //When its keybinding fired, on CLOCK_MONOTONIC; 0 if unknown
+    int32_t maxPolyphony; //Most voices of the sample that may play at once; 0 for no limit
+    int32_t retrigger; //A ksp_retrigger
+    int32_t chokeGroup; //Voices of KSP_RETRIGGER_CHOKE sounds in the same group cut each other off; 0 for none
+    int32_t preWaitMilliseconds; //How long the voice waits after it is told to start before it is heard
+    int32_t loop; //Non-zero to loop from loopStart to loopEnd until the loop is exited
+    int32_t loopStart; //In frames of the sound. With loopEnd 0, the loop stored in the file, or else the whole sound.
+    int32_t loopEnd;
+    int32_t loopCrossfadeMilliseconds; //Length of the crossfade across the seam, from the end of the loop to its start
+    int32_t fadeCurve; //A ksp_fade_curve, for the voice's fade in, its fade out at the end and its fade after a stop
+    int32_t bus; //Bus the voice is mixed into, from 0 to KSP_MAX_BUSES - 1
+    int32_t timeStretch; //Non-zero to keep the pitch where it is when the speed changes, by time stretching
+} ksp_voice_params;
+
+typedef struct ksp_voice
+{
+    _Atomic ksp_voice_state state;
+    _Atomic uint32_t generation;
+    _Atomic float volume; //Last volume requested by a control thread
+    _Atomic uint32_t underruns; //Cycles in which a streamed voice ran out of decoded audio
+    _Atomic float level; //Gain of the voice at the end of the last cycle it was mixed in, for picking one to steal
+    _Atomic uint32_t group; //Voices started together by one start command share a group; 0 for none
+    sem_t finished; //Posted by the audio thread whenever the voice stops playing
+    bool cutOff; //A stop has been sent to make room for another voice; only touched under the engine's voiceLock
+
+    //Everything below is written by the control thread while the voice is LOADING. Afterwards it belongs to the
+    //audio thread, and control threads can only change it by sending commands through the engine's queue.
+    ksp_sample *sample;
+    ksp_stream *stream; //This voice's decoder if the sample is streamed, otherwise NULL
+    ksp_stretch *stretch; //Set if the voice's speed doesn't change its pitch, otherwise NULL
+    ksp_voice_params params;
+    double step; //Source frames advanced per output frame
+    double position; //Current position, in source frames
+    double fadeInFrames; //In source frames
+    double fadeOutFrames; //In source frames
+
+    float gain; //Current volume, moving towards gainTarget
+    float gainTarget;
+    uint32_t gainRampFrames; //Output frames left before gain reaches gainTarget
+    uint32_t stopFrames; //Length of the fade out after a stop command, in output frames
+    uint32_t stopRemaining; //Output frames left before a stopping voice is finished
+    uint32_t preWaitFrames; //Output frames the voice waits for when it is started; cleared once it has
+    int32_t follower; //Voice to start when this one reaches its end, which is cancelled if this one is stopped; or -1
+    uint32_t loopStart; //In source frames
+    uint32_t loopEnd; //One past the last frame of the loop; 0 once the voice isn't looping, or never was
+    uint32_t loopCrossfade; //Source frames before loopEnd that are crossfaded with those from loopStart
+    bool loopExit; //The loop is played through to loopEnd once more, and then on to the end of the sound
+    ksp_fade_curve fadeCurve; //Shape of the fade in and of the fade out at the end
+    ksp_fade_curve stopCurve; //Shape of the fade after a stop, which a crossfade can change
+    int32_t fadesOut; //Voice faded out over this one's fade in, from the frame this one starts on; or -1
+    uint32_t bus;
 
-typedef struct waveData
+    int64_t startNs; //When the voice was started, on CLOCK_MONOTONIC
+    bool queued; //Whether any of the voice has been handed to PipeWire yet; only touched by the audio thread
+
+    //Level meters, after the voice's gain: the peak and mean square of each channel with their decay applied, and the
+    //largest magnitude and sum of squares reached so far in the current cycle
+    float meterPeaks[KSP_METER_CHANNELS];
+    float meterSquares[KSP_METER_CHANNELS];
+    float cyclePeaks[KSP_METER_CHANNELS];
+    float cycleSquares[KSP_METER_CHANNELS];
+} ksp_voice;
+
+//What ksp_engine_get_voices reports about one voice
+typedef struct ksp_voice_snapshot
 {
-    struct pw_main_loop *loop;
+    int32_t handle;
+    int32_t sampleId; //Sample in the engine's bank the voice is playing
+    int32_t state; //KSP_VOICE_PLAYING, KSP_VOICE_PAUSED or KSP_VOICE_STOPPING
+    int32_t bus;
+    uint64_t position; //Frame of the sample the voice has got to
+    uint64_t frameCount; //Length of the sample; 0 if a streamed sample's length isn't known
+    double seconds; //How far into the sample the voice is
+    double remaining; //Seconds until the voice ends at its current speed; -1 if it is looping or its length isn't known
+    float gain; //Of the voice's volume, fades and envelope together
+    uint32_t channels; //Channels metered, at most KSP_METER_CHANNELS
+    float peaks[KSP_METER_CHANNELS]; //Largest magnitude of each channel lately, falling back once it has passed
+    float rms[KSP_METER_CHANNELS]; //Of each channel over the last KSP_METER_DECAY_MILLISECONDS or so
+} ksp_voice_snapshot;
+
+/* Every voice that was playing, paused or stopping at the end of the last cycle, written by the audio thread once a
+ * cycle behind a sequence count that is odd while it is being written. Readers copy it out and try again if the count
+ * changed meanwhile, so neither side ever waits for the other. */
+typedef struct ksp_voice_meters
+{
+    _Atomic uint32_t sequence;
+    _Atomic uint32_t count;
+    ksp_voice_snapshot voices[KSP_MAX_VOICES];
+} ksp_voice_meters;
+
+typedef struct ksp_engine
+{
+    const ksp_backend_ops *backend;
+    void *backendData;
+    struct pw_thread_loop *loop; //Only used by the PipeWire backend
     struct pw_stream *stream;
 
-    size_t sampleIndex;
-    struct waveFile file;
+    uint32_t sampleRate;
+    uint32_t channels;
+    const ksp_kernels *kernels;
+    ksp_command_queue commands; //Control messages for the audio thread
+    ksp_streamer streamer;
+    _Atomic uint64_t underruns; //Total over every voice the engine has played
+    ksp_resampler resamplers[KSP_RESAMPLE_QUALITY_COUNT];
+    _Atomic ksp_resample_quality resampleQuality;
+    ksp_stats stats;
+    _Atomic uint64_t time; //First frame of the cycle after the one being mixed, on the engine's clock
+    _Atomic uint32_t nextGroup;
+
+    pthread_mutex_t voiceLock; //Serialises voices being started; never taken by the audio thread
+    _Atomic ksp_steal_policy stealPolicy;
+    ksp_voice voices[KSP_MAX_VOICES];
+    ksp_sample_bank bank;
+    ksp_bus buses[KSP_MAX_BUSES];
+    ksp_dsp master; //Filters and limiter the main output is run through, once every bus has been added to it
+    ksp_voice_meters meters;
 
-    pw_player_info *playerInfo;
-} waveData;
+    //Only touched by the audio thread
+    float scratch[KSP_SCRATCH_SAMPLES];
+    float planar[KSP_SCRATCH_SAMPLES]; //Scratch split into one run per channel, for the resampling filters
+    uint8_t startedVoices[KSP_MAX_VOICES]; //Slots of the voices mixed for the first time in the current cycle
+    uint32_t startedCount;
+    uint64_t frame; //Engine clock: frames mixed since the engine started, up to the start of the current cycle
+    ksp_command scheduled[KSP_MAX_SCHEDULED]; //Timed commands that aren't due yet, in the order they were sent
+    uint32_t scheduledCount;
+    bool following; //Whether a playing voice may have a follower, whose start has to be found to the frame
+} ksp_engine;
 
 #endif
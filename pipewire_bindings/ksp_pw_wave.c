@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ksp_pw_wave.h"
+
+/* Wave files too long to keep resident are read a block at a time on the streamer thread. Their audio is never
+ * mapped, so the audio thread can never fault on the file; it only ever sees what has already been copied into
+ * the ring. */
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+//The real sizes of an RF64 file are in its ds64 chunk, and the 32-bit ones are set to this
+#define RF64_SIZE_IN_DS64 0xFFFFFFFF
+
+//Sizes of the fixed part of a smpl chunk and of each loop in it, and of a cue chunk's count and each cue point in it
+#define SMPL_HEADER_BYTES 36
+#define SMPL_LOOP_BYTES 24
+#define CUE_HEADER_BYTES 4
+#define CUE_POINT_BYTES 24
+
+//How much of the file the kernel is asked to fetch ahead of the reads
+#define KSP_WAVE_READAHEAD_BYTES (4 * 1024 * 1024)
+
+typedef struct ksp_wave
+{
+    int fd;
+    off_t dataStart; //Offset of the first sample in the file
+    uint64_t dataBytes; //Whole frames in the data chunk, in bytes
+    uint64_t position; //Bytes of the data chunk read so far
+    uint64_t fetched; //Bytes of the data chunk readahead() has been asked for so far
+    uint32_t bytesPerFrame;
+} ksp_wave;
+
+//Wave files are little endian, as is every CPU the engine runs on
+static inline uint16_t read_u16(const uint8_t *p)
+{
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint64_t read_u64(const uint8_t *p)
+{
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+//Fills in format from the contents of a fmt chunk
+static bool parse_format(const char *filePath, const uint8_t *body, uint64_t size, waveFormatSubChunk *format)
+{
+    if (size < 16)
+    {
+        fprintf(stderr, "%s: format chunk is too short\n", filePath);
+        return false;
+    }
+    format->audioFormat = read_u16(body);
+    format->channels = read_u16(body + 2);
+    format->sampleRate = read_u32(body + 4);
+    format->avgBytesPerSec = read_u32(body + 8);
+    format->blockAlign = read_u16(body + 12);
+    format->bitsPerSample = read_u16(body + 14);
+    format->validBitsPerSample = format->bitsPerSample;
+    format->channelMask = 0;
+
+    if (format->audioFormat == WAVE_FORMAT_EXTENSIBLE)
+    {
+        if (size < 40)
+        {
+            fprintf(stderr, "%s: extensible format chunk is too short\n", filePath);
+            return false;
+        }
+        format->validBitsPerSample = read_u16(body + 18);
+        format->channelMask = read_u32(body + 20);
+        //The sub-format GUID starts with the format tag it stands for
+        format->audioFormat = read_u16(body + 24);
+    }
+    return true;
+}
+
+//Reads the first loop of a smpl chunk, whose end is the last frame played rather than one past it. Returns false if
+//there isn't one.
+static bool parse_sampler_loop(const uint8_t *body, uint64_t size, uint32_t *start, uint32_t *end)
+{
+    if (size < SMPL_HEADER_BYTES + SMPL_LOOP_BYTES || read_u32(body + 28) == 0)
+        return false;
+    const uint8_t *loop = body + SMPL_HEADER_BYTES;
+    *start = read_u32(loop + 8);
+    *end = read_u32(loop + 12) + 1;
+    return true;
+}
+
+//Finds the two earliest points in a cue chunk, which mark out the loop when the file has no smpl chunk. end is left
+//alone if there is only one point.
+static bool parse_cue_loop(const uint8_t *body, uint64_t size, uint32_t *start, uint32_t *end)
+{
+    if (size < CUE_HEADER_BYTES)
+        return false;
+    uint64_t count = read_u32(body);
+    if (count > (size - CUE_HEADER_BYTES) / CUE_POINT_BYTES)
+        count = (size - CUE_HEADER_BYTES) / CUE_POINT_BYTES;
+    uint32_t first = UINT32_MAX;
+    uint32_t second = UINT32_MAX;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint32_t offset = read_u32(body + CUE_HEADER_BYTES + i * CUE_POINT_BYTES + 20);
+        if (offset < first)
+        {
+            second = first;
+            first = offset;
+        }
+        else if (offset < second && offset != first)
+        {
+            second = offset;
+        }
+    }
+    if (first == UINT32_MAX)
+        return false;
+    *start = first;
+    if (second != UINT32_MAX)
+        *end = second;
+    return true;
+}
+
+bool ksp_wave_parse(const char *filePath, const uint8_t *file, size_t length, waveFile *output)
+{
+    memset(output, 0, sizeof(*output));
+    bool rf64 = length >= 12 && (memcmp(file, "RF64", 4) == 0 || memcmp(file, "BW64", 4) == 0);
+    if (length < 12 || (!rf64 && memcmp(file, "RIFF", 4) != 0) || memcmp(file + 8, "WAVE", 4) != 0)
+    {
+        fprintf(stderr, "%s: not a wave file\n", filePath);
+        return false;
+    }
+    memcpy(output->chunkId, file, 4);
+    memcpy(output->format, file + 8, 4);
+    output->chunkSize = read_u32(file + 4);
+
+    uint64_t ds64DataSize = 0;
+    bool haveFormat = false;
+    bool haveData = false;
+    bool haveSamplerLoop = false;
+    bool haveCueLoop = false;
+    uint32_t cueStart = 0;
+    uint32_t cueEnd = 0;
+    uint64_t offset = 12;
+    //Each chunk's header says how long it is, so everything but fmt, data, ds64 and the loop points is skipped
+    //without being read. Loop points often come after the data, so the whole file is walked.
+    while (offset + 8 <= length)
+    {
+        const uint8_t *chunk = file + offset;
+        const uint8_t *body = chunk + 8;
+        uint64_t available = length - offset - 8;
+        uint64_t size = read_u32(chunk + 4);
+
+        if (rf64 && memcmp(chunk, "ds64", 4) == 0 && size >= 24 && available >= 24)
+        {
+            output->chunkSize = read_u64(body);
+            ds64DataSize = read_u64(body + 8);
+        }
+        else if (memcmp(chunk, "fmt ", 4) == 0)
+        {
+            if (!parse_format(filePath, body, size < available ? size : available, &output->formatChunk))
+                return false;
+            haveFormat = true;
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            if (rf64 && size == RF64_SIZE_IN_DS64)
+                size = ds64DataSize;
+            //Recorders that were cut off can leave a size that runs past the end of the file
+            output->dataChunk.data = (uint8_t *)body;
+            output->dataChunk.dataSize = size < available ? size : available;
+            haveData = true;
+        }
+        else if (memcmp(chunk, "smpl", 4) == 0 && !haveSamplerLoop)
+        {
+            haveSamplerLoop = parse_sampler_loop(body, size < available ? size : available, &output->loopStart,
+                                                 &output->loopEnd);
+        }
+        else if (memcmp(chunk, "cue ", 4) == 0 && !haveCueLoop)
+        {
+            haveCueLoop = parse_cue_loop(body, size < available ? size : available, &cueStart, &cueEnd);
+        }
+        if (size >= available)
+            break;
+        //Chunks are padded to an even length
+        offset += 8 + size + (size & 1);
+    }
+
+    if (!haveFormat || !haveData)
+    {
+        fprintf(stderr, "%s: no %s chunk found\n", filePath, haveFormat ? "data" : "format");
+        return false;
+    }
+    const waveFormatSubChunk *format = &output->formatChunk;
+    if (format->bitsPerSample % 8 != 0 || format->blockAlign != format->channels * format->bitsPerSample / 8)
+    {
+        fprintf(stderr, "%s: unsupported sample layout: %u bits, %u channels, blocks of %u bytes\n", filePath,
+                format->bitsPerSample, format->channels, format->blockAlign);
+        return false;
+    }
+
+    //A single cue point loops from there to the end. Loops that don't fit in the data are ignored.
+    uint64_t frames = format->blockAlign > 0 ? output->dataChunk.dataSize / format->blockAlign : 0;
+    if (!haveSamplerLoop && haveCueLoop)
+    {
+        output->loopStart = cueStart;
+        output->loopEnd = cueEnd > cueStart ? cueEnd : (uint32_t)(frames < UINT32_MAX ? frames : UINT32_MAX);
+    }
+    if (output->loopEnd <= output->loopStart || output->loopEnd > frames)
+    {
+        if (output->loopEnd != 0)
+            fprintf(stderr, "%s: loop from frame %u to %u is outside the audio, ignoring it\n", filePath,
+                    output->loopStart, output->loopEnd);
+        output->loopStart = 0;
+        output->loopEnd = 0;
+    }
+    return true;
+}
+
+bool ksp_wave_sample_format(const char *filePath, const waveFormatSubChunk *format, ksp_sample_format *output)
+{
+    //Samples narrower than their container are left justified, so they play as if they filled it
+    if (format->audioFormat == WAVE_FORMAT_PCM)
+    {
+        switch (format->bitsPerSample)
+        {
+            case 8:
+                *output = KSP_SAMPLE_U8;
+                return true;
+            case 16:
+                *output = KSP_SAMPLE_S16;
+                return true;
+            case 24:
+                *output = KSP_SAMPLE_S24;
+                return true;
+            case 32:
+                *output = KSP_SAMPLE_S32;
+                return true;
+        }
+    }
+    else if (format->audioFormat == WAVE_FORMAT_IEEE_FLOAT)
+    {
+        switch (format->bitsPerSample)
+        {
+            case 32:
+                *output = KSP_SAMPLE_F32;
+                return true;
+            case 64:
+                *output = KSP_SAMPLE_F64;
+                return true;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "%s: unsupported audio format: 0x%04X\n", filePath, format->audioFormat);
+        return false;
+    }
+    fprintf(stderr, "%s: unsupported audio bits per sample: %u\n", filePath, format->bitsPerSample);
+    return false;
+}
+
+//Reads up to length bytes at offset, retrying short reads. Returns the number read, which is short only at the end
+//of the file, or -1 on error.
+static ssize_t read_at(int fd, void *dst, size_t length, off_t offset)
+{
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t got = pread(fd, (uint8_t *)dst + total, length - total, offset + total);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+            break;
+        total += got;
+    }
+    return total;
+}
+
+static void wave_close(void *decoder)
+{
+    ksp_wave *wave = decoder;
+    if (wave == NULL)
+        return;
+    if (wave->fd >= 0)
+        close(wave->fd);
+    free(wave);
+}
+
+static void *wave_open(const char *filePath, ksp_stream_info *info)
+{
+    ksp_wave *wave = calloc(1, sizeof(ksp_wave));
+    if (wave == NULL)
+        return NULL;
+
+    wave->fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (wave->fd < 0 || fstat(wave->fd, &status) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filePath, strerror(errno));
+        wave_close(wave);
+        return NULL;
+    }
+
+    //The header is parsed in place through a mapping, which is dropped again once the data chunk has been found
+    void *map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, wave->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", filePath, strerror(errno));
+        wave_close(wave);
+        return NULL;
+    }
+    waveFile file;
+    bool parsed = ksp_wave_parse(filePath, map, status.st_size, &file) &&
+                  ksp_wave_sample_format(filePath, &file.formatChunk, &info->sampleFormat);
+    wave->dataStart = parsed ? file.dataChunk.data - (uint8_t *)map : 0;
+    munmap(map, status.st_size);
+    if (!parsed)
+    {
+        wave_close(wave);
+        return NULL;
+    }
+
+    const waveFormatSubChunk *format = &file.formatChunk;
+    info->channels = format->channels;
+    info->sampleRate = format->sampleRate;
+    wave->bytesPerFrame = ksp_sample_format_size(info->sampleFormat) * format->channels;
+    if (wave->bytesPerFrame == 0)
+    {
+        fprintf(stderr, "%s: unsupported channel count: %u\n", filePath, format->channels);
+        wave_close(wave);
+        return NULL;
+    }
+    wave->dataBytes = file.dataChunk.dataSize - file.dataChunk.dataSize % wave->bytesPerFrame;
+    info->frameCount = wave->dataBytes / wave->bytesPerFrame;
+
+    //Lets the kernel drop pages behind the reads and use a larger readahead window
+    posix_fadvise(wave->fd, wave->dataStart, wave->dataBytes, POSIX_FADV_SEQUENTIAL);
+    return wave;
+}
+
+static uint32_t wave_read(void *decoder, uint8_t *dst, uint32_t frames)
+{
+    ksp_wave *wave = decoder;
+    uint64_t wanted = (uint64_t)frames * wave->bytesPerFrame;
+    if (wanted > wave->dataBytes - wave->position)
+        wanted = wave->dataBytes - wave->position;
+    if (wanted == 0)
+        return 0;
+
+    //Keep the kernel a window ahead of the reads, so the next pread is normally served from the page cache
+    if (wave->fetched < wave->position + wanted + KSP_WAVE_READAHEAD_BYTES && wave->fetched < wave->dataBytes)
+    {
+        uint64_t from = wave->fetched > wave->position ? wave->fetched : wave->position;
+        readahead(wave->fd, wave->dataStart + from, KSP_WAVE_READAHEAD_BYTES);
+        wave->fetched = from + KSP_WAVE_READAHEAD_BYTES;
+    }
+
+    ssize_t got = read_at(wave->fd, dst, wanted, wave->dataStart + wave->position);
+    if (got < 0)
+    {
+        fprintf(stderr, "Could not read wave data: %s\n", strerror(errno));
+        return 0;
+    }
+    //The file can only come up short if it was truncated while playing
+    uint32_t read = got / wave->bytesPerFrame;
+    wave->position += (uint64_t)read * wave->bytesPerFrame;
+    return read;
+}
+
+const ksp_decoder_ops ksp_wave_decoder = {
+    .name = "Wave",
+    .open = wave_open,
+    .read = wave_read,
+    .close = wave_close,
+};
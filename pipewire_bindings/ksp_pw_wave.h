@@ -0,0 +1,20 @@
+#ifndef KSP_PW_WAVE_H
+#define KSP_PW_WAVE_H
+
+#include <stdbool.h>
+
+#include "ksp_pw_structs.h"
+#include "ksp_pw_stream.h"
+
+//Streams the data chunk of a wave file straight off the disk with pread()
+extern const ksp_decoder_ops ksp_wave_decoder;
+
+//Walks the chunks of a wave file that has been mapped into memory, without copying anything. Handles RF64/BW64 files
+//and WAVE_FORMAT_EXTENSIBLE, and picks up a loop from the smpl or cue chunk. On success output's data pointer points
+//into file. Prints why and returns false on failure.
+bool ksp_wave_parse(const char *filePath, const uint8_t *file, size_t length, waveFile *output);
+
+//Works out the sample layout described by a wave file's format chunk. Prints why and returns false if it isn't supported.
+bool ksp_wave_sample_format(const char *filePath, const waveFormatSubChunk *format, ksp_sample_format *output);
+
+#endif
@@ -1,14 +1,112 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "ksp_pw_player_main.h"
+#include "ksp_pw_player_funcs.h"
+#include "ksp_pw_sample_bank.h"
 #include "ksp_pw_structs.h"
 
+static void usage(const char *name)
+{
+    printf("Usage: %s [-b pipewire|null|offline] [-o output.wav] [-v voices] file\n", name);
+    puts("  -b  Backend to play through; offline renders as fast as it can instead of in real time");
+    puts("  -o  Wave file the offline backend writes what it renders to");
+    puts("  -v  Number of copies of the sound to play at once");
+}
+
+static int32_t parse_backend(const char *name)
+{
+    if (strcmp(name, "pipewire") == 0)
+        return KSP_BACKEND_PIPEWIRE;
+    if (strcmp(name, "null") == 0)
+        return KSP_BACKEND_NULL;
+    if (strcmp(name, "offline") == 0)
+        return KSP_BACKEND_OFFLINE;
+    return -1;
+}
+
+//Renders until every voice has finished, then reports how much faster than real time that was
+static void render_offline(ksp_engine *engine, const int32_t *voices, int voiceCount)
+{
+    uint64_t frames = 0;
+    int64_t start = ksp_now_ns();
+    for (int i = 0; i < voiceCount; i++)
+    {
+        while (ksp_voice_is_playing(engine, voices[i]))
+            frames += ksp_engine_render(engine, NULL, KSP_BACKEND_QUANTUM);
+    }
+    double seconds = (ksp_now_ns() - start) / 1e9;
+    double audio = (double)frames / engine->sampleRate;
+    printf("Rendered %.3fs of audio with %d voices in %.3fs: %.1fx real time\n", audio, voiceCount, seconds,
+           seconds > 0 ? audio / seconds : 0);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2)
+    int32_t backend = KSP_BACKEND_PIPEWIRE;
+    const char *output = NULL;
+    int voiceCount = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:v:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                backend = parse_backend(optarg);
+                if (backend < 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'v':
+                voiceCount = atoi(optarg);
+                if (voiceCount < 1 || voiceCount > KSP_MAX_VOICES - KSP_VOICE_RESERVE)
+                {
+                    fprintf(stderr, "Voices must be from 1 to %d\n", KSP_MAX_VOICES - KSP_VOICE_RESERVE);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc)
     {
         puts("Please enter a file name!");
         return 1;
     }
-    pw_player_info playerInfo = { .volume = 1, .fileName = argv[1], .playing = true };
-    startPlayer(&playerInfo, argc, argv);
+    ksp_engine *engine = ksp_engine_create_backend(48000, 2, backend, output);
+    if (engine == NULL)
+        return 1;
+
+    //Preloading first lets every voice start in the same cycle
+    int32_t sampleId = ksp_bank_load(engine, argv[optind], 0);
+    int32_t voices[KSP_MAX_VOICES];
+    int started = 0;
+    ksp_voice_params params = { .volume = 1.0f / voiceCount, .speedFactor = 1, .minVolume = 0, .maxVolume = 1 };
+    for (int i = 0; i < voiceCount && sampleId >= 0; i++)
+    {
+        voices[started] = ksp_voice_start_bank(engine, sampleId, &params);
+        if (voices[started] >= 0)
+            started++;
+    }
+    if (sampleId >= 0)
+        ksp_bank_release(engine, sampleId);
+
+    if (backend == KSP_BACKEND_OFFLINE)
+        render_offline(engine, voices, started);
+    else
+    {
+        for (int i = 0; i < started; i++)
+            ksp_voice_wait(engine, voices[i]);
+    }
+
+    ksp_engine_destroy(engine);
+    return started > 0 ? 0 : 1;
 }